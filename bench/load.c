@@ -0,0 +1,587 @@
+// HTTP/1.1 load generator. Every thread drives its share of the connections
+// from its own epoll loop, keeps up to `depth` pipelined requests in flight
+// on each of them and times every request from the moment it is queued until
+// its response is complete. Prints JSON with -j.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PATHS 64
+#define MAX_DEPTH 256
+#define IN_BUF_SIZE (256 << 10)
+
+typedef struct options {
+  const char *host;
+  uint16_t port;
+  size_t connections;
+  size_t threads;
+  double duration;
+  size_t depth;
+  bool keep_alive;
+  bool json;
+  // the request mix, picked at random by weight
+  const char *paths[MAX_PATHS];
+  unsigned weights[MAX_PATHS];
+  size_t npaths;
+} options;
+
+typedef struct request {
+  char *raw;
+  size_t len;
+} request;
+
+typedef struct conn {
+  int fd;
+  // requests queued but not written yet
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  // the start of a response that is not complete yet
+  char *in;
+  size_t in_len;
+  // when each request in flight was queued, oldest first
+  uint64_t sent[MAX_DEPTH];
+  size_t head;
+  size_t inflight;
+} conn;
+
+typedef struct latencies {
+  uint64_t *data;
+  size_t len;
+  size_t cap;
+} latencies;
+
+typedef struct worker {
+  const options *opts;
+  const request *reqs;
+  unsigned total_weight;
+  struct sockaddr_in addr;
+  conn *conns;
+  size_t nconns;
+  pthread_t thread;
+  uint64_t rng;
+  uint64_t deadline;
+
+  uint64_t completed;
+  uint64_t non_2xx;
+  uint64_t errors;
+  uint64_t bytes;
+  latencies lat;
+} worker;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static void *xrealloc(void *p, size_t size) {
+  p = realloc(p, size);
+  if (p == NULL) {
+    perror("realloc");
+    exit(1);
+  }
+  return p;
+}
+
+static void record(worker *w, uint64_t ns) {
+  if (w->lat.len == w->lat.cap) {
+    w->lat.cap = w->lat.cap ? w->lat.cap * 2 : 1 << 16;
+    w->lat.data = xrealloc(w->lat.data, w->lat.cap * sizeof(uint64_t));
+  }
+  w->lat.data[w->lat.len++] = ns;
+}
+
+static bool conn_open(worker *w, conn *c, int epfd) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  // a connect that waits for a full accept queue mustn't hold up the other
+  // connections of the thread, writes fail with EAGAIN until it is done
+  if (connect(fd, (struct sockaddr *)&w->addr, sizeof(w->addr)) < 0 &&
+      errno != EINPROGRESS) {
+    close(fd);
+    return false;
+  }
+
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLET,
+                           .data.ptr = c};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    close(fd);
+    return false;
+  }
+
+  c->fd = fd;
+  c->out_len = 0;
+  c->in_len = 0;
+  c->head = 0;
+  c->inflight = 0;
+  return true;
+}
+
+static void conn_close(conn *c) {
+  if (c->fd >= 0) {
+    close(c->fd);
+    c->fd = -1;
+  }
+}
+
+// Queues requests until `depth` of them are in flight.
+static void conn_fill(worker *w, conn *c) {
+  uint64_t now = now_ns();
+  while (c->inflight < w->opts->depth) {
+    unsigned pick = (unsigned)(xorshift(&w->rng) % w->total_weight);
+    size_t i = 0;
+    for (; pick >= w->opts->weights[i]; i++) {
+      pick -= w->opts->weights[i];
+    }
+
+    const request *r = &w->reqs[i];
+    if (c->out_len + r->len > c->out_cap) {
+      c->out_cap = (c->out_len + r->len) * 2;
+      c->out = xrealloc(c->out, c->out_cap);
+    }
+    memcpy(c->out + c->out_len, r->raw, r->len);
+    c->out_len += r->len;
+
+    c->sent[(c->head + c->inflight) % MAX_DEPTH] = now;
+    c->inflight++;
+  }
+}
+
+static bool conn_write(conn *c) {
+  size_t off = 0;
+  while (off < c->out_len) {
+    ssize_t n = write(c->fd, c->out + off, c->out_len - off);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        break;
+      }
+      return false;
+    }
+    off += n;
+  }
+  memmove(c->out, c->out + off, c->out_len - off);
+  c->out_len -= off;
+  return true;
+}
+
+// Length of the chunked body at `p`, 0 while it is not complete.
+static size_t chunked_len(const char *p, size_t len) {
+  size_t off = 0;
+  for (;;) {
+    const char *eol = memmem(p + off, len - off, "\r\n", 2);
+    if (eol == NULL) {
+      return 0;
+    }
+    size_t size = strtoul(p + off, NULL, 16);
+    off = eol - p + 2;
+    if (size == 0) {
+      // no trailers, just the final CRLF
+      return off + 2 <= len ? off + 2 : 0;
+    }
+    off += size + 2;
+    if (off > len) {
+      return 0;
+    }
+  }
+}
+
+// Length of the first response in `p`, 0 while it is not complete and -1
+// when it can't be told where it ends. `last` is set when the server closes
+// the connection after it.
+static ssize_t response_len(const char *p, size_t len, int *status,
+                            bool *last) {
+  const char *end = memmem(p, len, "\r\n\r\n", 4);
+  if (end == NULL) {
+    return 0;
+  }
+  size_t head = end - p + 4;
+
+  if (len < 12 || memcmp(p, "HTTP/1.", 7) != 0) {
+    return -1;
+  }
+  *status = atoi(p + 9);
+  *last = false;
+
+  ssize_t body = -1;
+  bool chunked = false;
+  for (const char *line = (const char *)memchr(p, '\n', head) + 1; line < end;
+       line = (const char *)memchr(line, '\n', end + 2 - line) + 1) {
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      body = strtoul(line + 15, NULL, 10);
+    } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+      chunked = true;
+    } else if (strncasecmp(line, "Connection: close", 17) == 0) {
+      *last = true;
+    }
+  }
+
+  if (chunked) {
+    size_t n = chunked_len(p + head, len - head);
+    return n > 0 ? (ssize_t)(head + n) : 0;
+  }
+  if (body >= 0) {
+    return head + body <= len ? (ssize_t)(head + body) : 0;
+  }
+  // no body, e.g. 204 or 304
+  return *status == 204 || *status == 304 || *status / 100 == 1
+             ? (ssize_t)head
+             : -1;
+}
+
+// Reads what arrived and completes the responses in it. Returns false when
+// the connection has to be reopened.
+static bool conn_read(worker *w, conn *c) {
+  for (;;) {
+    if (c->in_len == IN_BUF_SIZE) {
+      // a single response larger than the buffer
+      return false;
+    }
+    ssize_t n = read(c->fd, c->in + c->in_len, IN_BUF_SIZE - c->in_len);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return true;
+      }
+      return false;
+    }
+    if (n == 0) {
+      return false;
+    }
+    c->in_len += n;
+    w->bytes += n;
+
+    size_t off = 0;
+    uint64_t now = now_ns();
+    while (c->inflight > 0) {
+      int status = 0;
+      bool last = false;
+      ssize_t rlen =
+          response_len(c->in + off, c->in_len - off, &status, &last);
+      if (rlen < 0) {
+        return false;
+      }
+      if (rlen == 0) {
+        break;
+      }
+      off += rlen;
+      if (status == 100) {
+        continue;
+      }
+
+      record(w, now - c->sent[c->head]);
+      c->head = (c->head + 1) % MAX_DEPTH;
+      c->inflight--;
+      w->completed++;
+      if (status / 100 != 2) {
+        w->non_2xx++;
+      }
+      if (last || !w->opts->keep_alive) {
+        // the server is done with the connection, e.g. after its maximum of
+        // requests, what was pipelined behind is sent again on the next one
+        c->inflight = 0;
+        return false;
+      }
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+  }
+}
+
+static void *worker_run(void *arg) {
+  worker *w = arg;
+  int epfd = epoll_create1(0);
+  if (epfd < 0) {
+    perror("epoll_create1");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < w->nconns; i++) {
+    conn *c = &w->conns[i];
+    c->in = xrealloc(NULL, IN_BUF_SIZE);
+    c->fd = -1;
+    if (!conn_open(w, c, epfd)) {
+      w->errors++;
+      continue;
+    }
+    conn_fill(w, c);
+    if (!conn_write(c)) {
+      w->errors++;
+      conn_close(c);
+    }
+  }
+
+  struct epoll_event events[256];
+  while (now_ns() < w->deadline) {
+    int n = epoll_wait(epfd, events, 256, 100);
+    for (int i = 0; i < n; i++) {
+      conn *c = events[i].data.ptr;
+      bool ok = true;
+      if (events[i].events & EPOLLIN) {
+        ok = conn_read(w, c);
+      }
+      if (ok && (events[i].events & (EPOLLERR | EPOLLHUP))) {
+        ok = false;
+      }
+      if (ok && c->inflight < w->opts->depth) {
+        conn_fill(w, c);
+      }
+      if (ok) {
+        ok = conn_write(c);
+      }
+      if (ok) {
+        continue;
+      }
+
+      // the server may close between responses, with or without keep-alive,
+      // it is an error only if requests were still waiting for theirs
+      if (c->inflight > 0) {
+        w->errors++;
+      }
+      conn_close(c);
+      if (conn_open(w, c, epfd)) {
+        conn_fill(w, c);
+        if (!conn_write(c)) {
+          conn_close(c);
+        }
+      } else {
+        w->errors++;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < w->nconns; i++) {
+    conn_close(&w->conns[i]);
+    free(w->conns[i].in);
+    free(w->conns[i].out);
+  }
+  close(epfd);
+
+  return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_us(latencies *l, double p) {
+  if (l->len == 0) {
+    return 0;
+  }
+  size_t idx = (size_t)(p * (l->len - 1));
+  return l->data[idx] / 1e3;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-h host] [-p port] [-c connections] [-t threads]\n"
+          "       [-d seconds] [-P depth] [-C] [-j] [-r [weight:]path]...\n"
+          "  -P  requests pipelined on every connection\n"
+          "  -C  one request per connection, with Connection: close\n"
+          "  -r  adds a GET of path to the request mix, may be repeated\n"
+          "  -j  print JSON\n",
+          argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  options opts = {
+      .host = "127.0.0.1",
+      .port = 8000,
+      .connections = 64,
+      .threads = 2,
+      .duration = 10,
+      .depth = 1,
+      .keep_alive = true,
+  };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:c:t:d:P:Cjr:")) != -1) {
+    switch (opt) {
+    case 'h':
+      opts.host = optarg;
+      break;
+    case 'p':
+      opts.port = (uint16_t)atoi(optarg);
+      break;
+    case 'c':
+      opts.connections = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      opts.threads = strtoul(optarg, NULL, 10);
+      break;
+    case 'd':
+      opts.duration = atof(optarg);
+      break;
+    case 'P':
+      opts.depth = strtoul(optarg, NULL, 10);
+      break;
+    case 'C':
+      opts.keep_alive = false;
+      break;
+    case 'j':
+      opts.json = true;
+      break;
+    case 'r': {
+      if (opts.npaths == MAX_PATHS) {
+        usage(argv[0]);
+      }
+      char *path = optarg;
+      unsigned weight = 1;
+      if (path[0] != '/') {
+        weight = (unsigned)strtoul(path, &path, 10);
+        if (*path++ != ':' || weight == 0) {
+          usage(argv[0]);
+        }
+      }
+      opts.paths[opts.npaths] = path;
+      opts.weights[opts.npaths] = weight;
+      opts.npaths++;
+      break;
+    }
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (opts.npaths == 0) {
+    opts.paths[0] = "/foo/bar";
+    opts.weights[0] = 1;
+    opts.npaths = 1;
+  }
+  if (!opts.keep_alive) {
+    opts.depth = 1;
+  }
+  if (opts.depth == 0 || opts.depth > MAX_DEPTH || opts.threads == 0 ||
+      opts.connections < opts.threads) {
+    usage(argv[0]);
+  }
+
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(opts.port),
+  };
+  if (inet_pton(AF_INET, opts.host, &addr.sin_addr) != 1) {
+    fprintf(stderr, "invalid address %s\n", opts.host);
+    return 2;
+  }
+
+  request reqs[MAX_PATHS];
+  unsigned total_weight = 0;
+  for (size_t i = 0; i < opts.npaths; i++) {
+    char raw[4096];
+    int n = snprintf(raw, sizeof(raw), "GET %s HTTP/1.1\r\nHost: %s:%u\r\n%s\r\n",
+                     opts.paths[i], opts.host, opts.port,
+                     opts.keep_alive ? "" : "Connection: close\r\n");
+    if (n < 0 || (size_t)n >= sizeof(raw)) {
+      usage(argv[0]);
+    }
+    reqs[i].raw = strdup(raw);
+    reqs[i].len = n;
+    total_weight += opts.weights[i];
+  }
+
+  worker *workers = calloc(opts.threads, sizeof(worker));
+  uint64_t start = now_ns();
+  uint64_t deadline = start + (uint64_t)(opts.duration * 1e9);
+  for (size_t i = 0; i < opts.threads; i++) {
+    worker *w = &workers[i];
+    w->opts = &opts;
+    w->reqs = reqs;
+    w->total_weight = total_weight;
+    w->addr = addr;
+    w->nconns = opts.connections / opts.threads +
+                (i < opts.connections % opts.threads);
+    w->conns = calloc(w->nconns, sizeof(conn));
+    w->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+    w->deadline = deadline;
+    if (pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+
+  latencies all = {0};
+  uint64_t completed = 0, non_2xx = 0, errors = 0, bytes = 0;
+  for (size_t i = 0; i < opts.threads; i++) {
+    worker *w = &workers[i];
+    pthread_join(w->thread, NULL);
+    completed += w->completed;
+    non_2xx += w->non_2xx;
+    errors += w->errors;
+    bytes += w->bytes;
+
+    all.data = xrealloc(all.data, (all.len + w->lat.len + 1) * sizeof(uint64_t));
+    memcpy(all.data + all.len, w->lat.data, w->lat.len * sizeof(uint64_t));
+    all.len += w->lat.len;
+    free(w->lat.data);
+    free(w->conns);
+  }
+  double secs = (now_ns() - start) / 1e9;
+  qsort(all.data, all.len, sizeof(uint64_t), cmp_u64);
+
+  double rps = completed / secs;
+  double p50 = percentile_us(&all, 0.50);
+  double p99 = percentile_us(&all, 0.99);
+  double p999 = percentile_us(&all, 0.999);
+  double max = all.len > 0 ? all.data[all.len - 1] / 1e3 : 0;
+
+  if (opts.json) {
+    printf("{\"connections\": %zu, \"threads\": %zu, \"depth\": %zu, "
+           "\"keep_alive\": %s, \"seconds\": %.2f, \"requests\": %llu, "
+           "\"rps\": %.0f, \"mbps\": %.2f, \"p50_us\": %.1f, "
+           "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f, "
+           "\"non_2xx\": %llu, \"errors\": %llu}\n",
+           opts.connections, opts.threads, opts.depth,
+           opts.keep_alive ? "true" : "false", secs,
+           (unsigned long long)completed, rps, bytes / secs / 1e6, p50, p99,
+           p999, max, (unsigned long long)non_2xx,
+           (unsigned long long)errors);
+  } else {
+    printf("%zu connections, %zu threads, depth %zu, %s, %.2f s\n",
+           opts.connections, opts.threads, opts.depth,
+           opts.keep_alive ? "keep-alive" : "close", secs);
+    printf("requests %llu  %.0f req/s  %.2f MB/s\n",
+           (unsigned long long)completed, rps, bytes / secs / 1e6);
+    printf("latency  p50 %.1f us  p99 %.1f us  p999 %.1f us  max %.1f us\n",
+           p50, p99, p999, max);
+    printf("non-2xx %llu  errors %llu\n", (unsigned long long)non_2xx,
+           (unsigned long long)errors);
+  }
+
+  free(all.data);
+  for (size_t i = 0; i < opts.npaths; i++) {
+    free(reqs[i].raw);
+  }
+  free(workers);
+
+  return errors > 0 || non_2xx > 0;
+}
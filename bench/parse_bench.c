@@ -0,0 +1,186 @@
+// Cost of the per-request work that doesn't touch a socket: parsing every
+// request of the corpus, telling its method apart and dispatching it through
+// a route tree of a typical API. Prints JSON with --json.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/arena.h"
+#include "../src/http.h"
+#include "../src/router.h"
+#include "../src/scan.h"
+#include "../src/server.h"
+#include "corpus.h"
+
+#define PARSE_ITERATIONS 200000
+#define METHOD_ITERATIONS 2000000
+#define ROUTE_ITERATIONS 1000000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// keeps the compiler from dropping the work
+static volatile size_t sink;
+
+static void handler(kop_context *ctx, void *data) {
+  (void)ctx;
+  (void)data;
+}
+
+static const struct {
+  kop_http_method method;
+  const char *path;
+} routes[] = {
+    {HTTP_GET, "/"},
+    {HTTP_GET, "/health"},
+    {HTTP_GET, "/foo/bar"},
+    {HTTP_GET, "/favicon.ico"},
+    {HTTP_GET, "/login"},
+    {HTTP_POST, "/login"},
+    {HTTP_POST, "/logout"},
+    {HTTP_POST, "/upload"},
+    {HTTP_GET, "/ws/chat"},
+    {HTTP_GET, "/static/*path"},
+    {HTTP_GET, "/users/:id"},
+    {HTTP_GET, "/users/:id/posts"},
+    {HTTP_GET, "/users/:id/posts/:post"},
+    {HTTP_GET, "/api/v1/orders"},
+    {HTTP_POST, "/api/v1/orders"},
+    {HTTP_GET, "/api/v1/orders/:id"},
+    {HTTP_DELETE, "/api/v1/orders/:id"},
+    {HTTP_GET, "/api/v1/products"},
+    {HTTP_GET, "/api/v1/products/:id"},
+    {HTTP_GET, "/api/v1/users/:id"},
+    {HTTP_PUT, "/api/v1/users/:id"},
+    {HTTP_GET, "/api/v1/users/:id/sessions"},
+    {HTTP_DELETE, "/api/v1/users/:id/sessions/:session"},
+    {HTTP_GET, "/admin/*rest"},
+};
+
+// Parses the request in `buf` the way the server does.
+static bool parse(kop_arena_pool *pool, char *buf, size_t len,
+                  kop_http_request *req) {
+  kop_arena *arena = kop_arena_pool_get(pool);
+  kop_http_parser parser;
+  kop_http_parse_status status;
+
+  kop_http_parser_init(&parser, req, arena);
+  kop_error err = parse_http_request(&parser, req, buf, len, &status);
+  if (err == NOERROR && status == KOP_PARSE_HEADERS_COMPLETE) {
+    // the server routes here before it takes in the body
+    err = parse_http_request(&parser, req, buf, len, &status);
+  }
+
+  kop_arena_pool_put(pool, arena);
+  return err == NOERROR && status == KOP_PARSE_COMPLETE;
+}
+
+int main(int argc, char **argv) {
+  bool json = argc > 1 && strcmp(argv[1], "--json") == 0;
+
+  kop_scan_init();
+  kop_arena_pool pool = {0};
+
+  char *bufs[KOP_BENCH_CORPUS_LEN];
+  size_t lens[KOP_BENCH_CORPUS_LEN];
+  size_t method_lens[KOP_BENCH_CORPUS_LEN];
+  kop_http_request reqs[KOP_BENCH_CORPUS_LEN];
+  for (size_t i = 0; i < KOP_BENCH_CORPUS_LEN; i++) {
+    lens[i] = strlen(kop_bench_corpus[i].raw);
+    method_lens[i] = strcspn(kop_bench_corpus[i].raw, " ");
+    bufs[i] = malloc(lens[i]);
+    memcpy(bufs[i], kop_bench_corpus[i].raw, lens[i]);
+  }
+
+  if (json) {
+    printf("{\n  \"parse\": {");
+  }
+
+  for (size_t i = 0; i < KOP_BENCH_CORPUS_LEN; i++) {
+    const char *raw = kop_bench_corpus[i].raw;
+    // chunked bodies are decoded in place, every run needs the original
+    bool restore = strstr(raw, "Transfer-Encoding: chunked") != NULL;
+
+    double start = now();
+    for (int it = 0; it < PARSE_ITERATIONS; it++) {
+      if (!parse(&pool, bufs[i], lens[i], &reqs[i])) {
+        fprintf(stderr, "%s: failed to parse the request\n",
+                kop_bench_corpus[i].name);
+        return 1;
+      }
+      if (restore) {
+        memcpy(bufs[i], raw, lens[i]);
+      }
+    }
+    double ns = (now() - start) * 1e9 / PARSE_ITERATIONS;
+
+    if (json) {
+      printf("%s\n    \"%s\": {\"bytes\": %zu, \"ns\": %.1f}", i ? "," : "",
+             kop_bench_corpus[i].name, lens[i], ns);
+    } else {
+      printf("parse   %-16s %5zu bytes %8.1f ns %6.2f GB/s\n",
+             kop_bench_corpus[i].name, lens[i], ns, lens[i] / ns);
+    }
+  }
+
+  // the request line of every request in turn, so the branches don't
+  // settle on one method
+  double start = now();
+  size_t methods = 0;
+  for (int it = 0; it < METHOD_ITERATIONS; it++) {
+    size_t i = it % KOP_BENCH_CORPUS_LEN;
+    methods += kop_http_method_from_str(kop_bench_corpus[i].raw,
+                                        method_lens[i]);
+  }
+  sink = methods;
+  double method_ns = (now() - start) * 1e9 / METHOD_ITERATIONS;
+
+  kop_router router;
+  if (kop_router_init(&router) != NOERROR) {
+    return 1;
+  }
+  for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+    if (kop_router_add(&router, routes[i].method, routes[i].path, handler,
+                       NULL) != NOERROR) {
+      fprintf(stderr, "failed to add route %s\n", routes[i].path);
+      return 1;
+    }
+  }
+
+  // the views of the parsed requests point into `bufs`, which are intact
+  start = now();
+  size_t found = 0;
+  for (int it = 0; it < ROUTE_ITERATIONS; it++) {
+    kop_http_request *req = &reqs[it % KOP_BENCH_CORPUS_LEN];
+    kop_route_params params;
+    kop_route_match m = kop_router_find(&router, req->method, req->path,
+                                        &params);
+    found += m.status == KOP_ROUTE_FOUND;
+  }
+  sink = found;
+  double route_ns = (now() - start) * 1e9 / ROUTE_ITERATIONS;
+
+  if (json) {
+    printf("\n  },\n  \"method\": {\"ns\": %.1f},\n"
+           "  \"route\": {\"routes\": %zu, \"ns\": %.1f}\n}\n",
+           method_ns, sizeof(routes) / sizeof(routes[0]), route_ns);
+  } else {
+    printf("method  %8.1f ns\n", method_ns);
+    printf("route   %8.1f ns over %zu routes\n", route_ns,
+           sizeof(routes) / sizeof(routes[0]));
+  }
+
+  kop_router_free(&router);
+  for (size_t i = 0; i < KOP_BENCH_CORPUS_LEN; i++) {
+    free(bufs[i]);
+  }
+  kop_arena_pool_free(&pool);
+
+  return 0;
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Runs the benchmarks against a local kopchik and writes the results as JSON,
+# to compare them across commits.
+#
+# usage: bench/run.sh [build dir] [output file]
+#
+# BENCH_DURATION sets the seconds of every load run, 10 by default.
+
+set -eu
+
+build=${1:-build}
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+out=${2:-bench-results/$commit.json}
+duration=${BENCH_DURATION:-10}
+
+mkdir -p "$(dirname "$out")"
+
+"$build/kopchik" >/dev/null 2>&1 &
+server=$!
+trap 'kill -INT $server 2>/dev/null || true' EXIT INT TERM
+sleep 1
+
+# errors and non-2xx responses are part of the results, not a reason to stop
+load() {
+  "$build/kopchik-bench-load" -j -d "$duration" "$@" || true
+}
+
+keepalive=$(load -c 64 -t 2)
+pipelined=$(load -c 64 -t 2 -P 16)
+close=$(load -c 32 -t 2 -C)
+parse=$("$build/kopchik-bench-parse" --json)
+
+cat >"$out" <<JSON
+{
+  "commit": "$commit",
+  "date": "$(date -u +%Y-%m-%dT%H:%M:%SZ)",
+  "load": {
+    "keepalive": $keepalive,
+    "pipelined": $pipelined,
+    "close": $close
+  },
+  "micro": $parse
+}
+JSON
+
+echo "results written to $out"
@@ -0,0 +1,116 @@
+// Parse throughput of every delimiter scanning implementation the CPU
+// supports, on a request with a large header block.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/arena.h"
+#include "../src/http.h"
+#include "../src/scan.h"
+
+#define ITERATIONS 200000
+#define RAW_BUF_SIZE (1 << 20)
+#define RAW_ITERATIONS 2000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *build_request(size_t *len) {
+  size_t cap = 16384;
+  char *buf = malloc(cap);
+  size_t n = 0;
+
+  n += snprintf(buf + n, cap - n,
+                "GET /api/v1/users/42/posts?limit=20 HTTP/1.1\r\n"
+                "Host: example.com\r\n"
+                "User-Agent: Mozilla/5.0 (X11; Linux x86_64) "
+                "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 "
+                "Safari/537.36\r\n"
+                "Accept: text/html,application/xhtml+xml,application/"
+                "xml;q=0.9,*/*;q=0.8\r\n"
+                "Accept-Encoding: gzip, deflate, br\r\n"
+                "Accept-Language: en-US,en;q=0.9\r\n"
+                "Connection: keep-alive\r\n"
+                "Authorization: Bearer ");
+  for (int i = 0; i < 800; i++) {
+    buf[n++] = 'A' + i % 26;
+  }
+  n += snprintf(buf + n, cap - n, "\r\nCookie: ");
+  for (int i = 0; i < 40; i++) {
+    n += snprintf(buf + n, cap - n,
+                  "session_%d=0123456789abcdef0123456789abcdef0123456789abcd"
+                  "ef0123456789abcdef; ",
+                  i);
+  }
+  n += snprintf(buf + n, cap - n, "\r\n\r\n");
+
+  *len = n;
+  return buf;
+}
+
+int main(void) {
+  size_t req_len;
+  char *req_buf = build_request(&req_len);
+
+  char *raw = malloc(RAW_BUF_SIZE);
+  memset(raw, 'x', RAW_BUF_SIZE);
+  raw[RAW_BUF_SIZE - 1] = '\n';
+
+  kop_arena_pool pool = {0};
+
+  printf("request of %zu bytes, %d iterations\n", req_len, ITERATIONS);
+
+  for (size_t i = 0; i < kop_scan_impls_count; i++) {
+    const kop_scan_impl *impl = &kop_scan_impls[i];
+    if (!impl->supported()) {
+      printf("%-8s not supported\n", impl->name);
+      continue;
+    }
+    kop_scan_use(impl);
+
+    double start = now();
+    for (int it = 0; it < ITERATIONS; it++) {
+      kop_arena *arena = kop_arena_pool_get(&pool);
+      kop_http_parser parser;
+      kop_http_request req = {0};
+      kop_http_parse_status status;
+
+      kop_http_parser_init(&parser, &req, arena);
+      kop_error err =
+          parse_http_request(&parser, &req, req_buf, req_len, &status);
+      if (err == NOERROR && status == KOP_PARSE_HEADERS_COMPLETE) {
+        // headers first, then the (empty) body, like the server
+        err = parse_http_request(&parser, &req, req_buf, req_len, &status);
+      }
+      if (err != NOERROR || status != KOP_PARSE_COMPLETE) {
+        fprintf(stderr, "%s: failed to parse the request\n", impl->name);
+        return 1;
+      }
+
+      kop_arena_pool_put(&pool, arena);
+    }
+    double parse_secs = now() - start;
+
+    start = now();
+    size_t found = 0;
+    for (int it = 0; it < RAW_ITERATIONS; it++) {
+      found += kop_scan_find2(raw, RAW_BUF_SIZE, '\r', '\n') - raw;
+    }
+    double raw_secs = now() - start;
+
+    printf("%-8s parse %6.2f GB/s  scan %6.2f GB/s\n", impl->name,
+           (double)req_len * ITERATIONS / parse_secs / 1e9,
+           (double)found / raw_secs / 1e9);
+  }
+
+  kop_arena_pool_free(&pool);
+  free(raw);
+  free(req_buf);
+
+  return 0;
+}
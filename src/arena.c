@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "utils.h"
+
+static kop_arena_block *kop_arena_block_new(size_t cap) {
+  kop_arena_block *b = malloc(sizeof(kop_arena_block) + cap);
+  if (b == NULL) {
+    return NULL;
+  }
+
+  b->next = NULL;
+  b->cap = cap;
+  b->used = 0;
+
+  return b;
+}
+
+void *kop_arena_alloc(kop_arena *a, size_t size) {
+  size = (size + KOP_ARENA_ALIGN - 1) & ~(KOP_ARENA_ALIGN - 1);
+
+  kop_arena_block *b = a->current;
+  if (b != NULL && b->cap - b->used >= size) {
+    void *ptr = (char *)b->align + b->used;
+    b->used += size;
+    return ptr;
+  }
+
+  // blocks past the current one are left over from before the last reset,
+  // reuse them before asking malloc for more
+  kop_arena_block *next = b != NULL ? b->next : a->first;
+  if (next == NULL || next->cap < size) {
+    size_t cap = size > KOP_ARENA_BLOCK_SIZE ? size : KOP_ARENA_BLOCK_SIZE;
+    kop_arena_block *fresh = kop_arena_block_new(cap);
+    if (fresh == NULL) {
+      return NULL;
+    }
+
+    fresh->next = next;
+    if (b != NULL) {
+      b->next = fresh;
+    } else {
+      a->first = fresh;
+    }
+    next = fresh;
+  }
+
+  next->used = size;
+  a->current = next;
+
+  return next->align;
+}
+
+void kop_arena_free(kop_arena *a) {
+  kop_arena_block *b = a->first;
+  while (b != NULL) {
+    kop_arena_block *next = b->next;
+    free(b);
+    b = next;
+  }
+
+  a->first = NULL;
+  a->current = NULL;
+}
+
+kop_arena *kop_arena_pool_get(kop_arena_pool *pool) {
+  kop_arena *a = pool->free;
+  if (a != NULL) {
+    pool->free = a->next;
+    pool->len--;
+    a->next = NULL;
+    return a;
+  }
+
+  return calloc(1, sizeof(kop_arena));
+}
+
+void kop_arena_pool_put(kop_arena_pool *pool, kop_arena *a) {
+  if (pool->len >= KOP_ARENA_POOL_MAX) {
+    kop_arena_free(a);
+    free(a);
+    return;
+  }
+
+  // blocks past the first one, or a first one grown for a large
+  // allocation, are freed
+  kop_arena_block *first = a->first;
+  if (first != NULL && first->cap != KOP_ARENA_BLOCK_SIZE) {
+    kop_arena_free(a);
+  } else if (first != NULL && first->next != NULL) {
+    a->first = first->next;
+    kop_arena_free(a);
+    first->next = NULL;
+    a->first = first;
+  }
+  kop_arena_reset(a);
+
+  a->next = pool->free;
+  pool->free = a;
+  pool->len++;
+}
+
+void kop_arena_pool_free(kop_arena_pool *pool) {
+  kop_arena *a = pool->free;
+  while (a != NULL) {
+    kop_arena *next = a->next;
+    kop_arena_free(a);
+    free(a);
+    a = next;
+  }
+
+  pool->free = NULL;
+  pool->len = 0;
+}
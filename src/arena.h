@@ -0,0 +1,85 @@
+#ifndef KOP_ARENA_H_
+#define KOP_ARENA_H_
+
+#include <stddef.h>
+#include <string.h>
+
+#include "utils.h"
+
+#define KOP_ARENA_BLOCK_SIZE 8192
+// idle arenas a pool keeps, those given back past it are freed
+#define KOP_ARENA_POOL_MAX 512
+#define KOP_ARENA_ALIGN (2 * sizeof(void *))
+
+typedef struct kop_arena_block {
+  struct kop_arena_block *next;
+  size_t cap;
+  size_t used;
+  // keeps `data` aligned for any type we hand out
+  union {
+    void *p;
+    long double ld;
+    long long ll;
+  } align[];
+} kop_arena_block;
+
+// Bump allocator for everything that lives exactly as long as a request:
+// parsed headers, handler scratch memory and response bodies. Nothing is
+// freed individually, kop_arena_reset rewinds the whole arena in O(1) and the
+// blocks are reused by the next request.
+typedef struct kop_arena {
+  kop_arena_block *first;
+  kop_arena_block *current;
+  // link in the free list of a kop_arena_pool
+  struct kop_arena *next;
+} kop_arena;
+
+// Free list of arenas owned by a single reactor, so steady-state traffic
+// never goes to malloc. Arenas come back with a single block of the default
+// size at most, so a burst or a large request doesn't pin its memory for
+// good.
+typedef struct kop_arena_pool {
+  kop_arena *free;
+  size_t len;
+} kop_arena_pool;
+
+void *kop_arena_alloc(kop_arena *a, size_t size);
+void kop_arena_free(kop_arena *a);
+
+static inline void kop_arena_reset(kop_arena *a) {
+  if (a->first != NULL) {
+    a->first->used = 0;
+  }
+  a->current = a->first;
+}
+
+// Arena-backed counterparts of the kop_vector_* macros. Growing copies the
+// elements into a new chunk of the arena, the old one is reclaimed together
+// with the rest of the arena, so there is no kop_vector_free counterpart.
+#define kop_vector_init_arena(type, v, arena)                                  \
+  do {                                                                         \
+    v.len = 0;                                                                 \
+    v.cap = 4;                                                                 \
+    v.data = kop_arena_alloc(arena, sizeof(type) * v.cap);                     \
+  } while (0)
+
+#define kop_vector_append_arena(type, vptr, value, arena)                      \
+  do {                                                                         \
+    if ((vptr).len == (vptr).cap) {                                            \
+      size_t cap_ = (vptr).cap ? (vptr).cap * 2 : 4;                           \
+      type *data_ = kop_arena_alloc(arena, sizeof(type) * cap_);               \
+      if ((vptr).len > 0) {                                                    \
+        memcpy(data_, (vptr).data, sizeof(type) * (vptr).len);                 \
+      }                                                                        \
+      (vptr).data = data_;                                                     \
+      (vptr).cap = cap_;                                                       \
+    }                                                                          \
+                                                                               \
+    (vptr).data[(vptr).len++] = value;                                         \
+  } while (0)
+
+kop_arena *kop_arena_pool_get(kop_arena_pool *pool);
+void kop_arena_pool_put(kop_arena_pool *pool, kop_arena *a);
+void kop_arena_pool_free(kop_arena_pool *pool);
+
+#endif // !KOP_ARENA_H_
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "http.h"
+#include "utils.h"
+
+#define KOP_CACHE_INITIAL_BUCKETS 64
+
+static uint64_t hash_bytes(const char *data, size_t len) {
+  // FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void kop_cached_response_release(kop_cached_response *e) {
+  if (--e->refs > 0) {
+    return;
+  }
+
+  free(e->key);
+  free(e->data);
+  free(e);
+}
+
+kop_error kop_response_cache_init(kop_response_cache *cache, size_t cap) {
+  *cache = (kop_response_cache){.cap = cap};
+  if (cap == 0) {
+    return NOERROR;
+  }
+
+  cache->buckets =
+      calloc(KOP_CACHE_INITIAL_BUCKETS, sizeof(kop_cached_response *));
+  if (cache->buckets == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  cache->nbuckets = KOP_CACHE_INITIAL_BUCKETS;
+
+  return NOERROR;
+}
+
+static void lru_unlink(kop_response_cache *cache, kop_cached_response *e) {
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  } else {
+    cache->head = e->next;
+  }
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  } else {
+    cache->tail = e->prev;
+  }
+  e->prev = e->next = NULL;
+}
+
+static void lru_push_front(kop_response_cache *cache,
+                           kop_cached_response *e) {
+  e->prev = NULL;
+  e->next = cache->head;
+  if (cache->head != NULL) {
+    cache->head->prev = e;
+  } else {
+    cache->tail = e;
+  }
+  cache->head = e;
+}
+
+// Drops the cache's reference, the entry stays alive while responses use it.
+static void cache_remove(kop_response_cache *cache, kop_cached_response *e) {
+  kop_cached_response **it =
+      &cache->buckets[e->hash & (cache->nbuckets - 1)];
+  while (*it != e) {
+    it = &(*it)->chain;
+  }
+  *it = e->chain;
+  e->chain = NULL;
+
+  lru_unlink(cache, e);
+  cache->len--;
+  cache->size -= e->key_len + e->len;
+  e->cached = false;
+  kop_cached_response_release(e);
+}
+
+void kop_response_cache_free(kop_response_cache *cache) {
+  while (cache->head != NULL) {
+    cache_remove(cache, cache->head);
+  }
+
+  free(cache->buckets);
+  *cache = (kop_response_cache){0};
+}
+
+static kop_cached_response *cache_find(kop_response_cache *cache, kop_str key,
+                                       uint64_t hash) {
+  kop_cached_response *e = cache->buckets[hash & (cache->nbuckets - 1)];
+  while (e != NULL && (e->hash != hash || e->key_len != key.len ||
+                       memcmp(e->key, key.data, key.len) != 0)) {
+    e = e->chain;
+  }
+  return e;
+}
+
+// Doubles the buckets once there are more entries than buckets. Failing to
+// is harmless, the chains just get longer.
+static void cache_grow(kop_response_cache *cache) {
+  size_t nbuckets = cache->nbuckets * 2;
+  kop_cached_response **buckets =
+      calloc(nbuckets, sizeof(kop_cached_response *));
+  if (buckets == NULL) {
+    return;
+  }
+
+  for (kop_cached_response *e = cache->head; e != NULL; e = e->next) {
+    kop_cached_response **bucket = &buckets[e->hash & (nbuckets - 1)];
+    e->chain = *bucket;
+    *bucket = e;
+  }
+
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->nbuckets = nbuckets;
+}
+
+kop_cached_response *kop_response_cache_get(kop_response_cache *cache,
+                                            kop_str key, uint64_t now) {
+  if (cache->cap == 0) {
+    return NULL;
+  }
+
+  kop_cached_response *e =
+      cache_find(cache, key, hash_bytes(key.data, key.len));
+  if (e == NULL) {
+    return NULL;
+  }
+  if (e->expires <= now) {
+    cache_remove(cache, e);
+    return NULL;
+  }
+
+  lru_unlink(cache, e);
+  lru_push_front(cache, e);
+  kop_cached_response_retain(e);
+
+  return e;
+}
+
+kop_error kop_response_cache_put(kop_response_cache *cache, kop_str key,
+                                 kop_http_response *resp, kop_arena *arena,
+                                 uint64_t ttl, uint64_t now,
+                                 kop_cached_response **entry) {
+  *entry = NULL;
+  if (cache->cap == 0) {
+    return NOERROR;
+  }
+
+  kop_str etag = {0};
+  kop_vector_foreach(kop_http_header, resp->headers, header) {
+    if (kop_str_eq_nocase(header->header, "ETag")) {
+      etag = header->value;
+    }
+  }
+  if (etag.len == 0) {
+    // the response has to carry it as well, the arena keeps it around for
+    // the case it ends up not being cached
+    char *generated = kop_arena_alloc(arena, 24);
+    if (generated == NULL) {
+      return ERR_OUT_OF_MEMORY;
+    }
+    snprintf(generated, 24, "\"%016llx\"",
+             (unsigned long long)hash_bytes(resp->body, resp->body_len));
+    etag = kop_str_from_cstr(generated);
+    kop_http_response_add_header(resp, arena, "ETag", generated);
+  }
+
+  // the blank line ending the head is left out together with Connection
+  size_t head_len = kop_http_response_head_len(resp, 1, true) - 2;
+  size_t len = head_len + resp->body_len;
+  if (key.len + len > cache->cap || etag.len > KOP_CACHE_MAX_ETAG) {
+    return NOERROR;
+  }
+
+  kop_cached_response *e = calloc(1, sizeof(kop_cached_response));
+  if (e == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  e->key = malloc(key.len > 0 ? key.len : 1);
+  e->data = malloc(len + 2);
+  if (e->key == NULL || e->data == NULL) {
+    free(e->key);
+    free(e->data);
+    free(e);
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  memcpy(e->key, key.data, key.len);
+  e->key_len = key.len;
+  e->hash = hash_bytes(key.data, key.len);
+  kop_http_response_write_head(resp, 1, true, e->data);
+  if (resp->body_len > 0) {
+    memcpy(e->data + head_len, resp->body, resp->body_len);
+  }
+  e->head_len = head_len;
+  e->len = len;
+  memcpy(e->etag, etag.data, etag.len);
+  e->etag[etag.len] = '\0';
+  e->expires = now + ttl;
+  // one for the cache, one for the caller
+  e->refs = 2;
+  e->cached = true;
+
+  // a request that missed while another one for the same key was handled
+  kop_cached_response *old = cache_find(cache, key, e->hash);
+  if (old != NULL) {
+    cache_remove(cache, old);
+  }
+  while (cache->tail != NULL && cache->size + key.len + len > cache->cap) {
+    cache_remove(cache, cache->tail);
+  }
+
+  kop_cached_response **bucket =
+      &cache->buckets[e->hash & (cache->nbuckets - 1)];
+  e->chain = *bucket;
+  *bucket = e;
+  lru_push_front(cache, e);
+  cache->len++;
+  cache->size += key.len + len;
+  if (cache->len > cache->nbuckets) {
+    cache_grow(cache);
+  }
+
+  *entry = e;
+  return NOERROR;
+}
@@ -0,0 +1,76 @@
+#ifndef KOP_CACHE_H_
+#define KOP_CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http.h"
+#include "utils.h"
+
+// longest ETag a cached response may carry, including the quotes
+#define KOP_CACHE_MAX_ETAG 63
+
+// A response the way it goes on the wire, shared by every request it
+// answers. Responses that are still being sent hold a reference, so an entry
+// that expires or falls out of the cache is only freed once the last of them
+// is written.
+typedef struct kop_cached_response {
+  // method, path and the values of the headers the route varies on
+  char *key;
+  size_t key_len;
+  uint64_t hash;
+  // status line and headers up to the Connection header, which depends on
+  // the request, followed by the body at `head_len`
+  char *data;
+  size_t head_len;
+  size_t len;
+  char etag[KOP_CACHE_MAX_ETAG + 1];
+  // kop_now_ms after which the entry is no longer served
+  uint64_t expires;
+
+  size_t refs;
+  // false once the entry was evicted or replaced
+  bool cached;
+  // recency list, most recently used first
+  struct kop_cached_response *prev;
+  struct kop_cached_response *next;
+  // hash bucket chain
+  struct kop_cached_response *chain;
+} kop_cached_response;
+
+// LRU of serialized responses owned by a single reactor, so lookups need no
+// locking. Every reactor fills its own.
+typedef struct kop_response_cache {
+  kop_cached_response **buckets;
+  size_t nbuckets;
+  kop_cached_response *head;
+  kop_cached_response *tail;
+  size_t len;
+  // bytes taken by the keys and data of the entries
+  size_t size;
+  size_t cap;
+} kop_response_cache;
+
+// `cap` is the number of bytes the entries may take, 0 disables caching.
+kop_error kop_response_cache_init(kop_response_cache *cache, size_t cap);
+void kop_response_cache_free(kop_response_cache *cache);
+// Looks `key` up. Expired entries are dropped and count as a miss. The
+// returned entry holds a reference for the caller, NULL on a miss.
+kop_cached_response *kop_response_cache_get(kop_response_cache *cache,
+                                            kop_str key, uint64_t now);
+// Serializes `resp`, which must not be streamed or come from a file, and
+// stores it under `key` for `ttl` milliseconds. An ETag is generated from the
+// body unless the response has one. The entry holds a reference for the
+// caller. `*entry` is NULL when the response doesn't fit into the cache.
+kop_error kop_response_cache_put(kop_response_cache *cache, kop_str key,
+                                 kop_http_response *resp, kop_arena *arena,
+                                 uint64_t ttl, uint64_t now,
+                                 kop_cached_response **entry);
+
+static inline void kop_cached_response_retain(kop_cached_response *e) {
+  e->refs++;
+}
+void kop_cached_response_release(kop_cached_response *e);
+
+#endif // !KOP_CACHE_H_
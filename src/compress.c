@@ -0,0 +1,349 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "arena.h"
+#include "compress.h"
+#include "utils.h"
+
+#define KOP_GZIP_LEVEL 6
+#define KOP_BROTLI_QUALITY 5
+// quality 11 is several times slower for a few percent, too slow even for
+// data compressed once while the reactor waits
+#define KOP_BROTLI_BEST_QUALITY 9
+
+const char *const kop_compress_default_types[] = {
+    "text/",
+    "application/json",
+    "application/javascript",
+    "application/xml",
+    "application/wasm",
+    "image/svg+xml",
+    NULL,
+};
+
+bool kop_encoding_supported(kop_encoding enc) {
+  switch (enc) {
+  case KOP_ENCODING_IDENTITY:
+    return true;
+#if defined(KOP_ZLIB)
+  case KOP_ENCODING_GZIP:
+  case KOP_ENCODING_DEFLATE:
+    return true;
+#endif
+#if defined(KOP_BROTLI)
+  case KOP_ENCODING_BR:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+// Weight of an Accept-Encoding item in thousandths, "q=0.5" is 500.
+static int parse_qvalue(const char *it, const char *end) {
+  if (it == end || (*it != '0' && *it != '1')) {
+    return 1000;
+  }
+
+  int q = (*it++ - '0') * 1000;
+  if (it < end && *it == '.') {
+    it++;
+    for (int scale = 100; scale > 0 && it < end && *it >= '0' && *it <= '9';
+         scale /= 10, it++) {
+      q += (*it - '0') * scale;
+    }
+  }
+  return q > 1000 ? 1000 : q;
+}
+
+kop_encoding kop_encoding_negotiate(kop_str accept_encoding) {
+  // -1 for codings the client didn't mention
+  int weights[kop_encoding_count];
+  for (size_t i = 0; i < kop_encoding_count; i++) {
+    weights[i] = -1;
+  }
+  int any = -1;
+
+  const char *it = accept_encoding.data;
+  const char *end = accept_encoding.data + accept_encoding.len;
+  while (it < end) {
+    while (it < end && (*it == ' ' || *it == '\t' || *it == ',')) {
+      it++;
+    }
+    const char *tok = it;
+    while (it < end && *it != ',' && *it != ';' && *it != ' ' &&
+           *it != '\t') {
+      it++;
+    }
+    size_t tok_len = it - tok;
+
+    int q = 1000;
+    const char *item_end = memchr(it, ',', end - it);
+    if (item_end == NULL) {
+      item_end = end;
+    }
+    for (const char *p = it; p + 1 < item_end; p++) {
+      if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+        q = parse_qvalue(p + 2, item_end);
+        break;
+      }
+    }
+    it = item_end;
+
+    if (tok_len == 1 && tok[0] == '*') {
+      any = q;
+      continue;
+    }
+    for (size_t i = 1; i < kop_encoding_count; i++) {
+      const char *name = kop_encoding_name(i);
+      if (strlen(name) == tok_len && strncasecmp(tok, name, tok_len) == 0) {
+        weights[i] = q;
+      }
+    }
+  }
+
+  kop_encoding best = KOP_ENCODING_IDENTITY;
+  int best_q = 0;
+  for (size_t i = 1; i < kop_encoding_count; i++) {
+    int q = weights[i] >= 0 ? weights[i] : any;
+    // ties go to the earlier coding, which compresses better
+    if (kop_encoding_supported(i) && q > best_q) {
+      best = i;
+      best_q = q;
+    }
+  }
+
+  return best;
+}
+
+bool kop_compress_wanted(const char *const *types, size_t min_size,
+                         kop_str content_type, size_t len) {
+  if (len < (min_size > 0 ? min_size : KOP_COMPRESS_MIN_SIZE)) {
+    return false;
+  }
+
+  // the media type without its parameters
+  size_t type_len = 0;
+  while (type_len < content_type.len && content_type.data[type_len] != ';' &&
+         content_type.data[type_len] != ' ') {
+    type_len++;
+  }
+  if (type_len == 0) {
+    return false;
+  }
+
+  for (const char *const *it = types != NULL ? types
+                                             : kop_compress_default_types;
+       *it != NULL; it++) {
+    size_t n = strlen(*it);
+    bool prefix = n > 0 && (*it)[n - 1] == '/';
+    if ((prefix ? type_len >= n : type_len == n) &&
+        strncasecmp(content_type.data, *it, n) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+kop_error kop_compressor_init(kop_compressor *c, kop_encoding enc, bool best) {
+  memset(c, 0, sizeof(*c));
+  c->enc = enc;
+
+  switch (enc) {
+#if defined(KOP_ZLIB)
+  case KOP_ENCODING_GZIP:
+  case KOP_ENCODING_DEFLATE:
+    // 16 more window bits ask for the gzip wrapper instead of zlib's
+    if (deflateInit2(&c->zs, best ? Z_BEST_COMPRESSION : KOP_GZIP_LEVEL,
+                     Z_DEFLATED, enc == KOP_ENCODING_GZIP ? 15 + 16 : 15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      return ERR_OUT_OF_MEMORY;
+    }
+    return NOERROR;
+#endif
+#if defined(KOP_BROTLI)
+  case KOP_ENCODING_BR:
+    c->br = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    if (c->br == NULL) {
+      return ERR_OUT_OF_MEMORY;
+    }
+    BrotliEncoderSetParameter(c->br, BROTLI_PARAM_QUALITY,
+                              best ? KOP_BROTLI_BEST_QUALITY : KOP_BROTLI_QUALITY);
+    return NOERROR;
+#endif
+  default:
+    (void)best;
+    return ERR_COMPRESSING;
+  }
+}
+
+void kop_compressor_free(kop_compressor *c) {
+  switch (c->enc) {
+#if defined(KOP_ZLIB)
+  case KOP_ENCODING_GZIP:
+  case KOP_ENCODING_DEFLATE:
+    deflateEnd(&c->zs);
+    break;
+#endif
+#if defined(KOP_BROTLI)
+  case KOP_ENCODING_BR:
+    BrotliEncoderDestroyInstance(c->br);
+    c->br = NULL;
+    break;
+#endif
+  default:
+    break;
+  }
+  c->enc = KOP_ENCODING_IDENTITY;
+}
+
+#if defined(KOP_ZLIB)
+static kop_error zlib_write(kop_compressor *c, const char *data, size_t len,
+                            kop_compress_flush flush, kop_compress_sink sink,
+                            void *arg) {
+  static const int flushes[] = {
+      [KOP_COMPRESS_NO_FLUSH] = Z_NO_FLUSH,
+      [KOP_COMPRESS_FLUSH] = Z_SYNC_FLUSH,
+      [KOP_COMPRESS_FINISH] = Z_FINISH,
+  };
+  char out[KOP_COMPRESS_BUF_SIZE];
+
+  c->zs.next_in = (Bytef *)data;
+  c->zs.avail_in = (uInt)len;
+  do {
+    c->zs.next_out = (Bytef *)out;
+    c->zs.avail_out = sizeof(out);
+    if (deflate(&c->zs, flushes[flush]) == Z_STREAM_ERROR) {
+      return ERR_COMPRESSING;
+    }
+
+    size_t n = sizeof(out) - c->zs.avail_out;
+    if (n > 0) {
+      kop_error err = sink(arg, out, n);
+      if (err != NOERROR) {
+        return err;
+      }
+    }
+    // a full buffer means there may be more
+  } while (c->zs.avail_out == 0);
+
+  return NOERROR;
+}
+#endif
+
+#if defined(KOP_BROTLI)
+static kop_error brotli_write(kop_compressor *c, const char *data, size_t len,
+                              kop_compress_flush flush,
+                              kop_compress_sink sink, void *arg) {
+  static const BrotliEncoderOperation ops[] = {
+      [KOP_COMPRESS_NO_FLUSH] = BROTLI_OPERATION_PROCESS,
+      [KOP_COMPRESS_FLUSH] = BROTLI_OPERATION_FLUSH,
+      [KOP_COMPRESS_FINISH] = BROTLI_OPERATION_FINISH,
+  };
+  uint8_t out[KOP_COMPRESS_BUF_SIZE];
+
+  const uint8_t *next_in = (const uint8_t *)data;
+  size_t avail_in = len;
+  for (;;) {
+    uint8_t *next_out = out;
+    size_t avail_out = sizeof(out);
+    if (!BrotliEncoderCompressStream(c->br, ops[flush], &avail_in, &next_in,
+                                     &avail_out, &next_out, NULL)) {
+      return ERR_COMPRESSING;
+    }
+
+    size_t n = sizeof(out) - avail_out;
+    if (n > 0) {
+      kop_error err = sink(arg, (const char *)out, n);
+      if (err != NOERROR) {
+        return err;
+      }
+    }
+
+    if (avail_in == 0 && !BrotliEncoderHasMoreOutput(c->br) &&
+        (flush != KOP_COMPRESS_FINISH || BrotliEncoderIsFinished(c->br))) {
+      return NOERROR;
+    }
+  }
+}
+#endif
+
+kop_error kop_compressor_write(kop_compressor *c, const char *data,
+                               size_t len, kop_compress_flush flush,
+                               kop_compress_sink sink, void *arg) {
+  switch (c->enc) {
+#if defined(KOP_ZLIB)
+  case KOP_ENCODING_GZIP:
+  case KOP_ENCODING_DEFLATE:
+    return zlib_write(c, data, len, flush, sink, arg);
+#endif
+#if defined(KOP_BROTLI)
+  case KOP_ENCODING_BR:
+    return brotli_write(c, data, len, flush, sink, arg);
+#endif
+  default:
+    (void)data;
+    (void)len;
+    (void)flush;
+    (void)sink;
+    (void)arg;
+    return ERR_COMPRESSING;
+  }
+}
+
+// Output of kop_compress, which has to come out smaller than the input.
+typedef struct kop_compress_buf {
+  char *data;
+  size_t len;
+  size_t cap;
+  bool overflow;
+} kop_compress_buf;
+
+static kop_error buf_sink(void *arg, const char *data, size_t len) {
+  kop_compress_buf *b = arg;
+  if (len > b->cap - b->len) {
+    b->overflow = true;
+    return ERR_COMPRESSING;
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+  return NOERROR;
+}
+
+kop_error kop_compress(kop_encoding enc, bool best, const char *data,
+                       size_t len, kop_arena *arena, char **out,
+                       size_t *out_len) {
+  *out = NULL;
+  *out_len = 0;
+  if (len < 2) {
+    return NOERROR;
+  }
+
+  kop_compress_buf b = {.cap = len - 1};
+  b.data = arena != NULL ? kop_arena_alloc(arena, b.cap) : malloc(b.cap);
+  if (b.data == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  kop_compressor c;
+  kop_error err = kop_compressor_init(&c, enc, best);
+  if (err == NOERROR) {
+    err = kop_compressor_write(&c, data, len, KOP_COMPRESS_FINISH, buf_sink,
+                               &b);
+    kop_compressor_free(&c);
+  }
+
+  if (err != NOERROR) {
+    if (arena == NULL) {
+      free(b.data);
+    }
+    // not worth it rather than a failure
+    return b.overflow ? NOERROR : err;
+  }
+
+  *out = b.data;
+  *out_len = b.len;
+  return NOERROR;
+}
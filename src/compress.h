@@ -0,0 +1,103 @@
+#ifndef KOP_COMPRESS_H_
+#define KOP_COMPRESS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(KOP_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(KOP_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#include "arena.h"
+#include "utils.h"
+
+// bodies smaller than this aren't worth the CPU, the saving would be lost in
+// the packet they go out with
+#define KOP_COMPRESS_MIN_SIZE 1024
+// output is handed on in pieces of this size
+#define KOP_COMPRESS_BUF_SIZE (16 << 10)
+
+// Content codings of RFC 9110, in the order they are preferred when a client
+// accepts several with the same weight.
+typedef enum kop_encoding {
+  KOP_ENCODING_IDENTITY = 0,
+  KOP_ENCODING_BR,
+  KOP_ENCODING_GZIP,
+  KOP_ENCODING_DEFLATE,
+
+  kop_encoding_count,
+} kop_encoding;
+
+// Name of the coding in Accept-Encoding and Content-Encoding.
+static inline const char *kop_encoding_name(kop_encoding enc) {
+  switch (enc) {
+  case KOP_ENCODING_BR:
+    return "br";
+  case KOP_ENCODING_GZIP:
+    return "gzip";
+  case KOP_ENCODING_DEFLATE:
+    return "deflate";
+  default:
+    return "identity";
+  }
+}
+
+// Media types compressed when a route doesn't list its own: everything
+// textual, but not images, video or archives, which are compressed already.
+extern const char *const kop_compress_default_types[];
+
+// Whether the encoding was compiled in.
+bool kop_encoding_supported(kop_encoding enc);
+// Picks the encoding the client prefers among the supported ones from its
+// Accept-Encoding header, identity if it accepts none of them.
+kop_encoding kop_encoding_negotiate(kop_str accept_encoding);
+// Whether a body of `len` bytes of `content_type` is worth compressing.
+// `types` is a NULL terminated list of media types, an entry ending in '/'
+// matches a whole top-level type like "text/". NULL picks the defaults.
+bool kop_compress_wanted(const char *const *types, size_t min_size,
+                         kop_str content_type, size_t len);
+
+// Output sink of a compressor, called whenever a piece of output is ready.
+typedef kop_error (*kop_compress_sink)(void *arg, const char *data,
+                                       size_t len);
+
+// Streaming compressor, memory stays bounded no matter how long the input.
+typedef struct kop_compressor {
+  kop_encoding enc;
+#if defined(KOP_ZLIB)
+  z_stream zs;
+#endif
+#if defined(KOP_BROTLI)
+  BrotliEncoderState *br;
+#endif
+} kop_compressor;
+
+typedef enum kop_compress_flush {
+  // output may be held back until more input arrives
+  KOP_COMPRESS_NO_FLUSH = 0,
+  // everything passed so far comes out, e.g. at the end of a batch
+  KOP_COMPRESS_FLUSH,
+  // the input is complete
+  KOP_COMPRESS_FINISH,
+} kop_compress_flush;
+
+// `best` trades speed for the smallest output, for data that is compressed
+// once and sent many times.
+kop_error kop_compressor_init(kop_compressor *c, kop_encoding enc, bool best);
+// Compresses `len` bytes and passes the output to `sink`.
+kop_error kop_compressor_write(kop_compressor *c, const char *data,
+                               size_t len, kop_compress_flush flush,
+                               kop_compress_sink sink, void *arg);
+void kop_compressor_free(kop_compressor *c);
+
+// Compresses `len` bytes at once into memory from `arena`, or from malloc
+// when `arena` is NULL. `out` is NULL when the output wouldn't be smaller
+// than the input.
+kop_error kop_compress(kop_encoding enc, bool best, const char *data,
+                       size_t len, kop_arena *arena, char **out,
+                       size_t *out_len);
+
+#endif // !KOP_COMPRESS_H_
@@ -0,0 +1,857 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "conn.h"
+#include "file.h"
+#include "http.h"
+#include "utils.h"
+
+#if defined(KOP_LINUX)
+#include <sys/sendfile.h>
+#endif
+
+struct kop_conn_chunk {
+  struct kop_conn_chunk *next;
+  kop_conn conns[KOP_CONNS_CHUNK];
+};
+
+static char *kop_buf_pool_get(kop_buf_pool *pool) {
+  void *buf = pool->free;
+  if (buf == NULL) {
+    return malloc(KOP_CONN_INITIAL_BUF_SIZE);
+  }
+
+  memcpy(&pool->free, buf, sizeof(void *));
+  pool->len--;
+  return buf;
+}
+
+// Buffers that grew past the initial size are freed, keeping them would
+// pin the memory of the largest requests ever seen, and so are those past
+// KOP_BUF_POOL_MAX.
+static void kop_buf_pool_put(kop_buf_pool *pool, char *buf, size_t cap) {
+  if (buf == NULL) {
+    return;
+  }
+  if (cap != KOP_CONN_INITIAL_BUF_SIZE || pool->len >= KOP_BUF_POOL_MAX) {
+    free(buf);
+    return;
+  }
+
+  memcpy(buf, &pool->free, sizeof(void *));
+  pool->free = buf;
+  pool->len++;
+}
+
+static void kop_buf_pool_free(kop_buf_pool *pool) {
+  while (pool->free != NULL) {
+    void *buf = pool->free;
+    memcpy(&pool->free, buf, sizeof(void *));
+    free(buf);
+  }
+  pool->len = 0;
+}
+
+static void kop_conn_init(kop_conn *c, kop_conns *conns, int fd) {
+  c->fd = fd;
+  c->gen = ++conns->gen;
+  c->slab = conns;
+  c->peer_addr = 0;
+  c->peer_port = 0;
+#if defined(KOP_TRACE)
+  c->trace.sampled = false;
+  c->trace_out.sampled = false;
+  c->trace_idle = 0;
+#endif
+  c->next_free = NULL;
+  c->requests = 0;
+  c->buf = NULL;
+  c->start = 0;
+  c->len = 0;
+  c->cap = 0;
+
+  c->arena = NULL;
+  c->arenas = conns->arenas;
+  c->metrics = conns->metrics;
+  c->started = 0;
+  c->routed = false;
+  c->body_state = NULL;
+  c->encoding = KOP_ENCODING_IDENTITY;
+  c->compressor = NULL;
+  c->stream_written = 0;
+  c->keep_alive = false;
+  c->offloaded = false;
+  c->orphaned = false;
+  c->offload_err = NOERROR;
+  c->detached = false;
+
+  c->wbuf = NULL;
+  c->wlen = 0;
+  c->wcap = 0;
+  c->out = (kop_out_segments){0};
+  c->out_head = 0;
+  c->out_arenas = NULL;
+  c->closing = false;
+  c->streaming = false;
+  c->stream_ended = false;
+  c->stream_keep_alive = false;
+  c->blocked = false;
+  kop_timer_init(&c->timer);
+  c->timeout = KOP_TIMEOUT_NONE;
+  c->timeout_requests = 0;
+#if defined(KOP_URING)
+  c->inflight = 0;
+  c->recv_armed = false;
+  c->recv_cancelled = false;
+  c->sending = false;
+  c->peer_closed = false;
+  c->dead = false;
+  c->next_dead = NULL;
+  c->iov = NULL;
+#endif
+}
+
+static void kop_conn_release_out_arenas(kop_conn *c) {
+  kop_arena *a = c->out_arenas;
+  while (a != NULL) {
+    kop_arena *next = a->next;
+    kop_arena_pool_put(c->arenas, a);
+    a = next;
+  }
+  c->out_arenas = NULL;
+}
+
+static void kop_conn_free_compressor(kop_conn *c) {
+  if (c->compressor != NULL) {
+    kop_compressor_free(c->compressor);
+    free(c->compressor);
+    c->compressor = NULL;
+  }
+}
+
+void kop_conn_free(kop_conn *c) {
+  kop_conn_free_compressor(c);
+  for (size_t i = c->out_head; i < c->out.len; i++) {
+    if (c->out.data[i].file != NULL) {
+      kop_file_release(c->out.data[i].file);
+    }
+    if (c->out.data[i].cached != NULL) {
+      kop_cached_response_release(c->out.data[i].cached);
+    }
+  }
+  if (c->arena != NULL) {
+    kop_arena_pool_put(c->arenas, c->arena);
+  }
+  kop_conn_release_out_arenas(c);
+  free(c->out.data);
+#if defined(KOP_URING)
+  free(c->iov);
+#endif
+  kop_buf_pool_put(&c->slab->bufs, c->wbuf, c->wcap);
+  kop_buf_pool_put(&c->slab->bufs, c->buf, c->cap);
+
+  c->next_free = c->slab->free;
+  c->slab->free = c;
+}
+
+void kop_conn_idle(kop_conn *c) {
+  if (c->arena != NULL || c->start < c->len ||
+      kop_conn_has_pending_output(c) || c->streaming || c->offloaded) {
+    return;
+  }
+
+  kop_buf_pool_put(&c->slab->bufs, c->buf, c->cap);
+  c->buf = NULL;
+  c->start = 0;
+  c->len = 0;
+  c->cap = 0;
+
+  kop_buf_pool_put(&c->slab->bufs, c->wbuf, c->wcap);
+  c->wbuf = NULL;
+  c->wlen = 0;
+  c->wcap = 0;
+  c->out.len = 0;
+  c->out_head = 0;
+}
+
+// Fixes up the views of the request in flight after the buffer moved.
+static void kop_conn_rebase(kop_conn *c, uintptr_t old_base,
+                            uintptr_t new_base) {
+  if (c->arena == NULL || c->detached) {
+    return;
+  }
+
+  kop_http_request_rebase(&c->req, old_base, new_base);
+  if (c->routed) {
+    for (size_t i = 0; i < c->params.len; i++) {
+      kop_str_rebase(&c->params.data[i].value, old_base, new_base);
+    }
+  }
+}
+
+// Moves the unserved bytes to the front of the buffer.
+static void kop_conn_compact(kop_conn *c) {
+  uintptr_t old_base = (uintptr_t)(c->buf + c->start);
+  memmove(c->buf, c->buf + c->start, c->len - c->start);
+  c->len -= c->start;
+  c->start = 0;
+
+  kop_conn_rebase(c, old_base, (uintptr_t)c->buf);
+}
+
+// Makes sure there is room for at least one more byte in the buffer.
+static kop_error kop_conn_reserve(kop_conn *c) {
+  if (c->buf == NULL) {
+    c->buf = kop_buf_pool_get(&c->slab->bufs);
+    if (c->buf == NULL) {
+      return ERR_OUT_OF_MEMORY;
+    }
+    c->cap = KOP_CONN_INITIAL_BUF_SIZE;
+  }
+
+  if (c->len == c->cap && c->start > 0) {
+    kop_conn_compact(c);
+  }
+
+  if (c->len == c->cap) {
+    // grow geometrically so that a request split into many segments costs
+    // amortized O(n) instead of copying everything on every read. The
+    // request parsed so far points into the buffer, its views hold their
+    // offsets while it moves, counted from 1 so a view of the very first
+    // byte doesn't look like a missing one.
+    kop_conn_rebase(c, (uintptr_t)c->buf, 1);
+    char *buf = realloc(c->buf, c->cap * 2);
+    if (buf == NULL) {
+      kop_conn_rebase(c, 1, (uintptr_t)c->buf);
+      return ERR_OUT_OF_MEMORY;
+    }
+    kop_conn_rebase(c, 1, (uintptr_t)buf);
+    c->buf = buf;
+    c->cap *= 2;
+  }
+
+  return NOERROR;
+}
+
+kop_error kop_conn_append(kop_conn *c, const char *data, size_t len) {
+  kop_metrics_add(&c->metrics->bytes_in, len);
+  while (len > 0) {
+    kop_error err = kop_conn_reserve(c);
+    if (err != NOERROR) {
+      return err;
+    }
+
+    size_t n = c->cap - c->len < len ? c->cap - c->len : len;
+    memcpy(c->buf + c->len, data, n);
+    c->len += n;
+    data += n;
+    len -= n;
+  }
+
+  return NOERROR;
+}
+
+kop_error kop_conn_read(kop_conn *c, bool *eof, bool *full) {
+  *eof = false;
+  *full = false;
+  bool got_data = false;
+
+  for (;;) {
+    if (got_data && c->len == c->cap) {
+      // growing here would let a single upload take as much memory as the
+      // client cares to send, the caller may be able to make room instead
+      *full = true;
+      break;
+    }
+
+    kop_error err = kop_conn_reserve(c);
+    if (err != NOERROR) {
+      return err;
+    }
+
+    ssize_t nbytes = read(c->fd, c->buf + c->len, c->cap - c->len);
+    if (nbytes < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        KOP_DEBUG_LOG("finished reading data from client %d", c->fd);
+        break;
+      } else if (errno == EINTR) {
+        continue;
+      } else {
+        return ERR_READING_DATA;
+      }
+    } else if (nbytes == 0) {
+      KOP_DEBUG_LOG("finished with %d", c->fd);
+      *eof = true;
+      break;
+    }
+
+    c->len += nbytes;
+    got_data = true;
+    kop_metrics_add(&c->metrics->bytes_in, nbytes);
+  }
+
+  return NOERROR;
+}
+
+kop_error kop_conn_start_request(kop_conn *c) {
+  if (c->arena != NULL) {
+    return NOERROR;
+  }
+
+  c->arena = kop_arena_pool_get(c->arenas);
+  if (c->arena == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  kop_http_parser_init(&c->parser, &c->req, c->arena);
+  c->resp = (kop_http_response){.code = HTTP_OK};
+  c->started = kop_now_us();
+  c->routed = false;
+  c->body_state = NULL;
+  c->detached = false;
+  c->cache_key = (kop_str){0};
+  c->encoding = KOP_ENCODING_IDENTITY;
+  c->stream_written = 0;
+
+  return NOERROR;
+}
+
+kop_error kop_conn_detach_request(kop_conn *c) {
+  size_t len = c->parser.pos;
+  char *copy = kop_arena_alloc(c->arena, len > 0 ? len : 1);
+  if (copy == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  memcpy(copy, c->buf + c->start, len);
+
+  kop_conn_rebase(c, (uintptr_t)(c->buf + c->start), (uintptr_t)copy);
+  c->detached = true;
+
+  return NOERROR;
+}
+
+kop_error kop_conn_detach_body(kop_conn *c) {
+  uintptr_t body = (uintptr_t)c->resp.body;
+  uintptr_t buf = (uintptr_t)c->buf;
+  if (c->resp.body_len == 0 || c->resp.file != NULL || body < buf ||
+      body >= buf + c->cap) {
+    return NOERROR;
+  }
+
+  char *copy = kop_arena_alloc(c->arena, c->resp.body_len);
+  if (copy == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  memcpy(copy, c->resp.body, c->resp.body_len);
+  c->resp.body = copy;
+
+  return NOERROR;
+}
+
+void kop_conn_next_request(kop_conn *c) {
+  // pipelined requests are served in place, the buffer is only compacted
+  // once it runs out of room
+  c->start += c->parser.pos;
+  if (c->start == c->len) {
+    c->start = 0;
+    c->len = 0;
+  }
+
+  if (c->arena != NULL) {
+    kop_arena_pool_put(c->arenas, c->arena);
+    c->arena = NULL;
+  }
+}
+
+static void kop_conn_push_segment(kop_conn *c, kop_out_segment seg) {
+  if (seg.len == 0) {
+    return;
+  }
+
+  if (c->out.data == NULL) {
+    kop_vector_init(kop_out_segment, c->out);
+  }
+  kop_vector_append(kop_out_segment, c->out, seg);
+}
+
+// Makes room for `len` more bytes in the write buffer.
+static kop_error kop_conn_reserve_wbuf(kop_conn *c, size_t len) {
+  if (c->wlen + len <= c->wcap) {
+    return NOERROR;
+  }
+
+  if (c->wbuf == NULL && len <= KOP_CONN_INITIAL_BUF_SIZE) {
+    c->wbuf = kop_buf_pool_get(&c->slab->bufs);
+    if (c->wbuf == NULL) {
+      return ERR_OUT_OF_MEMORY;
+    }
+    c->wcap = KOP_CONN_INITIAL_BUF_SIZE;
+    return NOERROR;
+  }
+
+  size_t cap = c->wcap ? c->wcap : KOP_CONN_INITIAL_BUF_SIZE;
+  while (cap < c->wlen + len) {
+    cap *= 2;
+  }
+
+  char *wbuf = realloc(c->wbuf, cap);
+  if (wbuf == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  c->wbuf = wbuf;
+  c->wcap = cap;
+
+  return NOERROR;
+}
+
+kop_error kop_conn_queue_continue(kop_conn *c) {
+  static const char line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+  if (kop_conn_reserve_wbuf(c, sizeof(line) - 1) != NOERROR) {
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  size_t off = c->wlen;
+  memcpy(c->wbuf + off, line, sizeof(line) - 1);
+  c->wlen += sizeof(line) - 1;
+  kop_conn_push_segment(c, (kop_out_segment){.off = off, .len = c->wlen - off});
+
+  return NOERROR;
+}
+
+kop_error kop_conn_queue_response(kop_conn *c, bool keep_alive) {
+  kop_http_response *resp = &c->resp;
+  kop_file *file = resp->file;
+  resp->file = NULL;
+  if (file != NULL &&
+      (resp->body_len == 0 || !kop_http_code_has_body(resp->code))) {
+    // nothing to send from it, e.g. a 304
+    kop_file_release(file);
+    file = NULL;
+  }
+
+  if (resp->stream != NULL && c->req.minor_version == 0) {
+    // without chunked encoding only closing the connection ends the body
+    keep_alive = false;
+  }
+
+  size_t head_len =
+      kop_http_response_head_len(resp, c->req.minor_version, keep_alive);
+
+  if (kop_conn_reserve_wbuf(c, head_len) != NOERROR) {
+    if (file != NULL) {
+      kop_file_release(file);
+    }
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  size_t off = c->wlen;
+  c->wlen += kop_http_response_write_head(resp, c->req.minor_version,
+                                          keep_alive, c->wbuf + off);
+
+  kop_conn_push_segment(c, (kop_out_segment){.off = off, .len = c->wlen - off});
+  if (c->req.method == HTTP_HEAD) {
+    // the head says what a GET would get, without any of the body
+    if (file != NULL) {
+      kop_file_release(file);
+    }
+    kop_conn_free_compressor(c);
+    resp->stream = NULL;
+  } else if (file != NULL && resp->body != NULL) {
+    // a compressed variant, it lives as long as the file
+    kop_conn_push_segment(c, (kop_out_segment){.data = resp->body,
+                                                .file = file,
+                                                .len = resp->body_len});
+  } else if (file != NULL) {
+    // the segment takes over the reference of the response
+    kop_conn_push_segment(c, (kop_out_segment){.file = file,
+                                                .off = resp->file_off,
+                                                .len = resp->body_len});
+  } else if (kop_http_code_has_body(resp->code)) {
+    kop_conn_push_segment(
+        c, (kop_out_segment){.data = resp->body, .len = resp->body_len});
+  }
+
+  if (resp->stream != NULL) {
+    // the producer runs with the request and its arena until it is done
+    c->streaming = true;
+    c->stream_ended = false;
+    c->stream_keep_alive = keep_alive;
+    return NOERROR;
+  }
+
+  // the body and the response headers live in the request arena
+  c->arena->next = c->out_arenas;
+  c->out_arenas = c->arena;
+  c->arena = NULL;
+
+  if (!keep_alive) {
+    c->closing = true;
+  }
+
+  return NOERROR;
+}
+
+// Queues `len` bytes of the cache entry at `data`, with a reference of their
+// own.
+static void kop_conn_push_cached(kop_conn *c, kop_cached_response *cached,
+                                 const char *data, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  kop_cached_response_retain(cached);
+  kop_conn_push_segment(
+      c, (kop_out_segment){.data = data, .cached = cached, .len = len});
+}
+
+kop_error kop_conn_queue_cached(kop_conn *c, kop_cached_response *cached,
+                                bool keep_alive) {
+  static const char end_close[] = "Connection: close\r\n\r\n";
+  static const char end_keep[] = "Connection: keep-alive\r\n\r\n";
+
+  const char *end = "\r\n";
+  size_t end_len = 2;
+  if (!keep_alive) {
+    end = end_close;
+    end_len = sizeof(end_close) - 1;
+  } else if (c->req.minor_version == 0) {
+    end = end_keep;
+    end_len = sizeof(end_keep) - 1;
+  }
+
+  if (kop_conn_reserve_wbuf(c, end_len) != NOERROR) {
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  kop_conn_push_cached(c, cached, cached->data, cached->head_len);
+  size_t off = c->wlen;
+  memcpy(c->wbuf + off, end, end_len);
+  c->wlen += end_len;
+  kop_conn_push_segment(c, (kop_out_segment){.off = off, .len = end_len});
+  kop_conn_push_cached(c, cached, cached->data + cached->head_len,
+                       cached->len - cached->head_len);
+
+  if (!keep_alive) {
+    c->closing = true;
+  }
+
+  return NOERROR;
+}
+
+kop_error kop_conn_queue_chunk(kop_conn *c, const char *data, size_t len) {
+  if (len == 0) {
+    // an empty chunk would end the body
+    return NOERROR;
+  }
+
+  bool chunked = c->req.minor_version > 0;
+  size_t hex_len = 1;
+  for (size_t n = len; n >= 16; n >>= 4) {
+    hex_len++;
+  }
+
+  if (kop_conn_reserve_wbuf(c, len + (chunked ? hex_len + 4 : 0)) !=
+      NOERROR) {
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  size_t off = c->wlen;
+  char *it = c->wbuf + off;
+  if (chunked) {
+    for (size_t i = hex_len; i > 0; i--) {
+      it[i - 1] = "0123456789abcdef"[(len >> (4 * (hex_len - i))) & 0xf];
+    }
+    it += hex_len;
+    *it++ = '\r';
+    *it++ = '\n';
+  }
+  memcpy(it, data, len);
+  it += len;
+  if (chunked) {
+    *it++ = '\r';
+    *it++ = '\n';
+  }
+  c->wlen = it - c->wbuf;
+
+  // small writes end up in one iovec instead of one each
+  kop_out_segment *last =
+      c->out.len > c->out_head ? &c->out.data[c->out.len - 1] : NULL;
+  if (last != NULL && last->data == NULL && last->file == NULL &&
+      last->off + last->len == off) {
+    last->len += c->wlen - off;
+    return NOERROR;
+  }
+  kop_conn_push_segment(c, (kop_out_segment){.off = off, .len = c->wlen - off});
+
+  return NOERROR;
+}
+
+static kop_error kop_conn_chunk_sink(void *arg, const char *data,
+                                     size_t len) {
+  return kop_conn_queue_chunk(arg, data, len);
+}
+
+kop_error kop_conn_queue_stream(kop_conn *c, const char *data, size_t len) {
+  c->stream_written += len;
+  if (c->compressor == NULL) {
+    return kop_conn_queue_chunk(c, data, len);
+  }
+  return kop_compressor_write(c->compressor, data, len, KOP_COMPRESS_NO_FLUSH,
+                              kop_conn_chunk_sink, c);
+}
+
+kop_error kop_conn_flush_stream(kop_conn *c) {
+  if (c->compressor == NULL) {
+    return NOERROR;
+  }
+  return kop_compressor_write(c->compressor, NULL, 0, KOP_COMPRESS_FLUSH,
+                              kop_conn_chunk_sink, c);
+}
+
+kop_error kop_conn_end_stream(kop_conn *c) {
+  static const char last_chunk[] = "0\r\n\r\n";
+
+  if (c->compressor != NULL) {
+    kop_error err = kop_compressor_write(c->compressor, NULL, 0,
+                                         KOP_COMPRESS_FINISH,
+                                         kop_conn_chunk_sink, c);
+    kop_conn_free_compressor(c);
+    if (err != NOERROR) {
+      return err;
+    }
+  }
+
+  if (c->req.minor_version > 0) {
+    if (kop_conn_reserve_wbuf(c, sizeof(last_chunk) - 1) != NOERROR) {
+      return ERR_OUT_OF_MEMORY;
+    }
+    size_t off = c->wlen;
+    memcpy(c->wbuf + off, last_chunk, sizeof(last_chunk) - 1);
+    c->wlen += sizeof(last_chunk) - 1;
+    kop_conn_push_segment(c,
+                          (kop_out_segment){.off = off, .len = c->wlen - off});
+  }
+
+  c->streaming = false;
+  c->resp.stream = NULL;
+  if (!c->stream_keep_alive) {
+    c->closing = true;
+  }
+
+  // the head and the chunks were copied, the arena can go right away
+  kop_conn_next_request(c);
+
+  return NOERROR;
+}
+
+// Sends the next piece of a file segment. Returns the number of bytes
+// written or -1 with errno set, like writev.
+static ssize_t kop_conn_sendfile(int sock, kop_out_segment *seg,
+                                 size_t count) {
+#if defined(KOP_LINUX)
+  off_t off = seg->off;
+  ssize_t n = sendfile(sock, seg->file->fd, &off, count);
+  if (n == 0) {
+    // the file got shorter than the Content-Length we promised
+    errno = EIO;
+    return -1;
+  }
+  return n;
+#elif defined(__APPLE__)
+  off_t len = count;
+  if (sendfile(seg->file->fd, sock, seg->off, &len, NULL, 0) < 0 && len == 0) {
+    return -1;
+  }
+  return len;
+#elif defined(KOP_BSD)
+  off_t sbytes = 0;
+  if (sendfile(seg->file->fd, sock, seg->off, count, NULL, &sbytes, 0) < 0 &&
+      sbytes == 0) {
+    return -1;
+  }
+  return sbytes;
+#endif
+}
+
+size_t kop_conn_fill_iov(kop_conn *c, struct iovec *iov, size_t max) {
+  size_t iovcnt = 0;
+
+  // a file segment ends the batch, it needs its own syscall
+  for (size_t i = c->out_head; i < c->out.len && iovcnt < max;
+       i++, iovcnt++) {
+    kop_out_segment *seg = &c->out.data[i];
+    if (kop_out_segment_is_file(seg)) {
+      break;
+    }
+    const char *base = seg->data != NULL ? seg->data : c->wbuf + seg->off;
+    iov[iovcnt] = (struct iovec){.iov_base = (void *)base, .iov_len = seg->len};
+  }
+
+  return iovcnt;
+}
+
+void kop_conn_advance(kop_conn *c, size_t written) {
+  kop_metrics_add(&c->metrics->bytes_out, written);
+  while (written > 0) {
+    kop_out_segment *seg = &c->out.data[c->out_head];
+    if (written >= seg->len) {
+      written -= seg->len;
+      if (seg->file != NULL) {
+        kop_file_release(seg->file);
+      }
+      if (seg->cached != NULL) {
+        kop_cached_response_release(seg->cached);
+      }
+      c->out_head++;
+      continue;
+    }
+
+    if (seg->data != NULL) {
+      seg->data += written;
+    } else {
+      seg->off += written;
+    }
+    seg->len -= written;
+    written = 0;
+  }
+}
+
+kop_error kop_conn_flush(kop_conn *c, bool *done) {
+  *done = false;
+  c->blocked = false;
+  size_t budget = KOP_CONN_FLUSH_BUDGET;
+
+  while (c->out_head < c->out.len) {
+    if (budget == 0) {
+      return NOERROR;
+    }
+
+    kop_out_segment *first = &c->out.data[c->out_head];
+    ssize_t written;
+
+    if (kop_out_segment_is_file(first)) {
+      written = kop_conn_sendfile(c->fd, first,
+                                  first->len < budget ? first->len : budget);
+    } else {
+      struct iovec iov[KOP_CONN_MAX_IOV];
+      size_t iovcnt = kop_conn_fill_iov(c, iov, KOP_CONN_MAX_IOV);
+      written = writev(c->fd, iov, (int)iovcnt);
+    }
+
+    if (written < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // the rest is parked until the socket becomes writable again
+        c->blocked = true;
+        return NOERROR;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      return ERR_WRITING_DATA;
+    }
+
+    budget -= (size_t)written < budget ? (size_t)written : budget;
+    kop_conn_advance(c, written);
+  }
+
+  c->out.len = 0;
+  c->out_head = 0;
+  c->wlen = 0;
+  kop_conn_release_out_arenas(c);
+  *done = true;
+
+  return NOERROR;
+}
+
+kop_error kop_conns_init(kop_conns *conns, kop_arena_pool *arenas,
+                         kop_metrics *metrics) {
+  *conns = (kop_conns){.arenas = arenas, .metrics = metrics};
+
+  // every fd the process may open, a connection can land on any of them
+  size_t cap = KOP_CONNS_MAX_PREALLOC;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < cap) {
+    cap = limit.rlim_cur;
+  }
+
+  conns->data = calloc(cap, sizeof(kop_conn *));
+  if (conns->data == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  conns->cap = cap;
+
+  return NOERROR;
+}
+
+// Makes room for `fd` in the table, only needed past KOP_CONNS_MAX_PREALLOC
+// or when the limit was raised after the table was sized.
+static kop_error kop_conns_grow(kop_conns *conns, int fd) {
+  size_t cap = conns->cap ? conns->cap : 64;
+  while (cap <= (size_t)fd) {
+    cap *= 2;
+  }
+
+  kop_conn **data = realloc(conns->data, sizeof(kop_conn *) * cap);
+  if (data == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  memset(data + conns->cap, 0, sizeof(kop_conn *) * (cap - conns->cap));
+
+  conns->data = data;
+  conns->cap = cap;
+
+  return NOERROR;
+}
+
+kop_conn *kop_conns_open(kop_conns *conns, int fd) {
+  if ((size_t)fd >= conns->cap && kop_conns_grow(conns, fd) != NOERROR) {
+    return NULL;
+  }
+
+  if (conns->free == NULL) {
+    struct kop_conn_chunk *chunk = malloc(sizeof(struct kop_conn_chunk));
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->next = conns->chunks;
+    conns->chunks = chunk;
+    for (size_t i = KOP_CONNS_CHUNK; i > 0; i--) {
+      chunk->conns[i - 1].next_free = conns->free;
+      conns->free = &chunk->conns[i - 1];
+    }
+  }
+
+  kop_conn *c = conns->free;
+  conns->free = c->next_free;
+  kop_conn_init(c, conns, fd);
+  conns->data[fd] = c;
+  conns->len++;
+
+  return c;
+}
+
+void kop_conns_free(kop_conns *conns) {
+  for (size_t i = 0; i < conns->cap; i++) {
+    if (conns->data[i] != NULL) {
+      close(conns->data[i]->fd);
+      kop_conn_free(conns->data[i]);
+    }
+  }
+  free(conns->data);
+
+  while (conns->chunks != NULL) {
+    struct kop_conn_chunk *next = conns->chunks->next;
+    free(conns->chunks);
+    conns->chunks = next;
+  }
+  kop_buf_pool_free(&conns->bufs);
+
+  *conns = (kop_conns){0};
+}
@@ -0,0 +1,349 @@
+#ifndef KOP_CONN_H_
+#define KOP_CONN_H_
+
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "arena.h"
+#include "compress.h"
+#include "http.h"
+#include "metrics.h"
+#include "pool.h"
+#include "router.h"
+#include "timer.h"
+#include "trace.h"
+#include "utils.h"
+
+#define KOP_CONN_INITIAL_BUF_SIZE 4096
+// upper bound of iovecs handed to a single writev
+#define KOP_CONN_MAX_IOV 64
+// bytes a single kop_conn_flush writes before it lets other connections of
+// the reactor run, so one large download can't stall the rest
+#define KOP_CONN_FLUSH_BUDGET (1 << 20)
+// bytes a streamed response is produced ahead of the client, the producer
+// runs again once they are written
+#define KOP_CONN_STREAM_BATCH (64 << 10)
+// connection objects allocated at once when the slab runs out of free ones
+#define KOP_CONNS_CHUNK 64
+// idle buffers a reactor keeps, 2 MiB of them. Those given back past it are
+// freed, so a burst of connections doesn't pin its memory for good.
+#define KOP_BUF_POOL_MAX 512
+// the fd table is sized from RLIMIT_NOFILE up to this many entries, past it
+// the table grows once such an fd actually shows up
+#define KOP_CONNS_MAX_PREALLOC (1 << 20)
+
+struct kop_cached_response;
+struct kop_conn_chunk;
+struct kop_conns;
+struct kop_file;
+
+// A chunk of pending output. Serialized heads live in the connection's write
+// buffer, which may move when it grows, so they are kept as an offset into it
+// (`data` is NULL). Bodies are referenced directly and never copied. File
+// bodies go out with sendfile, `off` is then the offset into the file and the
+// segment holds a reference to it. A file segment with `data` set is a
+// compressed variant kept by the file and goes out from memory instead.
+// Segments of a cached response point into the cache entry and hold a
+// reference to that instead.
+typedef struct kop_out_segment {
+  const char *data;
+  struct kop_file *file;
+  struct kop_cached_response *cached;
+  uint64_t off;
+  size_t len;
+} kop_out_segment;
+
+// Whether the segment goes out with sendfile rather than writev.
+static inline bool kop_out_segment_is_file(const kop_out_segment *seg) {
+  return seg->file != NULL && seg->data == NULL;
+}
+
+typedef struct kop_out_segments {
+  kop_out_segment *data;
+  size_t len;
+  size_t cap;
+} kop_out_segments;
+
+// Deadline a connection is currently waiting on.
+typedef enum kop_conn_timeout {
+  KOP_TIMEOUT_NONE = 0,
+  // the request line and headers have to arrive in time
+  KOP_TIMEOUT_HEADER,
+  // between two reads of a request body
+  KOP_TIMEOUT_BODY,
+  // between two writes of a response
+  KOP_TIMEOUT_WRITE,
+  // an idle keep-alive connection waiting for its next request
+  KOP_TIMEOUT_IDLE,
+} kop_conn_timeout;
+
+// State of a single client connection that has to survive between readiness
+// events: the bytes received so far, the parser working on them and the
+// output the socket did not accept yet.
+typedef struct kop_conn {
+  int fd;
+  // tells this connection apart from earlier ones on the same fd
+  uint32_t gen;
+  // slab the connection came from and goes back to
+  struct kop_conns *slab;
+  // IPv4 address in network byte order and port of the client, only known
+  // with an access log
+  uint32_t peer_addr;
+  uint16_t peer_port;
+  struct kop_conn *next_free;
+  // taken from the slab's pool on the first read, given back while the
+  // connection waits for its next request
+  char *buf;
+  // offset of the first byte of the request being parsed, everything before
+  // it belongs to requests that were already served
+  size_t start;
+  size_t len;
+  size_t cap;
+  kop_http_parser parser;
+  kop_http_request req;
+  // arena of the request in flight, NULL between requests so idle
+  // connections do not hold on to one
+  kop_arena *arena;
+  kop_arena_pool *arenas;
+  // counters of the reactor the connection belongs to
+  kop_metrics *metrics;
+  // when the first byte of the request in flight was seen, kop_now_us
+  uint64_t started;
+  kop_http_response resp;
+  // the route is looked up once the headers are in, before the body is read
+  bool routed;
+  kop_route_match route;
+  // views into the request path, like the request itself
+  kop_route_params params;
+  // state a streaming route keeps between its on_body calls and the handler
+  void *body_state;
+  // key of the request in the response cache, allocated from its arena. Only
+  // set for routes that cache.
+  kop_str cache_key;
+  // content coding the client and the route agreed on, the handler decides
+  // whether the body is worth it
+  kop_encoding encoding;
+  // compresses a streamed body on its way into the chunks, NULL when it goes
+  // out as is
+  kop_compressor *compressor;
+  // bytes the producer of a streamed response passed so far
+  size_t stream_written;
+  // number of requests served on this connection so far
+  size_t requests;
+  // whether the connection stays open after the request in flight
+  bool keep_alive;
+
+  // runs the handler of an offloaded route on the pool
+  kop_job job;
+  // the handler is running on the pool, the reactor leaves the request and
+  // the response alone until it is done
+  bool offloaded;
+  // closed while offloaded, freed once the handler is done
+  bool orphaned;
+  // what the offloaded handler failed with, answered once it is back
+  kop_error offload_err;
+  // the request in flight was copied out of `buf` into its arena
+  bool detached;
+
+  // serialized status lines and headers, reused between responses and
+  // pooled like `buf`
+  char *wbuf;
+  size_t wlen;
+  size_t wcap;
+  kop_out_segments out;
+  // index of the first segment that is not fully written yet
+  size_t out_head;
+  // arenas of responses that are queued but not written yet, the bodies
+  // point into them
+  kop_arena *out_arenas;
+  // close the connection once the pending output is written
+  bool closing;
+  // the response to the request in flight is being streamed, the request
+  // stays in flight until the producer is done
+  bool streaming;
+  bool stream_ended;
+  bool stream_keep_alive;
+  // the last flush stopped because the socket was full, EPOLLOUT will tell
+  // when to continue. Otherwise it ran out of its budget and the reactor has
+  // to resume it by itself.
+  bool blocked;
+
+  // linked into the timer wheel of the reactor
+  kop_timer timer;
+  kop_conn_timeout timeout;
+  // value of `requests` when the timer was armed
+  size_t timeout_requests;
+
+#if defined(KOP_TRACE)
+  // the request in flight, if it is sampled
+  kop_trace_span trace;
+  // a traced request whose response is still being written
+  kop_trace_span trace_out;
+  // when the connection started waiting for the request in flight
+  uint64_t trace_idle;
+#endif
+
+#if defined(KOP_URING)
+  // io_uring operations that still reference the connection, it can only be
+  // freed once all of them completed
+  unsigned inflight;
+  bool recv_armed;
+  // the armed recv is being cancelled, it stays armed until it completes
+  bool recv_cancelled;
+  // a send or POLLOUT poll is in flight, the output must not move
+  bool sending;
+  // recv reported EOF, the connection closes once the output is written
+  bool peer_closed;
+  // closed but waiting for its in-flight operations
+  bool dead;
+  struct kop_conn *next_dead;
+  struct msghdr msg;
+  // KOP_CONN_MAX_IOV entries, allocated with the first send
+  struct iovec *iov;
+#endif
+} kop_conn;
+
+// Read and write buffers of KOP_CONN_INITIAL_BUF_SIZE bytes that idle
+// connections gave back, linked through their first bytes. Most keep-alive
+// connections wait for their next request most of the time and hold none.
+typedef struct kop_buf_pool {
+  void *free;
+  size_t len;
+} kop_buf_pool;
+
+// Connections of a reactor: a slab of connection objects indexed by their fd.
+// Objects are allocated KOP_CONNS_CHUNK at a time and reused through a free
+// list, so accepting doesn't go through malloc. Every connection gets a new
+// generation, readiness events carry it, so those left over from a closed
+// connection whose fd was reused are told apart. io_uring completions don't
+// need it, the object they point to isn't reused before they all arrived.
+typedef struct kop_conns {
+  kop_conn **data;
+  size_t cap;
+  // connections in the table
+  size_t len;
+  kop_conn *free;
+  struct kop_conn_chunk *chunks;
+  uint32_t gen;
+  kop_buf_pool bufs;
+  kop_arena_pool *arenas;
+  // counters of the reactor the connections belong to
+  kop_metrics *metrics;
+} kop_conns;
+
+// Sizes the fd table from RLIMIT_NOFILE. Its pages are only touched once
+// fds that high are in use.
+kop_error kop_conns_init(kop_conns *conns, kop_arena_pool *arenas,
+                         kop_metrics *metrics);
+// Sets up a connection for the freshly accepted `fd` and puts it into the
+// table. NULL when out of memory.
+kop_conn *kop_conns_open(kop_conns *conns, int fd);
+// Closes every connection still in the table and frees the slab.
+void kop_conns_free(kop_conns *conns);
+// Releases what the connection holds and returns it to its slab. The fd is
+// left alone and the connection has to be out of the table already.
+void kop_conn_free(kop_conn *c);
+// Gives the buffers of a connection that waits for its next request back to
+// the pool, unless it is in the middle of something.
+void kop_conn_idle(kop_conn *c);
+// Reads what the socket has to offer into the connection buffer. `eof` is set
+// when the peer closed its side of the connection. Reading stops early with
+// `full` set once the buffer is full, the caller has the chance to consume
+// some of it, e.g. a streamed body, before calling again.
+kop_error kop_conn_read(kop_conn *c, bool *eof, bool *full);
+// Copies bytes received by other means than kop_conn_read, e.g. from an
+// io_uring provided buffer, into the connection buffer.
+kop_error kop_conn_append(kop_conn *c, const char *data, size_t len);
+// Takes an arena from the pool and sets up the parser, unless a request is
+// already in progress.
+kop_error kop_conn_start_request(kop_conn *c);
+// Drops the request that was just served and prepares the connection for the
+// next one. Bytes received past the end of the request, e.g. pipelined
+// requests, are kept.
+void kop_conn_next_request(kop_conn *c);
+// Copies the request in flight into its arena, so the connection buffer may
+// move and take in more bytes while another thread looks at the request.
+kop_error kop_conn_detach_request(kop_conn *c);
+// Queues the interim 100 Continue a client sending Expect waits for.
+kop_error kop_conn_queue_continue(kop_conn *c);
+// Copies a response body that points into the connection buffer, e.g. the
+// request body echoed back, into the request arena. The buffer may then move
+// while the response is queued.
+kop_error kop_conn_detach_body(kop_conn *c);
+// Serializes the head of `c->resp` and queues it together with the body. The
+// request arena is kept alive until the response is written. A streamed
+// response only queues its head and keeps the request in flight. The answer
+// to a HEAD request is the head alone.
+kop_error kop_conn_queue_response(kop_conn *c, bool keep_alive);
+// Queues a response from the response cache for the request in flight. The
+// head and body are sent straight from the entry, only the Connection header
+// is written for this request.
+kop_error kop_conn_queue_cached(kop_conn *c,
+                                struct kop_cached_response *cached,
+                                bool keep_alive);
+// Copies `len` bytes of a streamed body into the write buffer, framed as a
+// chunk unless the client speaks HTTP/1.0.
+kop_error kop_conn_queue_chunk(kop_conn *c, const char *data, size_t len);
+// Queues `len` bytes the producer of a streamed body wrote, through the
+// compressor if the response has one.
+kop_error kop_conn_queue_stream(kop_conn *c, const char *data, size_t len);
+// Makes the compressor of a streamed body give up what it holds back, so
+// the client gets everything produced so far.
+kop_error kop_conn_flush_stream(kop_conn *c);
+// Terminates a streamed body and finishes its request like
+// kop_conn_next_request.
+kop_error kop_conn_end_stream(kop_conn *c);
+// Writes as much of the queued output as the socket accepts, up to
+// KOP_CONN_FLUSH_BUDGET bytes, with a single writev per batch. `done` is set
+// once nothing is left, otherwise `c->blocked` tells whether the rest is
+// finished from EPOLLOUT.
+kop_error kop_conn_flush(kop_conn *c, bool *done);
+
+// Describes the pending output up to the next file segment as iovecs, at
+// most `max` of them. Returns how many were filled in.
+size_t kop_conn_fill_iov(kop_conn *c, struct iovec *iov, size_t max);
+// Drops `written` bytes from the front of the pending output.
+void kop_conn_advance(kop_conn *c, size_t written);
+
+static inline bool kop_conn_has_pending_output(kop_conn *c) {
+  return c->out_head < c->out.len;
+}
+
+// Remembers who the client is for the access log.
+static inline void kop_conn_set_peer(kop_conn *c,
+                                     const struct sockaddr_in *peer) {
+  if (peer->sin_family == AF_INET) {
+    c->peer_addr = peer->sin_addr.s_addr;
+    c->peer_port = ntohs(peer->sin_port);
+  }
+}
+
+static inline kop_conn *kop_conns_get(kop_conns *conns, int fd) {
+  if (fd < 0 || (size_t)fd >= conns->cap) {
+    return NULL;
+  }
+  return conns->data[fd];
+}
+
+// Looks up the connection an event was registered for, NULL when that one
+// is gone.
+static inline kop_conn *kop_conns_find(kop_conns *conns, int fd,
+                                       uint32_t gen) {
+  kop_conn *c = kop_conns_get(conns, fd);
+  return c != NULL && c->gen == gen ? c : NULL;
+}
+
+static inline kop_conn *kop_conns_take(kop_conns *conns, int fd) {
+  kop_conn *c = kop_conns_get(conns, fd);
+  if (c != NULL) {
+    conns->data[fd] = NULL;
+    conns->len--;
+  }
+  return c;
+}
+
+#endif // !KOP_CONN_H_
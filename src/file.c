@@ -0,0 +1,568 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "compress.h"
+#include "file.h"
+#include "http.h"
+#include "utils.h"
+
+#if defined(__APPLE__)
+#define KOP_STAT_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define KOP_STAT_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
+
+#define KOP_HTTP_DATE_FMT "%a, %d %b %Y %H:%M:%S GMT"
+
+static const struct {
+  const char *ext;
+  const char *type;
+} content_types[] = {
+    {"html", "text/html; charset=utf-8"},
+    {"htm", "text/html; charset=utf-8"},
+    {"css", "text/css; charset=utf-8"},
+    {"js", "text/javascript; charset=utf-8"},
+    {"mjs", "text/javascript; charset=utf-8"},
+    {"json", "application/json"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"xml", "application/xml"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"ico", "image/x-icon"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+};
+
+static const char *content_type_of(const char *path) {
+  const char *dot = strrchr(path, '.');
+  const char *slash = strrchr(path, '/');
+  if (dot == NULL || (slash != NULL && dot < slash)) {
+    return "application/octet-stream";
+  }
+
+  for (size_t i = 0; i < sizeof(content_types) / sizeof(content_types[0]);
+       i++) {
+    if (strcasecmp(dot + 1, content_types[i].ext) == 0) {
+      return content_types[i].type;
+    }
+  }
+
+  return "application/octet-stream";
+}
+
+static uint64_t hash_path(const char *path) {
+  // FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for (const unsigned char *it = (const unsigned char *)path; *it != '\0';
+       it++) {
+    h ^= *it;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static bool same_file(kop_file *f, struct stat *st) {
+  return f->dev == st->st_dev && f->ino == st->st_ino &&
+         f->size == (uint64_t)st->st_size && f->mtime == st->st_mtime &&
+         f->mtime_nsec == KOP_STAT_MTIME_NSEC(st);
+}
+
+static kop_file *file_open(const char *path, uint64_t hash, time_t now) {
+  // O_NONBLOCK keeps a FIFO planted in the directory from blocking the
+  // reactor, it is rejected right after
+  int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return NULL;
+  }
+
+  kop_file *f = calloc(1, sizeof(kop_file));
+  if (f == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  f->path = strdup(path);
+  if (f->path == NULL) {
+    free(f);
+    close(fd);
+    return NULL;
+  }
+
+  f->hash = hash;
+  f->fd = fd;
+  f->size = st.st_size;
+  f->dev = st.st_dev;
+  f->ino = st.st_ino;
+  f->mtime = st.st_mtime;
+  f->mtime_nsec = KOP_STAT_MTIME_NSEC(&st);
+  f->checked = now;
+  f->refs = 1;
+  f->content_type = content_type_of(path);
+
+  // same shape as the ETags nginx produces
+  snprintf(f->etag, sizeof(f->etag), "\"%llx-%llx\"",
+           (unsigned long long)f->mtime, (unsigned long long)f->size);
+
+  struct tm tm;
+  gmtime_r(&f->mtime, &tm);
+  strftime(f->last_modified, sizeof(f->last_modified), KOP_HTTP_DATE_FMT, &tm);
+
+  return f;
+}
+
+void kop_file_release(kop_file *f) {
+  if (--f->refs > 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < kop_encoding_count; i++) {
+    free(f->variants[i].data);
+  }
+  close(f->fd);
+  free(f->path);
+  free(f);
+}
+
+kop_error kop_file_cache_init(kop_file_cache *cache, size_t cap) {
+  *cache = (kop_file_cache){.cap = cap};
+  if (cap == 0) {
+    return NOERROR;
+  }
+
+  size_t nbuckets = 16;
+  while (nbuckets < cap) {
+    nbuckets *= 2;
+  }
+
+  cache->buckets = calloc(nbuckets, sizeof(kop_file *));
+  if (cache->buckets == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  cache->nbuckets = nbuckets;
+
+  return NOERROR;
+}
+
+static void lru_unlink(kop_file_cache *cache, kop_file *f) {
+  if (f->prev != NULL) {
+    f->prev->next = f->next;
+  } else {
+    cache->head = f->next;
+  }
+  if (f->next != NULL) {
+    f->next->prev = f->prev;
+  } else {
+    cache->tail = f->prev;
+  }
+  f->prev = f->next = NULL;
+}
+
+static void lru_push_front(kop_file_cache *cache, kop_file *f) {
+  f->prev = NULL;
+  f->next = cache->head;
+  if (cache->head != NULL) {
+    cache->head->prev = f;
+  } else {
+    cache->tail = f;
+  }
+  cache->head = f;
+}
+
+// Drops the cache's reference, the file stays open while responses use it.
+static void cache_remove(kop_file_cache *cache, kop_file *f) {
+  kop_file **it = &cache->buckets[f->hash & (cache->nbuckets - 1)];
+  while (*it != f) {
+    it = &(*it)->chain;
+  }
+  *it = f->chain;
+  f->chain = NULL;
+
+  lru_unlink(cache, f);
+  cache->len--;
+  f->cached = false;
+  kop_file_release(f);
+}
+
+void kop_file_cache_free(kop_file_cache *cache) {
+  while (cache->head != NULL) {
+    cache_remove(cache, cache->head);
+  }
+
+  free(cache->buckets);
+  *cache = (kop_file_cache){0};
+}
+
+kop_error kop_file_cache_get(kop_file_cache *cache, const char *path,
+                             kop_file **file) {
+  uint64_t hash = hash_path(path);
+  time_t now = time(NULL);
+
+  if (cache->cap > 0) {
+    kop_file *f = cache->buckets[hash & (cache->nbuckets - 1)];
+    while (f != NULL && (f->hash != hash || strcmp(f->path, path) != 0)) {
+      f = f->chain;
+    }
+
+    if (f != NULL) {
+      struct stat st;
+      if (now - f->checked < KOP_FILE_CHECK_INTERVAL ||
+          (stat(path, &st) == 0 && same_file(f, &st))) {
+        f->checked = now;
+        lru_unlink(cache, f);
+        lru_push_front(cache, f);
+        kop_file_retain(f);
+        *file = f;
+        return NOERROR;
+      }
+
+      // changed or gone, responses still being sent keep the old version
+      cache_remove(cache, f);
+    }
+  }
+
+  kop_file *f = file_open(path, hash, now);
+  if (f == NULL) {
+    return errno == ENOMEM ? ERR_OUT_OF_MEMORY : ERR_OPENING_FILE;
+  }
+
+  if (cache->cap > 0) {
+    kop_file **bucket = &cache->buckets[hash & (cache->nbuckets - 1)];
+    f->chain = *bucket;
+    *bucket = f;
+    lru_push_front(cache, f);
+    cache->len++;
+    f->cached = true;
+    kop_file_retain(f);
+
+    if (cache->len > cache->cap) {
+      cache_remove(cache, cache->tail);
+    }
+  }
+
+  *file = f;
+  return NOERROR;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+// Builds `dir/rel` with `rel` percent-decoded. Returns NULL for anything that
+// could leave `dir`: dot segments and embedded NULs.
+static char *resolve_path(kop_arena *arena, const char *dir, kop_str rel) {
+  size_t dir_len = strlen(dir);
+  size_t max = dir_len + 1 + rel.len + sizeof("index.html");
+  char *path = kop_arena_alloc(arena, max);
+  if (path == NULL) {
+    return NULL;
+  }
+
+  memcpy(path, dir, dir_len);
+  char *it = path + dir_len;
+  *it++ = '/';
+  char *segment = it;
+
+  for (size_t i = 0; i <= rel.len; i++) {
+    char c;
+    if (i == rel.len) {
+      c = '/';
+    } else if (rel.data[i] == '%' && i + 2 < rel.len &&
+               hex_value(rel.data[i + 1]) >= 0 &&
+               hex_value(rel.data[i + 2]) >= 0) {
+      c = (char)(hex_value(rel.data[i + 1]) << 4 | hex_value(rel.data[i + 2]));
+      i += 2;
+    } else {
+      c = rel.data[i];
+    }
+
+    if (c == '\0') {
+      return NULL;
+    }
+
+    if (c != '/') {
+      *it++ = c;
+      continue;
+    }
+
+    size_t len = it - segment;
+    if ((len == 1 && segment[0] == '.') ||
+        (len == 2 && segment[0] == '.' && segment[1] == '.')) {
+      return NULL;
+    }
+    if (i < rel.len && len > 0) {
+      *it++ = '/';
+      segment = it;
+    }
+  }
+
+  // "dir/" or "dir/sub/" serve the index of the directory
+  if (it == segment) {
+    memcpy(it, "index.html", sizeof("index.html") - 1);
+    it += sizeof("index.html") - 1;
+  }
+  *it = '\0';
+
+  return path;
+}
+
+static bool not_modified_since(kop_str value, time_t mtime) {
+  char date[64];
+  if (value.len == 0 || value.len >= sizeof(date)) {
+    return false;
+  }
+  memcpy(date, value.data, value.len);
+  date[value.len] = '\0';
+
+  struct tm tm = {0};
+  if (strptime(date, KOP_HTTP_DATE_FMT, &tm) == NULL) {
+    return false;
+  }
+
+  return mtime <= timegm(&tm);
+}
+
+static bool parse_u64(const char **it, const char *end, uint64_t *out) {
+  const char *start = *it;
+  uint64_t n = 0;
+  for (; *it < end && **it >= '0' && **it <= '9'; (*it)++) {
+    unsigned digit = **it - '0';
+    if (n > (UINT64_MAX - digit) / 10) {
+      return false;
+    }
+    n = n * 10 + digit;
+  }
+  *out = n;
+  return *it > start;
+}
+
+typedef enum kop_range_status {
+  // no usable Range header, send the whole file
+  KOP_RANGE_NONE = 0,
+  KOP_RANGE_OK,
+  KOP_RANGE_UNSATISFIABLE,
+} kop_range_status;
+
+// Only a single "bytes" range is supported. Multiple ranges would need a
+// multipart body, for those the whole file is sent instead, which RFC 9110
+// allows.
+static kop_range_status parse_range(kop_str value, uint64_t size,
+                                    uint64_t *first, uint64_t *last) {
+  const char *it = value.data;
+  const char *end = value.data + value.len;
+
+  if (value.len < 6 || strncasecmp(it, "bytes=", 6) != 0 ||
+      memchr(it, ',', value.len) != NULL) {
+    return KOP_RANGE_NONE;
+  }
+  it += 6;
+
+  if (it < end && *it == '-') {
+    // the last N bytes
+    it++;
+    uint64_t n;
+    if (!parse_u64(&it, end, &n) || it != end) {
+      return KOP_RANGE_NONE;
+    }
+    if (n == 0 || size == 0) {
+      return KOP_RANGE_UNSATISFIABLE;
+    }
+    *first = n < size ? size - n : 0;
+    *last = size - 1;
+    return KOP_RANGE_OK;
+  }
+
+  if (!parse_u64(&it, end, first) || it == end || *it++ != '-') {
+    return KOP_RANGE_NONE;
+  }
+
+  *last = UINT64_MAX;
+  if (it != end && (!parse_u64(&it, end, last) || it != end)) {
+    return KOP_RANGE_NONE;
+  }
+  if (*last < *first) {
+    return KOP_RANGE_NONE;
+  }
+  if (*first >= size) {
+    return KOP_RANGE_UNSATISFIABLE;
+  }
+  if (*last >= size) {
+    *last = size - 1;
+  }
+
+  return KOP_RANGE_OK;
+}
+
+// Returns `f` compressed with `enc`, compressing it on first use. NULL when
+// that doesn't pay off, which is remembered as well.
+static kop_file_variant *file_variant(kop_file *f, kop_encoding enc) {
+  kop_file_variant *v = &f->variants[enc];
+  if (v->tried) {
+    return v->data != NULL ? v : NULL;
+  }
+
+  char *data = malloc(f->size > 0 ? f->size : 1);
+  if (data == NULL) {
+    // may work out next time
+    return NULL;
+  }
+  size_t len = 0;
+  while (len < f->size) {
+    ssize_t n = pread(f->fd, data + len, f->size - len, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      free(data);
+      return NULL;
+    }
+    len += n;
+  }
+
+  v->tried = true;
+  // at the default level like any other response, the request that hits it
+  // first waits for it and so does the rest of the reactor
+  kop_error err = kop_compress(enc, false, data, len, NULL, &v->data, &v->len);
+  free(data);
+  if (err != NOERROR || v->data == NULL) {
+    return NULL;
+  }
+
+  size_t etag_len = strlen(f->etag);
+  snprintf(v->etag, sizeof(v->etag), "%.*s-%s\"", (int)etag_len - 1, f->etag,
+           kop_encoding_name(enc));
+
+  return v;
+}
+
+kop_error kop_file_serve(kop_file_cache *cache, kop_http_request *req,
+                         kop_http_response *resp, kop_arena *arena,
+                         const char *dir, kop_str rel, kop_encoding enc) {
+  char *path = resolve_path(arena, dir, rel);
+  if (path == NULL) {
+    resp->code = HTTP_NOT_FOUND;
+    return NOERROR;
+  }
+
+  kop_file *f;
+  kop_error err = kop_file_cache_get(cache, path, &f);
+  if (err == ERR_OPENING_FILE) {
+    resp->code = HTTP_NOT_FOUND;
+    return NOERROR;
+  } else if (err != NOERROR) {
+    return err;
+  }
+
+  kop_str range_value = kop_http_request_header(req, KOP_HEADER_RANGE);
+
+  // ranges are served from the file as is, resuming a compressed download
+  // would need the variant to stay around for good
+  kop_file_variant *variant = NULL;
+  if (kop_compress_wanted(NULL, 0, kop_str_from_cstr(f->content_type),
+                          f->size)) {
+    kop_http_response_add_header(resp, arena, "Vary", "Accept-Encoding");
+    if (enc != KOP_ENCODING_IDENTITY && range_value.len == 0 &&
+        f->size <= KOP_FILE_MAX_COMPRESS) {
+      variant = file_variant(f, enc);
+    }
+  }
+  const char *etag = variant != NULL ? variant->etag : f->etag;
+
+  // the views below point into the entry, the reference handed to the
+  // response keeps it alive until the response is written
+  kop_http_response_add_header(resp, arena, "ETag", etag);
+  kop_http_response_add_header(resp, arena, "Last-Modified", f->last_modified);
+
+  kop_str inm = kop_http_request_header(req, KOP_HEADER_IF_NONE_MATCH);
+  kop_str ims = kop_http_request_header(req, KOP_HEADER_IF_MODIFIED_SINCE);
+  bool not_modified = inm.len > 0 ? kop_http_etag_matches(inm, etag)
+                                  : not_modified_since(ims, f->mtime);
+  if (not_modified) {
+    resp->code = HTTP_NOT_MODIFIED;
+    resp->file = f;
+    resp->body_len = 0;
+    return NOERROR;
+  }
+
+  kop_http_response_add_header(resp, arena, "Content-Type", f->content_type);
+  kop_http_response_add_header(resp, arena, "Accept-Ranges", "bytes");
+
+  if (variant != NULL) {
+    kop_http_response_add_header(resp, arena, "Content-Encoding",
+                                 kop_encoding_name(enc));
+    resp->code = HTTP_OK;
+    resp->body = variant->data;
+    resp->body_len = variant->len;
+    resp->file = f;
+    return NOERROR;
+  }
+
+  uint64_t first = 0;
+  uint64_t last = f->size > 0 ? f->size - 1 : 0;
+  kop_range_status range = KOP_RANGE_NONE;
+
+  kop_str if_range = kop_http_request_header(req, KOP_HEADER_IF_RANGE);
+  if (range_value.len > 0 &&
+      (if_range.len == 0 || kop_str_eq(if_range, f->etag) ||
+       kop_str_eq(if_range, f->last_modified))) {
+    range = parse_range(range_value, f->size, &first, &last);
+  }
+
+  char *content_range = kop_arena_alloc(arena, 64);
+  if (content_range == NULL) {
+    kop_file_release(f);
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  switch (range) {
+  case KOP_RANGE_NONE:
+    resp->code = HTTP_OK;
+    resp->file_off = 0;
+    resp->body_len = f->size;
+    break;
+  case KOP_RANGE_OK:
+    snprintf(content_range, 64, "bytes %llu-%llu/%llu",
+             (unsigned long long)first, (unsigned long long)last,
+             (unsigned long long)f->size);
+    kop_http_response_add_header(resp, arena, "Content-Range", content_range);
+    resp->code = HTTP_PARTIAL_CONTENT;
+    resp->file_off = first;
+    resp->body_len = last - first + 1;
+    break;
+  case KOP_RANGE_UNSATISFIABLE:
+    snprintf(content_range, 64, "bytes */%llu", (unsigned long long)f->size);
+    kop_http_response_add_header(resp, arena, "Content-Range", content_range);
+    resp->code = HTTP_RANGE_NOT_SATISFIABLE;
+    resp->body_len = 0;
+    break;
+  }
+
+  resp->file = f;
+
+  return NOERROR;
+}
@@ -0,0 +1,96 @@
+#ifndef KOP_FILE_H_
+#define KOP_FILE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "arena.h"
+#include "compress.h"
+#include "http.h"
+#include "utils.h"
+
+// how often a cached file is checked against the disk, in seconds
+#define KOP_FILE_CHECK_INTERVAL 1
+// largest file kept compressed in memory, bigger ones always go out with
+// sendfile
+#define KOP_FILE_MAX_COMPRESS (1 << 20)
+
+// The file compressed with one coding, made the first time a client asks for
+// it and kept as long as the file.
+typedef struct kop_file_variant {
+  // NULL when compressing didn't make the file smaller
+  char *data;
+  size_t len;
+  // the ETag of the file with the coding appended, the representations
+  // differ byte for byte
+  char etag[80];
+  bool tried;
+} kop_file_variant;
+
+// An open file together with everything needed to answer a request for it
+// without touching the disk again. Responses that are still being sent hold a
+// reference, so an entry that falls out of the cache is only closed once the
+// last of them is written.
+typedef struct kop_file {
+  // full path, the cache key
+  char *path;
+  uint64_t hash;
+  int fd;
+  uint64_t size;
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  long mtime_nsec;
+  // when the entry was last compared with what is on disk
+  time_t checked;
+
+  const char *content_type;
+  char etag[64];
+  char last_modified[32];
+  kop_file_variant variants[kop_encoding_count];
+
+  size_t refs;
+  // false once the entry was evicted or replaced
+  bool cached;
+  // recency list, most recently used first
+  struct kop_file *prev;
+  struct kop_file *next;
+  // hash bucket chain
+  struct kop_file *chain;
+} kop_file;
+
+// LRU of open files owned by a single reactor, so lookups need no locking.
+typedef struct kop_file_cache {
+  kop_file **buckets;
+  size_t nbuckets;
+  kop_file *head;
+  kop_file *tail;
+  size_t len;
+  size_t cap;
+} kop_file_cache;
+
+// `cap` is the number of files kept open, 0 disables caching and every
+// request opens the file on its own.
+kop_error kop_file_cache_init(kop_file_cache *cache, size_t cap);
+void kop_file_cache_free(kop_file_cache *cache);
+// Looks `path` up, opening and caching it on a miss. Entries older than
+// KOP_FILE_CHECK_INTERVAL are revalidated with stat and reopened if the file
+// changed. The returned file holds a reference for the caller.
+kop_error kop_file_cache_get(kop_file_cache *cache, const char *path,
+                             kop_file **file);
+
+static inline void kop_file_retain(kop_file *f) { f->refs++; }
+void kop_file_release(kop_file *f);
+
+// Answers a GET for `rel`, a path relative to `dir`, from the cache. Handles
+// conditional requests (If-None-Match, If-Modified-Since) and single byte
+// ranges. Missing files, directories and paths escaping `dir` yield a 404.
+// Textual files are sent compressed with `enc` unless a range was asked for.
+kop_error kop_file_serve(kop_file_cache *cache, kop_http_request *req,
+                         kop_http_response *resp, kop_arena *arena,
+                         const char *dir, kop_str rel, kop_encoding enc);
+
+#endif // !KOP_FILE_H_
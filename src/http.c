@@ -4,184 +4,729 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "http.h"
+#include "scan.h"
 #include "utils.h"
 
-void kop_http_request_free(kop_http_request *req) {
-  free((void *)req->body);
-  free((void *)req->path);
-  kop_headers_free(req->headers);
-  req->body_len = 0;
-  req->path = 0;
-}
-
-static kop_error read_data(int sock, char **buf, size_t *n) {
-  const size_t BUF_SIZE = 4096;
-  char tmp_buf[BUF_SIZE];
-  bool first = true;
-
-  for (;;) {
-    ssize_t nbytes = read(sock, tmp_buf, BUF_SIZE - 1);
-    if (nbytes < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        KOP_DEBUG_LOG("finished reading data from client%s", "");
-        break;
-      } else {
-        return ERR_READING_DATA;
-      }
-    } else if (nbytes == 0) {
-      KOP_DEBUG_LOG("finished with %d", sock);
-      break;
+const char *const kop_http_method_str[] = {
+    [HTTP_GET] = "GET",
+    [HTTP_POST] = "POST",
+    [HTTP_PUT] = "PUT",
+    [HTTP_DELETE] = "DELETE",
+    [HTTP_HEAD] = "HEAD",
+    [HTTP_OPTIONS] = "OPTIONS",
+    [HTTP_PATCH] = "PATCH",
+};
+
+const char *const kop_http_header_names[] = {
+    [KOP_HEADER_ACCEPT] = "Accept",
+    [KOP_HEADER_ACCEPT_ENCODING] = "Accept-Encoding",
+    [KOP_HEADER_ACCEPT_LANGUAGE] = "Accept-Language",
+    [KOP_HEADER_AUTHORIZATION] = "Authorization",
+    [KOP_HEADER_CACHE_CONTROL] = "Cache-Control",
+    [KOP_HEADER_CONNECTION] = "Connection",
+    [KOP_HEADER_CONTENT_LENGTH] = "Content-Length",
+    [KOP_HEADER_CONTENT_TYPE] = "Content-Type",
+    [KOP_HEADER_COOKIE] = "Cookie",
+    [KOP_HEADER_EXPECT] = "Expect",
+    [KOP_HEADER_HOST] = "Host",
+    [KOP_HEADER_IF_MODIFIED_SINCE] = "If-Modified-Since",
+    [KOP_HEADER_IF_NONE_MATCH] = "If-None-Match",
+    [KOP_HEADER_IF_RANGE] = "If-Range",
+    [KOP_HEADER_ORIGIN] = "Origin",
+    [KOP_HEADER_RANGE] = "Range",
+    [KOP_HEADER_REFERER] = "Referer",
+    [KOP_HEADER_TRANSFER_ENCODING] = "Transfer-Encoding",
+    [KOP_HEADER_UPGRADE] = "Upgrade",
+    [KOP_HEADER_USER_AGENT] = "User-Agent",
+    [KOP_HEADER_X_FORWARDED_FOR] = "X-Forwarded-For",
+};
+
+// Perfect hash over the well-known header names: the length and the first
+// and last byte tell all of them apart. `| 0x20` folds ASCII letters to lower
+// case, other bytes land somewhere and fail the comparison that follows. Two
+// names sharing a slot trip -Woverride-init.
+#define KOP_HEADER_SLOTS 64
+#define KOP_HEADER_SLOT(len, first, last)                                    \
+  (((len) + ((first) | 0x20) * 4 + ((last) | 0x20)) & (KOP_HEADER_SLOTS - 1))
+
+// Ids are stored off by one, so the empty slots read as 0. The entries spell
+// out the length and the bytes the hash looks at, the name's characters
+// aren't constant expressions.
+#define KOP_HEADER_ENTRY(len, first, last, id)                               \
+  [KOP_HEADER_SLOT(len, first, last)] = (id) + 1
+
+static const unsigned char header_slots[KOP_HEADER_SLOTS] = {
+    KOP_HEADER_ENTRY(6, 'A', 't', KOP_HEADER_ACCEPT),
+    KOP_HEADER_ENTRY(15, 'A', 'g', KOP_HEADER_ACCEPT_ENCODING),
+    KOP_HEADER_ENTRY(15, 'A', 'e', KOP_HEADER_ACCEPT_LANGUAGE),
+    KOP_HEADER_ENTRY(13, 'A', 'n', KOP_HEADER_AUTHORIZATION),
+    KOP_HEADER_ENTRY(13, 'C', 'l', KOP_HEADER_CACHE_CONTROL),
+    KOP_HEADER_ENTRY(10, 'C', 'n', KOP_HEADER_CONNECTION),
+    KOP_HEADER_ENTRY(14, 'C', 'h', KOP_HEADER_CONTENT_LENGTH),
+    KOP_HEADER_ENTRY(12, 'C', 'e', KOP_HEADER_CONTENT_TYPE),
+    KOP_HEADER_ENTRY(6, 'C', 'e', KOP_HEADER_COOKIE),
+    KOP_HEADER_ENTRY(6, 'E', 't', KOP_HEADER_EXPECT),
+    KOP_HEADER_ENTRY(4, 'H', 't', KOP_HEADER_HOST),
+    KOP_HEADER_ENTRY(17, 'I', 'e', KOP_HEADER_IF_MODIFIED_SINCE),
+    KOP_HEADER_ENTRY(13, 'I', 'h', KOP_HEADER_IF_NONE_MATCH),
+    KOP_HEADER_ENTRY(8, 'I', 'e', KOP_HEADER_IF_RANGE),
+    KOP_HEADER_ENTRY(6, 'O', 'n', KOP_HEADER_ORIGIN),
+    KOP_HEADER_ENTRY(5, 'R', 'e', KOP_HEADER_RANGE),
+    KOP_HEADER_ENTRY(7, 'R', 'r', KOP_HEADER_REFERER),
+    KOP_HEADER_ENTRY(17, 'T', 'g', KOP_HEADER_TRANSFER_ENCODING),
+    KOP_HEADER_ENTRY(7, 'U', 'e', KOP_HEADER_UPGRADE),
+    KOP_HEADER_ENTRY(10, 'U', 't', KOP_HEADER_USER_AGENT),
+    KOP_HEADER_ENTRY(15, 'X', 'r', KOP_HEADER_X_FORWARDED_FOR),
+};
+
+// ASCII case-insensitive comparison with a canonical name, cheaper than
+// strncasecmp, which goes through the locale.
+static bool header_name_eq(kop_str name, const char *canonical) {
+  size_t i = 0;
+  for (; i < name.len && canonical[i] != '\0'; i++) {
+    char a = name.data[i];
+    char b = canonical[i];
+    if (a != b &&
+        ((a ^ b) != 0x20 || (b | 0x20) < 'a' || (b | 0x20) > 'z')) {
+      return false;
     }
-    tmp_buf[nbytes] = '\0';
+  }
+  return i == name.len && canonical[i] == '\0';
+}
+
+kop_http_header_id kop_http_header_id_of(kop_str name) {
+  if (name.len == 0) {
+    return KOP_HEADER_UNKNOWN;
+  }
+
+  unsigned slot = header_slots[KOP_HEADER_SLOT(
+      name.len, (unsigned char)name.data[0],
+      (unsigned char)name.data[name.len - 1])];
+  if (slot == 0 || !header_name_eq(name, kop_http_header_names[slot - 1])) {
+    return KOP_HEADER_UNKNOWN;
+  }
 
-    if (first) {
-      *buf = strdup(tmp_buf);
-      assert(*buf && "ur ram is dead");
-      first = false;
-    } else {
-      *buf = realloc(*buf, *n + nbytes);
-      assert(*buf && "ur ram is dead");
-      strcat(*buf, tmp_buf);
+  return slot - 1;
+}
+
+kop_str kop_http_request_find_header(kop_http_request *req, kop_str name) {
+  kop_http_header_id id = kop_http_header_id_of(name);
+  if (id != KOP_HEADER_UNKNOWN) {
+    return req->known[id];
+  }
+
+  kop_vector_foreach(kop_http_header, req->headers, header) {
+    if (header->header.len == name.len &&
+        strncasecmp(header->header.data, name.data, name.len) == 0) {
+      return header->value;
     }
+  }
+
+  return (kop_str){0};
+}
+
+void kop_http_request_rebase(kop_http_request *req, uintptr_t old_base,
+                             uintptr_t new_base) {
+  kop_str_rebase(&req->path, old_base, new_base);
+  kop_str_rebase(&req->body, old_base, new_base);
 
-    *n += nbytes;
+  kop_vector_foreach(kop_http_header, req->headers, header) {
+    kop_str_rebase(&header->header, old_base, new_base);
+    kop_str_rebase(&header->value, old_base, new_base);
   }
+  for (size_t i = 0; i < kop_http_header_id_count; i++) {
+    if (req->known[i].data != NULL) {
+      kop_str_rebase(&req->known[i], old_base, new_base);
+    }
+  }
+}
 
-  return NOERROR;
+void kop_http_parser_init(kop_http_parser *p, kop_http_request *req,
+                          kop_arena *arena) {
+  *p = (kop_http_parser){.state = KOP_PARSE_REQUEST_LINE, .arena = arena};
+  *req = (kop_http_request){0};
+  kop_vector_init_arena(kop_http_header, req->headers, arena);
 }
 
-kop_error parse_http_request(int sock, kop_http_request *req) {
-  char *buf = 0;
-  size_t n = 0;
+// Finds the next line starting at `buf`. Returns false if the line is not
+// complete yet, otherwise stores the length of the line without the line
+// terminator in `line_len` and the length including it in `consumed`.
+static bool next_line(const char *buf, size_t len, size_t *line_len,
+                      size_t *consumed) {
+  const char *nl = kop_scan_find(buf, len, '\n');
+  if (nl == NULL) {
+    return false;
+  }
 
-  if (read_data(sock, &buf, &n) != NOERROR) {
-    free(buf);
-    return ERR_READING_DATA;
+  size_t n = nl - buf;
+  *consumed = n + 1;
+  if (n > 0 && buf[n - 1] == '\r') {
+    n--;
   }
+  *line_len = n;
 
-  if (buf == NULL || n == 0) {
-    return ERR_READING_DATA;
+  return true;
+}
+
+// Same as next_line, but also locates the first ':' on the way, so the bytes
+// of a header line are only scanned once. `colon` is NULL if the line has
+// none.
+static bool next_header_line(const char *buf, size_t len, size_t *line_len,
+                             size_t *consumed, const char **colon) {
+  const char *delim = kop_scan_find2(buf, len, ':', '\n');
+  if (delim == NULL) {
+    return false;
+  }
+
+  *colon = NULL;
+  if (*delim == ':') {
+    *colon = delim;
+    size_t offset = delim + 1 - buf;
+    if (!next_line(buf + offset, len - offset, line_len, consumed)) {
+      return false;
+    }
+    *line_len += offset;
+    *consumed += offset;
+    return true;
   }
 
-  void *defer_buf = buf;
+  return next_line(buf, len, line_len, consumed);
+}
 
-  const char *method = strsep(&buf, " ");
-  if (buf == NULL) {
-    free(defer_buf);
+static kop_error parse_request_line(kop_http_request *req, const char *line,
+                                    size_t len) {
+  const char *method_end = kop_scan_find(line, len, ' ');
+  // the shortest valid line, "GET / HTTP/1.1", is longer than the word the
+  // method is read as
+  if (method_end == NULL || len < 8) {
     return ERR_MALFORMED_METHOD;
   }
 
-  kop_http_method http_method = kop_http_method_from_str(method);
+  kop_http_method http_method =
+      kop_http_method_from_str(line, method_end - line);
   if (http_method == HTTP_BAD_METHOD) {
-    free(defer_buf);
     return ERR_MALFORMED_METHOD;
   }
 
   req->method = http_method;
 
-  const char *tmp_path = strsep(&buf, " ");
-  char *path = strdup(tmp_path);
-  if (path == NULL) {
-    free(defer_buf);
-    return ERR_OUT_OF_MEMORY;
+  const char *path = method_end + 1;
+  const char *path_end = kop_scan_find(path, len - (path - line), ' ');
+  if (path_end == NULL || path_end == path) {
+    return ERR_MALFORMED_HTTP_VERSION;
   }
 
-  req->path = path;
+  const char *http_version = path_end + 1;
+  size_t http_version_len = len - (http_version - line);
+  if (http_version_len != strlen("HTTP/1.1") ||
+      strncmp(http_version, "HTTP/1.", strlen("HTTP/1.")) != 0 ||
+      (http_version[7] != '0' && http_version[7] != '1')) {
+    return ERR_UNSUPPORTED_HTTP_VERSION;
+  }
 
-  const char *http_version = strsep(&buf, "\r\n");
-  if (buf == NULL) {
-    free(defer_buf);
-    free((void *)path);
-    return ERR_MALFORMED_HTTP_VERSION;
+  req->minor_version = http_version[7] - '0';
+
+  req->path = (kop_str){.data = path, .len = path_end - path};
+
+  return NOERROR;
+}
+
+static kop_error parse_header_line(kop_http_parser *p, kop_http_request *req,
+                                   const char *line, size_t len,
+                                   const char *colon) {
+  if (colon == NULL || colon == line) {
+    return ERR_MALFORMED_HEADER;
   }
 
-  if (strncmp(http_version, "HTTP/1.1", strlen("HTTP/1.1")) != 0) {
-    free((void *)path);
-    free(defer_buf);
-    return ERR_UNSUPPORTED_HTTP_VERSION;
+  // optional whitespace around the value isn't part of it, RFC 9112
+  // section 5
+  const char *value = colon + 1;
+  const char *end = line + len;
+  for (; value < end && (*value == ' ' || *value == '\t'); ++value)
+    ;
+  for (; end > value && (end[-1] == ' ' || end[-1] == '\t'); --end)
+    ;
+
+  if (value == end) {
+    return ERR_MALFORMED_HEADER;
   }
 
-  buf += 1;
+  kop_http_header header = (kop_http_header){
+      .header = {.data = line, .len = colon - line},
+      .value = {.data = value, .len = end - value},
+  };
+
+  kop_vector_append_arena(kop_http_header, req->headers, header, p->arena);
 
-  kop_http_headers headers = {0};
-  kop_vector_init(kop_http_header, headers);
+  kop_http_header_id id = kop_http_header_id_of(header.header);
+  if (id != KOP_HEADER_UNKNOWN && req->known[id].data == NULL) {
+    req->known[id] = header.value;
+  }
+
+  return NOERROR;
+}
+
+// Parses a Content-Length value, RFC 9110 section 8.6.
+static kop_error parse_content_length(kop_str value, uint64_t *len) {
+  if (value.len == 0) {
+    return ERR_INVALID_BODY;
+  }
 
-  while (strncmp(buf, "\r\n", 2) != 0) {
-    const char *tmp_header_key = strsep(&buf, ":");
-    char *header_key = strdup(tmp_header_key);
-    if (header_key == NULL) {
-      free((void *)path);
-      free(defer_buf);
-      kop_headers_free(headers);
-      return ERR_OUT_OF_MEMORY;
+  uint64_t n = 0;
+  for (size_t i = 0; i < value.len; i++) {
+    char ch = value.data[i];
+    if (ch < '0' || ch > '9' || n > (UINT64_MAX - 9) / 10) {
+      return ERR_INVALID_BODY;
     }
+    n = n * 10 + (ch - '0');
+  }
+  *len = n;
 
-    for (; *buf != '\0' && *buf != '\r' && *buf == ' '; ++buf)
-      ;
+  return NOERROR;
+}
+
+// Works out how the body is delimited, RFC 9112 section 6.3.
+static kop_error parse_body_framing(kop_http_parser *p,
+                                    kop_http_request *req) {
+  kop_str transfer_encoding =
+      kop_http_request_header(req, KOP_HEADER_TRANSFER_ENCODING);
+  kop_str content_length =
+      kop_http_request_header(req, KOP_HEADER_CONTENT_LENGTH);
+
+  if (transfer_encoding.data == NULL && content_length.data == NULL) {
+    return NOERROR;
+  }
+  // a request with both is how requests get smuggled past proxies
+  if (transfer_encoding.data != NULL && content_length.data != NULL) {
+    return ERR_INVALID_BODY;
+  }
 
-    if (*buf == '\0' || *buf == '\r') {
-      free((void *)path);
-      free(defer_buf);
-      free(header_key);
-      kop_headers_free(headers);
-      return ERR_MALFORMED_HEADER;
+  // `known` only keeps the first of them, a proxy may have gone by another
+  // one, so every copy has to agree
+  size_t ncodings = 0;
+  bool have_len = false;
+  uint64_t body_len = 0;
+  for (size_t i = 0; i < req->headers.len; i++) {
+    kop_http_header *h = &req->headers.data[i];
+    switch (kop_http_header_id_of(h->header)) {
+    case KOP_HEADER_TRANSFER_ENCODING:
+      // chunked has to be the last coding and no other one is decoded here
+      if (!kop_str_eq_nocase(h->value, "chunked")) {
+        return ERR_UNSUPPORTED_TRANSFER_ENCODING;
+      }
+      ncodings++;
+      break;
+    case KOP_HEADER_CONTENT_LENGTH: {
+      uint64_t len;
+      if (parse_content_length(h->value, &len) != NOERROR ||
+          (have_len && len != body_len)) {
+        return ERR_INVALID_BODY;
+      }
+      have_len = true;
+      body_len = len;
+      break;
+    }
+    default:
+      break;
     }
+  }
 
-    const char *tmp_header_value = strsep(&buf, "\r\n");
-    char *header_value = strdup(tmp_header_value);
-    if (header_value == NULL) {
-      free((void *)path);
-      free(defer_buf);
-      free(header_key);
-      kop_headers_free(headers);
-      return ERR_OUT_OF_MEMORY;
+  if (ncodings > 0) {
+    // chunked twice over is no framing at all
+    if (ncodings > 1) {
+      return ERR_INVALID_BODY;
     }
+    p->chunked = true;
+    p->chunk_state = KOP_CHUNK_SIZE;
+    return NOERROR;
+  }
 
-    buf += 1;
+  p->remaining = body_len;
 
-    kop_http_header header =
-        (kop_http_header){.header = header_key, .value = header_value};
+  return NOERROR;
+}
 
-    kop_vector_append(kop_http_header, headers, header);
+static int hex_digit(char ch) {
+  if (ch >= '0' && ch <= '9') {
+    return ch - '0';
+  }
+  if (ch >= 'a' && ch <= 'f') {
+    return ch - 'a' + 10;
   }
+  if (ch >= 'A' && ch <= 'F') {
+    return ch - 'A' + 10;
+  }
+  return -1;
+}
 
-  req->headers = headers;
+static kop_error parse_chunk_size(kop_http_parser *p, const char *line,
+                                  size_t len) {
+  uint64_t size = 0;
+  size_t i = 0;
+  for (int digit; i < len && (digit = hex_digit(line[i])) >= 0; i++) {
+    if (size > UINT64_MAX >> 4) {
+      return ERR_MALFORMED_BODY;
+    }
+    size = size << 4 | (uint64_t)digit;
+  }
 
-  buf += 2;
+  // chunk extensions after the size are ignored
+  if (i == 0 ||
+      (i < len && line[i] != ';' && line[i] != ' ' && line[i] != '\t')) {
+    return ERR_MALFORMED_BODY;
+  }
 
-  const char *content_length_str =
-      find_header_or_default(req, "Content-Length", "0");
-  uint64_t body_len = strtoll(content_length_str, NULL, 10);
+  if (size == 0) {
+    p->chunk_state = KOP_CHUNK_TRAILER;
+  } else {
+    p->chunk_state = KOP_CHUNK_DATA;
+    p->remaining = size;
+  }
 
-  if (body_len == 0) {
-    req->body_len = body_len;
-    req->body = strdup("");
+  return NOERROR;
+}
 
-    return NOERROR;
+// Decodes as much of the body as is buffered. Chunk data is moved down to
+// `body_end`, over the framing that came before it, so the decoded body ends
+// up contiguous no matter how it was chunked.
+static kop_error parse_body(kop_http_parser *p, char *buf, size_t len) {
+  kop_error err;
+  size_t line_len, consumed;
+
+  while (p->state == KOP_PARSE_BODY) {
+    if (!p->chunked || p->chunk_state == KOP_CHUNK_DATA) {
+      // rejected as soon as the size is announced, not once it arrived
+      if (p->max_body > 0 && (p->remaining > p->max_body ||
+                              p->body_len > p->max_body - p->remaining)) {
+        return ERR_BODY_TOO_LARGE;
+      }
+
+      size_t n = len - p->pos;
+      if (n > p->remaining) {
+        n = (size_t)p->remaining;
+      }
+      if (p->body_end != p->pos) {
+        memmove(buf + p->body_end, buf + p->pos, n);
+      }
+      p->pos += n;
+      p->body_end += n;
+      p->body_len += n;
+      p->remaining -= n;
+
+      if (p->remaining > 0) {
+        return NOERROR;
+      }
+      if (!p->chunked) {
+        p->state = KOP_PARSE_DONE;
+      } else {
+        p->chunk_state = KOP_CHUNK_DATA_END;
+      }
+      continue;
+    }
+
+    // framing lines are capped like the head, the buffer isn't left to grow
+    // for a line that never ends
+    const char *line = buf + p->pos;
+    bool complete = next_line(line, len - p->pos, &line_len, &consumed);
+    size_t line_size = complete ? consumed : len - p->pos;
+    if (p->chunk_state == KOP_CHUNK_TRAILER) {
+      if (p->max_head > 0 && p->trailer_len + line_size > p->max_head) {
+        return ERR_HEADERS_TOO_LARGE;
+      }
+    } else if (line_size > KOP_HTTP_MAX_CHUNK_LINE) {
+      return ERR_MALFORMED_BODY;
+    }
+    if (!complete) {
+      return NOERROR;
+    }
+    p->pos += consumed;
+
+    switch (p->chunk_state) {
+    case KOP_CHUNK_SIZE:
+      if ((err = parse_chunk_size(p, line, line_len)) != NOERROR) {
+        return err;
+      }
+      break;
+    case KOP_CHUNK_DATA_END:
+      if (line_len != 0) {
+        return ERR_MALFORMED_BODY;
+      }
+      p->chunk_state = KOP_CHUNK_SIZE;
+      break;
+    case KOP_CHUNK_TRAILER:
+      p->trailer_len += consumed;
+      if (line_len == 0) {
+        p->state = KOP_PARSE_DONE;
+      }
+      break;
+    case KOP_CHUNK_DATA:
+      break;
+    }
   }
 
-  char *body = strdup(buf);
-  if (body == NULL) {
-    free((void *)path);
-    free(defer_buf);
-    kop_headers_free(headers);
-    return ERR_OUT_OF_MEMORY;
+  return NOERROR;
+}
+
+size_t kop_http_parser_discard_body(kop_http_parser *p, char *buf,
+                                    size_t len) {
+  size_t dropped = p->pos - p->body_start;
+  if (dropped > 0) {
+    memmove(buf + p->body_start, buf + p->pos, len - p->pos);
   }
 
-  if (body + body_len > (char *)defer_buf + n) {
-    free((void *)path);
-    free(defer_buf);
-    kop_headers_free(headers);
-    return ERR_MALFORMED_BODY;
+  p->pos = p->body_start;
+  p->body_end = p->body_start;
+
+  return dropped;
+}
+
+// Checks whether the comma separated `list` contains `token`, ignoring case.
+static bool has_token(kop_str list, const char *token) {
+  const char *it = list.data;
+  const char *end = list.data + list.len;
+
+  while (it < end) {
+    for (; it < end && (*it == ' ' || *it == '\t' || *it == ','); ++it)
+      ;
+
+    const char *item_end = it;
+    for (; item_end < end && *item_end != ','; ++item_end)
+      ;
+
+    const char *last = item_end;
+    for (; last > it && (last[-1] == ' ' || last[-1] == '\t'); --last)
+      ;
+
+    if (kop_str_eq_nocase((kop_str){.data = it, .len = last - it}, token)) {
+      return true;
+    }
+
+    it = item_end;
+  }
+
+  return false;
+}
+
+bool kop_http_request_expects_continue(kop_http_request *req) {
+  // HTTP/1.0 clients don't know about 100 Continue and never wait for it
+  return req->minor_version > 0 &&
+         kop_str_eq_nocase(kop_http_request_header(req, KOP_HEADER_EXPECT),
+                           "100-continue");
+}
+
+bool kop_http_etag_matches(kop_str list, const char *etag) {
+  // If-None-Match uses the weak comparison, which ignores W/ on either side
+  if (etag[0] == 'W' && etag[1] == '/') {
+    etag += 2;
+  }
+  size_t etag_len = strlen(etag);
+  const char *it = list.data;
+  const char *end = list.data + list.len;
+
+  while (it < end) {
+    while (it < end && (*it == ' ' || *it == '\t' || *it == ',')) {
+      it++;
+    }
+    const char *tok = it;
+    while (it < end && *it != ',') {
+      it++;
+    }
+    const char *tok_end = it;
+    while (tok_end > tok && (tok_end[-1] == ' ' || tok_end[-1] == '\t')) {
+      tok_end--;
+    }
+
+    if (tok_end - tok == 1 && *tok == '*') {
+      return true;
+    }
+    if (tok_end - tok > 2 && tok[0] == 'W' && tok[1] == '/') {
+      tok += 2;
+    }
+    if ((size_t)(tok_end - tok) == etag_len &&
+        memcmp(tok, etag, etag_len) == 0) {
+      return true;
+    }
   }
 
-  body[body_len] = '\0';
+  return false;
+}
 
-  req->body_len = body_len;
-  req->body = body;
+bool kop_http_request_keep_alive(kop_http_request *req) {
+  kop_str connection = kop_http_request_header(req, KOP_HEADER_CONNECTION);
+
+  if (req->minor_version == 0) {
+    return has_token(connection, "keep-alive");
+  }
+
+  return !has_token(connection, "close");
+}
+
+kop_error parse_http_request(kop_http_parser *p, kop_http_request *req,
+                             char *buf, size_t len,
+                             kop_http_parse_status *status) {
+  kop_error err;
+  size_t line_len, consumed;
+
+  *status = KOP_PARSE_NEED_MORE;
+
+  while (p->state == KOP_PARSE_REQUEST_LINE ||
+         p->state == KOP_PARSE_HEADERS) {
+    const char *line = buf + p->pos;
+    const char *colon = NULL;
+    bool complete =
+        p->state == KOP_PARSE_REQUEST_LINE
+            ? next_line(line, len - p->pos, &line_len, &consumed)
+            : next_header_line(line, len - p->pos, &line_len, &consumed,
+                               &colon);
+    if (!complete) {
+      // everything from the request line on is still request line and
+      // headers, the buffer isn't left to grow for them
+      if (p->max_head > 0 && len > p->max_head) {
+        return ERR_HEADERS_TOO_LARGE;
+      }
+      return NOERROR;
+    }
+    p->pos += consumed;
+    if (p->max_head > 0 && p->pos > p->max_head) {
+      return ERR_HEADERS_TOO_LARGE;
+    }
+
+    if (p->state == KOP_PARSE_REQUEST_LINE) {
+      if (line_len == 0) {
+        // stray CRLF in front of the request line is allowed by RFC 9112
+        continue;
+      }
+      if ((err = parse_request_line(req, line, line_len)) != NOERROR) {
+        return err;
+      }
+      p->state = KOP_PARSE_HEADERS;
+    } else if (line_len == 0) {
+      // empty line, the headers are over
+      if ((err = parse_body_framing(p, req)) != NOERROR) {
+        return err;
+      }
+      p->state = KOP_PARSE_BODY;
+      p->body_start = p->pos;
+      p->body_end = p->pos;
+      // the caller decides how much body it takes before it gets any
+      *status = KOP_PARSE_HEADERS_COMPLETE;
+      return NOERROR;
+    } else if ((err = parse_header_line(p, req, line, line_len, colon)) !=
+               NOERROR) {
+      return err;
+    }
+  }
+
+  if (p->state == KOP_PARSE_BODY) {
+    if ((err = parse_body(p, buf, len)) != NOERROR) {
+      return err;
+    }
+    if (p->state != KOP_PARSE_DONE) {
+      *status = KOP_PARSE_HEADERS_COMPLETE;
+      return NOERROR;
+    }
+
+    req->body = kop_http_parser_body(p, buf);
+  }
+
+  *status = KOP_PARSE_COMPLETE;
 
   return NOERROR;
 }
+
+// Length of the decimal representation of `n`.
+static size_t num_len(size_t n) {
+  size_t len = 1;
+  for (; n >= 10; n /= 10) {
+    len++;
+  }
+  return len;
+}
+
+static char *write_num(char *out, size_t n) {
+  size_t len = num_len(n);
+  for (size_t i = len; i > 0; i--) {
+    out[i - 1] = '0' + n % 10;
+    n /= 10;
+  }
+  return out + len;
+}
+
+static char *write_str(char *out, const char *s, size_t len) {
+  memcpy(out, s, len);
+  return out + len;
+}
+
+#define WRITE_LITERAL(out, literal)                                            \
+  write_str(out, literal, sizeof(literal) - 1)
+
+size_t kop_http_response_head_len(kop_http_response *resp, int minor_version,
+                                  bool keep_alive) {
+  // "HTTP/1.1 200 OK\r\n"
+  size_t len = strlen("HTTP/1.1 ") + num_len(resp->code) + 1 +
+               strlen(kop_http_code_reason(resp->code)) + 2;
+
+  kop_vector_foreach(kop_http_header, resp->headers, header) {
+    len += header->header.len + 2 + header->value.len + 2;
+  }
+
+  if (resp->stream != NULL) {
+    // HTTP/1.0 has no chunked encoding, the body ends with the connection
+    if (minor_version > 0) {
+      len += strlen("Transfer-Encoding: chunked\r\n");
+    }
+  } else if (kop_http_code_has_body(resp->code)) {
+    len += strlen("Content-Length: ") + num_len(resp->body_len) + 2;
+  }
+
+  if (!keep_alive) {
+    len += strlen("Connection: close\r\n");
+  } else if (minor_version == 0) {
+    len += strlen("Connection: keep-alive\r\n");
+  }
+
+  return len + 2;
+}
+
+size_t kop_http_response_write_head(kop_http_response *resp, int minor_version,
+                                    bool keep_alive, char *out) {
+  char *it = out;
+
+  it = WRITE_LITERAL(it, "HTTP/1.1 ");
+  it = write_num(it, resp->code);
+  *it++ = ' ';
+  const char *reason = kop_http_code_reason(resp->code);
+  it = write_str(it, reason, strlen(reason));
+  it = WRITE_LITERAL(it, "\r\n");
+
+  kop_vector_foreach(kop_http_header, resp->headers, header) {
+    it = write_str(it, header->header.data, header->header.len);
+    it = WRITE_LITERAL(it, ": ");
+    it = write_str(it, header->value.data, header->value.len);
+    it = WRITE_LITERAL(it, "\r\n");
+  }
+
+  if (resp->stream != NULL) {
+    if (minor_version > 0) {
+      it = WRITE_LITERAL(it, "Transfer-Encoding: chunked\r\n");
+    }
+  } else if (kop_http_code_has_body(resp->code)) {
+    it = WRITE_LITERAL(it, "Content-Length: ");
+    it = write_num(it, resp->body_len);
+    it = WRITE_LITERAL(it, "\r\n");
+  }
+
+  if (!keep_alive) {
+    it = WRITE_LITERAL(it, "Connection: close\r\n");
+  } else if (minor_version == 0) {
+    it = WRITE_LITERAL(it, "Connection: keep-alive\r\n");
+  }
+
+  it = WRITE_LITERAL(it, "\r\n");
+
+  return it - out;
+}
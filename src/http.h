@@ -1,18 +1,25 @@
 #ifndef KOP_HTTP_H_
 #define KOP_HTTP_H_
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
+#include "arena.h"
 #include "utils.h"
 
 #define KOP_HTTP_METHOD_TO_STR(method) kop_http_method_str[method]
 
 struct kop_context;
+struct kop_file;
 
+// Headers, path and body of a request are views into the receive buffer of
+// the connection and are only valid until the handler returns. Use
+// kop_str_dup to keep any of them around for longer.
 typedef struct kop_http_header {
-  const char *header;
-  const char *value;
+  kop_str header;
+  kop_str value;
 } kop_http_header;
 
 typedef struct kop_http_headers {
@@ -21,78 +28,342 @@ typedef struct kop_http_headers {
   size_t cap;
 } kop_http_headers;
 
+// Request headers the server or common handlers look at. The parser
+// recognizes them whatever their spelling and keeps their values in
+// kop_http_request.known, so looking one up is a single array index.
+typedef enum kop_http_header_id {
+  KOP_HEADER_ACCEPT = 0,
+  KOP_HEADER_ACCEPT_ENCODING,
+  KOP_HEADER_ACCEPT_LANGUAGE,
+  KOP_HEADER_AUTHORIZATION,
+  KOP_HEADER_CACHE_CONTROL,
+  KOP_HEADER_CONNECTION,
+  KOP_HEADER_CONTENT_LENGTH,
+  KOP_HEADER_CONTENT_TYPE,
+  KOP_HEADER_COOKIE,
+  KOP_HEADER_EXPECT,
+  KOP_HEADER_HOST,
+  KOP_HEADER_IF_MODIFIED_SINCE,
+  KOP_HEADER_IF_NONE_MATCH,
+  KOP_HEADER_IF_RANGE,
+  KOP_HEADER_ORIGIN,
+  KOP_HEADER_RANGE,
+  KOP_HEADER_REFERER,
+  KOP_HEADER_TRANSFER_ENCODING,
+  KOP_HEADER_UPGRADE,
+  KOP_HEADER_USER_AGENT,
+  KOP_HEADER_X_FORWARDED_FOR,
+
+  kop_http_header_id_count,
+
+  KOP_HEADER_UNKNOWN,
+} kop_http_header_id;
+
+// Canonical spelling of every kop_http_header_id.
+extern const char *const kop_http_header_names[];
+
 typedef enum kop_http_method {
   HTTP_GET = 0,
   HTTP_POST,
   HTTP_PUT,
   HTTP_DELETE,
+  HTTP_HEAD,
+  HTTP_OPTIONS,
+  HTTP_PATCH,
 
   kop_http_method_count,
 
   HTTP_BAD_METHOD,
 } kop_http_method;
 
-static const char *kop_http_method_str[] = {
-    [HTTP_GET] = "GET",
-    [HTTP_POST] = "POST",
-    [HTTP_PUT] = "PUT",
-    [HTTP_DELETE] = "DELETE",
-};
+extern const char *const kop_http_method_str[];
 
 typedef enum kop_http_code {
   HTTP_OK = 200,
+  HTTP_CREATED = 201,
+  HTTP_NO_CONTENT = 204,
+  HTTP_PARTIAL_CONTENT = 206,
+  HTTP_NOT_MODIFIED = 304,
+  HTTP_BAD_REQUEST = 400,
+  HTTP_NOT_FOUND = 404,
+  HTTP_METHOD_NOT_ALLOWED = 405,
+  HTTP_CONTENT_TOO_LARGE = 413,
+  HTTP_RANGE_NOT_SATISFIABLE = 416,
+  HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
   HTTP_INTERNAL_SERVER_ERROR = 500,
+  HTTP_NOT_IMPLEMENTED = 501,
 } kop_http_code;
 
+static inline const char *kop_http_code_reason(kop_http_code code) {
+  switch (code) {
+  case HTTP_OK:
+    return "OK";
+  case HTTP_CREATED:
+    return "Created";
+  case HTTP_NO_CONTENT:
+    return "No Content";
+  case HTTP_PARTIAL_CONTENT:
+    return "Partial Content";
+  case HTTP_NOT_MODIFIED:
+    return "Not Modified";
+  case HTTP_BAD_REQUEST:
+    return "Bad Request";
+  case HTTP_NOT_FOUND:
+    return "Not Found";
+  case HTTP_METHOD_NOT_ALLOWED:
+    return "Method Not Allowed";
+  case HTTP_CONTENT_TOO_LARGE:
+    return "Content Too Large";
+  case HTTP_RANGE_NOT_SATISFIABLE:
+    return "Range Not Satisfiable";
+  case HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE:
+    return "Request Header Fields Too Large";
+  case HTTP_INTERNAL_SERVER_ERROR:
+    return "Internal Server Error";
+  case HTTP_NOT_IMPLEMENTED:
+    return "Not Implemented";
+  }
+
+  return "Unknown";
+}
+
 typedef struct kop_http_request {
   kop_http_method method;
+  // 0 for HTTP/1.0, 1 for HTTP/1.1
+  int minor_version;
+  // every header in the order it arrived
   kop_http_headers headers;
-  const char *path;
-  const char *body;
-  size_t body_len;
+  // values of the well-known headers, the first one if a header is repeated.
+  // `data` is NULL for the ones that are missing.
+  kop_str known[kop_http_header_id_count];
+  kop_str path;
+  kop_str body;
 } kop_http_request;
 
+// Produces the next part of a streamed response body, see kop_stream.
+typedef kop_error (*kop_stream_func)(struct kop_context *ctx, void *state);
+
+// Response filled in by a handler. Headers and body are not copied when the
+// response is sent, so they have to stay valid until then, which is what the
+// request arena (kop_alloc) is for. Content-Length and Connection are added by
+// the server.
 typedef struct kop_http_response {
   kop_http_code code;
-  char *body;
+  kop_http_headers headers;
+  const char *body;
   size_t body_len;
+  // when set, the body is `body_len` bytes of this file starting at
+  // `file_off`, sent with sendfile. The response owns a reference.
+  struct kop_file *file;
+  uint64_t file_off;
+  // when set, the body is produced by `stream` after the head went out and
+  // sent chunked instead of with a Content-Length
+  kop_stream_func stream;
+  void *stream_state;
 } kop_http_response;
 
-static inline kop_http_method kop_http_method_from_str(const char *buf) {
-  for (size_t i = 0; i < kop_http_method_count; ++i) {
-    const char *method = kop_http_method_str[i];
+typedef enum kop_http_parse_state {
+  KOP_PARSE_REQUEST_LINE = 0,
+  KOP_PARSE_HEADERS,
+  KOP_PARSE_BODY,
+  KOP_PARSE_DONE,
+} kop_http_parse_state;
+
+typedef enum kop_http_parse_status {
+  // the request line or headers are not complete yet
+  KOP_PARSE_NEED_MORE = 0,
+  // headers are parsed, part of the body is still missing
+  KOP_PARSE_HEADERS_COMPLETE,
+  // the whole request is parsed
+  KOP_PARSE_COMPLETE,
+} kop_http_parse_status;
+
+// longest chunk size line, extensions included, and the line break after
+// the data of a chunk
+#define KOP_HTTP_MAX_CHUNK_LINE 4096
+
+typedef enum kop_http_chunk_state {
+  // the line with the size of the next chunk
+  KOP_CHUNK_SIZE = 0,
+  KOP_CHUNK_DATA,
+  // the line break ending the data of a chunk
+  KOP_CHUNK_DATA_END,
+  // trailer fields after the last chunk, they are skipped
+  KOP_CHUNK_TRAILER,
+} kop_http_chunk_state;
+
+// Resumable request parser. It keeps its position in the connection buffer,
+// so every time new bytes arrive it continues where it stopped instead of
+// starting over.
+typedef struct kop_http_parser {
+  kop_http_parse_state state;
+  // offset of the first byte that has not been consumed yet
+  size_t pos;
+  // the body comes with Transfer-Encoding: chunked
+  bool chunked;
+  kop_http_chunk_state chunk_state;
+  // bytes still missing from the current chunk or the Content-Length body
+  uint64_t remaining;
+  // the decoded body sits at [body_start, body_end), chunked framing is
+  // squeezed out in place as the chunks come in
+  size_t body_start;
+  size_t body_end;
+  // body bytes decoded so far, including discarded ones
+  uint64_t body_len;
+  // bytes of trailer fields seen so far, they count against `max_head`
+  size_t trailer_len;
+  // largest body accepted, 0 for no limit
+  uint64_t max_body;
+  // largest request line and headers together, 0 for no limit
+  size_t max_head;
+  // per-request arena the header vector is allocated from
+  kop_arena *arena;
+} kop_http_parser;
+
+// The first `len` bytes of `buf` as a word, in memory order. For literals
+// the compiler folds it into a constant.
+static inline uint64_t kop_http_word(const char *buf, size_t len) {
+  uint64_t w = 0;
+  memcpy(&w, buf, len);
+  return w;
+}
 
-    if (strncmp(buf, method, strlen(method)) == 0) {
-      return i;
-    }
+// Whether the word `w` starts with the `len` bytes of `name`.
+static inline bool kop_http_word_is(uint64_t w, const char *name,
+                                    size_t len) {
+  return (w & kop_http_word("\xff\xff\xff\xff\xff\xff\xff\xff", len)) ==
+         kop_http_word(name, len);
+}
+
+// Parses the `len` bytes of a method token. `buf` has to have at least 8
+// readable bytes, which every request line does, so the token is compared as
+// a single word instead of byte by byte.
+static inline kop_http_method kop_http_method_from_str(const char *buf,
+                                                       size_t len) {
+  if (len < 3 || len > 7) {
+    return HTTP_BAD_METHOD;
+  }
+
+  uint64_t w = kop_http_word(buf, 8);
+  switch (len) {
+  case 3:
+    return kop_http_word_is(w, "GET", 3)   ? HTTP_GET
+           : kop_http_word_is(w, "PUT", 3) ? HTTP_PUT
+                                           : HTTP_BAD_METHOD;
+  case 4:
+    return kop_http_word_is(w, "POST", 4)   ? HTTP_POST
+           : kop_http_word_is(w, "HEAD", 4) ? HTTP_HEAD
+                                            : HTTP_BAD_METHOD;
+  case 5:
+    return kop_http_word_is(w, "PATCH", 5) ? HTTP_PATCH : HTTP_BAD_METHOD;
+  case 6:
+    return kop_http_word_is(w, "DELETE", 6) ? HTTP_DELETE : HTTP_BAD_METHOD;
+  case 7:
+    return kop_http_word_is(w, "OPTIONS", 7) ? HTTP_OPTIONS : HTTP_BAD_METHOD;
   }
 
   return HTTP_BAD_METHOD;
 }
 
-static inline const char *find_header_or_default(kop_http_request *req,
-                                                 const char *header,
-                                                 const char *def) {
-  for (size_t i = 0; i < req->headers.len; i++) {
-    if (strcmp(req->headers.data[i].header, header) == 0) {
-      return req->headers.data[i].value;
-    }
-  }
+// Maps a header name to its id, ignoring case. KOP_HEADER_UNKNOWN for names
+// that aren't well-known.
+kop_http_header_id kop_http_header_id_of(kop_str name);
+
+// Value of a well-known header, `data` is NULL if the request has none.
+static inline kop_str kop_http_request_header(kop_http_request *req,
+                                              kop_http_header_id id) {
+  return req->known[id];
+}
+
+// Value of any header, the name is matched ignoring case. `data` is NULL if
+// the request has none.
+kop_str kop_http_request_find_header(kop_http_request *req, kop_str name);
+
+static inline kop_str find_header_or_default(kop_http_request *req,
+                                             const char *header,
+                                             const char *def) {
+  kop_str value =
+      kop_http_request_find_header(req, kop_str_from_cstr(header));
+  return value.data != NULL ? value : kop_str_from_cstr(def);
+}
+
+// Resets the parser and the request for the next message. Anything the parser
+// has to allocate comes from `arena`.
+void kop_http_parser_init(kop_http_parser *p, kop_http_request *req,
+                          kop_arena *arena);
+// `buf` holds everything received for the current request so far, `len` is
+// its total length. The parser consumes the bytes past `p->pos` and stores
+// how far it got in `status`. It stops right after the headers, reporting
+// KOP_PARSE_HEADERS_COMPLETE, so the caller can set `p->max_body` before any
+// of the body is taken in. Chunked bodies are decoded in place, which is why
+// `buf` is not const.
+kop_error parse_http_request(kop_http_parser *p, kop_http_request *req,
+                             char *buf, size_t len,
+                             kop_http_parse_status *status);
 
-  return def;
+// Body bytes decoded so far and not discarded yet.
+static inline kop_str kop_http_parser_body(kop_http_parser *p,
+                                           const char *buf) {
+  return (kop_str){.data = buf + p->body_start,
+                   .len = p->body_end - p->body_start};
 }
 
-#define kop_headers_free(headers)                                              \
-  do {                                                                         \
-    kop_vector_foreach(kop_http_header, headers, header) {                     \
-      free((void *)header->header);                                            \
-      free((void *)header->value);                                             \
-    }                                                                          \
-                                                                               \
-    kop_vector_free(headers);                                                  \
-  } while (0)
-
-kop_error parse_http_request(int sock, kop_http_request *req);
-void kop_http_request_free(kop_http_request *req);
+// Drops the decoded body bytes and moves whatever follows them in `buf` down
+// to take their place, used to stream a body through a buffer of a fixed
+// size. Returns by how many bytes `len` shrank.
+size_t kop_http_parser_discard_body(kop_http_parser *p, char *buf,
+                                    size_t len);
+// Fixes up the views of `req` after the buffer they point into has moved from
+// `old_base` to `new_base`.
+void kop_http_request_rebase(kop_http_request *req, uintptr_t old_base,
+                             uintptr_t new_base);
+// Adds a header to `resp`. The strings are not copied, they have to live as
+// long as the response, e.g. in `arena`.
+static inline void kop_http_response_add_header(kop_http_response *resp,
+                                                kop_arena *arena,
+                                                const char *name,
+                                                const char *value) {
+  kop_http_header h = (kop_http_header){
+      .header = kop_str_from_cstr(name),
+      .value = kop_str_from_cstr(value),
+  };
+  kop_vector_append_arena(kop_http_header, resp->headers, h, arena);
+}
+
+// Whether a response with this status carries Content-Length and a body.
+static inline bool kop_http_code_has_body(kop_http_code code) {
+  return code != HTTP_NO_CONTENT && code != HTTP_NOT_MODIFIED;
+}
+
+// Number of bytes kop_http_response_write_head is going to produce.
+size_t kop_http_response_head_len(kop_http_response *resp, int minor_version,
+                                  bool keep_alive);
+// Serializes the status line and headers of `resp` into `out`, which must have
+// room for kop_http_response_head_len bytes. Returns the number of bytes
+// written.
+size_t kop_http_response_write_head(kop_http_response *resp, int minor_version,
+                                    bool keep_alive, char *out);
+// Whether the connection may be reused after this request, following the
+// persistence rules of RFC 9112 section 9.3.
+bool kop_http_request_keep_alive(kop_http_request *req);
+// Whether the If-None-Match list `list` matches `etag`, using the weak
+// comparison.
+bool kop_http_etag_matches(kop_str list, const char *etag);
+// Whether the client waits for a 100 Continue before it sends the body.
+bool kop_http_request_expects_continue(kop_http_request *req);
+
+// Status of the response to a request that failed to parse with `err`.
+static inline kop_http_code kop_http_error_code(kop_error err) {
+  switch (err) {
+  case ERR_BODY_TOO_LARGE:
+    return HTTP_CONTENT_TOO_LARGE;
+  case ERR_HEADERS_TOO_LARGE:
+    return HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE;
+  case ERR_UNSUPPORTED_TRANSFER_ENCODING:
+    return HTTP_NOT_IMPLEMENTED;
+  default:
+    return HTTP_BAD_REQUEST;
+  }
+}
 
 #endif // !KOP_HTTP_H_
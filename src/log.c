@@ -0,0 +1,261 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "log.h"
+#include "utils.h"
+
+// the longest line a record formats to, an escaped path byte takes four
+#define KOP_ACCESS_LOG_LINE_MAX (KOP_ACCESS_LOG_PATH_LEN * 4 + 512)
+
+// SIGHUPs so far, only the handler writes it. Every writer compares it
+// with its own count, a flag cleared by the first one would keep the
+// others from seeing it.
+static volatile sig_atomic_t gHangups = 0;
+
+void kop_access_log_reopen(int sig) {
+  (void)sig;
+  gHangups = gHangups + 1;
+}
+
+static int open_log(const char *path) {
+  return open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+kop_error kop_access_log_open(kop_access_log *log, const char *path,
+                              size_t nrings, const kop_route_infos *routes) {
+  *log = (kop_access_log){
+      .fd = -1, .routes = routes, .hangups = (unsigned)gHangups};
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_cond_init(&log->cond, NULL);
+
+  log->path = strdup(path);
+  log->rings = calloc(nrings, sizeof(kop_access_ring));
+  log->buf = malloc(KOP_ACCESS_LOG_BUF_SIZE);
+  if (log->path == NULL || log->rings == NULL || log->buf == NULL) {
+    kop_access_log_close(log);
+    return ERR_OUT_OF_MEMORY;
+  }
+  log->nrings = nrings;
+
+  for (size_t i = 0; i < nrings; i++) {
+    log->rings[i].records =
+        malloc(sizeof(kop_access_record) * KOP_ACCESS_LOG_RING_SIZE);
+    if (log->rings[i].records == NULL) {
+      kop_access_log_close(log);
+      return ERR_OUT_OF_MEMORY;
+    }
+  }
+
+  log->fd = open_log(path);
+  if (log->fd < 0) {
+    kop_access_log_close(log);
+    return ERR_OPENING_FILE;
+  }
+
+  return NOERROR;
+}
+
+static void log_flush(kop_access_log *log) {
+  size_t off = 0;
+  while (off < log->len) {
+    ssize_t n = write(log->fd, log->buf + off, log->len - off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // nobody to tell, the lines are lost like those of a full ring
+      KOP_DEBUG_LOG("error writing access log: %s", strerror(errno));
+      break;
+    }
+    off += n;
+  }
+  log->len = 0;
+}
+
+// Keeps the previous file when the new one can't be opened, losing the
+// lines would be worse than writing them to a rotated file.
+static void log_reopen(kop_access_log *log) {
+  int fd = open_log(log->path);
+  if (fd < 0) {
+    KOP_DEBUG_LOG("error reopening access log: %s", strerror(errno));
+    return;
+  }
+  close(log->fd);
+  log->fd = fd;
+}
+
+// Bytes that would let a client forge lines or break up fields are
+// written as \xHH.
+static char *escape_path(char *it, const char *path, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+
+  for (size_t i = 0; i < len; i++) {
+    unsigned char ch = (unsigned char)path[i];
+    if (ch <= ' ' || ch >= 0x7f || ch == '\\' || ch == '"') {
+      *it++ = '\\';
+      *it++ = 'x';
+      *it++ = hex[ch >> 4];
+      *it++ = hex[ch & 15];
+    } else {
+      *it++ = (char)ch;
+    }
+  }
+  return it;
+}
+
+// The date and time of a second, most records share it with the one before.
+typedef struct log_clock {
+  time_t sec;
+  char text[32];
+} log_clock;
+
+// One line per record:
+//   <time> <peer> <method> <path> <status> <bytes> <latency us> <route>
+// in UTC with milliseconds, "-" for a missing method or route.
+static void log_format(kop_access_log *log, log_clock *clock,
+                       const kop_access_record *rec) {
+  time_t sec = (time_t)(rec->time_ms / 1000);
+  if (sec != clock->sec) {
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    strftime(clock->text, sizeof(clock->text), "%Y-%m-%dT%H:%M:%S", &tm);
+    clock->sec = sec;
+  }
+
+  const char *route = "-";
+  if (rec->route != KOP_ACCESS_LOG_NO_ROUTE &&
+      rec->route < log->routes->len) {
+    route = log->routes->data[rec->route].path;
+  }
+  const char *method = rec->method < kop_http_method_count
+                           ? kop_http_method_str[rec->method]
+                           : "-";
+  uint32_t addr = ntohl(rec->peer_addr);
+
+  char *it = log->buf + log->len;
+  it += sprintf(it, "%s.%03uZ %u.%u.%u.%u:%u %s ", clock->text,
+                (unsigned)(rec->time_ms % 1000), addr >> 24,
+                (addr >> 16) & 255, (addr >> 8) & 255, addr & 255,
+                rec->peer_port, method);
+  it = escape_path(it, rec->path, rec->path_len);
+  if (rec->path_len == 0) {
+    *it++ = '-';
+  }
+  // route patterns are the server's own, they need no escaping
+  it += sprintf(it, " %u %llu %llu %.256s\n", rec->status,
+                (unsigned long long)rec->bytes,
+                (unsigned long long)rec->latency_us, route);
+
+  log->len = it - log->buf;
+  if (log->len > KOP_ACCESS_LOG_BUF_SIZE - KOP_ACCESS_LOG_LINE_MAX) {
+    log_flush(log);
+  }
+}
+
+// Formats everything the rings hold. Returns the number of records.
+static size_t log_drain(kop_access_log *log, log_clock *clock) {
+  size_t n = 0;
+
+  for (size_t i = 0; i < log->nrings; i++) {
+    kop_access_ring *ring = &log->rings[i];
+    size_t tail = ring->tail;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    for (; tail != head; tail++) {
+      log_format(log, clock,
+                 &ring->records[tail & (KOP_ACCESS_LOG_RING_SIZE - 1)]);
+      // the slot goes back as soon as it is formatted, a reactor waiting
+      // for room doesn't have to wait for the write
+      __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+      n++;
+    }
+  }
+
+  return n;
+}
+
+static void *log_thread(void *arg) {
+  kop_access_log *log = arg;
+  log_clock clock = {.sec = -1};
+
+  for (;;) {
+    unsigned hangups = (unsigned)gHangups;
+    if (hangups != log->hangups) {
+      log->hangups = hangups;
+      log_flush(log);
+      log_reopen(log);
+    }
+
+    size_t n = log_drain(log, &clock);
+    log_flush(log);
+
+    pthread_mutex_lock(&log->lock);
+    bool stop = log->stop && n == 0;
+    if (!stop && n == 0) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += KOP_ACCESS_LOG_INTERVAL_MS * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&log->cond, &log->lock, &deadline);
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    if (stop) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+kop_error kop_access_log_start(kop_access_log *log) {
+  log->stop = false;
+  if (pthread_create(&log->thread, NULL, log_thread, log) != 0) {
+    return ERR_CREATING_THREAD;
+  }
+  log->running = true;
+
+  return NOERROR;
+}
+
+void kop_access_log_stop(kop_access_log *log) {
+  if (!log->running) {
+    return;
+  }
+
+  pthread_mutex_lock(&log->lock);
+  log->stop = true;
+  pthread_cond_signal(&log->cond);
+  pthread_mutex_unlock(&log->lock);
+
+  pthread_join(log->thread, NULL);
+  log->running = false;
+}
+
+void kop_access_log_close(kop_access_log *log) {
+  kop_access_log_stop(log);
+
+  if (log->fd >= 0) {
+    close(log->fd);
+  }
+  pthread_mutex_destroy(&log->lock);
+  pthread_cond_destroy(&log->cond);
+  for (size_t i = 0; log->rings != NULL && i < log->nrings; i++) {
+    free(log->rings[i].records);
+  }
+  free(log->rings);
+  free(log->buf);
+  free(log->path);
+
+  *log = (kop_access_log){.fd = -1};
+}
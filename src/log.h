@@ -0,0 +1,127 @@
+#ifndef KOP_LOG_H_
+#define KOP_LOG_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "router.h"
+#include "utils.h"
+
+// records a reactor may queue before the writer catches up, a power of two
+#define KOP_ACCESS_LOG_RING_SIZE 8192
+// bytes of the request path a record keeps, longer paths are cut
+#define KOP_ACCESS_LOG_PATH_LEN 88
+// formatted lines are collected up to this many bytes for a single write
+#define KOP_ACCESS_LOG_BUF_SIZE (256 << 10)
+// how long the writer sleeps once every ring is empty
+#define KOP_ACCESS_LOG_INTERVAL_MS 50
+// route of a record whose request wasn't routed
+#define KOP_ACCESS_LOG_NO_ROUTE UINT32_MAX
+
+// A served request. Fixed size, the reactor fills it in right in the ring
+// and the writer formats it later.
+typedef struct kop_access_record {
+  // wall clock when the response was queued, milliseconds since the epoch
+  uint64_t time_ms;
+  // from the first byte of the request until its response was queued
+  uint64_t latency_us;
+  // of the response body, before compression
+  uint64_t bytes;
+  // IPv4 address in network byte order, port in host byte order
+  uint32_t peer_addr;
+  uint16_t peer_port;
+  uint16_t status;
+  // index into the routes of the router, KOP_ACCESS_LOG_NO_ROUTE if none
+  uint32_t route;
+  // a kop_http_method, HTTP_BAD_METHOD when the request line didn't parse
+  uint8_t method;
+  uint8_t path_len;
+  char path[KOP_ACCESS_LOG_PATH_LEN];
+} kop_access_record;
+
+// Records on their way from a single reactor to the writer. Each side only
+// ever writes its own index, so neither takes a lock.
+typedef struct kop_access_ring {
+  kop_access_record *records;
+  // next slot the reactor fills
+  size_t head;
+  // `tail` as the reactor last read it, it only looks again once the ring
+  // seems full
+  size_t tail_cache;
+  // keeps the writer's index off the reactor's cache line
+  char pad[64];
+  // next slot the writer formats
+  size_t tail;
+  // and off the line of the next ring's reactor, the rings are allocated
+  // as a single array
+  char pad_end[64];
+} kop_access_ring;
+
+// Access log of a server: a ring per reactor and a thread that empties them
+// into a file in large writes, so the reactors never wait for the disk.
+typedef struct kop_access_log {
+  char *path;
+  int fd;
+  kop_access_ring *rings;
+  size_t nrings;
+  // patterns of the records' routes, not modified while the server runs
+  const kop_route_infos *routes;
+  char *buf;
+  size_t len;
+  // SIGHUPs the writer has reopened the file for, it does again whenever
+  // the count kept by the handler moves past it
+  unsigned hangups;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool running;
+  bool stop;
+} kop_access_log;
+
+// Opens `path` for appending and sets up a ring for each of `nrings`
+// reactors.
+kop_error kop_access_log_open(kop_access_log *log, const char *path,
+                              size_t nrings, const kop_route_infos *routes);
+// Starts the writer.
+kop_error kop_access_log_start(kop_access_log *log);
+// Lets the writer empty the rings and joins it. The producers have to be
+// done by then.
+void kop_access_log_stop(kop_access_log *log);
+void kop_access_log_close(kop_access_log *log);
+// SIGHUP handler: the writer of every open access log reopens its file,
+// e.g. after logrotate moved it away.
+void kop_access_log_reopen(int sig);
+
+// Milliseconds since the epoch from the coarse clock.
+static inline uint64_t kop_wall_ms(void) {
+  struct timespec ts;
+#if defined(CLOCK_REALTIME_COARSE)
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Slot for the next record, NULL when the ring is full. The record is
+// dropped then, the reactor doesn't wait for the writer.
+static inline kop_access_record *
+kop_access_ring_reserve(kop_access_ring *ring) {
+  if (ring->head - ring->tail_cache == KOP_ACCESS_LOG_RING_SIZE) {
+    ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - ring->tail_cache == KOP_ACCESS_LOG_RING_SIZE) {
+      return NULL;
+    }
+  }
+  return &ring->records[ring->head & (KOP_ACCESS_LOG_RING_SIZE - 1)];
+}
+
+// Hands the reserved record to the writer.
+static inline void kop_access_ring_commit(kop_access_ring *ring) {
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+#endif // !KOP_LOG_H_
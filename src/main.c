@@ -3,15 +3,19 @@
 
 #define PORT 8000
 
-void sample_get(kop_context ctx) {
-  (void)ctx;
+void sample_get(kop_context *ctx, void *data) {
+  (void)data;
   KOP_DEBUG_LOG("get handler %s", "");
+
+  static const char body[] = "hello from kopchik\n";
+  kop_set_header(ctx, "Content-Type", "text/plain");
+  kop_send(ctx, HTTP_OK, body, sizeof(body) - 1);
 }
 
 int main(void) {
   kop_server s;
 
-  if (kop_server_new(&s, PORT) != NOERROR) {
+  if (kop_server_new(&s, PORT, 0) != NOERROR) {
     perror("server new");
     return -1;
   }
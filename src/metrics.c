@@ -0,0 +1,203 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http.h"
+#include "metrics.h"
+#include "text.h"
+#include "utils.h"
+
+kop_error kop_metrics_init(kop_metrics *m, size_t nroutes) {
+  *m = (kop_metrics){0};
+  if (nroutes == 0) {
+    return NOERROR;
+  }
+
+  m->routes = calloc(nroutes, sizeof(kop_histogram));
+  if (m->routes == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  m->nroutes = nroutes;
+
+  return NOERROR;
+}
+
+void kop_metrics_free(kop_metrics *m) {
+  free(m->routes);
+  m->routes = NULL;
+  m->nroutes = 0;
+}
+
+static void sum_counters(uint64_t *into, uint64_t *from, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    into[i] += kop_metrics_get(&from[i]);
+  }
+}
+
+void kop_metrics_sum(kop_metrics *into, kop_metrics *m) {
+  into->accepted += kop_metrics_get(&m->accepted);
+  into->closed += kop_metrics_get(&m->closed);
+  into->rejected += kop_metrics_get(&m->rejected);
+  into->accept_failed += kop_metrics_get(&m->accept_failed);
+  into->log_dropped += kop_metrics_get(&m->log_dropped);
+  into->bytes_in += kop_metrics_get(&m->bytes_in);
+  into->bytes_out += kop_metrics_get(&m->bytes_out);
+  sum_counters(into->methods, m->methods, kop_http_method_count);
+  sum_counters(into->statuses, m->statuses, KOP_METRICS_STATUSES);
+  sum_counters(into->errors, m->errors, kop_error_count);
+
+  for (size_t i = 0; i < into->nroutes && i < m->nroutes; i++) {
+    kop_histogram *h = &into->routes[i];
+    sum_counters(h->buckets, m->routes[i].buckets, KOP_HISTOGRAM_BUCKETS);
+    h->count += kop_metrics_get(&m->routes[i].count);
+    h->sum += kop_metrics_get(&m->routes[i].sum);
+  }
+}
+
+// Label values escaped as the exposition format wants them.
+static void text_label(kop_text *t, const char *value) {
+  for (const char *it = value; *it != '\0'; it++) {
+    switch (*it) {
+    case '\\':
+      kop_text_printf(t, "\\\\");
+      break;
+    case '"':
+      kop_text_printf(t, "\\\"");
+      break;
+    case '\n':
+      kop_text_printf(t, "\\n");
+      break;
+    default:
+      kop_text_printf(t, "%c", *it);
+    }
+  }
+}
+
+static void text_metric(kop_text *t, const char *name, const char *type,
+                        const char *help) {
+  kop_text_printf(t, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Largest value in microseconds that still falls into bucket `idx`.
+static uint64_t histogram_bucket_le(size_t idx) {
+  if (idx < KOP_HISTOGRAM_SUB) {
+    return idx;
+  }
+  size_t exp = idx / KOP_HISTOGRAM_SUB + KOP_HISTOGRAM_SUB_BITS - 1;
+  uint64_t sub = idx % KOP_HISTOGRAM_SUB;
+  return ((KOP_HISTOGRAM_SUB + sub + 1) << (exp - KOP_HISTOGRAM_SUB_BITS)) - 1;
+}
+
+// Starts a series of the latency histogram of `route`, up to the labels that
+// follow.
+static void text_route_series(kop_text *t, const char *suffix,
+                              kop_route_info *route) {
+  kop_text_printf(t,
+                  "kopchik_request_duration_seconds%s{method=\"%s\",route=\"",
+                  suffix, KOP_HTTP_METHOD_TO_STR(route->method));
+  text_label(t, route->path);
+  kop_text_printf(t, "\"");
+}
+
+// Only the bucket ending each power of two is exported, which keeps the
+// bounds the same for every route and every scrape at a quarter of the
+// lines. Routes that weren't requested yet are left out.
+static void text_histogram(kop_text *t, kop_histogram *h,
+                           kop_route_info *route) {
+  if (h->count == 0) {
+    return;
+  }
+
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < KOP_HISTOGRAM_BUCKETS; i++) {
+    cumulative += h->buckets[i];
+    if (i % KOP_HISTOGRAM_SUB != KOP_HISTOGRAM_SUB - 1) {
+      continue;
+    }
+    text_route_series(t, "_bucket", route);
+    kop_text_printf(t, ",le=\"%.6f\"} %llu\n", histogram_bucket_le(i) / 1e6,
+                    (unsigned long long)cumulative);
+  }
+  text_route_series(t, "_bucket", route);
+  kop_text_printf(t, ",le=\"+Inf\"} %llu\n", (unsigned long long)h->count);
+
+  text_route_series(t, "_sum", route);
+  kop_text_printf(t, "} %.6f\n", h->sum / 1e6);
+  text_route_series(t, "_count", route);
+  kop_text_printf(t, "} %llu\n", (unsigned long long)h->count);
+}
+
+char *kop_metrics_format(kop_metrics *m, kop_route_info *routes,
+                         size_t *len) {
+  kop_text t;
+  kop_text_init(&t, 4096);
+
+  text_metric(&t, "kopchik_connections_accepted_total", "counter",
+              "Connections accepted.");
+  kop_text_printf(&t, "kopchik_connections_accepted_total %llu\n",
+                  (unsigned long long)m->accepted);
+  text_metric(&t, "kopchik_connections_active", "gauge",
+              "Connections currently open.");
+  kop_text_printf(&t, "kopchik_connections_active %llu\n",
+                  (unsigned long long)(m->accepted - m->closed));
+  text_metric(&t, "kopchik_connections_rejected_total", "counter",
+              "Connections turned away over the connection limit.");
+  kop_text_printf(&t, "kopchik_connections_rejected_total %llu\n",
+                  (unsigned long long)m->rejected);
+  text_metric(&t, "kopchik_connections_failed_total", "counter",
+              "Connections closed right after the accept because they "
+              "couldn't be set up.");
+  kop_text_printf(&t, "kopchik_connections_failed_total %llu\n",
+                  (unsigned long long)m->accept_failed);
+  text_metric(&t, "kopchik_access_log_dropped_total", "counter",
+              "Access log records dropped because the writer fell behind.");
+  kop_text_printf(&t, "kopchik_access_log_dropped_total %llu\n",
+                  (unsigned long long)m->log_dropped);
+
+  text_metric(&t, "kopchik_received_bytes_total", "counter",
+              "Bytes read from clients.");
+  kop_text_printf(&t, "kopchik_received_bytes_total %llu\n",
+                  (unsigned long long)m->bytes_in);
+  text_metric(&t, "kopchik_sent_bytes_total", "counter",
+              "Bytes written to clients.");
+  kop_text_printf(&t, "kopchik_sent_bytes_total %llu\n",
+                  (unsigned long long)m->bytes_out);
+
+  text_metric(&t, "kopchik_requests_total", "counter",
+              "Requests by method, routed or not.");
+  for (size_t i = 0; i < kop_http_method_count; i++) {
+    kop_text_printf(&t, "kopchik_requests_total{method=\"%s\"} %llu\n",
+                    KOP_HTTP_METHOD_TO_STR(i),
+                    (unsigned long long)m->methods[i]);
+  }
+
+  text_metric(&t, "kopchik_responses_total", "counter",
+              "Responses by status code.");
+  for (size_t i = 0; i < KOP_METRICS_STATUSES; i++) {
+    if (m->statuses[i] > 0) {
+      kop_text_printf(&t, "kopchik_responses_total{code=\"%zu\"} %llu\n",
+                      i + KOP_METRICS_MIN_STATUS,
+                      (unsigned long long)m->statuses[i]);
+    }
+  }
+
+  text_metric(&t, "kopchik_parse_errors_total", "counter",
+              "Requests that failed to parse, by error.");
+  for (size_t i = 0; i < kop_error_count; i++) {
+    if (m->errors[i] > 0) {
+      kop_text_printf(&t, "kopchik_parse_errors_total{error=\"%s\"} %llu\n",
+                      KOP_STRERROR(i), (unsigned long long)m->errors[i]);
+    }
+  }
+
+  text_metric(&t, "kopchik_request_duration_seconds", "histogram",
+              "Time from the first byte of a request until its response is "
+              "queued, or its streamed body ended.");
+  for (size_t i = 0; i < m->nroutes; i++) {
+    text_histogram(&t, &m->routes[i], &routes[i]);
+  }
+
+  *len = t.len;
+  return t.data;
+}
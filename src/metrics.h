@@ -0,0 +1,106 @@
+#ifndef KOP_METRICS_H_
+#define KOP_METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http.h"
+#include "router.h"
+#include "utils.h"
+
+// Latencies are kept in microseconds, log-linear like an HDR histogram:
+// every power of two is split into KOP_HISTOGRAM_SUB buckets, so the error
+// stays below 25% over the whole range.
+#define KOP_HISTOGRAM_SUB_BITS 2
+#define KOP_HISTOGRAM_SUB (1 << KOP_HISTOGRAM_SUB_BITS)
+// values from 2^KOP_HISTOGRAM_MAX_BITS us, about 67 s, on only show up in the
+// count and the sum
+#define KOP_HISTOGRAM_MAX_BITS 26
+#define KOP_HISTOGRAM_BUCKETS                                                  \
+  (KOP_HISTOGRAM_SUB * (KOP_HISTOGRAM_MAX_BITS - KOP_HISTOGRAM_SUB_BITS + 1))
+
+// first status code counted, codes below or past the range are not
+#define KOP_METRICS_MIN_STATUS 100
+#define KOP_METRICS_STATUSES 500
+
+typedef struct kop_histogram {
+  uint64_t buckets[KOP_HISTOGRAM_BUCKETS];
+  uint64_t count;
+  // microseconds
+  uint64_t sum;
+} kop_histogram;
+
+// Counters of a single reactor. Only the reactor writes them, so recording
+// takes no locks and no atomic read-modify-write. Others may read them at any
+// time with kop_metrics_sum.
+typedef struct kop_metrics {
+  uint64_t accepted;
+  uint64_t closed;
+  // connections turned away with a 503 because the reactor was full
+  uint64_t rejected;
+  // connections closed right after the accept because they couldn't be
+  // set up, e.g. out of memory
+  uint64_t accept_failed;
+  // access log records lost because the writer fell behind
+  uint64_t log_dropped;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  // requests that got as far as a method, routed or not
+  uint64_t methods[kop_http_method_count];
+  uint64_t statuses[KOP_METRICS_STATUSES];
+  // requests that failed to parse
+  uint64_t errors[kop_error_count];
+  // latencies of the registered routes, indexed by kop_route_match.id
+  kop_histogram *routes;
+  size_t nroutes;
+} kop_metrics;
+
+kop_error kop_metrics_init(kop_metrics *m, size_t nroutes);
+void kop_metrics_free(kop_metrics *m);
+// Adds the counters of `m` to `into`, which must have as many routes.
+void kop_metrics_sum(kop_metrics *into, kop_metrics *m);
+// Renders `m` in the Prometheus text exposition format. Returns a buffer
+// to be freed by the caller, NULL when out of memory.
+char *kop_metrics_format(kop_metrics *m, kop_route_info *routes,
+                         size_t *len);
+
+// A single writer doesn't need a locked add, the atomic load and store only
+// keep concurrent readers from seeing torn values.
+static inline void kop_metrics_add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+static inline uint64_t kop_metrics_get(uint64_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline void kop_metrics_count_status(kop_metrics *m,
+                                            kop_http_code code) {
+  unsigned idx = (unsigned)code - KOP_METRICS_MIN_STATUS;
+  if (idx < KOP_METRICS_STATUSES) {
+    kop_metrics_add(&m->statuses[idx], 1);
+  }
+}
+
+static inline size_t kop_histogram_bucket(uint64_t us) {
+  if (us < KOP_HISTOGRAM_SUB) {
+    return us;
+  }
+  // position of the highest bit picks the power of two, the bits right
+  // below it the sub-bucket
+  size_t exp = 63 - __builtin_clzll(us);
+  size_t sub = (us >> (exp - KOP_HISTOGRAM_SUB_BITS)) & (KOP_HISTOGRAM_SUB - 1);
+  return KOP_HISTOGRAM_SUB * (exp - KOP_HISTOGRAM_SUB_BITS + 1) + sub;
+}
+
+static inline void kop_histogram_record(kop_histogram *h, uint64_t us) {
+  size_t idx = kop_histogram_bucket(us);
+  if (idx < KOP_HISTOGRAM_BUCKETS) {
+    kop_metrics_add(&h->buckets[idx], 1);
+  }
+  kop_metrics_add(&h->count, 1);
+  kop_metrics_add(&h->sum, us);
+}
+
+#endif // !KOP_METRICS_H_
@@ -0,0 +1,129 @@
+#include <stdlib.h>
+
+#include "pool.h"
+#include "utils.h"
+
+static kop_job *worker_pop(kop_pool_worker *w) {
+  pthread_mutex_lock(&w->lock);
+  kop_job *job = w->head;
+  if (job != NULL) {
+    w->head = job->next;
+    if (w->head == NULL) {
+      w->tail = NULL;
+    }
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return job;
+}
+
+// Own queue first, then the others starting right after it, so idle workers
+// spread over the busy ones instead of all hitting the first.
+static kop_job *pool_take(kop_pool *p, size_t self) {
+  for (size_t i = 0; i < p->nworkers; i++) {
+    kop_job *job = worker_pop(&p->workers[(self + i) % p->nworkers]);
+    if (job != NULL) {
+      __atomic_sub_fetch(&p->queued, 1, __ATOMIC_RELAXED);
+      return job;
+    }
+  }
+
+  return NULL;
+}
+
+static void *pool_thread(void *arg) {
+  kop_pool_worker *w = arg;
+  kop_pool *p = w->pool;
+  size_t self = w - p->workers;
+
+  for (;;) {
+    kop_job *job = pool_take(p, self);
+    if (job != NULL) {
+      job->run(job);
+      continue;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    while (__atomic_load_n(&p->queued, __ATOMIC_RELAXED) == 0 && !p->stop) {
+      pthread_cond_wait(&p->cond, &p->lock);
+    }
+    bool stop = p->stop && __atomic_load_n(&p->queued, __ATOMIC_RELAXED) == 0;
+    pthread_mutex_unlock(&p->lock);
+
+    if (stop) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+kop_error kop_pool_start(kop_pool *p, size_t nworkers) {
+  *p = (kop_pool){0};
+  p->workers = calloc(nworkers, sizeof(kop_pool_worker));
+  if (p->workers == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+
+  for (size_t i = 0; i < nworkers; i++) {
+    kop_pool_worker *w = &p->workers[i];
+    w->pool = p;
+    pthread_mutex_init(&w->lock, NULL);
+  }
+
+  for (; p->nworkers < nworkers; p->nworkers++) {
+    kop_pool_worker *w = &p->workers[p->nworkers];
+    if (pthread_create(&w->thread, NULL, pool_thread, w) != 0) {
+      kop_pool_stop(p);
+      return ERR_CREATING_THREAD;
+    }
+  }
+
+  return NOERROR;
+}
+
+void kop_pool_stop(kop_pool *p) {
+  if (p->workers == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->stop = true;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+
+  for (size_t i = 0; i < p->nworkers; i++) {
+    pthread_join(p->workers[i].thread, NULL);
+  }
+
+  free(p->workers);
+  p->workers = NULL;
+  p->nworkers = 0;
+}
+
+void kop_pool_submit(kop_pool *p, kop_job *job) {
+  size_t i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED) % p->nworkers;
+  kop_pool_worker *w = &p->workers[i];
+
+  // counted before it is published, a worker stealing it right away must
+  // not take the count below zero
+  __atomic_add_fetch(&p->queued, 1, __ATOMIC_RELAXED);
+
+  job->next = NULL;
+  pthread_mutex_lock(&w->lock);
+  if (w->tail != NULL) {
+    w->tail->next = job;
+  } else {
+    w->head = job;
+  }
+  w->tail = job;
+  pthread_mutex_unlock(&w->lock);
+
+  // signalled under the lock the workers sleep on, so none of them can miss
+  // it between checking the count and going to sleep
+  pthread_mutex_lock(&p->lock);
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+}
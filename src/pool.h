@@ -0,0 +1,50 @@
+#ifndef KOP_POOL_H_
+#define KOP_POOL_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "utils.h"
+
+struct kop_pool;
+
+// A unit of work, embedded in whatever it belongs to so that queueing it
+// never allocates.
+typedef struct kop_job {
+  struct kop_job *next;
+  // runs on one of the workers
+  void (*run)(struct kop_job *job);
+  void *arg;
+} kop_job;
+
+// A worker and the jobs queued on it.
+typedef struct kop_pool_worker {
+  struct kop_pool *pool;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  kop_job *head;
+  kop_job *tail;
+} kop_pool_worker;
+
+// Fixed set of threads for work that must not run on a reactor. Jobs are
+// spread over the workers' own queues, a worker that runs dry steals from
+// the others, so one long job doesn't hold up the ones queued behind it.
+typedef struct kop_pool {
+  kop_pool_worker *workers;
+  size_t nworkers;
+  // worker the next job is queued on
+  size_t next;
+  // jobs queued and not taken yet, workers sleep while there are none
+  size_t queued;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool stop;
+} kop_pool;
+
+kop_error kop_pool_start(kop_pool *p, size_t nworkers);
+// Lets the workers run what is still queued and joins them.
+void kop_pool_stop(kop_pool *p);
+void kop_pool_submit(kop_pool *p, kop_job *job);
+
+#endif // !KOP_POOL_H_
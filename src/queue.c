@@ -1,6 +1,12 @@
+#include <stdint.h>
+
 #include "queue.h"
 #include "utils.h"
 
+#if defined(KOP_LINUX)
+#include <sys/eventfd.h>
+#endif
+
 kop_error kop_queue_init(kop_queue *q, int server_sock) {
 #if defined(KOP_LINUX)
   int fd = epoll_create1(0);
@@ -10,35 +16,108 @@ kop_error kop_queue_init(kop_queue *q, int server_sock) {
   if (fd < 0) {
     return ERR_CREATING_QUEUE;
   }
+  q->backend = KOP_BACKEND_EPOLL;
   q->queue = fd;
   q->server_sock = server_sock;
 
+#if defined(KOP_LINUX)
+  int wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake < 0) {
+    return ERR_CREATING_QUEUE;
+  }
+  q->wake_fds[0] = q->wake_fds[1] = wake;
+#else
+  if (pipe(q->wake_fds) < 0) {
+    return ERR_CREATING_QUEUE;
+  }
+  set_nonblocking(q->wake_fds[0]);
+  set_nonblocking(q->wake_fds[1]);
+#endif
+
   kop_queue_event event = {0};
 
 #if defined(KOP_LINUX)
-  event.data.fd = server_sock;
+  event.data.u64 = (uint32_t)server_sock;
   event.events = EPOLLIN | EPOLLET;
   if (epoll_ctl(fd, EPOLL_CTL_ADD, server_sock, &event) < 0) {
     return ERR_CREATING_QUEUE;
   }
+
+  event.data.u64 = (uint32_t)q->wake_fds[0];
+  event.events = EPOLLIN;
+  if (epoll_ctl(fd, EPOLL_CTL_ADD, q->wake_fds[0], &event) < 0) {
+    return ERR_CREATING_QUEUE;
+  }
 #elif defined(KOP_BSD)
   EV_SET(&event, server_sock, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, 0);
   if (kevent(fd, &event, 1, NULL, 0, NULL) < 0) {
     return ERR_CREATING_QUEUE;
   }
+
+  EV_SET(&event, q->wake_fds[0], EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, 0);
+  if (kevent(fd, &event, 1, NULL, 0, NULL) < 0) {
+    return ERR_CREATING_QUEUE;
+  }
 #endif
   return NOERROR;
 }
 
+void kop_queue_select_backend(kop_queue *q, kop_backend backend) {
+#if defined(KOP_URING)
+  if (backend == KOP_BACKEND_EPOLL || !kop_uring_supported()) {
+    return;
+  }
+
+  kop_error err = kop_uring_init(&q->uring);
+  if (err != NOERROR) {
+    KOP_DEBUG_LOG("falling back to epoll: %s", KOP_STRERROR(err));
+    return;
+  }
+
+  // the listening socket and the wake pipe are watched through the ring now
+  close(q->queue);
+  q->queue = -1;
+  q->backend = KOP_BACKEND_URING;
+#else
+  (void)q;
+  (void)backend;
+#endif
+}
+
+void kop_queue_wake(kop_queue *q) {
+#if defined(KOP_LINUX)
+  uint64_t one = 1;
+  // the counter only overflows if nobody drains it, and then the reactor is
+  // awake anyway
+  (void)!write(q->wake_fds[1], &one, sizeof(one));
+#else
+  char c = 0;
+  // the pipe is non-blocking, if it is full the reactor is already awake
+  (void)!write(q->wake_fds[1], &c, 1);
+#endif
+}
+
+void kop_queue_drain_wake(kop_queue *q) {
+  char buf[64];
+  // one read resets an eventfd, a pipe is read until it is empty
+  while (read(q->wake_fds[0], buf, sizeof(buf)) > 0) {
+  }
+}
+
 kop_error kop_queue_wait(kop_queue *q, kop_queue_event *events, size_t nevents,
-                         int *new_events) {
+                         int timeout_ms, int *new_events) {
 #if defined(KOP_LINUX)
-  int evts = epoll_wait(q->queue, events, nevents, -1);
+  int evts = epoll_wait(q->queue, events, nevents, timeout_ms);
   if (evts < 0) {
     return ERR_QUEUE_WAIT;
   }
 #elif defined(KOP_BSD)
-  int evts = kevent(q->queue, NULL, 0, events, nevents, NULL);
+  struct timespec ts = {
+      .tv_sec = timeout_ms / 1000,
+      .tv_nsec = (long)(timeout_ms % 1000) * 1000000,
+  };
+  int evts = kevent(q->queue, NULL, 0, events, nevents,
+                    timeout_ms < 0 ? NULL : &ts);
   if (evts < 0) {
     return ERR_QUEUE_WAIT;
   }
@@ -47,19 +126,25 @@ kop_error kop_queue_wait(kop_queue *q, kop_queue_event *events, size_t nevents,
   return NOERROR;
 }
 
-kop_error kop_queue_add_client_sock(kop_queue *q, int client_sock) {
-  kop_queue_event event = {0};
-
+kop_error kop_queue_add_client_sock(kop_queue *q, int client_sock,
+                                    uint32_t gen) {
 #if defined(KOP_LINUX)
-  set_nonblocking(client_sock);
-  event.data.fd = client_sock;
+  kop_queue_event event = {0};
+  // the fd in the low half, kop_queue_event_get_sock reads it back
+  event.data.u64 = (uint64_t)gen << 32 | (uint32_t)client_sock;
   event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
   if (epoll_ctl(q->queue, EPOLL_CTL_ADD, client_sock, &event) < 0) {
     return ERR_QUEUE_ADD_CLIENT;
   }
 #elif defined(KOP_BSD)
-  EV_SET(&event, client_sock, EVFILT_READ | EVFILT_WRITE, EV_ADD, 0, 0, NULL);
-  if (kevent(q->queue, &event, 1, NULL, 0, NULL) < 0) {
+  // kqueue filters are not flags, read and write readiness are two separate
+  // edge-triggered registrations
+  kop_queue_event events[2];
+  void *udata = (void *)(uintptr_t)gen;
+  EV_SET(&events[0], client_sock, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, udata);
+  EV_SET(&events[1], client_sock, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0,
+         udata);
+  if (kevent(q->queue, events, 2, NULL, 0, NULL) < 0) {
     return ERR_QUEUE_ADD_CLIENT;
   }
 #endif
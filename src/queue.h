@@ -2,10 +2,13 @@
 #define KOP_QUEUE_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "uring.h"
 #include "utils.h"
 
 #if defined(KOP_LINUX)
@@ -28,26 +31,89 @@ typedef void *
 
 #define MAX_EVENTS 64
 
+typedef enum kop_backend {
+  // io_uring when it was compiled in and the kernel supports it, epoll
+  // otherwise
+  KOP_BACKEND_AUTO = 0,
+  // readiness notifications: epoll on Linux, kqueue on BSD
+  KOP_BACKEND_EPOLL,
+  // completions from io_uring, Linux only
+  KOP_BACKEND_URING,
+} kop_backend;
+
 typedef struct kop_queue {
+  kop_backend backend;
   int queue;
   int server_sock;
+  // wakes up a reactor blocked in kop_queue_wait from another thread: an
+  // eventfd on Linux, both ends are the same descriptor then, a self-pipe
+  // elsewhere
+  int wake_fds[2];
+#if defined(KOP_URING)
+  // only set up by kop_queue_select_backend, `queue` is closed then
+  kop_uring uring;
+  // the wake pipe is drained into it by a read on the ring
+  char wake_buf[16];
+#endif
 } kop_queue;
 
 kop_error kop_queue_init(kop_queue *q, int server_sock);
+// Switches the queue over to io_uring if `backend` allows it and the kernel
+// supports it. Has to be called from the thread that is going to wait on the
+// queue. Any failure leaves the queue on epoll.
+void kop_queue_select_backend(kop_queue *q, kop_backend backend);
+// Waits for up to `timeout_ms` milliseconds, -1 waits until something
+// happens.
 kop_error kop_queue_wait(kop_queue *q, kop_queue_event *events, size_t nevents,
-                         int *new_events);
-kop_error kop_queue_add_client_sock(kop_queue *q, int client_sock);
+                         int timeout_ms, int *new_events);
+// The socket has to be non-blocking already. `gen` comes back with every
+// event of it, see kop_queue_event_get_gen.
+kop_error kop_queue_add_client_sock(kop_queue *q, int client_sock,
+                                    uint32_t gen);
+void kop_queue_wake(kop_queue *q);
+// Resets the wakeup so that a level-triggered wait doesn't keep returning it.
+void kop_queue_drain_wake(kop_queue *q);
+
+static inline bool kop_queue_is_uring(kop_queue *q) {
+  return q->backend == KOP_BACKEND_URING;
+}
 
 static inline void kop_queue_close(kop_queue *q) {
+#if defined(KOP_URING)
+  if (kop_queue_is_uring(q)) {
+    kop_uring_free(&q->uring);
+  }
+#endif
   close(q->queue);
+  close(q->wake_fds[0]);
+  if (q->wake_fds[1] != q->wake_fds[0]) {
+    close(q->wake_fds[1]);
+  }
   q->queue = 0;
   q->server_sock = 0;
+  q->wake_fds[0] = q->wake_fds[1] = 0;
+}
+
+static inline int kop_queue_event_get_sock(kop_queue_event event) {
+#if defined(KOP_LINUX)
+  return (int)(uint32_t)event.data.u64;
+#elif defined(KOP_BSD)
+  return event.ident;
+#endif
+}
+
+// Generation of the connection the socket was registered for.
+static inline uint32_t kop_queue_event_get_gen(kop_queue_event event) {
+#if defined(KOP_LINUX)
+  return (uint32_t)(event.data.u64 >> 32);
+#elif defined(KOP_BSD)
+  return (uint32_t)(uintptr_t)event.udata;
+#endif
 }
 
 static inline bool kop_queue_event_check_error(kop_queue_event event) {
 #if defined(KOP_LINUX)
-  return (event.events & EPOLLERR) || (event.events & EPOLLHUP) ||
-         (!(event.events & EPOLLIN));
+  return (event.events & EPOLLERR) || (event.events & EPOLLHUP);
 #elif defined(KOP_BSD)
   return event.flags & EV_ERROR;
 #endif
@@ -56,16 +122,42 @@ static inline bool kop_queue_event_check_error(kop_queue_event event) {
 static inline bool kop_queue_event_is_server(kop_queue *q,
                                              kop_queue_event event) {
 #if defined(KOP_LINUX)
-  return event.data.fd == q->server_sock;
+  return kop_queue_event_get_sock(event) == q->server_sock;
 #elif defined(KOP_BSD)
   return event.ident == (uintptr_t)q->server_sock;
 #endif
 }
 
+static inline bool kop_queue_event_is_wakeup(kop_queue *q,
+                                             kop_queue_event event) {
+#if defined(KOP_LINUX)
+  return kop_queue_event_get_sock(event) == q->wake_fds[0];
+#elif defined(KOP_BSD)
+  return event.ident == (uintptr_t)q->wake_fds[0];
+#endif
+}
+
 static inline bool kop_queue_event_is_client(kop_queue *q,
                                              kop_queue_event event) {
   // NOTE: kinda hacky, but it's the best way at the moment
-  return !kop_queue_event_is_server(q, event);
+  return !kop_queue_event_is_server(q, event) &&
+         !kop_queue_event_is_wakeup(q, event);
+}
+
+static inline bool kop_queue_event_is_readable(kop_queue_event event) {
+#if defined(KOP_LINUX)
+  return event.events & EPOLLIN;
+#elif defined(KOP_BSD)
+  return event.filter == EVFILT_READ;
+#endif
+}
+
+static inline bool kop_queue_event_is_writable(kop_queue_event event) {
+#if defined(KOP_LINUX)
+  return event.events & EPOLLOUT;
+#elif defined(KOP_BSD)
+  return event.filter == EVFILT_WRITE;
+#endif
 }
 
 static inline bool kop_queue_event_is_client_disconnect(kop_queue_event event) {
@@ -80,7 +172,7 @@ static inline const char *kop_queue_event_strerror(kop_queue_event event) {
 #if defined(KOP_LINUX)
   int error = 0;
   socklen_t errlen = sizeof(error);
-  if (getsockopt(event.data.fd, SOL_SOCKET, SO_ERROR, (void *)&error,
+  if (getsockopt(kop_queue_event_get_sock(event), SOL_SOCKET, SO_ERROR, (void *)&error,
                  &errlen) == 0) {
     return strerror(error);
   }
@@ -92,18 +184,10 @@ static inline const char *kop_queue_event_strerror(kop_queue_event event) {
 
 static inline void kop_queue_event_close_client(kop_queue_event event) {
 #if defined(KOP_LINUX)
-  close(event.data.fd);
+  close(kop_queue_event_get_sock(event));
 #elif defined(KOP_BSD)
   close(event.ident);
 #endif
 }
 
-static inline int kop_queue_event_get_sock(kop_queue_event event) {
-#if defined(KOP_LINUX)
-  return event.data.fd;
-#elif defined(KOP_BSD)
-  return event.ident;
-#endif
-}
-
 #endif // !KOP_QUEUE_H_
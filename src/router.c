@@ -0,0 +1,358 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "http.h"
+#include "router.h"
+#include "utils.h"
+
+static kop_route_node *node_new(const char *prefix, size_t len) {
+  kop_route_node *n = calloc(1, sizeof(kop_route_node));
+  if (n == NULL) {
+    return NULL;
+  }
+
+  if (len > 0) {
+    n->prefix = malloc(len);
+    if (n->prefix == NULL) {
+      free(n);
+      return NULL;
+    }
+    memcpy(n->prefix, prefix, len);
+  }
+  n->prefix_len = len;
+
+  return n;
+}
+
+static void node_free(kop_route_node *n) {
+  if (n == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < n->nchildren; i++) {
+    node_free(n->children[i]);
+  }
+  node_free(n->param);
+  node_free(n->wildcard);
+
+  free(n->children);
+  free(n->indices);
+  free(n->prefix);
+  free((void *)n->name.data);
+  free(n);
+}
+
+static bool node_has_handlers(kop_route_node *n) {
+  for (size_t i = 0; i < kop_http_method_count; i++) {
+    if (n->handlers[i] != NULL) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static kop_error node_add_child(kop_route_node *n, kop_route_node *child) {
+  kop_route_node **children =
+      realloc(n->children, sizeof(kop_route_node *) * (n->nchildren + 1));
+  if (children == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  n->children = children;
+
+  char *indices = realloc(n->indices, n->nchildren + 1);
+  if (indices == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  n->indices = indices;
+
+  n->children[n->nchildren] = child;
+  n->indices[n->nchildren] = child->prefix[0];
+  n->nchildren++;
+
+  return NOERROR;
+}
+
+static kop_route_node *node_find_child(kop_route_node *n, char first) {
+  if (n->nchildren == 0) {
+    return NULL;
+  }
+
+  const char *idx = memchr(n->indices, first, n->nchildren);
+  return idx != NULL ? n->children[idx - n->indices] : NULL;
+}
+
+// Follows the static edges below `n` along `s`, splitting an edge where `s`
+// diverges from it and adding a new one for whatever is left. Returns the
+// node `s` ends at.
+static kop_route_node *node_insert_static(kop_route_node *n, const char *s,
+                                          size_t len) {
+  while (len > 0) {
+    kop_route_node *c = node_find_child(n, s[0]);
+    if (c == NULL) {
+      kop_route_node *child = node_new(s, len);
+      if (child == NULL || node_add_child(n, child) != NOERROR) {
+        node_free(child);
+        return NULL;
+      }
+      return child;
+    }
+
+    size_t common = 0;
+    for (; common < len && common < c->prefix_len &&
+           c->prefix[common] == s[common];
+         common++)
+      ;
+
+    if (common < c->prefix_len) {
+      // `c` keeps the shared part of the prefix, everything below it moves to
+      // a new node holding the rest
+      kop_route_node *tail =
+          node_new(c->prefix + common, c->prefix_len - common);
+      if (tail == NULL) {
+        return NULL;
+      }
+
+      tail->indices = c->indices;
+      tail->children = c->children;
+      tail->nchildren = c->nchildren;
+      tail->param = c->param;
+      tail->wildcard = c->wildcard;
+      memcpy(tail->handlers, c->handlers, sizeof(c->handlers));
+      memcpy(tail->opts, c->opts, sizeof(c->opts));
+      memcpy(tail->ids, c->ids, sizeof(c->ids));
+
+      c->indices = NULL;
+      c->children = NULL;
+      c->nchildren = 0;
+      c->param = NULL;
+      c->wildcard = NULL;
+      memset(c->handlers, 0, sizeof(c->handlers));
+      memset(c->opts, 0, sizeof(c->opts));
+      memset(c->ids, 0, sizeof(c->ids));
+      c->prefix_len = common;
+
+      if (node_add_child(c, tail) != NOERROR) {
+        return NULL;
+      }
+    }
+
+    n = c;
+    s += common;
+    len -= common;
+  }
+
+  return n;
+}
+
+// Returns the param or wildcard child stored in `slot`, creating it if
+// needed. Two routes can't name the same parameter differently.
+static kop_route_node *node_capture_child(kop_route_node **slot,
+                                          const char *name, size_t len) {
+  if (*slot != NULL) {
+    kop_str existing = (*slot)->name;
+    if (existing.len != len || memcmp(existing.data, name, len) != 0) {
+      return NULL;
+    }
+    return *slot;
+  }
+
+  kop_route_node *n = node_new(NULL, 0);
+  if (n == NULL) {
+    return NULL;
+  }
+
+  char *owned = malloc(len);
+  if (owned == NULL) {
+    free(n);
+    return NULL;
+  }
+  memcpy(owned, name, len);
+  n->name = (kop_str){.data = owned, .len = len};
+
+  *slot = n;
+  return n;
+}
+
+kop_error kop_router_init(kop_router *router) {
+  router->root = node_new(NULL, 0);
+  if (router->root == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  kop_vector_init(kop_route_info, router->routes);
+  return NOERROR;
+}
+
+void kop_router_free(kop_router *router) {
+  node_free(router->root);
+  router->root = NULL;
+
+  kop_vector_foreach(kop_route_info, router->routes, route) {
+    free(route->path);
+  }
+  kop_vector_free(router->routes);
+}
+
+kop_error kop_router_add(kop_router *router, kop_http_method method,
+                         const char *path, kop_handler_func handler,
+                         const kop_route_opts *opts) {
+  if (method >= kop_http_method_count || path[0] != '/') {
+    return ERR_INVALID_ROUTE;
+  }
+
+  kop_route_node *n = router->root;
+  const char *it = path;
+
+  while (*it != '\0') {
+    // parameters only start right after a '/'
+    const char *special = it;
+    for (; *special != '\0'; special++) {
+      if ((*special == ':' || *special == '*') && special[-1] == '/') {
+        break;
+      }
+    }
+
+    n = node_insert_static(n, it, special - it);
+    if (n == NULL) {
+      return ERR_OUT_OF_MEMORY;
+    }
+
+    if (*special == '\0') {
+      break;
+    }
+
+    const char *name = special + 1;
+    const char *name_end = name;
+    for (; *name_end != '\0' && *name_end != '/'; name_end++)
+      ;
+
+    if (name_end == name) {
+      return ERR_INVALID_ROUTE;
+    }
+
+    if (*special == ':') {
+      n = node_capture_child(&n->param, name, name_end - name);
+    } else if (*name_end != '\0') {
+      // a wildcard eats the rest of the path, nothing can follow it
+      return ERR_INVALID_ROUTE;
+    } else {
+      n = node_capture_child(&n->wildcard, name, name_end - name);
+    }
+
+    if (n == NULL) {
+      return ERR_INVALID_ROUTE;
+    }
+
+    it = name_end;
+  }
+
+  if (n->handlers[method] != NULL) {
+    return ERR_INVALID_ROUTE;
+  }
+
+  char *owned = strdup(path);
+  if (owned == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  kop_vector_append(kop_route_info, router->routes,
+                    ((kop_route_info){.method = method, .path = owned}));
+
+  n->ids[method] = router->routes.len - 1;
+  n->handlers[method] = handler;
+  if (opts != NULL) {
+    n->opts[method] = *opts;
+  }
+
+  return NOERROR;
+}
+
+static bool params_push(kop_route_params *params, kop_str name,
+                        const char *value, size_t len) {
+  if (params->len == KOP_MAX_ROUTE_PARAMS) {
+    return false;
+  }
+
+  params->data[params->len++] = (kop_route_param){
+      .name = name,
+      .value = {.data = value, .len = len},
+  };
+  return true;
+}
+
+// Matches the remaining `s` below `n`. Static edges win over parameters and
+// parameters win over wildcards, falling back to the next option when a
+// branch dead-ends.
+static kop_route_node *node_find(kop_route_node *n, const char *s, size_t len,
+                                 kop_route_params *params) {
+  if (len == 0 && node_has_handlers(n)) {
+    return n;
+  }
+
+  if (len > 0) {
+    kop_route_node *c = node_find_child(n, s[0]);
+    if (c != NULL && c->prefix_len <= len &&
+        memcmp(c->prefix, s, c->prefix_len) == 0) {
+      kop_route_node *found =
+          node_find(c, s + c->prefix_len, len - c->prefix_len, params);
+      if (found != NULL) {
+        return found;
+      }
+    }
+  }
+
+  if (len > 0 && n->param != NULL) {
+    const char *slash = memchr(s, '/', len);
+    size_t seg_len = slash != NULL ? (size_t)(slash - s) : len;
+
+    if (seg_len > 0 && params_push(params, n->param->name, s, seg_len)) {
+      kop_route_node *found =
+          node_find(n->param, s + seg_len, len - seg_len, params);
+      if (found != NULL) {
+        return found;
+      }
+      params->len--;
+    }
+  }
+
+  if (n->wildcard != NULL && node_has_handlers(n->wildcard) &&
+      params_push(params, n->wildcard->name, s, len)) {
+    return n->wildcard;
+  }
+
+  return NULL;
+}
+
+kop_route_match kop_router_find(kop_router *router, kop_http_method method,
+                                kop_str path, kop_route_params *params) {
+  params->len = 0;
+
+  // the query string takes no part in routing
+  const char *query = memchr(path.data, '?', path.len);
+  if (query != NULL) {
+    path.len = query - path.data;
+  }
+
+  kop_route_node *n = node_find(router->root, path.data, path.len, params);
+  if (n == NULL) {
+    params->len = 0;
+    return (kop_route_match){.status = KOP_ROUTE_NOT_FOUND};
+  }
+
+  if (method == HTTP_HEAD && n->handlers[HTTP_HEAD] == NULL) {
+    method = HTTP_GET;
+  }
+  if (method >= kop_http_method_count || n->handlers[method] == NULL) {
+    params->len = 0;
+    return (kop_route_match){
+        .status = KOP_ROUTE_METHOD_NOT_ALLOWED,
+        .handlers = n->handlers,
+    };
+  }
+
+  return (kop_route_match){
+      .status = KOP_ROUTE_FOUND,
+      .handler = n->handlers[method],
+      .opts = &n->opts[method],
+      .id = n->ids[method],
+      .handlers = n->handlers,
+  };
+}
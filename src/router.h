@@ -0,0 +1,143 @@
+#ifndef KOP_ROUTER_H_
+#define KOP_ROUTER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "http.h"
+#include "utils.h"
+
+#define KOP_MAX_ROUTE_PARAMS 8
+
+struct kop_context;
+
+// Serves a request, `data` is the one the route was registered with.
+typedef void (*kop_handler_func)(struct kop_context *ctx, void *data);
+// Takes the next piece of a streamed request body. Returning an error aborts
+// the request.
+typedef kop_error (*kop_body_func)(struct kop_context *ctx, kop_str chunk,
+                                   void *data);
+
+// Per-route settings, a zeroed struct gives the defaults.
+typedef struct kop_route_opts {
+  // largest request body accepted, anything longer is rejected with 413
+  // before it is read. 0 falls back to kop_config.max_body_size, SIZE_MAX
+  // lifts the limit.
+  size_t max_body;
+  // when set, the body is not buffered but handed to `on_body` piece by
+  // piece as it arrives, and the handler runs once all of it went through
+  kop_body_func on_body;
+  // run the handler on the offload pool instead of the reactor, for
+  // handlers that block, e.g. on a database or a slow file system. The
+  // handler must not touch state of the reactor, such as the file cache of
+  // kop_static. Body callbacks and stream producers still run on the reactor.
+  bool offload;
+  // milliseconds a 200 response to a GET is served from the response cache
+  // of the reactor instead of calling the handler again, 0 disables caching.
+  // Responses are told apart by path, query included, and the values of the
+  // request headers in `cache_vary`, a NULL terminated list that has to stay
+  // valid while the server runs. Cached responses get an ETag unless the
+  // handler set one, a matching If-None-Match is answered with a 304.
+  size_t cache_ttl_ms;
+  const char *const *cache_vary;
+  // compress the response with the best coding of the client's
+  // Accept-Encoding, if its Content-Type is listed in `compress_types` and
+  // the body has at least `compress_min_size` bytes. Streamed bodies are
+  // compressed whatever their size. NULL and 0 pick the defaults of
+  // compress.h. Cached responses are kept once per coding.
+  bool compress;
+  size_t compress_min_size;
+  const char *const *compress_types;
+  // handed to the handler and `on_body` of the route, e.g. a database
+  // handle shared by several routes, so they don't need globals
+  void *data;
+} kop_route_opts;
+
+typedef struct kop_route_param {
+  // name without the leading ':' or '*', owned by the router
+  kop_str name;
+  // view into the request path
+  kop_str value;
+} kop_route_param;
+
+typedef struct kop_route_params {
+  kop_route_param data[KOP_MAX_ROUTE_PARAMS];
+  size_t len;
+} kop_route_params;
+
+// Node of a compressed prefix tree over route paths. Static children are
+// told apart by the first byte of their prefix, which is mirrored in
+// `indices` so picking the next edge is a single memchr. A node may also have
+// one `:param` child matching a single path segment and one `*wildcard`
+// child matching the rest of the path.
+typedef struct kop_route_node {
+  char *prefix;
+  size_t prefix_len;
+
+  char *indices;
+  struct kop_route_node **children;
+  size_t nchildren;
+
+  struct kop_route_node *param;
+  struct kop_route_node *wildcard;
+  // name of the parameter captured by a param or wildcard node
+  kop_str name;
+
+  kop_handler_func handlers[kop_http_method_count];
+  kop_route_opts opts[kop_http_method_count];
+  // index of the route into kop_router.routes
+  size_t ids[kop_http_method_count];
+} kop_route_node;
+
+// A registered route, in the order they were added.
+typedef struct kop_route_info {
+  kop_http_method method;
+  // the path pattern as passed to kop_router_add
+  char *path;
+} kop_route_info;
+
+typedef struct kop_route_infos {
+  kop_route_info *data;
+  size_t len;
+  size_t cap;
+} kop_route_infos;
+
+typedef struct kop_router {
+  kop_route_node *root;
+  kop_route_infos routes;
+} kop_router;
+
+typedef enum kop_route_status {
+  KOP_ROUTE_FOUND = 0,
+  // nothing is registered for this path
+  KOP_ROUTE_NOT_FOUND,
+  // the path exists, but not for this method
+  KOP_ROUTE_METHOD_NOT_ALLOWED,
+} kop_route_status;
+
+typedef struct kop_route_match {
+  kop_route_status status;
+  kop_handler_func handler;
+  // options of the route, only set when it was found
+  const kop_route_opts *opts;
+  // index into kop_router.routes, only set when it was found
+  size_t id;
+  // handlers of the matched path, used to build the Allow header of a 405
+  kop_handler_func *handlers;
+} kop_route_match;
+
+kop_error kop_router_init(kop_router *router);
+void kop_router_free(kop_router *router);
+// Registers `handler` for `method` and `path`. A segment starting with ':'
+// captures one path segment, a trailing segment starting with '*' captures
+// the rest of the path. `opts` may be NULL.
+kop_error kop_router_add(kop_router *router, kop_http_method method,
+                         const char *path, kop_handler_func handler,
+                         const kop_route_opts *opts);
+// Looks up `path`, the cost depends on the length of the path and not on the
+// number of routes. Captured parameters are views into `path`. HEAD falls
+// back to the GET handler of a path that has none of its own.
+kop_route_match kop_router_find(kop_router *router, kop_http_method method,
+                                kop_str path, kop_route_params *params);
+
+#endif // !KOP_ROUTER_H_
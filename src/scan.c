@@ -0,0 +1,105 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "scan.h"
+#include "utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KOP_SCAN_X86
+#include <immintrin.h>
+#endif
+
+static bool scalar_supported(void) { return true; }
+
+// A single byte is left to memchr in every implementation: libc already
+// ships aligned, unrolled SSE2/AVX2/EVEX variants of it and picks one at load
+// time, a hand-rolled loop only loses against it.
+static const char *scalar_find(const char *buf, size_t len, char c) {
+  return memchr(buf, c, len);
+}
+
+static const char *scalar_find2(const char *buf, size_t len, char a, char b) {
+  for (const char *it = buf; it < buf + len; ++it) {
+    if (*it == a || *it == b) {
+      return it;
+    }
+  }
+  return NULL;
+}
+
+#if defined(KOP_SCAN_X86)
+
+static bool sse2_supported(void) { return __builtin_cpu_supports("sse2"); }
+
+__attribute__((target("sse2"))) static const char *
+sse2_find2(const char *buf, size_t len, char a, char b) {
+  const __m128i needle_a = _mm_set1_epi8(a);
+  const __m128i needle_b = _mm_set1_epi8(b);
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(buf + i));
+    __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(chunk, needle_a),
+                              _mm_cmpeq_epi8(chunk, needle_b));
+    int mask = _mm_movemask_epi8(eq);
+    if (mask != 0) {
+      return buf + i + __builtin_ctz(mask);
+    }
+  }
+
+  return scalar_find2(buf + i, len - i, a, b);
+}
+
+static bool avx2_supported(void) { return __builtin_cpu_supports("avx2"); }
+
+__attribute__((target("avx2"))) static const char *
+avx2_find2(const char *buf, size_t len, char a, char b) {
+  const __m256i needle_a = _mm256_set1_epi8(a);
+  const __m256i needle_b = _mm256_set1_epi8(b);
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(buf + i));
+    __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, needle_a),
+                                 _mm256_cmpeq_epi8(chunk, needle_b));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(eq);
+    if (mask != 0) {
+      return buf + i + __builtin_ctz(mask);
+    }
+  }
+
+  return sse2_find2(buf + i, len - i, a, b);
+}
+
+#endif // KOP_SCAN_X86
+
+// ordered from the slowest to the fastest
+const kop_scan_impl kop_scan_impls[] = {
+    {"scalar", scalar_supported, scalar_find, scalar_find2},
+#if defined(KOP_SCAN_X86)
+    {"sse2", sse2_supported, scalar_find, sse2_find2},
+    {"avx2", avx2_supported, scalar_find, avx2_find2},
+#endif
+};
+
+const size_t kop_scan_impls_count =
+    sizeof(kop_scan_impls) / sizeof(kop_scan_impls[0]);
+
+const kop_scan_impl *kop_scan = &kop_scan_impls[0];
+
+void kop_scan_init(void) {
+#if defined(KOP_SCAN_X86)
+  __builtin_cpu_init();
+#endif
+
+  for (size_t i = 0; i < kop_scan_impls_count; i++) {
+    if (kop_scan_impls[i].supported()) {
+      kop_scan = &kop_scan_impls[i];
+    }
+  }
+
+  KOP_DEBUG_LOG("using %s delimiter scanning", kop_scan->name);
+}
+
+void kop_scan_use(const kop_scan_impl *impl) { kop_scan = impl; }
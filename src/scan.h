@@ -0,0 +1,40 @@
+#ifndef KOP_SCAN_H_
+#define KOP_SCAN_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "utils.h"
+
+// Delimiter search used by the parser. Every implementation returns exactly
+// the same results, the fastest one the CPU supports is picked at runtime by
+// kop_scan_init.
+typedef struct kop_scan_impl {
+  const char *name;
+  bool (*supported)(void);
+  // first occurrence of `c` in `buf`, NULL if there is none
+  const char *(*find)(const char *buf, size_t len, char c);
+  // first occurrence of either `a` or `b` in `buf`, NULL if there is none
+  const char *(*find2)(const char *buf, size_t len, char a, char b);
+} kop_scan_impl;
+
+extern const kop_scan_impl kop_scan_impls[];
+extern const size_t kop_scan_impls_count;
+extern const kop_scan_impl *kop_scan;
+
+// Selects the best implementation for this CPU. Has to be called before any
+// reactor thread starts, until then the scalar implementation is used.
+void kop_scan_init(void);
+// Forces a specific implementation, meant for benchmarks.
+void kop_scan_use(const kop_scan_impl *impl);
+
+static inline const char *kop_scan_find(const char *buf, size_t len, char c) {
+  return kop_scan->find(buf, len, c);
+}
+
+static inline const char *kop_scan_find2(const char *buf, size_t len, char a,
+                                         char b) {
+  return kop_scan->find2(buf, len, a, b);
+}
+
+#endif // !KOP_SCAN_H_
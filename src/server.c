@@ -1,7 +1,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -10,34 +14,39 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "cache.h"
+#include "conn.h"
+#include "file.h"
 #include "http.h"
 #include "queue.h"
+#include "scan.h"
 #include "server.h"
 #include "utils.h"
 
-static kop_error set_nonblocking(int fd) {
-  int flags = fcntl(fd, F_GETFL, 0);
-  if (flags == -1) {
-    return ERR_NONBLOCKING;
-  }
-
-  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-    return ERR_NONBLOCKING;
-  }
-
-  return NOERROR;
-}
-
 static kop_error kop_server_init(int *server_sock, uint16_t port) {
   int sock = socket(AF_INET, SOCK_STREAM, 0);
-  int reuseaddr = 1;
+  if (sock < 0) {
+    return ERR_CREATING_SOCKET;
+  }
 
+  int reuseaddr = 1;
   if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuseaddr,
                  sizeof(reuseaddr)) < 0) {
+    close(sock);
     return ERR_CREATING_SOCKET;
   }
 
-  if (sock < 0) {
+  // every reactor binds its own socket to the same port, the kernel then
+  // balances incoming connections between them
+  int reuseport = 1;
+#if defined(SO_REUSEPORT_LB)
+  int reuseport_opt = SO_REUSEPORT_LB;
+#else
+  int reuseport_opt = SO_REUSEPORT;
+#endif
+  if (setsockopt(sock, SOL_SOCKET, reuseport_opt, &reuseport,
+                 sizeof(reuseport)) < 0) {
+    close(sock);
     return ERR_CREATING_SOCKET;
   }
 
@@ -48,11 +57,13 @@ static kop_error kop_server_init(int *server_sock, uint16_t port) {
   };
 
   if (bind(sock, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sock);
     return ERR_CREATING_SOCKET;
   }
 
   kop_error err = set_nonblocking(sock);
   if (err != NOERROR) {
+    close(sock);
     return err;
   }
 
@@ -70,196 +81,2086 @@ static void kop_server_shutdown(int sig) {
   gStop = true;
 }
 
-kop_error kop_server_new(kop_server *s, uint16_t port) {
-  kop_error err = kop_server_init(&s->sock_fd, port);
+static void kop_server_stop(kop_server *s) {
+  gStop = true;
+  for (size_t i = 0; i < s->nreactors; i++) {
+    kop_queue_wake(&s->reactors[i].queue);
+  }
+}
+
+static kop_error kop_reactor_init(kop_reactor *r, kop_server *s, size_t id,
+                                  uint16_t port) {
+  r->server = s;
+  r->id = id;
+  r->err = NOERROR;
+  r->metrics = (kop_metrics){0};
+  r->log = NULL;
+  r->spare_fd = -1;
+  r->accept_retry = 0;
+#if defined(KOP_TRACE)
+  kop_tracer_init(&r->tracer, 0);
+#endif
+
+  kop_error err = kop_server_init(&r->sock_fd, port);
   if (err != NOERROR) {
     return err;
   }
 
-  err = kop_queue_init(&s->queue, s->sock_fd);
+  err = kop_queue_init(&r->queue, r->sock_fd);
   if (err != NOERROR) {
+    close(r->sock_fd);
     return err;
   }
+  // without it the backlog just waits for a descriptor to free up
+  r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-  s->port = port;
+  return NOERROR;
+}
+
+static void kop_reactor_delete(kop_reactor *r) {
+  // connections closed while their handler ran are no longer in `conns`
+  for (kop_job *job = r->offloaded; job != NULL;) {
+    kop_job *next = job->next;
+    kop_conn *c = (kop_conn *)((char *)job - offsetof(kop_conn, job));
+    if (c->orphaned) {
+      kop_conn_free(c);
+    }
+    job = next;
+  }
+  r->offloaded = NULL;
+
+  // connections first, they may still hold references to cached files. The
+  // closed ones go back to the slab before it is freed.
+#if defined(KOP_URING)
+  while (r->dead != NULL) {
+    kop_conn *next = r->dead->next_dead;
+    kop_conn_free(r->dead);
+    r->dead = next;
+  }
+#endif
+  kop_conns_free(&r->conns);
+  kop_file_cache_free(&r->files);
+  kop_response_cache_free(&r->responses);
+  kop_metrics_free(&r->metrics);
+#if defined(KOP_TRACE)
+  kop_tracer_free(&r->tracer);
+#endif
+  kop_vector_free(r->resume);
+  kop_arena_pool_free(&r->arenas);
+  kop_queue_close(&r->queue);
+
+  close(r->sock_fd);
+  r->sock_fd = 0;
+  if (r->spare_fd >= 0) {
+    close(r->spare_fd);
+  }
+  r->spare_fd = -1;
+}
+
+kop_error kop_server_new(kop_server *s, uint16_t port, size_t workers) {
+  if (workers == 0) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = ncpu > 0 ? (size_t)ncpu : 1;
+  }
+
+  kop_scan_init();
 
-  kop_vector_init(kop_handler, s->handlers);
+  kop_error err = kop_router_init(&s->router);
+  if (err != NOERROR) {
+    return err;
+  }
+  s->statics = (kop_static_mounts){0};
+  s->pool = (kop_pool){0};
+  s->offload = false;
+  s->log = (kop_access_log){.fd = -1};
+
+  s->reactors = calloc(workers, sizeof(kop_reactor));
+  if (s->reactors == NULL) {
+    kop_router_free(&s->router);
+    return ERR_OUT_OF_MEMORY;
+  }
+  s->nreactors = 0;
+
+  for (size_t i = 0; i < workers; i++) {
+    err = kop_reactor_init(&s->reactors[i], s, i, port);
+    if (err != NOERROR) {
+      kop_server_delete(s);
+      return err;
+    }
+    s->nreactors++;
+  }
+
+  s->port = port;
+  s->config = (kop_config){
+      .max_requests_per_conn = 1000,
+      .max_body_size = 1 << 20,
+      .max_header_size = 16 << 10,
+      .header_timeout_ms = 10000,
+      .body_timeout_ms = 30000,
+      .write_timeout_ms = 30000,
+      .keepalive_timeout_ms = 5000,
+      .static_cache_size = 1024,
+      .response_cache_size = 16 << 20,
+      .offload_threads = 4,
+      .backend = KOP_BACKEND_AUTO,
+      .listen_backlog = 4096,
+      .max_events = MAX_EVENTS,
+      .trace_every = KOP_TRACE_EVERY,
+  };
 
   s->shutdown = kop_server_shutdown;
   signal(SIGINT, s->shutdown);
+  // a client going away mid-response must not take the process down
+  signal(SIGPIPE, SIG_IGN);
 
   return NOERROR;
 }
 
-static kop_error kop_handle_client(kop_server *s, int client_sock) {
-  kop_http_request req = {0};
-  kop_error err;
-  if ((err = parse_http_request(client_sock, &req)) != NOERROR) {
-    return err;
+static bool kop_method_allowed(kop_handler_func *handlers,
+                               kop_http_method method) {
+  return handlers[method] != NULL || method == HTTP_OPTIONS ||
+         (method == HTTP_HEAD && handlers[HTTP_GET] != NULL);
+}
+
+// Lists the methods the matched path does support, as required for a 405.
+static kop_error kop_set_allow_header(kop_context *ctx,
+                                      kop_handler_func *handlers) {
+  size_t len = 0;
+  for (size_t i = 0; i < kop_http_method_count; i++) {
+    if (kop_method_allowed(handlers, i)) {
+      len += strlen(KOP_HTTP_METHOD_TO_STR(i)) + 2;
+    }
   }
 
-  KOP_DEBUG_LOG("got client with method '%s'",
-                KOP_HTTP_METHOD_TO_STR(req.method));
+  char *allow = kop_alloc(ctx, len + 1);
+  if (allow == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
 
-  kop_vector_foreach(kop_http_header, req.headers, header) {
-    KOP_DEBUG_LOG("                %s : %s", header->header, header->value);
+  char *it = allow;
+  for (size_t i = 0; i < kop_http_method_count; i++) {
+    if (!kop_method_allowed(handlers, i)) {
+      continue;
+    }
+    if (it != allow) {
+      *it++ = ',';
+      *it++ = ' ';
+    }
+    const char *method = KOP_HTTP_METHOD_TO_STR(i);
+    memcpy(it, method, strlen(method));
+    it += strlen(method);
   }
+  *it = '\0';
 
-  KOP_DEBUG_LOG("                path '%s'", req.path);
-  KOP_DEBUG_LOG("                body(len=%zu) '%s'", req.body_len, req.body);
+  kop_set_header(ctx, "Allow", allow);
 
-  for (size_t i = 0; i < s->handlers.len; i++) {
-    kop_handler handler = s->handlers.data[i];
-    if (handler.method != req.method || (strcmp(handler.path, req.path) != 0)) {
-      continue;
+  return NOERROR;
+}
+
+static kop_context kop_reactor_context(kop_reactor *r, kop_conn *c) {
+  return (kop_context){
+      .client_sock = c->fd,
+      .req = &c->req,
+      .server = r->server,
+      .reactor = r,
+      .resp = &c->resp,
+      .arena = c->arena,
+      .params = &c->params,
+      .body_state = &c->body_state,
+      .encoding = c->encoding,
+  };
+}
+
+// Compresses the response the handler of `c` left behind with the coding
+// picked for the request, if the route asks for it and the body is worth it.
+// A streamed body gets a compressor its chunks go through.
+static kop_error kop_compress_response(kop_conn *c) {
+  const kop_route_opts *opts = c->route.opts;
+  kop_http_response *resp = &c->resp;
+  if (c->route.status != KOP_ROUTE_FOUND || !opts->compress ||
+      resp->file != NULL || !kop_http_code_has_body(resp->code) ||
+      resp->code == HTTP_PARTIAL_CONTENT) {
+    return NOERROR;
+  }
+
+  kop_http_header *etag = NULL;
+  kop_str content_type = {0};
+  kop_vector_foreach(kop_http_header, resp->headers, header) {
+    if (kop_str_eq_nocase(header->header, "Content-Encoding")) {
+      // the handler took care of it
+      return NOERROR;
+    } else if (kop_str_eq_nocase(header->header, "Content-Type")) {
+      content_type = header->value;
+    } else if (kop_str_eq_nocase(header->header, "ETag")) {
+      etag = header;
+    }
+  }
+
+  if (!kop_compress_wanted(opts->compress_types, opts->compress_min_size,
+                           content_type,
+                           resp->stream != NULL ? SIZE_MAX : resp->body_len)) {
+    return NOERROR;
+  }
+  // caches in between have to tell the codings apart as well
+  kop_http_response_add_header(resp, c->arena, "Vary", "Accept-Encoding");
+  if (c->encoding == KOP_ENCODING_IDENTITY) {
+    return NOERROR;
+  }
+
+  if (resp->stream != NULL) {
+    c->compressor = malloc(sizeof(kop_compressor));
+    if (c->compressor == NULL) {
+      return ERR_OUT_OF_MEMORY;
+    }
+    kop_error err = kop_compressor_init(c->compressor, c->encoding, false);
+    if (err != NOERROR) {
+      free(c->compressor);
+      c->compressor = NULL;
+      return err;
+    }
+  } else {
+    char *body;
+    size_t body_len;
+    kop_error err = kop_compress(c->encoding, false, resp->body,
+                                 resp->body_len, c->arena, &body, &body_len);
+    if (err != NOERROR || body == NULL) {
+      return err;
     }
+    resp->body = body;
+    resp->body_len = body_len;
+  }
 
-    kop_context ctx = {
-        .client_sock = client_sock,
-        .req = req,
-        .server = s,
-        .resp = {.body_len = 0, .body = NULL, .code = HTTP_OK},
-    };
-    handler.handler(ctx);
-    break;
+  const char *name = kop_encoding_name(c->encoding);
+  kop_http_response_add_header(resp, c->arena, "Content-Encoding", name);
+
+  // the compressed body is a representation of its own, "x" becomes
+  // "x-gzip"
+  if (etag != NULL && etag->value.len >= 2 &&
+      etag->value.data[etag->value.len - 1] == '"') {
+    size_t len = etag->value.len + 1 + strlen(name);
+    char *value = kop_arena_alloc(c->arena, len);
+    if (value == NULL) {
+      return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(value, etag->value.data, etag->value.len - 1);
+    value[etag->value.len - 1] = '-';
+    memcpy(value + etag->value.len, name, strlen(name));
+    value[len - 1] = '"';
+    etag->value = (kop_str){.data = value, .len = len};
   }
 
-  kop_http_request_free(&req);
+  return NOERROR;
+}
 
-  KOP_DEBUG_LOG("client disconnect %d", client_sock);
+static kop_error kop_handle_client(kop_reactor *r, kop_conn *c) {
+  kop_http_request *req = &c->req;
+
+  KOP_DEBUG_LOG("got client with method '%s'",
+                KOP_HTTP_METHOD_TO_STR(req->method));
+
+  kop_vector_foreach(kop_http_header, req->headers, header) {
+    KOP_DEBUG_LOG("                " KOP_STR_FMT " : " KOP_STR_FMT,
+                  KOP_STR_ARG(header->header), KOP_STR_ARG(header->value));
+  }
+
+  KOP_DEBUG_LOG("                path '" KOP_STR_FMT "'",
+                KOP_STR_ARG(req->path));
+  KOP_DEBUG_LOG("                body(len=%zu) '" KOP_STR_FMT "'",
+                req->body.len, KOP_STR_ARG(req->body));
+
+  kop_context ctx = kop_reactor_context(r, c);
+
+  switch (c->route.status) {
+  case KOP_ROUTE_FOUND:
+    c->route.handler(&ctx, c->route.opts->data);
+    return kop_compress_response(c);
+  case KOP_ROUTE_NOT_FOUND:
+    c->resp.code = HTTP_NOT_FOUND;
+    break;
+  case KOP_ROUTE_METHOD_NOT_ALLOWED:
+    // a path without an OPTIONS route of its own just lists its methods
+    c->resp.code = req->method == HTTP_OPTIONS ? HTTP_NO_CONTENT
+                                               : HTTP_METHOD_NOT_ALLOWED;
+    return kop_set_allow_header(&ctx, c->route.handlers);
+  }
 
   return NOERROR;
 }
 
-kop_error kop_server_run(kop_server *s) {
-  if (listen(s->sock_fd, 10) < 0) {
-    return ERR_LISTENING;
+static bool kop_route_streams(kop_route_match *route) {
+  return route->status == KOP_ROUTE_FOUND && route->opts->on_body != NULL;
+}
+
+// Looks up the route of a request whose headers just came in. It decides
+// how much body the request may have and whether that body is buffered.
+static void kop_reactor_route(kop_reactor *r, kop_conn *c) {
+  kop_server *s = r->server;
+
+  c->route = kop_router_find(&s->router, c->req.method, c->req.path,
+                             &c->params);
+  c->routed = true;
+  if (c->req.method < kop_http_method_count) {
+    kop_metrics_add(&r->metrics.methods[c->req.method], 1);
   }
 
-  int server_sock = s->sock_fd;
+  // requests without a route still have their body read past, so the
+  // default limit applies to them as well
+  size_t max_body = s->config.max_body_size;
+  if (c->route.status == KOP_ROUTE_FOUND && c->route.opts->max_body > 0) {
+    max_body = c->route.opts->max_body;
+  }
+  c->parser.max_body = max_body == SIZE_MAX ? 0 : max_body;
 
-  int nevents = 0;
-  kop_queue_event events[10] = {0};
+  c->encoding = KOP_ENCODING_IDENTITY;
+  if (c->route.status == KOP_ROUTE_FOUND && c->route.opts->compress) {
+    c->encoding = kop_encoding_negotiate(
+        kop_http_request_header(&c->req, KOP_HEADER_ACCEPT_ENCODING));
+  }
+}
 
+// Hands the body decoded so far to the on_body callback of a streaming
+// route and drops it from the buffer, so an upload of any size goes through
+// the same few kilobytes.
+static kop_error kop_reactor_stream_body(kop_reactor *r, kop_conn *c) {
+  kop_http_parser *p = &c->parser;
+  kop_str chunk = kop_http_parser_body(p, c->buf + c->start);
   kop_error err = NOERROR;
 
-  while (!gStop) {
-    err = kop_queue_wait(&s->queue, events, 10, &nevents);
+  if (chunk.len > 0) {
+    kop_context ctx = kop_reactor_context(r, c);
+    err = c->route.opts->on_body(&ctx, chunk, c->route.opts->data);
+    c->len -= kop_http_parser_discard_body(p, c->buf + c->start,
+                                           c->len - c->start);
+  }
+  c->req.body = (kop_str){0};
+
+  if (err != NOERROR && c->resp.code < HTTP_BAD_REQUEST) {
+    // the callback may have picked a status of its own
+    c->resp.code = HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  return err;
+}
+
+// Parses what arrived for the request in flight. The route is looked up as
+// soon as the headers are complete, before any of the body is taken in.
+static kop_error kop_reactor_parse(kop_reactor *r, kop_conn *c,
+                                   kop_http_parse_status *status) {
+  kop_http_parser *p = &c->parser;
+
+  KOP_TRACE_PARSE_BEGIN(c);
+  kop_error err = parse_http_request(p, &c->req, c->buf + c->start,
+                                     c->len - c->start, status);
+  KOP_TRACE_PARSE_END(c);
+  if (err != NOERROR || *status == KOP_PARSE_NEED_MORE) {
+    return err;
+  }
+
+  if (!c->routed) {
+    KOP_TRACE_MARK(c, KOP_TRACE_HEADERS);
+    kop_reactor_route(r, c);
+    KOP_TRACE_MARK(c, KOP_TRACE_ROUTED);
+
+    KOP_TRACE_PARSE_BEGIN(c);
+    err = parse_http_request(p, &c->req, c->buf + c->start,
+                             c->len - c->start, status);
+    KOP_TRACE_PARSE_END(c);
     if (err != NOERROR) {
-      gStop = true;
-      break;
+      // e.g. a Content-Length over the limit, rejected before the client
+      // sends the body if it waits for 100 Continue
+      return err;
     }
 
-    for (size_t i = 0; i < (size_t)nevents; i++) {
-      kop_queue_event event = events[i];
+    if (*status == KOP_PARSE_HEADERS_COMPLETE &&
+        p->pos == c->len - c->start &&
+        kop_http_request_expects_continue(&c->req) &&
+        (err = kop_conn_queue_continue(c)) != NOERROR) {
+      return err;
+    }
+  }
 
-      if (kop_queue_event_check_error(event)) {
-        KOP_DEBUG_LOG("socket error: %s", kop_queue_event_strerror(event));
+  if (kop_route_streams(&c->route)) {
+    return kop_reactor_stream_body(r, c);
+  }
 
-        if (kop_queue_event_is_server(&s->queue, event)) {
-          // server is fucking dead
-          goto server_dead;
-        }
+  return NOERROR;
+}
 
-        kop_queue_event_close_client(event);
-        continue;
-      }
+static void kop_reactor_close_client(kop_reactor *r, int client_sock) {
+  KOP_DEBUG_LOG("client disconnect %d", client_sock);
 
-      if (kop_queue_event_is_server(&s->queue, event)) {
-        for (;;) {
-          struct sockaddr in_addr;
-          socklen_t in_addr_len = sizeof(in_addr);
-          int client = accept(server_sock, &in_addr, &in_addr_len);
-          if (client < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-              goto server_dead;
-            }
-            // we processed all of the connections
-            break;
-          }
+  kop_conn *c = kop_conns_take(&r->conns, client_sock);
+  if (c != NULL) {
+    kop_timer_cancel(&c->timer);
+    kop_metrics_add(&r->metrics.closed, 1);
+    KOP_TRACE_CLOSED(r, c);
+  }
+  if (c != NULL && c->offloaded) {
+    // the handler still uses it, kop_reactor_finish_offloads frees it
+    c->orphaned = true;
+#if defined(KOP_URING)
+    if (c->inflight > 0) {
+      shutdown(client_sock, SHUT_RDWR);
+      c->dead = true;
+    }
+#endif
+    close(client_sock);
+    return;
+  }
+#if defined(KOP_URING)
+  if (c != NULL && c->inflight > 0) {
+    // completions still point at the connection. Shutting the socket down
+    // makes them finish, once they did kop_reactor_reap frees it.
+    shutdown(client_sock, SHUT_RDWR);
+    c->dead = true;
+    c->next_dead = r->dead;
+    r->dead = c;
+    close(client_sock);
+    return;
+  }
+#endif
+  if (c != NULL) {
+    kop_conn_free(c);
+  }
+  close(client_sock);
+}
 
-          KOP_DEBUG_LOG("accepted new connection on fd: %d", client);
-          set_nonblocking(client);
+// Whether the reactor has its share of the server's connection limit.
+static bool kop_reactor_full(kop_reactor *r) {
+  size_t max = r->server->config.max_connections;
+  if (max == 0) {
+    return false;
+  }
+  size_t share = (max + r->server->nreactors - 1) / r->server->nreactors;
+  return r->conns.len >= share;
+}
 
-          struct timeval tv = (struct timeval){
-              .tv_sec = 5,
-              .tv_usec = 0,
-          };
-          setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+// Turns away a connection over the limit. It is answered at once instead of
+// waiting for a slot, which would only pile up more of them.
+static void kop_reactor_reject(kop_reactor *r, int client) {
+  static const char resp[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                             "Content-Length: 0\r\n"
+                             "Connection: close\r\n"
+                             "Retry-After: 1\r\n"
+                             "\r\n";
 
-          err = kop_queue_add_client_sock(&s->queue, client);
-          if (err != NOERROR) {
-            goto server_dead;
-          }
-        }
-      } else {
-        // a client socket
-        int client_sock = kop_queue_event_get_sock(event);
-        err = kop_handle_client(s, client_sock);
-        if (err != NOERROR) {
-          KOP_DEBUG_LOG("error handling client: %s", KOP_STRERROR(err));
-        }
-        close(client_sock);
-      }
-    }
+  KOP_DEBUG_LOG("rejecting connection on fd: %d", client);
+  // a fresh socket has room for it, if not the client just sees the close
+  (void)!send(client, resp, sizeof(resp) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(client);
+  kop_metrics_add(&r->metrics.rejected, 1);
+}
 
-    continue;
-  server_dead:
-    err = ERR_DEAD_SERVER;
-    gStop = true;
+// Accepts a connection from the listening socket and fills in the address
+// of the client. New sockets come out non-blocking, with accept4 that takes
+// no extra syscalls on Linux.
+static int kop_reactor_accept(kop_reactor *r, struct sockaddr_in *peer) {
+  socklen_t len = sizeof(*peer);
+#if defined(KOP_LINUX)
+  return accept4(r->sock_fd, (struct sockaddr *)peer, &len,
+                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  int client = accept(r->sock_fd, (struct sockaddr *)peer, &len);
+  if (client >= 0 && set_nonblocking(client) != NOERROR) {
+    close(client);
+    // skipped like a connection that went away before it was accepted
+    errno = ECONNABORTED;
+    return -1;
   }
+  return client;
+#endif
+}
 
-  return err;
+// Gives up the spare descriptor for long enough to turn away a connection
+// waiting in the backlog. Returns false once there are none or the spare is
+// gone.
+static bool kop_reactor_shed(kop_reactor *r) {
+  if (r->spare_fd < 0) {
+    return false;
+  }
+
+  close(r->spare_fd);
+  struct sockaddr_in peer;
+  int client = kop_reactor_accept(r, &peer);
+  if (client >= 0) {
+    kop_reactor_reject(r, client);
+  }
+  r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  return client >= 0;
 }
 
-void kop_server_delete(kop_server *s) {
-  s->port = 0;
+// how long accepting pauses after running out of descriptors or memory,
+// trying again right away would only fail again
+#define KOP_ACCEPT_RETRY_MS 50
+
+// Accepting failed with `err`, an errno. Out of descriptors the backlog is
+// turned away instead of waiting for one to free up, either way accepting is
+// tried again after KOP_ACCEPT_RETRY_MS.
+static void kop_reactor_pause_accept(kop_reactor *r, int err) {
+  KOP_DEBUG_LOG("error accepting: %s", strerror(err));
+  if (err == EMFILE || err == ENFILE) {
+    while (kop_reactor_shed(r)) {
+    }
+  }
+  r->accept_retry = kop_now_ms() + KOP_ACCEPT_RETRY_MS;
+}
+
+#if defined(KOP_URING)
+// What a completion belongs to, kept in the low bits of its user_data next
+// to the connection pointer.
+typedef enum kop_uring_op {
+  KOP_URING_OP_ACCEPT = 1,
+  KOP_URING_OP_WAKE,
+  KOP_URING_OP_RECV,
+  KOP_URING_OP_SEND,
+  KOP_URING_OP_POLL,
+  KOP_URING_OP_CANCEL,
+} kop_uring_op;
 
-  kop_queue_close(&s->queue);
+#define KOP_URING_OP_MASK 7
 
-  close(s->sock_fd);
-  s->sock_fd = 0;
+// input a connection that doesn't read its responses may pile up before its
+// recv is cancelled
+#define KOP_URING_RECV_BACKLOG (4 * KOP_URING_BUF_SIZE)
 
-  kop_vector_free(s->handlers);
+static inline uint64_t kop_uring_data(kop_conn *c, kop_uring_op op) {
+  return (uint64_t)(uintptr_t)c | op;
 }
 
-void kop_get(kop_server *s, const char *path, kop_handler_func handler_func) {
-  kop_handler handler = (kop_handler){
-      .method = HTTP_GET,
-      .path = path,
-      .handler = handler_func,
-  };
+// Starts an operation on `c` that is tracked by `c->inflight`.
+static kop_error kop_reactor_submit(kop_reactor *r, kop_conn *c,
+                                    kop_uring_op op) {
+  struct io_uring_sqe *sqe = kop_uring_get_sqe(&r->queue.uring);
+  if (sqe == NULL) {
+    return ERR_QUEUE_ADD_CLIENT;
+  }
+
+  uint64_t data = kop_uring_data(c, op);
+  switch (op) {
+  case KOP_URING_OP_RECV:
+    kop_uring_prep_recv_multishot(sqe, c->fd, data);
+    c->recv_armed = true;
+    break;
+  case KOP_URING_OP_SEND:
+    kop_uring_prep_sendmsg(sqe, c->fd, &c->msg, data);
+    c->sending = true;
+    break;
+  case KOP_URING_OP_POLL:
+    kop_uring_prep_poll(sqe, c->fd, POLLOUT, data);
+    c->sending = true;
+    break;
+  case KOP_URING_OP_CANCEL:
+    kop_uring_prep_cancel(sqe, kop_uring_data(c, KOP_URING_OP_RECV), data);
+    c->recv_cancelled = true;
+    break;
+  default:
+    return ERR_QUEUE_ADD_CLIENT;
+  }
+  c->inflight++;
 
-  kop_vector_append(kop_handler, s->handlers, handler);
+  return NOERROR;
 }
 
-void kop_post(kop_server *s, const char *path, kop_handler_func handler_func) {
-  kop_handler handler = (kop_handler){
-      .method = HTTP_POST,
-      .path = path,
-      .handler = handler_func,
-  };
+// Multishot recv appends whatever arrives for as long as it is armed. It is
+// cancelled once a client that doesn't read its responses piled up
+// KOP_URING_RECV_BACKLOG bytes of requests, and armed again when the output
+// is written and those are served.
+static kop_error kop_reactor_sync_recv(kop_reactor *r, kop_conn *c) {
+  bool busy = kop_conn_has_pending_output(c) || c->sending || c->streaming ||
+              c->offloaded;
+  if (busy && c->len - c->start >= KOP_URING_RECV_BACKLOG) {
+    if (!c->recv_armed || c->recv_cancelled) {
+      return NOERROR;
+    }
+    return kop_reactor_submit(r, c, KOP_URING_OP_CANCEL);
+  }
 
-  kop_vector_append(kop_handler, s->handlers, handler);
+  if (c->recv_armed || c->peer_closed) {
+    return NOERROR;
+  }
+  return kop_reactor_submit(r, c, KOP_URING_OP_RECV);
 }
 
-void kop_put(kop_server *s, const char *path, kop_handler_func handler_func) {
-  kop_handler handler = (kop_handler){
-      .method = HTTP_PUT,
-      .path = path,
-      .handler = handler_func,
+// Queues the pending output of `c` as a sendmsg on the ring, it is submitted
+// together with everything else at the end of the loop iteration. Files are
+// the exception: there is no sendfile on the ring, so they go out
+// synchronously and the ring only reports when the socket has room again.
+static kop_error kop_reactor_flush_uring(kop_reactor *r, kop_conn *c,
+                                         bool *done) {
+  *done = false;
+  if (c->sending) {
+    c->blocked = true;
+    return NOERROR;
+  }
+
+  if (!kop_conn_has_pending_output(c) ||
+      kop_out_segment_is_file(&c->out.data[c->out_head])) {
+    kop_error err = kop_conn_flush(c, done);
+    if (err != NOERROR || *done || !c->blocked) {
+      return err;
+    }
+    return kop_reactor_submit(r, c, KOP_URING_OP_POLL);
+  }
+
+  if (c->iov == NULL) {
+    c->iov = malloc(sizeof(struct iovec) * KOP_CONN_MAX_IOV);
+    if (c->iov == NULL) {
+      return ERR_OUT_OF_MEMORY;
+    }
+  }
+
+  // the segments can't move until the send completes, nothing is queued on
+  // a connection with pending output
+  c->msg = (struct msghdr){
+      .msg_iov = c->iov,
+      .msg_iovlen = kop_conn_fill_iov(c, c->iov, KOP_CONN_MAX_IOV),
   };
+  c->blocked = true;
 
-  kop_vector_append(kop_handler, s->handlers, handler);
+  return kop_reactor_submit(r, c, KOP_URING_OP_SEND);
 }
+#endif
 
-void kop_delete(kop_server *s, const char *path,
-                kop_handler_func handler_func) {
-  kop_handler handler = (kop_handler){
-      .method = HTTP_DELETE,
-      .path = path,
-      .handler = handler_func,
-  };
+// Records how long the request in flight on `c` took, once its response is
+// complete, and hands it to the access log. `bytes` is the size of the body.
+static void kop_reactor_record(kop_reactor *r, kop_conn *c, uint64_t bytes) {
+  uint64_t now = kop_now_us();
+  uint64_t latency = now - c->started;
+  bool found = c->routed && c->route.status == KOP_ROUTE_FOUND;
+  if (found && c->route.id < r->metrics.nroutes) {
+    kop_histogram_record(&r->metrics.routes[c->route.id], latency);
+  }
+  // a request line that didn't parse leaves the request half filled in
+  bool parsed = c->parser.state != KOP_PARSE_REQUEST_LINE;
+  KOP_TRACE_QUEUED(r, c, now,
+                   found ? (uint32_t)c->route.id : KOP_ACCESS_LOG_NO_ROUTE,
+                   parsed ? (uint8_t)c->req.method : HTTP_BAD_METHOD);
+
+  if (r->log == NULL) {
+    return;
+  }
+  kop_access_record *rec = kop_access_ring_reserve(r->log);
+  if (rec == NULL) {
+    kop_metrics_add(&r->metrics.log_dropped, 1);
+    return;
+  }
+
+  size_t path_len = parsed ? c->req.path.len : 0;
+  if (path_len > KOP_ACCESS_LOG_PATH_LEN) {
+    path_len = KOP_ACCESS_LOG_PATH_LEN;
+  }
+  rec->time_ms = kop_wall_ms();
+  rec->latency_us = latency;
+  rec->bytes = bytes;
+  rec->peer_addr = c->peer_addr;
+  rec->peer_port = c->peer_port;
+  rec->status = (uint16_t)c->resp.code;
+  rec->route = found ? (uint32_t)c->route.id : KOP_ACCESS_LOG_NO_ROUTE;
+  rec->method = parsed ? (uint8_t)c->req.method : HTTP_BAD_METHOD;
+  rec->path_len = (uint8_t)path_len;
+  if (path_len > 0) {
+    memcpy(rec->path, c->req.path.data, path_len);
+  }
+  kop_access_ring_commit(r->log);
+}
+
+// Runs the producer of the streamed response of `c` until it wrote a batch
+// or ended the body.
+static kop_error kop_reactor_produce(kop_reactor *r, kop_conn *c) {
+  kop_context ctx = kop_reactor_context(r, c);
+  size_t batch = c->stream_written;
+
+  // a compressor may hold on to what the producer wrote, the batch is
+  // bounded by both what was produced and what is ready to go out
+  while (c->streaming && c->wlen < KOP_CONN_STREAM_BATCH &&
+         c->stream_written - batch < KOP_CONN_STREAM_BATCH) {
+    size_t written = c->stream_written;
+    kop_error err = c->resp.stream(&ctx, c->resp.stream_state);
+    if (err != NOERROR) {
+      return err;
+    }
+    if (c->stream_ended) {
+      kop_reactor_record(r, c, c->stream_written);
+      return kop_conn_end_stream(c);
+    }
+    if (c->stream_written == written) {
+      // nothing would ever call it again, there is no way for a producer
+      // to say it has more later
+      return ERR_WRITING_DATA;
+    }
+  }
+
+  // the client shouldn't wait for the rest to see this batch
+  return kop_conn_flush_stream(c);
+}
+
+kop_error kop_write(kop_context *ctx, const char *data, size_t len) {
+  kop_conn *c = kop_conns_get(&ctx->reactor->conns, ctx->client_sock);
+  if (c == NULL || !c->streaming) {
+    return ERR_WRITING_DATA;
+  }
+  return kop_conn_queue_stream(c, data, len);
+}
+
+void kop_stream_end(kop_context *ctx) {
+  kop_conn *c = kop_conns_get(&ctx->reactor->conns, ctx->client_sock);
+  if (c != NULL && c->streaming) {
+    c->stream_ended = true;
+  }
+}
+
+// Flushes the output of `c`. Output that was cut short by the write budget
+// rather than by a full socket gets no EPOLLOUT, so the connection is queued
+// to be resumed on the next loop iteration. So is a streamed response once a
+// batch of it went out, its producer runs again on the next iteration, after
+// the other connections had their turn.
+static kop_error kop_reactor_flush(kop_reactor *r, kop_conn *c, bool *done) {
+  kop_error err;
+
+  // a new batch only once the client took the previous one, this is what
+  // ties the producer to the pace of the socket
+  if (c->streaming && !kop_conn_has_pending_output(c) &&
+      (err = kop_reactor_produce(r, c)) != NOERROR) {
+    KOP_DEBUG_LOG("error producing response: %s", KOP_STRERROR(err));
+    return err;
+  }
+
+#if defined(KOP_URING)
+  err = kop_queue_is_uring(&r->queue) ? kop_reactor_flush_uring(r, c, done)
+                                      : kop_conn_flush(c, done);
+#else
+  err = kop_conn_flush(c, done);
+#endif
+  if (err != NOERROR || c->blocked) {
+    return err;
+  }
+  if (*done) {
+    if (!c->streaming) {
+      return NOERROR;
+    }
+    *done = false;
+  }
+
+  if (r->resume.data == NULL) {
+    kop_vector_init(int, r->resume);
+  }
+  kop_vector_append(int, r->resume, c->fd);
+
+  return NOERROR;
+}
+
+static bool kop_route_caches(kop_conn *c) {
+  return c->route.status == KOP_ROUTE_FOUND &&
+         c->route.opts->cache_ttl_ms > 0 && c->req.method == HTTP_GET;
+}
+
+// Builds the cache key of the request in flight on `c`: method, path and
+// the values of the headers the route varies on, one per line.
+static kop_error kop_reactor_cache_key(kop_conn *c) {
+  const char *const *vary = c->route.opts->cache_vary;
+  const char *method = KOP_HTTP_METHOD_TO_STR(c->req.method);
+  size_t method_len = strlen(method);
+
+  size_t len = method_len + 1 + c->req.path.len;
+  for (size_t i = 0; vary != NULL && vary[i] != NULL; i++) {
+    len += 1 + find_header_or_default(&c->req, vary[i], "").len;
+  }
+  // every coding is cached on its own
+  const char *encoding = kop_encoding_name(c->encoding);
+  if (c->encoding != KOP_ENCODING_IDENTITY) {
+    len += 1 + strlen(encoding);
+  }
+
+  char *key = kop_arena_alloc(c->arena, len);
+  if (key == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  char *it = key;
+  memcpy(it, method, method_len);
+  it += method_len;
+  *it++ = ' ';
+  memcpy(it, c->req.path.data, c->req.path.len);
+  it += c->req.path.len;
+  for (size_t i = 0; vary != NULL && vary[i] != NULL; i++) {
+    kop_str value = find_header_or_default(&c->req, vary[i], "");
+    *it++ = '\n';
+    memcpy(it, value.data, value.len);
+    it += value.len;
+  }
+  if (c->encoding != KOP_ENCODING_IDENTITY) {
+    *it++ = '\n';
+    memcpy(it, encoding, strlen(encoding));
+  }
+
+  c->cache_key = (kop_str){.data = key, .len = len};
+  return NOERROR;
+}
+
+// Queues `cached` in response to the request in flight on `c`, or a 304 if
+// the client already has it.
+static kop_error kop_reactor_send_cached(kop_reactor *r, kop_conn *c,
+                                        kop_cached_response *cached) {
+  kop_error err;
+  kop_str inm = kop_http_request_header(&c->req, KOP_HEADER_IF_NONE_MATCH);
+  uint64_t bytes = 0;
+
+  if (inm.len > 0 && kop_http_etag_matches(inm, cached->etag)) {
+    // the head is serialized right away, the view into the entry doesn't
+    // have to outlive it
+    c->resp = (kop_http_response){.code = HTTP_NOT_MODIFIED};
+    kop_http_response_add_header(&c->resp, c->arena, "ETag", cached->etag);
+    if (c->route.opts->compress) {
+      kop_http_response_add_header(&c->resp, c->arena, "Vary",
+                                   "Accept-Encoding");
+    }
+    err = kop_conn_queue_response(c, c->keep_alive);
+  } else {
+    c->resp.code = HTTP_OK;
+    err = kop_conn_queue_cached(c, cached, c->keep_alive);
+    bytes = cached->len - cached->head_len;
+  }
+  if (err != NOERROR) {
+    return err;
+  }
+
+  kop_metrics_count_status(&r->metrics, c->resp.code);
+  kop_reactor_record(r, c, bytes);
+  kop_conn_next_request(c);
+  return NOERROR;
+}
+
+// Answers the request in flight on `c` from the response cache of the
+// reactor if its route caches and a fresh entry is there. `hit` tells
+// whether it was, the handler runs otherwise.
+static kop_error kop_reactor_serve_cached(kop_reactor *r, kop_conn *c,
+                                         bool *hit) {
+  *hit = false;
+  if (r->responses.cap == 0 || !kop_route_caches(c)) {
+    return NOERROR;
+  }
+
+  kop_error err = kop_reactor_cache_key(c);
+  if (err != NOERROR) {
+    return err;
+  }
+
+  kop_cached_response *cached =
+      kop_response_cache_get(&r->responses, c->cache_key, kop_now_ms());
+  if (cached == NULL) {
+    return NOERROR;
+  }
+
+  *hit = true;
+  err = kop_reactor_send_cached(r, c, cached);
+  kop_cached_response_release(cached);
+  return err;
+}
+
+// Queues the response the handler of `c` left behind, `err` is what serving
+// the request failed with. Responses of routes that cache are stored in the
+// response cache on the way.
+static kop_error kop_reactor_respond(kop_reactor *r, kop_conn *c,
+                                    kop_error err) {
+  if (err != NOERROR) {
+    KOP_DEBUG_LOG("error handling client: %s", KOP_STRERROR(err));
+    if (c->resp.file != NULL) {
+      kop_file_release(c->resp.file);
+    }
+    c->resp = (kop_http_response){.code = HTTP_INTERNAL_SERVER_ERROR};
+  }
+
+  kop_cached_response *cached = NULL;
+  if (c->cache_key.data != NULL && c->resp.code == HTTP_OK &&
+      c->resp.stream == NULL && c->resp.file == NULL &&
+      kop_response_cache_put(&r->responses, c->cache_key, &c->resp, c->arena,
+                             c->route.opts->cache_ttl_ms, kop_now_ms(),
+                             &cached) == NOERROR &&
+      cached != NULL) {
+    // the first request goes out from the entry just like the ones after it
+    err = kop_reactor_send_cached(r, c, cached);
+    kop_cached_response_release(cached);
+    return err;
+  }
+
+#if defined(KOP_URING)
+  // recv keeps appending to the buffer while the response waits to be
+  // sent, unlike epoll, which stops reading
+  if (kop_queue_is_uring(&r->queue) &&
+      (err = kop_conn_detach_body(c)) != NOERROR) {
+    return err;
+  }
+#endif
+  if ((err = kop_conn_queue_response(c, c->keep_alive)) != NOERROR) {
+    return err;
+  }
+  kop_metrics_count_status(&r->metrics, c->resp.code);
+  if (!c->streaming) {
+    kop_reactor_record(r, c,
+                       c->req.method == HTTP_HEAD ? 0 : c->resp.body_len);
+    kop_conn_next_request(c);
+    return NOERROR;
+  }
+
+  // the first part of the body goes out together with the head
+  if ((err = kop_reactor_produce(r, c)) != NOERROR) {
+    KOP_DEBUG_LOG("error producing response: %s", KOP_STRERROR(err));
+  }
+  return err;
+}
+
+static bool kop_route_offloads(kop_route_match *route) {
+  return route->status == KOP_ROUTE_FOUND && route->opts->offload;
+}
+
+// Runs on a pool worker.
+static void kop_offload_run(kop_job *job) {
+  kop_conn *c = (kop_conn *)((char *)job - offsetof(kop_conn, job));
+  kop_reactor *r = job->arg;
+
+  c->offload_err = kop_handle_client(r, c);
+  KOP_TRACE_MARK(c, KOP_TRACE_HANDLED);
+
+  // hand the connection back, the release publishes what the handler wrote
+  kop_job *head = __atomic_load_n(&r->offloaded, __ATOMIC_RELAXED);
+  do {
+    job->next = head;
+  } while (!__atomic_compare_exchange_n(&r->offloaded, &head, job, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  kop_queue_wake(&r->queue);
+}
+
+// Passes the request in flight on `c` to the offload pool. The connection
+// sits out until kop_reactor_finish_offloads takes it back.
+static kop_error kop_reactor_offload(kop_reactor *r, kop_conn *c) {
+  // more input may arrive meanwhile and move the buffer
+  kop_error err = kop_conn_detach_request(c);
+  if (err != NOERROR) {
+    return err;
+  }
+
+  c->offloaded = true;
+  c->job.run = kop_offload_run;
+  c->job.arg = r;
+  kop_pool_submit(&r->server->pool, &c->job);
+
+  return NOERROR;
+}
+
+// Serves every complete request sitting in the connection buffer and writes
+// the responses with as few writev calls as possible. A request that is not
+// complete yet stays parked on the connection until the next readiness event,
+// and so does output the socket did not accept. Returns true when the
+// connection has to be closed.
+static bool kop_reactor_serve(kop_reactor *r, kop_conn *c, bool eof) {
+  kop_config *config = &r->server->config;
+  kop_error err;
+
+  // the buffer may hold several pipelined requests, they are all served in
+  // order and their responses go out together
+  while (c->start < c->len && !c->closing && !c->streaming &&
+         !c->offloaded) {
+    if (c->arena == NULL) {
+      KOP_TRACE_BEGIN(r, c);
+    }
+    if ((err = kop_conn_start_request(c)) != NOERROR) {
+      return true;
+    }
+    c->parser.max_head = config->max_header_size;
+
+    kop_http_parse_status status;
+    err = kop_reactor_parse(r, c, &status);
+    if (err != NOERROR) {
+      KOP_DEBUG_LOG("error parsing request: %s", KOP_STRERROR(err));
+      kop_metrics_add(&r->metrics.errors[err], 1);
+      // where the request ends is unknown, so is where the next one starts
+      if (c->resp.code < HTTP_BAD_REQUEST) {
+        c->resp.code = kop_http_error_code(err);
+      }
+      if (kop_conn_queue_response(c, false) != NOERROR) {
+        return true;
+      }
+      kop_metrics_count_status(&r->metrics, c->resp.code);
+      kop_reactor_record(r, c, c->resp.body_len);
+      break;
+    }
+
+    if (status != KOP_PARSE_COMPLETE) {
+      break;
+    }
+    KOP_TRACE_MARK(c, KOP_TRACE_BODY);
+
+    c->requests++;
+    c->keep_alive = kop_http_request_keep_alive(&c->req) &&
+                    (config->max_requests_per_conn == 0 ||
+                     c->requests < config->max_requests_per_conn);
+
+    bool cached;
+    if (kop_reactor_serve_cached(r, c, &cached) != NOERROR) {
+      return true;
+    }
+
+    if (!cached && kop_route_offloads(&c->route)) {
+      if (kop_reactor_offload(r, c) != NOERROR) {
+        return true;
+      }
+      // requests pipelined behind it wait until its response is queued,
+      // the responses before it still go out
+      break;
+    }
+
+    if (!cached) {
+      err = kop_handle_client(r, c);
+      KOP_TRACE_MARK(c, KOP_TRACE_HANDLED);
+      if (kop_reactor_respond(r, c, err) != NOERROR) {
+        return true;
+      }
+    }
+    if (c->streaming) {
+      // requests pipelined behind it wait until the body is done
+      break;
+    }
+
+    if (c->out.len < KOP_CONN_MAX_IOV) {
+      continue;
+    }
+
+    // a full batch, send it before queueing more
+    bool done;
+    if ((err = kop_reactor_flush(r, c, &done)) != NOERROR) {
+      KOP_DEBUG_LOG("error writing to client: %s", KOP_STRERROR(err));
+      return true;
+    }
+    if (!done) {
+      // the rest of the buffered requests wait until the client catches up
+      return false;
+    }
+  }
+
+  bool done;
+  if ((err = kop_reactor_flush(r, c, &done)) != NOERROR) {
+    KOP_DEBUG_LOG("error writing to client: %s", KOP_STRERROR(err));
+    return true;
+  }
+  if (!done || c->offloaded) {
+    return false;
+  }
+
+  return c->closing || eof;
+}
+
+static bool kop_reactor_on_readable(kop_reactor *r, kop_conn *c) {
+  for (;;) {
+    if (kop_conn_has_pending_output(c) || c->streaming || c->offloaded) {
+      // don't take more requests from a client that doesn't read its
+      // responses or while one is still produced or handled on the pool,
+      // reading resumes once the output is flushed
+      return false;
+    }
+
+    bool eof = false, full = false;
+    kop_error err = kop_conn_read(c, &eof, &full);
+    if (err != NOERROR) {
+      KOP_DEBUG_LOG("error reading from client: %s", KOP_STRERROR(err));
+      return true;
+    }
+
+    bool close_client = kop_reactor_serve(r, c, eof);
+    if (close_client || !full) {
+      // the socket stays registered edge-triggered, the next request on
+      // this connection shows up as a new EPOLLIN
+      return close_client;
+    }
+    // the buffer filled up before the socket ran dry, edge-triggered
+    // readiness won't report the rest again
+  }
+}
+
+// Keeps writing the pending output of `c` and goes back to serving requests
+// once it is all out.
+static bool kop_reactor_continue_output(kop_reactor *r, kop_conn *c) {
+  bool done;
+  kop_error err = kop_reactor_flush(r, c, &done);
+  if (err != NOERROR) {
+    KOP_DEBUG_LOG("error writing to client: %s", KOP_STRERROR(err));
+    return true;
+  }
+  if (!done) {
+    return false;
+  }
+  if (c->closing) {
+    return true;
+  }
+
+#if defined(KOP_URING)
+  if (kop_queue_is_uring(&r->queue)) {
+    // recv kept filling the buffer in the meantime, unless there was too
+    // much of it
+    return kop_reactor_serve(r, c, c->peer_closed) ||
+           kop_reactor_sync_recv(r, c) != NOERROR;
+  }
+#endif
+
+  // input that arrived while we were blocked on the client was not read,
+  // edge-triggered readiness won't report it again
+  return kop_reactor_on_readable(r, c);
+}
+
+static bool kop_reactor_on_writable(kop_reactor *r, kop_conn *c) {
+  if (!kop_conn_has_pending_output(c) && !c->streaming) {
+    return false;
+  }
+
+  return kop_reactor_continue_output(r, c);
+}
+
+// Picks the deadline for what `c` is waiting on now. Header and keep-alive
+// deadlines are absolute, so a client trickling in a byte at a time doesn't
+// get to keep the connection. Body and write deadlines are pushed back on
+// every event, which for those means progress.
+static void kop_reactor_update_timer(kop_reactor *r, kop_conn *c) {
+  kop_config *config = &r->server->config;
+  kop_conn_timeout timeout;
+  size_t ms;
+
+  // every event ends up here, including the one that wrote the last byte
+  KOP_TRACE_WRITTEN(r, c);
+
+  if (c->offloaded) {
+    // the handler takes as long as it takes, the connection can't be freed
+    // under it anyway
+    timeout = KOP_TIMEOUT_NONE;
+    ms = 0;
+  } else if (kop_conn_has_pending_output(c) || c->streaming) {
+    timeout = KOP_TIMEOUT_WRITE;
+    ms = config->write_timeout_ms;
+  } else if (c->arena != NULL && c->parser.state == KOP_PARSE_BODY) {
+    timeout = KOP_TIMEOUT_BODY;
+    ms = config->body_timeout_ms;
+  } else if (c->start < c->len || c->requests == 0) {
+    // the first request of a connection is on the header deadline from the
+    // moment it is accepted
+    timeout = KOP_TIMEOUT_HEADER;
+    ms = config->header_timeout_ms;
+  } else {
+    timeout = KOP_TIMEOUT_IDLE;
+    ms = config->keepalive_timeout_ms;
+    // the next EPOLLIN or recv takes them from the pool again
+    kop_conn_idle(c);
+  }
+
+  if (timeout == c->timeout && c->requests == c->timeout_requests &&
+      (timeout == KOP_TIMEOUT_HEADER || timeout == KOP_TIMEOUT_IDLE)) {
+    return;
+  }
+
+  c->timeout = timeout;
+  c->timeout_requests = c->requests;
+  if (ms == 0) {
+    kop_timer_cancel(&c->timer);
+    return;
+  }
+
+  kop_timer_wheel_add(&r->timers, &c->timer, r->timers.now + ms);
+}
+
+// Closes the connections whose timers are on the `expired` list.
+static void kop_reactor_expire(kop_reactor *r, kop_timer *expired) {
+  while (kop_timer_pending(expired)) {
+    kop_conn *c =
+        (kop_conn *)((char *)expired->next - offsetof(kop_conn, timer));
+    KOP_DEBUG_LOG("connection %d timed out (%d)", c->fd, c->timeout);
+    // cancels the timer, which takes it off the list
+    kop_reactor_close_client(r, c->fd);
+  }
+}
+
+// How long the reactor may sleep: not at all while some connection still
+// has output to resume, otherwise until the next deadline.
+static int kop_reactor_timeout(kop_reactor *r) {
+  if (r->resume.len > 0) {
+    return 0;
+  }
+  int timeout = kop_timer_wheel_timeout(&r->timers);
+  if (r->accept_retry > 0) {
+    uint64_t now = kop_now_ms();
+    int retry = r->accept_retry > now ? (int)(r->accept_retry - now) : 0;
+    if (timeout < 0 || retry < timeout) {
+      timeout = retry;
+    }
+  }
+  return timeout;
+}
+
+// Moves the timer wheel to the current time. The timers that fired are only
+// collected, the events that arrived meanwhile are handled first and may
+// still rescue their connections by re-arming.
+static void kop_reactor_tick(kop_reactor *r, kop_timer *expired) {
+  kop_timer_init(expired);
+  kop_timer_wheel_advance(&r->timers, kop_now_ms(), expired);
+}
+
+// Continues the connections that ran out of their write budget. Those that
+// run out again queue themselves anew.
+static void kop_reactor_resume(kop_reactor *r) {
+  size_t nresume = r->resume.len;
+  for (size_t i = 0; i < nresume; i++) {
+    int client_sock = r->resume.data[i];
+    kop_conn *c = kop_conns_get(&r->conns, client_sock);
+    // the fd may have been closed or even reused meanwhile, which is
+    // harmless, a connection without pending output is skipped
+    if (c == NULL) {
+      continue;
+    }
+    if (kop_reactor_on_writable(r, c)) {
+      kop_reactor_close_client(r, client_sock);
+    } else {
+      kop_reactor_update_timer(r, c);
+    }
+  }
+  if (nresume > 0) {
+    memmove(r->resume.data, r->resume.data + nresume,
+            (r->resume.len - nresume) * sizeof(int));
+    r->resume.len -= nresume;
+  }
+}
+
+// Queues the responses of the offloaded handlers that are done and picks
+// their connections back up where kop_reactor_serve left them.
+static void kop_reactor_finish_offloads(kop_reactor *r) {
+  kop_job *job = __atomic_exchange_n(&r->offloaded, NULL, __ATOMIC_ACQUIRE);
+
+  // pushed last first, in order they finished is fairer
+  kop_job *done = NULL;
+  while (job != NULL) {
+    kop_job *next = job->next;
+    job->next = done;
+    done = job;
+    job = next;
+  }
+
+  while (done != NULL) {
+    kop_conn *c = (kop_conn *)((char *)done - offsetof(kop_conn, job));
+    done = done->next;
+    c->offloaded = false;
+
+    if (c->orphaned) {
+#if defined(KOP_URING)
+      if (c->inflight > 0) {
+        c->next_dead = r->dead;
+        r->dead = c;
+        continue;
+      }
+#endif
+      kop_conn_free(c);
+      continue;
+    }
+
+    if (kop_reactor_respond(r, c, c->offload_err) != NOERROR ||
+        kop_reactor_continue_output(r, c)) {
+      kop_reactor_close_client(r, c->fd);
+    } else {
+      kop_reactor_update_timer(r, c);
+    }
+  }
+}
+
+#if defined(KOP_URING)
+// Frees the closed connections whose last operation completed.
+static void kop_reactor_reap(kop_reactor *r) {
+  kop_conn **it = &r->dead;
+  while (*it != NULL) {
+    kop_conn *c = *it;
+    if (c->inflight > 0) {
+      it = &c->next_dead;
+      continue;
+    }
+    *it = c->next_dead;
+    kop_conn_free(c);
+  }
+}
+
+static kop_error kop_reactor_arm_accept(kop_reactor *r) {
+  struct io_uring_sqe *sqe = kop_uring_get_sqe(&r->queue.uring);
+  if (sqe == NULL) {
+    return ERR_ACCEPTING;
+  }
+  kop_uring_prep_accept_multishot(sqe, r->sock_fd,
+                                  kop_uring_data(NULL, KOP_URING_OP_ACCEPT));
+  return NOERROR;
+}
+
+// Arms the accept again once the pause after running out of descriptors or
+// memory is over.
+static kop_error kop_reactor_retry_accept(kop_reactor *r) {
+  if (r->accept_retry == 0 || kop_now_ms() < r->accept_retry) {
+    return NOERROR;
+  }
+  r->accept_retry = 0;
+  return kop_reactor_arm_accept(r);
+}
+
+static kop_error kop_reactor_arm_wake(kop_reactor *r) {
+  struct io_uring_sqe *sqe = kop_uring_get_sqe(&r->queue.uring);
+  if (sqe == NULL) {
+    return ERR_QUEUE_WAIT;
+  }
+  kop_uring_prep_read(sqe, r->queue.wake_fds[0], r->queue.wake_buf,
+                      sizeof(r->queue.wake_buf),
+                      kop_uring_data(NULL, KOP_URING_OP_WAKE));
+  return NOERROR;
+}
+
+static kop_error kop_reactor_on_accept(kop_reactor *r, int client) {
+  KOP_DEBUG_LOG("accepted new connection on fd: %d", client);
+
+  if (kop_reactor_full(r)) {
+    kop_reactor_reject(r, client);
+    return NOERROR;
+  }
+
+  kop_conn *c = kop_conns_open(&r->conns, client);
+  if (c == NULL) {
+    kop_metrics_add(&r->metrics.accept_failed, 1);
+    close(client);
+    return NOERROR;
+  }
+  kop_metrics_add(&r->metrics.accepted, 1);
+  KOP_TRACE_IDLE_SINCE(c, kop_now_us());
+  if (r->log != NULL) {
+    // multishot accept doesn't hand out addresses
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    if (getpeername(client, (struct sockaddr *)&peer, &len) == 0) {
+      kop_conn_set_peer(c, &peer);
+    }
+  }
+
+  kop_error err = kop_reactor_submit(r, c, KOP_URING_OP_RECV);
+  if (err != NOERROR) {
+    kop_metrics_add(&r->metrics.accept_failed, 1);
+    kop_reactor_close_client(r, client);
+    return NOERROR;
+  }
+  kop_reactor_update_timer(r, c);
+
+  return NOERROR;
+}
+
+// Returns true when the connection has to be closed.
+static bool kop_reactor_on_recv(kop_reactor *r, kop_conn *c,
+                                struct io_uring_cqe *cqe) {
+  kop_uring *u = &r->queue.uring;
+  kop_error err = NOERROR;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    c->inflight--;
+    c->recv_armed = false;
+    c->recv_cancelled = false;
+  }
+
+  if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (!c->dead) {
+      err = kop_conn_append(c, kop_uring_buf(u, bid), cqe->res);
+    }
+    kop_uring_buf_recycle(u, bid);
+  }
+
+  if (c->dead) {
+    return false;
+  }
+  if (err != NOERROR) {
+    KOP_DEBUG_LOG("error reading from client: %s", KOP_STRERROR(err));
+    return true;
+  }
+
+  if (cqe->res == 0) {
+    c->peer_closed = true;
+  } else if (cqe->res < 0 && cqe->res != -ENOBUFS &&
+             cqe->res != -ECANCELED) {
+    KOP_DEBUG_LOG("error reading from client: %s", strerror(-cqe->res));
+    return true;
+  }
+
+  if (kop_conn_has_pending_output(c) || c->sending || c->streaming ||
+      c->offloaded) {
+    // don't take more requests from a client that doesn't read its
+    // responses, what arrived is served once the output is written
+    return kop_reactor_sync_recv(r, c) != NOERROR;
+  }
+
+  // the kernel ends multishot recv when it runs out of buffers or on errors
+  // it considers transient
+  return kop_reactor_serve(r, c, c->peer_closed) ||
+         kop_reactor_sync_recv(r, c) != NOERROR;
+}
+
+// The cancel of a recv completed, the recv itself reports it ended.
+static void kop_reactor_on_cancel(kop_conn *c) {
+  c->inflight--;
+}
+
+// Returns true when the connection has to be closed.
+static bool kop_reactor_on_sent(kop_reactor *r, kop_conn *c,
+                                struct io_uring_cqe *cqe,
+                                kop_uring_op op) {
+  c->inflight--;
+  c->sending = false;
+
+  if (c->dead) {
+    return false;
+  }
+
+  if (op == KOP_URING_OP_SEND) {
+    if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+      return kop_reactor_submit(r, c, KOP_URING_OP_POLL) != NOERROR;
+    } else if (cqe->res < 0) {
+      KOP_DEBUG_LOG("error writing to client: %s", strerror(-cqe->res));
+      return true;
+    }
+    kop_conn_advance(c, cqe->res);
+  } else if (cqe->res < 0 || (cqe->res & (POLLERR | POLLHUP))) {
+    return true;
+  }
+
+  return kop_reactor_continue_output(r, c);
+}
+
+// The io_uring counterpart of kop_reactor_run. Accept and recv are armed once
+// as multishot operations, the data lands in the provided buffers of the
+// ring, and every send prepared while handling one batch of completions is
+// submitted together with the next wait: a single syscall per iteration.
+static kop_error kop_reactor_run_uring(kop_reactor *r) {
+  kop_uring *u = &r->queue.uring;
+
+  kop_error err = kop_reactor_arm_accept(r);
+  if (err == NOERROR) {
+    err = kop_reactor_arm_wake(r);
+  }
+
+  while (err == NOERROR && !gStop) {
+    err = kop_uring_submit_and_wait(u, kop_reactor_timeout(r));
+    if (err != NOERROR) {
+      if (errno == EINTR) {
+        err = NOERROR;
+        continue;
+      }
+      break;
+    }
+
+    kop_timer expired;
+    kop_reactor_tick(r, &expired);
+
+    struct io_uring_cqe *head;
+    while (err == NOERROR && (head = kop_uring_peek_cqe(u)) != NULL) {
+      // copied out, handling it may reuse the slot
+      struct io_uring_cqe cqe = *head;
+      kop_uring_cqe_seen(u);
+
+      kop_uring_op op = cqe.user_data & KOP_URING_OP_MASK;
+      kop_conn *c = (kop_conn *)(uintptr_t)(cqe.user_data &
+                                            ~(uint64_t)KOP_URING_OP_MASK);
+      bool close_client = false;
+
+      switch (op) {
+      case KOP_URING_OP_ACCEPT:
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+          if (cqe.res == -EMFILE || cqe.res == -ENFILE ||
+              cqe.res == -ENOBUFS || cqe.res == -ENOMEM) {
+            kop_reactor_pause_accept(r, -cqe.res);
+          } else {
+            err = kop_reactor_arm_accept(r);
+          }
+        }
+        if (err == NOERROR && cqe.res >= 0) {
+          err = kop_reactor_on_accept(r, cqe.res);
+        } else {
+          KOP_DEBUG_LOG("error accepting: %s", strerror(-cqe.res));
+        }
+        break;
+      case KOP_URING_OP_WAKE:
+        // only used to interrupt the wait, gStop and the offloaded handlers
+        // are checked outside
+        err = kop_reactor_arm_wake(r);
+        break;
+      case KOP_URING_OP_RECV:
+        close_client = kop_reactor_on_recv(r, c, &cqe);
+        break;
+      case KOP_URING_OP_SEND:
+      case KOP_URING_OP_POLL:
+        close_client = kop_reactor_on_sent(r, c, &cqe, op);
+        break;
+      case KOP_URING_OP_CANCEL:
+        kop_reactor_on_cancel(c);
+        break;
+      }
+
+      if (c == NULL || c->dead) {
+        continue;
+      }
+      if (close_client) {
+        kop_reactor_close_client(r, c->fd);
+      } else {
+        kop_reactor_update_timer(r, c);
+      }
+    }
+
+    kop_reactor_finish_offloads(r);
+    kop_reactor_resume(r);
+    kop_reactor_expire(r, &expired);
+    kop_reactor_reap(r);
+    if (err == NOERROR) {
+      err = kop_reactor_retry_accept(r);
+    }
+  }
+
+  if (err != NOERROR) {
+    gStop = true;
+  }
+
+  return err;
+}
+#endif
+
+// Applies the accept options of the config to the listening socket and
+// starts listening.
+static kop_error kop_reactor_listen(kop_reactor *r) {
+  kop_config *config = &r->server->config;
+
+  // both are optimizations the server works without, a kernel that doesn't
+  // know them is no reason to fail
+#if defined(TCP_DEFER_ACCEPT)
+  if (config->defer_accept_s > 0) {
+    int secs = config->defer_accept_s > INT_MAX ? INT_MAX
+                                                : (int)config->defer_accept_s;
+    if (setsockopt(r->sock_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs,
+                   sizeof(secs)) < 0) {
+      KOP_DEBUG_LOG("TCP_DEFER_ACCEPT: %s", strerror(errno));
+    }
+  }
+#endif
+#if defined(TCP_FASTOPEN)
+  if (config->fastopen_queue > 0) {
+    int qlen = config->fastopen_queue > INT_MAX ? INT_MAX
+                                                : (int)config->fastopen_queue;
+    if (setsockopt(r->sock_fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen,
+                   sizeof(qlen)) < 0) {
+      KOP_DEBUG_LOG("TCP_FASTOPEN: %s", strerror(errno));
+    }
+  }
+#endif
+
+  size_t backlog = config->listen_backlog > 0 ? config->listen_backlog
+                                              : SOMAXCONN;
+  if (listen(r->sock_fd, backlog > INT_MAX ? INT_MAX : (int)backlog) < 0) {
+    return ERR_LISTENING;
+  }
+
+  return NOERROR;
+}
+
+// Accepts every connection waiting in the backlog. An error is one the
+// server can't go on after, a connection that can't be set up is closed and
+// the rest are accepted.
+static kop_error kop_reactor_accept_all(kop_reactor *r) {
+  for (;;) {
+    struct sockaddr_in peer;
+    int client = kop_reactor_accept(r, &peer);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+          errno == ENOMEM) {
+        kop_reactor_pause_accept(r, errno);
+        return NOERROR;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return ERR_ACCEPTING;
+      }
+      // we processed all of the connections
+      return NOERROR;
+    }
+
+    KOP_DEBUG_LOG("accepted new connection on fd: %d", client);
+    if (kop_reactor_full(r)) {
+      kop_reactor_reject(r, client);
+      continue;
+    }
+
+    kop_conn *c = kop_conns_open(&r->conns, client);
+    if (c == NULL) {
+      kop_metrics_add(&r->metrics.accept_failed, 1);
+      close(client);
+      continue;
+    }
+    kop_metrics_add(&r->metrics.accepted, 1);
+    kop_conn_set_peer(c, &peer);
+    KOP_TRACE_IDLE_SINCE(c, kop_now_us());
+
+    if (kop_queue_add_client_sock(&r->queue, client, c->gen) != NOERROR) {
+      KOP_DEBUG_LOG("registering fd %d: %s", client, strerror(errno));
+      kop_metrics_add(&r->metrics.accept_failed, 1);
+      kop_reactor_close_client(r, client);
+      continue;
+    }
+    kop_reactor_update_timer(r, c);
+  }
+}
+
+static kop_error kop_reactor_run(kop_reactor *r) {
+  // the ring has to be created on the thread that uses it
+  kop_queue_select_backend(&r->queue, r->server->config.backend);
+
+  kop_error err = kop_reactor_listen(r);
+  if (err != NOERROR) {
+    return err;
+  }
+
+  err = kop_conns_init(&r->conns, &r->arenas, &r->metrics);
+  if (err != NOERROR) {
+    return err;
+  }
+  err = kop_file_cache_init(&r->files, r->server->config.static_cache_size);
+  if (err != NOERROR) {
+    return err;
+  }
+  err = kop_response_cache_init(&r->responses,
+                                r->server->config.response_cache_size);
+  if (err != NOERROR) {
+    return err;
+  }
+
+  kop_timer_wheel_init(&r->timers, kop_now_ms());
+
+#if defined(KOP_URING)
+  if (kop_queue_is_uring(&r->queue)) {
+    return kop_reactor_run_uring(r);
+  }
+#endif
+
+  size_t max_events =
+      r->server->config.max_events > 0 ? r->server->config.max_events
+                                       : MAX_EVENTS;
+  kop_queue_event *events = malloc(sizeof(kop_queue_event) * max_events);
+  if (events == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  int nevents = 0;
+
+  while (!gStop) {
+    err = kop_queue_wait(&r->queue, events, max_events,
+                         kop_reactor_timeout(r), &nevents);
+    if (err != NOERROR) {
+      if (errno == EINTR) {
+        // interrupted by a signal, gStop tells us whether to keep going
+        err = NOERROR;
+        continue;
+      }
+      gStop = true;
+      break;
+    }
+
+    kop_timer expired;
+    kop_reactor_tick(r, &expired);
+
+    for (size_t i = 0; i < (size_t)nevents; i++) {
+      kop_queue_event event = events[i];
+
+      if (kop_queue_event_is_wakeup(&r->queue, event)) {
+        // stop or offloaded handlers that are done, both are checked
+        // outside the loop
+        kop_queue_drain_wake(&r->queue);
+        continue;
+      }
+
+      if (kop_queue_event_check_error(event)) {
+        KOP_DEBUG_LOG("socket error: %s", kop_queue_event_strerror(event));
+
+        if (kop_queue_event_is_server(&r->queue, event)) {
+          // server is fucking dead
+          goto server_dead;
+        }
+
+        int client_sock = kop_queue_event_get_sock(event);
+        if (kop_conns_find(&r->conns, client_sock,
+                           kop_queue_event_get_gen(event)) != NULL) {
+          kop_reactor_close_client(r, client_sock);
+        }
+        continue;
+      }
+
+      if (kop_queue_event_is_server(&r->queue, event)) {
+        if (kop_reactor_accept_all(r) != NOERROR) {
+          goto server_dead;
+        }
+      } else {
+        // a client socket
+        int client_sock = kop_queue_event_get_sock(event);
+        kop_conn *c = kop_conns_find(&r->conns, client_sock,
+                                     kop_queue_event_get_gen(event));
+        if (c == NULL) {
+          // left over from a connection closed earlier in this batch, the
+          // fd may belong to a new one or to something else entirely
+          continue;
+        }
+        bool close_client = false;
+
+        if (kop_queue_event_is_writable(event)) {
+          close_client = kop_reactor_on_writable(r, c);
+        }
+        if (!close_client && kop_queue_event_is_readable(event)) {
+          close_client = kop_reactor_on_readable(r, c);
+        }
+
+        if (close_client) {
+          kop_reactor_close_client(r, client_sock);
+        } else {
+          kop_reactor_update_timer(r, c);
+        }
+      }
+    }
+
+    kop_reactor_finish_offloads(r);
+    kop_reactor_resume(r);
+    kop_reactor_expire(r, &expired);
+    if (r->accept_retry > 0 && kop_now_ms() >= r->accept_retry) {
+      r->accept_retry = 0;
+      if (kop_reactor_accept_all(r) != NOERROR) {
+        goto server_dead;
+      }
+    }
+
+    continue;
+  server_dead:
+    err = ERR_DEAD_SERVER;
+    gStop = true;
+  }
+
+  free(events);
+  return err;
+}
+
+static void *kop_reactor_thread(void *arg) {
+  kop_reactor *r = arg;
+
+  r->err = kop_reactor_run(r);
+  if (r->err != NOERROR) {
+    KOP_DEBUG_LOG("reactor %zu died: %s", r->id, KOP_STRERROR(r->err));
+  }
+  // one reactor going down takes the whole server with it
+  kop_server_stop(r->server);
+
+  return NULL;
+}
+
+#if defined(KOP_TRACE)
+// The tracers of all reactors, for kop_trace_format. NULL when out of
+// memory.
+static kop_tracer **kop_server_tracers(kop_server *s) {
+  kop_tracer **tracers = malloc(sizeof(kop_tracer *) * s->nreactors);
+  for (size_t i = 0; tracers != NULL && i < s->nreactors; i++) {
+    tracers[i] = &s->reactors[i].tracer;
+  }
+  return tracers;
+}
+#endif
+
+kop_error kop_server_run(kop_server *s) {
+  // the routes are known by now, every reactor gets a histogram for each
+  for (size_t i = 0; i < s->nreactors; i++) {
+    kop_reactor *r = &s->reactors[i];
+    kop_metrics_free(&r->metrics);
+    kop_error err = kop_metrics_init(&r->metrics, s->router.routes.len);
+    if (err != NOERROR) {
+      return err;
+    }
+#if defined(KOP_TRACE)
+    kop_tracer_free(&r->tracer);
+    err = kop_tracer_init(&r->tracer, s->config.trace_every);
+    if (err != NOERROR) {
+      return err;
+    }
+#endif
+  }
+
+  if (s->config.access_log != NULL) {
+    kop_error err = kop_access_log_open(&s->log, s->config.access_log,
+                                        s->nreactors, &s->router.routes);
+    if (err != NOERROR) {
+      return err;
+    }
+    for (size_t i = 0; i < s->nreactors; i++) {
+      s->reactors[i].log = &s->log.rings[i];
+    }
+    s->prev_sighup = signal(SIGHUP, kop_access_log_reopen);
+  }
+
+  // reactors other than the first one run on their own threads with signals
+  // blocked, so SIGINT is always delivered to the calling thread which then
+  // wakes everyone else up
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+
+  // the pool threads and the access log writer inherit the blocked signals
+  // as well
+  kop_error err = NOERROR;
+  if (s->log.path != NULL) {
+    err = kop_access_log_start(&s->log);
+  }
+  if (err == NOERROR && s->offload) {
+    err = kop_pool_start(&s->pool, s->config.offload_threads > 0
+                                       ? s->config.offload_threads
+                                       : 1);
+  }
+
+  size_t started = 1;
+  for (; err == NOERROR && started < s->nreactors; started++) {
+    kop_reactor *r = &s->reactors[started];
+    if (pthread_create(&r->thread, NULL, kop_reactor_thread, r) != 0) {
+      err = ERR_CREATING_THREAD;
+      break;
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (err == NOERROR) {
+    kop_reactor_thread(&s->reactors[0]);
+    err = s->reactors[0].err;
+  } else {
+    kop_server_stop(s);
+  }
+
+  for (size_t i = 1; i < started; i++) {
+    pthread_join(s->reactors[i].thread, NULL);
+    if (err == NOERROR) {
+      err = s->reactors[i].err;
+    }
+  }
+
+  // handlers still running finish first, their connections are freed with
+  // the reactors
+  kop_pool_stop(&s->pool);
+
+  // the writer gets to empty the rings before it goes
+  if (s->log.path != NULL) {
+    for (size_t i = 0; i < s->nreactors; i++) {
+      s->reactors[i].log = NULL;
+    }
+    kop_access_log_close(&s->log);
+    if (s->prev_sighup != SIG_ERR) {
+      signal(SIGHUP, s->prev_sighup);
+    }
+  }
+
+#if defined(KOP_TRACE)
+  kop_tracer **tracers = NULL;
+  if (s->config.trace_path != NULL &&
+      (tracers = kop_server_tracers(s)) != NULL) {
+    kop_error dump_err = kop_trace_dump(tracers, s->nreactors,
+                                        &s->router.routes,
+                                        s->config.trace_path);
+    if (dump_err != NOERROR) {
+      KOP_DEBUG_LOG("error dumping trace: %s", KOP_STRERROR(dump_err));
+    }
+  }
+  free(tracers);
+#endif
+
+  return err;
+}
+
+void kop_server_delete(kop_server *s) {
+  s->port = 0;
+
+  kop_vector_foreach(kop_static_mount, s->statics, m) {
+    free(m->prefix);
+    free(m->dir);
+  }
+  kop_vector_free(s->statics);
+
+  for (size_t i = 0; i < s->nreactors; i++) {
+    kop_reactor_delete(&s->reactors[i]);
+  }
+  free(s->reactors);
+  s->reactors = NULL;
+  s->nreactors = 0;
+
+  kop_router_free(&s->router);
+}
+
+kop_error kop_route(kop_server *s, kop_http_method method, const char *path,
+                    kop_handler_func handler_func,
+                    const kop_route_opts *opts) {
+  kop_error err = kop_router_add(&s->router, method, path, handler_func, opts);
+  if (err == NOERROR && opts != NULL && opts->offload) {
+    s->offload = true;
+  }
+  return err;
+}
+
+kop_error kop_get(kop_server *s, const char *path,
+                  kop_handler_func handler_func) {
+  return kop_route(s, HTTP_GET, path, handler_func, NULL);
+}
+
+kop_error kop_post(kop_server *s, const char *path,
+                   kop_handler_func handler_func) {
+  return kop_route(s, HTTP_POST, path, handler_func, NULL);
+}
+
+kop_error kop_put(kop_server *s, const char *path,
+                  kop_handler_func handler_func) {
+  return kop_route(s, HTTP_PUT, path, handler_func, NULL);
+}
+
+kop_error kop_patch(kop_server *s, const char *path,
+                    kop_handler_func handler_func) {
+  return kop_route(s, HTTP_PATCH, path, handler_func, NULL);
+}
+
+kop_error kop_delete(kop_server *s, const char *path,
+                     kop_handler_func handler_func) {
+  return kop_route(s, HTTP_DELETE, path, handler_func, NULL);
+}
+
+static void kop_static_handler(kop_context *ctx, void *data) {
+  kop_server *s = data;
+
+  // the route only tells us that some mount matched, the longest prefix is
+  // the one whose route the router picked
+  kop_static_mount *mount = NULL;
+  kop_vector_foreach(kop_static_mount, s->statics, m) {
+    if (ctx->req->path.len >= m->prefix_len &&
+        memcmp(ctx->req->path.data, m->prefix, m->prefix_len) == 0 &&
+        (mount == NULL || m->prefix_len > mount->prefix_len)) {
+      mount = m;
+    }
+  }
+
+  if (mount == NULL) {
+    ctx->resp->code = HTTP_NOT_FOUND;
+    return;
+  }
+
+  kop_error err =
+      kop_file_serve(&ctx->reactor->files, ctx->req, ctx->resp, ctx->arena,
+                     mount->dir, kop_param(ctx, "path"), ctx->encoding);
+  if (err != NOERROR) {
+    KOP_DEBUG_LOG("error serving file: %s", KOP_STRERROR(err));
+    ctx->resp->code = HTTP_INTERNAL_SERVER_ERROR;
+  }
+}
+
+kop_error kop_static(kop_server *s, const char *prefix, const char *dir) {
+  size_t prefix_len = strlen(prefix);
+  while (prefix_len > 0 && prefix[prefix_len - 1] == '/') {
+    prefix_len--;
+  }
+
+  kop_static_mount mount = {
+      .prefix = malloc(prefix_len + sizeof("/*path")),
+      .prefix_len = prefix_len + 1,
+      .dir = strdup(dir),
+  };
+  if (mount.prefix == NULL || mount.dir == NULL) {
+    free(mount.prefix);
+    free(mount.dir);
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  // the route is "<prefix>/*path", the mount keeps "<prefix>/"
+  memcpy(mount.prefix, prefix, prefix_len);
+  memcpy(mount.prefix + prefix_len, "/*path", sizeof("/*path"));
+
+  kop_error err = kop_route(s, HTTP_GET, mount.prefix, kop_static_handler,
+                            &(kop_route_opts){.compress = true, .data = s});
+  mount.prefix[mount.prefix_len] = '\0';
+  if (err != NOERROR) {
+    free(mount.prefix);
+    free(mount.dir);
+    return err;
+  }
+
+  if (s->statics.data == NULL) {
+    kop_vector_init(kop_static_mount, s->statics);
+  }
+  kop_vector_append(kop_static_mount, s->statics, mount);
+
+  return NOERROR;
+}
+
+static void kop_metrics_handler(kop_context *ctx, void *data) {
+  kop_server *s = data;
+  ctx->resp->code = HTTP_INTERNAL_SERVER_ERROR;
+
+  kop_metrics total;
+  if (kop_metrics_init(&total, s->router.routes.len) != NOERROR) {
+    return;
+  }
+  for (size_t i = 0; i < s->nreactors; i++) {
+    kop_metrics_sum(&total, &s->reactors[i].metrics);
+  }
+
+  size_t len;
+  char *text = kop_metrics_format(&total, s->router.routes.data, &len);
+  kop_metrics_free(&total);
+  if (text == NULL) {
+    return;
+  }
+
+  char *body = kop_alloc(ctx, len);
+  if (body != NULL) {
+    memcpy(body, text, len);
+    kop_set_header(ctx, "Content-Type", "text/plain; version=0.0.4");
+    kop_send(ctx, HTTP_OK, body, len);
+  }
+  free(text);
+}
+
+kop_error kop_serve_metrics(kop_server *s, const char *path) {
+  return kop_route(s, HTTP_GET, path, kop_metrics_handler,
+                   &(kop_route_opts){.data = s});
+}
+
+static void kop_trace_handler(kop_context *ctx, void *data) {
+  const char *text = "{\"traceEvents\":[]}\n";
+  size_t len = strlen(text);
+#if defined(KOP_TRACE)
+  kop_server *s = data;
+  ctx->resp->code = HTTP_INTERNAL_SERVER_ERROR;
+
+  kop_tracer **tracers = kop_server_tracers(s);
+  if (tracers == NULL) {
+    return;
+  }
+  char *json = kop_trace_format(tracers, s->nreactors, &s->router.routes,
+                                &len);
+  free(tracers);
+  if (json == NULL) {
+    return;
+  }
+  text = json;
+#else
+  (void)data;
+#endif
+
+  char *body = kop_alloc(ctx, len);
+  if (body != NULL) {
+    memcpy(body, text, len);
+    kop_set_header(ctx, "Content-Type", "application/json");
+    kop_send(ctx, HTTP_OK, body, len);
+  }
+#if defined(KOP_TRACE)
+  free(json);
+#endif
+}
 
-  kop_vector_append(kop_handler, s->handlers, handler);
+kop_error kop_serve_trace(kop_server *s, const char *path) {
+  return kop_route(s, HTTP_GET, path, kop_trace_handler,
+                   &(kop_route_opts){.compress = true, .data = s});
 }
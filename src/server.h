@@ -1,15 +1,28 @@
 #ifndef KOP_SERVER_H_
 #define KOP_SERVER_H_
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include "arena.h"
+#include "cache.h"
+#include "compress.h"
+#include "conn.h"
+#include "file.h"
 #include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
 #include "queue.h"
+#include "router.h"
+#include "timer.h"
+#include "trace.h"
 #include "utils.h"
 
 struct kop_server;
+struct kop_reactor;
 
 typedef struct kop_address {
   const char *ip;
@@ -18,42 +31,245 @@ typedef struct kop_address {
 
 typedef struct kop_context {
   struct kop_server *server;
-  kop_http_request req;
-  kop_http_response resp;
+  // reactor the request is served on
+  struct kop_reactor *reactor;
+  kop_http_request *req;
+  // filled in by the handler and sent by the server once it returns
+  kop_http_response *resp;
   int client_sock;
+  // released as a whole once the request is served
+  kop_arena *arena;
+  // values of the :param and *wildcard segments of the matched route
+  kop_route_params *params;
+  // slot for the state of a streaming route, NULL when its first on_body call
+  // runs and kept until its handler returns, e.g. for the file an upload
+  // goes to. Memory from kop_alloc lives that long as well.
+  void **body_state;
+  // content coding the response may use, identity unless the route
+  // compresses and the client accepts one of the codings compiled in
+  kop_encoding encoding;
 } kop_context;
 
-typedef void (*kop_handler_func)(kop_context);
+// Allocates memory that stays valid until the response has been sent, e.g.
+// for a response body. It must not be freed.
+static inline void *kop_alloc(kop_context *ctx, size_t size) {
+  return kop_arena_alloc(ctx->arena, size);
+}
 
-typedef struct kop_handler {
-  kop_http_method method;
-  const char *path;
-  kop_handler_func handler;
-} kop_handler;
+// Adds a response header. Both strings have to outlive the response, use
+// literals or memory from kop_alloc.
+static inline void kop_set_header(kop_context *ctx, const char *header,
+                                  const char *value) {
+  kop_http_response_add_header(ctx->resp, ctx->arena, header, value);
+}
 
-typedef struct kop_handlers {
-  kop_handler *data;
-  size_t cap;
-  size_t len;
-} kop_handlers;
+// Value of the route parameter `name`, an empty view if the route has none.
+static inline kop_str kop_param(kop_context *ctx, const char *name) {
+  for (size_t i = 0; i < ctx->params->len; i++) {
+    if (kop_str_eq(ctx->params->data[i].name, name)) {
+      return ctx->params->data[i].value;
+    }
+  }
+  return (kop_str){0};
+}
+
+// Sets the status and body of the response. The body is not copied.
+static inline void kop_send(kop_context *ctx, kop_http_code code,
+                            const char *body, size_t body_len) {
+  ctx->resp->code = code;
+  ctx->resp->body = body;
+  ctx->resp->body_len = body_len;
+}
+
+// Starts a streamed response for bodies that are large or generated on the
+// fly. The head goes out once the handler returns, then `producer` is called
+// with `state` to write the body with kop_write, and called again each time
+// everything it wrote so far has reached the socket, so a slow client slows
+// the producer down instead of the output piling up. Every call has to write
+// something or end the body with kop_stream_end. `state` is best allocated
+// with kop_alloc, the request stays in flight until the body ends.
+static inline void kop_stream(kop_context *ctx, kop_http_code code,
+                              kop_stream_func producer, void *state) {
+  ctx->resp->code = code;
+  ctx->resp->stream = producer;
+  ctx->resp->stream_state = state;
+}
+
+// Appends to the body of a streamed response, only valid in its producer.
+// The data is copied.
+kop_error kop_write(kop_context *ctx, const char *data, size_t len);
+// Ends the body of a streamed response after the current producer call.
+void kop_stream_end(kop_context *ctx);
 
 typedef void (*shutdown_func)(int);
 
-typedef struct kop_server {
+typedef struct kop_fds {
+  int *data;
+  size_t len;
+  size_t cap;
+} kop_fds;
+
+// A reactor is a single event loop pinned to its own thread. Every reactor
+// owns a listening socket bound with SO_REUSEPORT and its own queue, so the
+// kernel spreads incoming connections between them and nothing is shared on
+// the hot path except the read-only route tree.
+typedef struct kop_reactor {
+  struct kop_server *server;
+  size_t id;
   int sock_fd;
+  // held in reserve and given up to turn away the connections in the
+  // backlog while the process is out of descriptors, -1 if it couldn't be
+  // opened again
+  int spare_fd;
+  // when to try accepting again after running out of descriptors or
+  // memory, kop_now_ms. 0 while accepting.
+  uint64_t accept_retry;
+  kop_queue queue;
+  kop_conns conns;
+  kop_arena_pool arenas;
+  kop_file_cache files;
+  kop_response_cache responses;
+  // connections that used up their write budget and continue on the next
+  // loop iteration
+  kop_fds resume;
+  // deadlines of all connections
+  kop_timer_wheel timers;
+  kop_metrics metrics;
+  // where served requests are recorded, NULL without an access log
+  kop_access_ring *log;
+#if defined(KOP_TRACE)
+  kop_tracer tracer;
+#endif
+  // jobs of connections whose offloaded handler is done, pushed by the pool
+  // workers, taken by the reactor after its queue woke it up
+  kop_job *offloaded;
+#if defined(KOP_URING)
+  // connections closed while io_uring operations were still in flight
+  kop_conn *dead;
+#endif
+  pthread_t thread;
+  kop_error err;
+} kop_reactor;
+
+typedef struct kop_config {
+  // requests served on a single keep-alive connection before it is closed,
+  // 0 means no limit
+  size_t max_requests_per_conn;
+  // largest request body of routes without a limit of their own, 0 means no
+  // limit. Buffered bodies take this much memory at most.
+  size_t max_body_size;
+  // largest request line and headers together, larger ones are answered
+  // with a 431 before the buffer grows any further. 0 means no limit.
+  size_t max_header_size;
+  // Timeouts in milliseconds, 0 disables one. The header timeout covers a
+  // whole request line and headers, body and write timeouts apply between
+  // two successful reads or writes, the keep-alive timeout to an idle
+  // connection waiting for its next request.
+  size_t header_timeout_ms;
+  size_t body_timeout_ms;
+  size_t write_timeout_ms;
+  size_t keepalive_timeout_ms;
+  // open files kept by every reactor for kop_static, 0 disables the cache
+  size_t static_cache_size;
+  // bytes of serialized responses every reactor keeps for routes with a
+  // cache_ttl_ms, 0 disables the cache
+  size_t response_cache_size;
+  // threads of the pool offloaded routes run on, it is only started if a
+  // route asks for it
+  size_t offload_threads;
+  // event notification mechanism of the reactors, falls back to epoll when
+  // io_uring is unavailable
+  kop_backend backend;
+  // connections the kernel queues on every reactor's socket until they are
+  // accepted, capped by net.core.somaxconn
+  size_t listen_backlog;
+  // readiness events taken from the queue with a single wait
+  size_t max_events;
+  // seconds the kernel holds a new connection back until its first bytes
+  // arrive, so no reactor wakes up for an empty one. Linux only, 0 disables
+  // it.
+  size_t defer_accept_s;
+  // TCP Fast Open queue length, returning clients may send their request
+  // along with the SYN. 0 disables it.
+  size_t fastopen_queue;
+  // open connections of the whole server, split evenly between the
+  // reactors. Those over the limit are answered with a 503 and closed right
+  // away, 0 means no limit.
+  size_t max_connections;
+  // file every served request is appended to, NULL disables the access log.
+  // SIGHUP makes the server reopen it.
+  const char *access_log;
+  // with KOP_TRACE, one request in this many has the time its phases took
+  // recorded, 0 records none. The spans are written to `trace_path`, when
+  // set, once the server stops.
+  size_t trace_every;
+  const char *trace_path;
+} kop_config;
+
+// A directory served by kop_static.
+typedef struct kop_static_mount {
+  // URL prefix including the trailing '/'
+  char *prefix;
+  size_t prefix_len;
+  char *dir;
+} kop_static_mount;
+
+typedef struct kop_static_mounts {
+  kop_static_mount *data;
+  size_t len;
+  size_t cap;
+} kop_static_mounts;
+
+typedef struct kop_server {
   uint16_t port;
-  kop_handlers handlers;
+  // defaults are filled in by kop_server_new, tweak before kop_server_run
+  kop_config config;
+  kop_router router;
+  kop_static_mounts statics;
   shutdown_func shutdown;
-  kop_queue queue;
+  kop_reactor *reactors;
+  size_t nreactors;
+  kop_pool pool;
+  // only open while kop_server_run runs
+  kop_access_log log;
+  // SIGHUP handler from before the access log was opened, put back once it
+  // is closed
+  void (*prev_sighup)(int);
+  // some route is offloaded, the pool has to run
+  bool offload;
 } kop_server;
 
-kop_error kop_server_new(kop_server *s, uint16_t port);
+// `workers` is the number of reactor threads, 0 means one per online CPU.
+kop_error kop_server_new(kop_server *s, uint16_t port, size_t workers);
 kop_error kop_server_run(kop_server *s);
 void kop_server_delete(kop_server *s);
 
-void kop_get(kop_server *s, const char *path, kop_handler_func handler);
-void kop_post(kop_server *s, const char *path, kop_handler_func handler);
-void kop_put(kop_server *s, const char *path, kop_handler_func handler);
-void kop_delete(kop_server *s, const char *path, kop_handler_func handler);
+// Routes have to be registered before kop_server_run. Paths may contain
+// `:name` segments and end with a `*name` segment, see kop_router_add. GET
+// routes answer HEAD as well, without sending the body, and OPTIONS is
+// answered with the methods a path allows unless it has a route of its own.
+kop_error kop_get(kop_server *s, const char *path, kop_handler_func handler);
+kop_error kop_post(kop_server *s, const char *path, kop_handler_func handler);
+kop_error kop_put(kop_server *s, const char *path, kop_handler_func handler);
+kop_error kop_patch(kop_server *s, const char *path,
+                    kop_handler_func handler);
+kop_error kop_delete(kop_server *s, const char *path,
+                     kop_handler_func handler);
+// Registers a route with options, e.g. its own body limit, a streamed body or
+// the data its handler gets. The shorthands above pass NULL.
+kop_error kop_route(kop_server *s, kop_http_method method, const char *path,
+                    kop_handler_func handler, const kop_route_opts *opts);
+// Serves the files below `dir` for GET requests under `prefix`, e.g.
+// kop_static(s, "/assets", "./public") maps /assets/app.js to
+// ./public/app.js. A path ending in '/' serves index.html.
+kop_error kop_static(kop_server *s, const char *prefix, const char *dir);
+// Serves the counters and latency histograms of all reactors for GET
+// requests to `path` in the Prometheus text format, e.g.
+// kop_serve_metrics(s, "/metrics").
+kop_error kop_serve_metrics(kop_server *s, const char *path);
+// Serves the latest traced requests of all reactors for GET requests to
+// `path` as Chrome trace JSON, which Perfetto and chrome://tracing load.
+// Without KOP_TRACE the trace is empty.
+kop_error kop_serve_trace(kop_server *s, const char *path);
 
 #endif // KOP_SERVER_H_
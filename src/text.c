@@ -0,0 +1,39 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "text.h"
+
+void kop_text_init(kop_text *t, size_t cap) {
+  *t = (kop_text){.data = malloc(cap), .cap = cap};
+}
+
+void kop_text_printf(kop_text *t, const char *fmt, ...) {
+  for (;;) {
+    if (t->data == NULL) {
+      return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(t->data + t->len, t->cap - t->len, fmt, args);
+    va_end(args);
+    if (n < 0) {
+      return;
+    }
+    if ((size_t)n < t->cap - t->len) {
+      t->len += n;
+      return;
+    }
+
+    size_t cap = t->cap * 2 > t->len + n + 1 ? t->cap * 2 : t->len + n + 1;
+    char *data = realloc(t->data, cap);
+    if (data == NULL) {
+      free(t->data);
+      *t = (kop_text){0};
+      return;
+    }
+    t->data = data;
+    t->cap = cap;
+  }
+}
@@ -0,0 +1,19 @@
+#ifndef KOP_TEXT_H_
+#define KOP_TEXT_H_
+
+#include <stddef.h>
+
+// Text that grows as it is written to, `data` is NULL after a failed
+// allocation and every further write is dropped, so only the result has to
+// be checked.
+typedef struct kop_text {
+  char *data;
+  size_t len;
+  size_t cap;
+} kop_text;
+
+// Starts out with room for `cap` bytes.
+void kop_text_init(kop_text *t, size_t cap);
+void kop_text_printf(kop_text *t, const char *fmt, ...);
+
+#endif // !KOP_TEXT_H_
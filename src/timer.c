@@ -0,0 +1,144 @@
+#include <limits.h>
+
+#include "timer.h"
+#include "utils.h"
+
+#define LEVEL_SHIFT(level) (KOP_TIMER_WHEEL_BITS * (level))
+
+static inline bool slot_empty(kop_timer *head) { return head->next == head; }
+
+static inline void list_append(kop_timer *head, kop_timer *t) {
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+// Moves everything in `from` to the end of `to`.
+static void list_splice(kop_timer *from, kop_timer *to) {
+  if (slot_empty(from)) {
+    return;
+  }
+
+  from->next->prev = to->prev;
+  to->prev->next = from->next;
+  from->prev->next = to;
+  to->prev = from->prev;
+  kop_timer_init(from);
+}
+
+void kop_timer_wheel_init(kop_timer_wheel *w, uint64_t now) {
+  w->now = now;
+  for (size_t level = 0; level < KOP_TIMER_WHEEL_LEVELS; level++) {
+    for (size_t i = 0; i < KOP_TIMER_WHEEL_SLOTS; i++) {
+      kop_timer_init(&w->slots[level][i]);
+    }
+  }
+}
+
+static void wheel_insert(kop_timer_wheel *w, kop_timer *t) {
+  // anything already due fires on the next tick
+  if (t->expires <= w->now) {
+    t->expires = w->now + 1;
+  }
+
+  uint64_t delta = t->expires - w->now;
+  size_t level = 0;
+  while (level < KOP_TIMER_WHEEL_LEVELS - 1 &&
+         delta >= (uint64_t)1 << LEVEL_SHIFT(level + 1)) {
+    level++;
+  }
+
+  uint64_t max = ((uint64_t)1 << LEVEL_SHIFT(KOP_TIMER_WHEEL_LEVELS)) - 1;
+  if (delta > max) {
+    t->expires = w->now + max;
+  }
+
+  size_t idx = (t->expires >> LEVEL_SHIFT(level)) & KOP_TIMER_WHEEL_MASK;
+  list_append(&w->slots[level][idx], t);
+}
+
+void kop_timer_wheel_add(kop_timer_wheel *w, kop_timer *t, uint64_t expires) {
+  kop_timer_cancel(t);
+  t->expires = expires;
+  wheel_insert(w, t);
+}
+
+// Redistributes a slot of a higher level over the levels below it, its
+// timers are now less than a slot of that level away.
+static size_t cascade(kop_timer_wheel *w, size_t level) {
+  size_t idx = (w->now >> LEVEL_SHIFT(level)) & KOP_TIMER_WHEEL_MASK;
+
+  kop_timer pending;
+  kop_timer_init(&pending);
+  list_splice(&w->slots[level][idx], &pending);
+
+  while (!slot_empty(&pending)) {
+    kop_timer *t = pending.next;
+    kop_timer_cancel(t);
+    wheel_insert(w, t);
+  }
+
+  return idx;
+}
+
+static bool wheel_empty(kop_timer_wheel *w) {
+  for (size_t level = 0; level < KOP_TIMER_WHEEL_LEVELS; level++) {
+    for (size_t i = 0; i < KOP_TIMER_WHEEL_SLOTS; i++) {
+      if (!slot_empty(&w->slots[level][i])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void kop_timer_wheel_advance(kop_timer_wheel *w, uint64_t now,
+                             kop_timer *expired) {
+  if (now <= w->now) {
+    return;
+  }
+
+  // nothing to cascade, e.g. after the reactor slept with no connections
+  if (wheel_empty(w)) {
+    w->now = now;
+    return;
+  }
+
+  while (w->now < now) {
+    w->now++;
+
+    // a lower level wrapping around pulls the next slot of the one above
+    for (size_t level = 1;
+         level < KOP_TIMER_WHEEL_LEVELS &&
+         ((w->now >> LEVEL_SHIFT(level - 1)) & KOP_TIMER_WHEEL_MASK) == 0;
+         level++) {
+      cascade(w, level);
+    }
+
+    list_splice(&w->slots[0][w->now & KOP_TIMER_WHEEL_MASK], expired);
+  }
+}
+
+int kop_timer_wheel_timeout(kop_timer_wheel *w) {
+  // level 0 holds exact deadlines
+  for (uint64_t i = 1; i <= KOP_TIMER_WHEEL_SLOTS; i++) {
+    if (!slot_empty(&w->slots[0][(w->now + i) & KOP_TIMER_WHEEL_MASK])) {
+      return (int)i;
+    }
+  }
+
+  // higher levels only tell when their slot gets cascaded
+  for (size_t level = 1; level < KOP_TIMER_WHEEL_LEVELS; level++) {
+    uint64_t block = w->now >> LEVEL_SHIFT(level);
+    for (uint64_t i = 1; i <= KOP_TIMER_WHEEL_SLOTS; i++) {
+      if (!slot_empty(&w->slots[level][(block + i) & KOP_TIMER_WHEEL_MASK])) {
+        uint64_t at = (block + i) << LEVEL_SHIFT(level);
+        uint64_t delta = at - w->now;
+        return delta > INT_MAX ? INT_MAX : (int)delta;
+      }
+    }
+  }
+
+  return -1;
+}
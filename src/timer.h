@@ -0,0 +1,82 @@
+#ifndef KOP_TIMER_H_
+#define KOP_TIMER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "utils.h"
+
+#define KOP_TIMER_WHEEL_BITS 6
+#define KOP_TIMER_WHEEL_SLOTS (1 << KOP_TIMER_WHEEL_BITS)
+#define KOP_TIMER_WHEEL_MASK (KOP_TIMER_WHEEL_SLOTS - 1)
+// 4 levels of 64 slots with 1 ms ticks cover about 4.6 hours, longer timers
+// are clamped
+#define KOP_TIMER_WHEEL_LEVELS 4
+
+// Intrusive timer, embedded in whatever it times out. An unlinked timer
+// points to itself.
+typedef struct kop_timer {
+  struct kop_timer *next;
+  struct kop_timer *prev;
+  // absolute deadline in milliseconds of kop_now_ms
+  uint64_t expires;
+} kop_timer;
+
+// Hierarchical timing wheel. Adding, moving and cancelling a timer are O(1)
+// list operations that never allocate, timers further out than the current
+// level are cascaded down as time passes.
+typedef struct kop_timer_wheel {
+  uint64_t now;
+  kop_timer slots[KOP_TIMER_WHEEL_LEVELS][KOP_TIMER_WHEEL_SLOTS];
+} kop_timer_wheel;
+
+// Monotonic milliseconds. Uses the coarse clocks, which are read from the
+// vDSO without a syscall and are precise enough for timeouts.
+static inline uint64_t kop_now_ms(void) {
+  struct timespec ts;
+#if defined(CLOCK_MONOTONIC_COARSE)
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#elif defined(CLOCK_MONOTONIC_FAST)
+  clock_gettime(CLOCK_MONOTONIC_FAST, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Monotonic microseconds from the precise clock, for measuring latencies.
+static inline uint64_t kop_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static inline void kop_timer_init(kop_timer *t) {
+  t->next = t;
+  t->prev = t;
+}
+
+static inline bool kop_timer_pending(kop_timer *t) { return t->next != t; }
+
+static inline void kop_timer_cancel(kop_timer *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  kop_timer_init(t);
+}
+
+void kop_timer_wheel_init(kop_timer_wheel *w, uint64_t now);
+// (Re)arms `t` to fire at `expires`, cancelling it first if it is pending.
+void kop_timer_wheel_add(kop_timer_wheel *w, kop_timer *t, uint64_t expires);
+// Moves the wheel forward to `now` and appends every timer that fired to the
+// list headed by `expired`. Timers stay linked there until the caller takes
+// them off, cancelling or re-adding one simply drops it from the list.
+void kop_timer_wheel_advance(kop_timer_wheel *w, uint64_t now,
+                             kop_timer *expired);
+// Milliseconds until the wheel has to be advanced next, -1 when it is empty.
+// May be earlier than the next deadline when a higher level has to be
+// cascaded first.
+int kop_timer_wheel_timeout(kop_timer_wheel *w);
+
+#endif // !KOP_TIMER_H_
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http.h"
+#include "text.h"
+#include "trace.h"
+#include "utils.h"
+
+#if defined(KOP_TRACE)
+
+// names of the phases ending at each mark
+static const char *const phase_names[kop_trace_mark_count] = {
+    [KOP_TRACE_START] = "wait",
+    [KOP_TRACE_HEADERS] = "headers",
+    [KOP_TRACE_ROUTED] = "route",
+    [KOP_TRACE_BODY] = "body",
+    [KOP_TRACE_HANDLED] = "handler",
+    [KOP_TRACE_QUEUED] = "respond",
+    [KOP_TRACE_WRITTEN] = "write",
+};
+
+kop_error kop_tracer_init(kop_tracer *t, size_t every) {
+  *t = (kop_tracer){.every = every, .countdown = every};
+  pthread_mutex_init(&t->lock, NULL);
+  if (every == 0) {
+    return NOERROR;
+  }
+
+  t->spans = malloc(sizeof(kop_trace_span) * KOP_TRACE_SPANS);
+  if (t->spans == NULL) {
+    pthread_mutex_destroy(&t->lock);
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  return NOERROR;
+}
+
+void kop_tracer_free(kop_tracer *t) {
+  free(t->spans);
+  pthread_mutex_destroy(&t->lock);
+  *t = (kop_tracer){0};
+}
+
+void kop_tracer_commit(kop_tracer *t, const kop_trace_span *span) {
+  pthread_mutex_lock(&t->lock);
+  t->spans[t->len % KOP_TRACE_SPANS] = *span;
+  t->len++;
+  pthread_mutex_unlock(&t->lock);
+}
+
+// Route patterns are the server's own, but nothing keeps them from having
+// a quote in them.
+static void text_string(kop_text *t, const char *s) {
+  kop_text_printf(t, "\"");
+  for (; *s != '\0'; s++) {
+    unsigned char ch = (unsigned char)*s;
+    if (ch < ' ' || ch == '"' || ch == '\\') {
+      kop_text_printf(t, "\\u%04x", ch);
+    } else {
+      kop_text_printf(t, "%c", ch);
+    }
+  }
+  kop_text_printf(t, "\"");
+}
+
+static void text_event(kop_text *t, const char *name, size_t pid, int tid,
+                       uint64_t from, uint64_t to) {
+  kop_text_printf(t,
+                  ",\n{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"X\","
+                  "\"pid\":%zu,\"tid\":%d,\"ts\":%llu,\"dur\":%llu}",
+                  name, pid, tid, (unsigned long long)from,
+                  (unsigned long long)(to - from));
+}
+
+// A span becomes a "request" event from its first byte until it was
+// written, with an event for every phase inside it. The wait for the
+// request comes before it.
+static void text_span(kop_text *t, size_t pid, const kop_trace_span *span,
+                      const kop_route_infos *routes) {
+  const uint64_t *at = span->at;
+  uint64_t end = at[KOP_TRACE_WRITTEN] > 0 ? at[KOP_TRACE_WRITTEN]
+                                           : at[KOP_TRACE_QUEUED];
+
+  kop_text_printf(t,
+                  ",\n{\"name\":\"request\",\"cat\":\"http\",\"ph\":\"X\","
+                  "\"pid\":%zu,\"tid\":%d,\"ts\":%llu,\"dur\":%llu,\"args\":{"
+                  "\"method\":\"%s\",\"status\":%u,\"parse_us\":%llu,"
+                  "\"route\":",
+                  pid, span->fd, (unsigned long long)at[KOP_TRACE_START],
+                  (unsigned long long)(end - at[KOP_TRACE_START]),
+                  span->method < kop_http_method_count
+                      ? kop_http_method_str[span->method]
+                      : "-",
+                  span->status, (unsigned long long)span->parse_us);
+  if (span->route < routes->len) {
+    text_string(t, routes->data[span->route].path);
+  } else {
+    kop_text_printf(t, "null");
+  }
+  kop_text_printf(t, "}}");
+
+  if (at[KOP_TRACE_IDLE] > 0) {
+    text_event(t, span->first ? "accept" : "wait", pid, span->fd,
+               at[KOP_TRACE_IDLE], at[KOP_TRACE_START]);
+  }
+  uint64_t from = at[KOP_TRACE_START];
+  for (size_t i = KOP_TRACE_HEADERS; i < kop_trace_mark_count; i++) {
+    if (at[i] == 0) {
+      continue;
+    }
+    text_event(t, phase_names[i], pid, span->fd, from, at[i]);
+    from = at[i];
+  }
+}
+
+char *kop_trace_format(kop_tracer *const *tracers, size_t n,
+                       const kop_route_infos *routes, size_t *len) {
+  kop_text t;
+  kop_text_init(&t, 4096);
+
+  // the metadata event leads so every one after it starts with a comma
+  kop_text_printf(&t, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                      "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+                      "\"args\":{\"name\":\"reactor 0\"}}");
+  for (size_t i = 0; i < n; i++) {
+    kop_tracer *tracer = tracers[i];
+    if (i > 0) {
+      kop_text_printf(&t,
+                      ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%zu,"
+                      "\"args\":{\"name\":\"reactor %zu\"}}",
+                      i, i);
+    }
+
+    pthread_mutex_lock(&tracer->lock);
+    size_t first = tracer->len > KOP_TRACE_SPANS
+                       ? tracer->len - KOP_TRACE_SPANS
+                       : 0;
+    for (size_t j = first; j < tracer->len; j++) {
+      text_span(&t, i, &tracer->spans[j % KOP_TRACE_SPANS], routes);
+    }
+    pthread_mutex_unlock(&tracer->lock);
+  }
+  kop_text_printf(&t, "\n]}\n");
+
+  *len = t.len;
+  return t.data;
+}
+
+kop_error kop_trace_dump(kop_tracer *const *tracers, size_t n,
+                         const kop_route_infos *routes, const char *path) {
+  size_t len;
+  char *text = kop_trace_format(tracers, n, routes, &len);
+  if (text == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    free(text);
+    return ERR_OPENING_FILE;
+  }
+  size_t written = fwrite(text, 1, len, f);
+  free(text);
+  if (fclose(f) != 0 || written != len) {
+    return ERR_WRITING_DATA;
+  }
+
+  return NOERROR;
+}
+
+#endif
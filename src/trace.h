@@ -0,0 +1,199 @@
+#ifndef KOP_TRACE_H_
+#define KOP_TRACE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "router.h"
+#include "timer.h"
+#include "utils.h"
+
+// Per-request phase tracing, built with KOP_TRACE (cmake -DKOP_WITH_TRACE=ON).
+// Without it every KOP_TRACE_* macro expands to nothing and connections and
+// reactors carry none of the state.
+
+// sampled requests a reactor keeps, the oldest are overwritten
+#define KOP_TRACE_SPANS 4096
+// default for kop_config.trace_every
+#define KOP_TRACE_EVERY 100
+
+// Points in the life of a request. The phase ending at a mark is named after
+// it, marks a request never reached are skipped.
+typedef enum kop_trace_mark {
+  // accepted, or the response to the previous request was queued
+  KOP_TRACE_IDLE = 0,
+  // the first byte of the request was seen
+  KOP_TRACE_START,
+  // the request line and headers are in, before the route lookup
+  KOP_TRACE_HEADERS,
+  KOP_TRACE_ROUTED,
+  // the whole body is in
+  KOP_TRACE_BODY,
+  // the handler returned
+  KOP_TRACE_HANDLED,
+  // the response was queued, for a streamed one its last chunk
+  KOP_TRACE_QUEUED,
+  // the socket took the last byte of the response
+  KOP_TRACE_WRITTEN,
+  kop_trace_mark_count,
+} kop_trace_mark;
+
+// Timestamps of a single request, kop_now_us. Zero for marks it didn't reach.
+typedef struct kop_trace_span {
+  uint64_t at[kop_trace_mark_count];
+  // time spent in parse_http_request, which is spread over the reads
+  uint64_t parse_us;
+  uint64_t parse_from;
+  int fd;
+  // index into the routes of the router, UINT32_MAX if none
+  uint32_t route;
+  uint16_t status;
+  // a kop_http_method, HTTP_BAD_METHOD when the request line didn't parse
+  uint8_t method;
+  // the first request of its connection, the idle phase is the accept
+  bool first;
+  bool sampled;
+} kop_trace_span;
+
+#if defined(KOP_TRACE)
+
+// Spans a single reactor recorded. Only the reactor writes them, the lock
+// is taken once per sampled request and keeps a dump from reading a span
+// that is half written.
+typedef struct kop_tracer {
+  kop_trace_span *spans;
+  // spans recorded so far, the latest KOP_TRACE_SPANS of them are kept
+  size_t len;
+  // every how many requests one is sampled, 0 for none
+  size_t every;
+  size_t countdown;
+  pthread_mutex_t lock;
+} kop_tracer;
+
+kop_error kop_tracer_init(kop_tracer *t, size_t every);
+void kop_tracer_free(kop_tracer *t);
+// Keeps a finished span.
+void kop_tracer_commit(kop_tracer *t, const kop_trace_span *span);
+// Renders the spans of `n` tracers in the Chrome trace event format, every
+// reactor a process and every connection a thread. Returns a buffer to be
+// freed by the caller, NULL when out of memory.
+char *kop_trace_format(kop_tracer *const *tracers, size_t n,
+                       const kop_route_infos *routes, size_t *len);
+// Writes what kop_trace_format renders to `path`.
+kop_error kop_trace_dump(kop_tracer *const *tracers, size_t n,
+                         const kop_route_infos *routes, const char *path);
+
+// Whether the request starting now is one to trace. Costs a decrement for
+// the others.
+static inline bool kop_tracer_sample(kop_tracer *t) {
+  if (t->every == 0 || --t->countdown > 0) {
+    return false;
+  }
+  t->countdown = t->every;
+  return true;
+}
+
+static inline void kop_trace_begin(kop_tracer *t, kop_trace_span *span,
+                                   uint64_t idle, bool first) {
+  span->sampled = kop_tracer_sample(t);
+  if (!span->sampled) {
+    return;
+  }
+  for (size_t i = 0; i < kop_trace_mark_count; i++) {
+    span->at[i] = 0;
+  }
+  span->at[KOP_TRACE_IDLE] = idle;
+  span->at[KOP_TRACE_START] = kop_now_us();
+  span->parse_us = 0;
+  span->first = first;
+}
+
+// The response of the traced request is queued. Its span waits in `out`
+// until the socket took it, a response still waiting there is done as far
+// as tracing goes.
+static inline void kop_trace_queued(kop_tracer *t, kop_trace_span *span,
+                                    kop_trace_span *out, uint64_t now) {
+  if (out->sampled) {
+    out->at[KOP_TRACE_WRITTEN] = now;
+    kop_tracer_commit(t, out);
+  }
+  span->at[KOP_TRACE_QUEUED] = now;
+  *out = *span;
+  span->sampled = false;
+}
+
+static inline void kop_trace_written(kop_tracer *t, kop_trace_span *out) {
+  out->at[KOP_TRACE_WRITTEN] = kop_now_us();
+  kop_tracer_commit(t, out);
+  out->sampled = false;
+}
+
+// The reactor `r` starts on a new request on `c`.
+#define KOP_TRACE_BEGIN(r, c)                                                  \
+  kop_trace_begin(&(r)->tracer, &(c)->trace, (c)->trace_idle,                  \
+                  (c)->requests == 0)
+#define KOP_TRACE_MARK(c, mark)                                                \
+  do {                                                                         \
+    if ((c)->trace.sampled) {                                                  \
+      (c)->trace.at[mark] = kop_now_us();                                      \
+    }                                                                          \
+  } while (0)
+#define KOP_TRACE_PARSE_BEGIN(c)                                               \
+  do {                                                                         \
+    if ((c)->trace.sampled) {                                                  \
+      (c)->trace.parse_from = kop_now_us();                                    \
+    }                                                                          \
+  } while (0)
+#define KOP_TRACE_PARSE_END(c)                                                 \
+  do {                                                                         \
+    if ((c)->trace.sampled) {                                                  \
+      (c)->trace.parse_us += kop_now_us() - (c)->trace.parse_from;             \
+    }                                                                          \
+  } while (0)
+// The connection starts waiting for its next request at `now`.
+#define KOP_TRACE_IDLE_SINCE(c, now) ((c)->trace_idle = (now))
+// The response to the request in flight on `c` is queued at `now`, with
+// what the access log would record about it.
+#define KOP_TRACE_QUEUED(r, c, now, route_, method_)                           \
+  do {                                                                         \
+    if ((c)->trace.sampled) {                                                  \
+      (c)->trace.fd = (c)->fd;                                                 \
+      (c)->trace.status = (uint16_t)(c)->resp.code;                            \
+      (c)->trace.route = (route_);                                             \
+      (c)->trace.method = (method_);                                           \
+      kop_trace_queued(&(r)->tracer, &(c)->trace, &(c)->trace_out, (now));     \
+    }                                                                          \
+    (c)->trace_idle = (now);                                                   \
+  } while (0)
+// Finishes the span of a response the socket took completely.
+#define KOP_TRACE_WRITTEN(r, c)                                                \
+  do {                                                                         \
+    if ((c)->trace_out.sampled && !kop_conn_has_pending_output(c)) {           \
+      kop_trace_written(&(r)->tracer, &(c)->trace_out);                        \
+    }                                                                          \
+  } while (0)
+// A connection closing ends the span of its last response, whether the
+// client got all of it or not.
+#define KOP_TRACE_CLOSED(r, c)                                                 \
+  do {                                                                         \
+    if ((c)->trace_out.sampled) {                                              \
+      kop_trace_written(&(r)->tracer, &(c)->trace_out);                        \
+    }                                                                          \
+  } while (0)
+
+#else
+
+#define KOP_TRACE_BEGIN(r, c) ((void)0)
+#define KOP_TRACE_MARK(c, mark) ((void)0)
+#define KOP_TRACE_PARSE_BEGIN(c) ((void)0)
+#define KOP_TRACE_PARSE_END(c) ((void)0)
+#define KOP_TRACE_IDLE_SINCE(c, now) ((void)0)
+#define KOP_TRACE_QUEUED(r, c, now, route_, method_) ((void)0)
+#define KOP_TRACE_WRITTEN(r, c) ((void)0)
+#define KOP_TRACE_CLOSED(r, c) ((void)0)
+
+#endif // KOP_TRACE
+
+#endif // !KOP_TRACE_H_
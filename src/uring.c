@@ -0,0 +1,261 @@
+#include "uring.h"
+#include "utils.h"
+
+#if defined(KOP_URING)
+
+#include <errno.h>
+#include <linux/time_types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// liburing is not a dependency, the three syscalls are all we need
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags, void *arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nargs) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+bool kop_uring_supported(void) {
+  struct io_uring_params p = {0};
+  int fd = sys_setup(4, &p);
+  if (fd < 0) {
+    return false;
+  }
+
+  bool supported = false;
+  size_t len = sizeof(struct io_uring_probe) +
+               IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, len);
+  if (probe != NULL &&
+      sys_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+    // multishot recv came in the same release as SEND_ZC (6.0), which is the
+    // only way to tell it is there short of trying
+    static const unsigned ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV,
+                                   IORING_OP_SENDMSG, IORING_OP_POLL_ADD,
+                                   IORING_OP_READ, IORING_OP_SEND_ZC};
+    supported = (p.features & IORING_FEAT_EXT_ARG) != 0;
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+      if (ops[i] > probe->last_op ||
+          !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+        supported = false;
+      }
+    }
+  }
+
+  free(probe);
+  close(fd);
+
+  return supported;
+}
+
+static kop_error kop_uring_setup_bufs(kop_uring *u) {
+  u->buf_ring_size = KOP_URING_BUFS * sizeof(struct io_uring_buf);
+  void *ring = mmap(NULL, u->buf_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  u->buf_ring = ring;
+
+  u->bufs = malloc((size_t)KOP_URING_BUFS * KOP_URING_BUF_SIZE);
+  if (u->bufs == NULL) {
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  struct io_uring_buf_reg reg = {
+      .ring_addr = (uintptr_t)ring,
+      .ring_entries = KOP_URING_BUFS,
+      .bgid = KOP_URING_BGID,
+  };
+  if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return ERR_CREATING_QUEUE;
+  }
+
+  for (unsigned i = 0; i < KOP_URING_BUFS; i++) {
+    kop_uring_buf_recycle(u, i);
+  }
+
+  return NOERROR;
+}
+
+kop_error kop_uring_init(kop_uring *u) {
+  *u = (kop_uring){.fd = -1};
+
+  // only the reactor thread submits, which lets the kernel skip locking and
+  // run completion work right when we ask for events
+  struct io_uring_params p = {
+      .flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+               IORING_SETUP_DEFER_TASKRUN,
+      .cq_entries = KOP_URING_ENTRIES * 2,
+  };
+  int fd = sys_setup(KOP_URING_ENTRIES, &p);
+  if (fd < 0 && errno == EINVAL) {
+    // kernels before 6.1
+    p = (struct io_uring_params){
+        .flags = IORING_SETUP_CQSIZE,
+        .cq_entries = KOP_URING_ENTRIES * 2,
+    };
+    fd = sys_setup(KOP_URING_ENTRIES, &p);
+  }
+  if (fd < 0) {
+    return ERR_CREATING_QUEUE;
+  }
+  u->fd = fd;
+
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_ring_size > u->sq_ring_size) {
+      u->sq_ring_size = u->cq_ring_size;
+    }
+    u->cq_ring_size = 0;
+  }
+
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED) {
+    u->sq_ring = NULL;
+    kop_uring_free(u);
+    return ERR_CREATING_QUEUE;
+  }
+
+  if (u->cq_ring_size > 0) {
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED) {
+      u->cq_ring = NULL;
+      kop_uring_free(u);
+      return ERR_CREATING_QUEUE;
+    }
+  } else {
+    u->cq_ring = u->sq_ring;
+  }
+
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    u->sqes = NULL;
+    kop_uring_free(u);
+    return ERR_CREATING_QUEUE;
+  }
+
+  char *sq = u->sq_ring;
+  u->sq_head = (unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_local_tail = *u->sq_tail;
+  // SQEs are always consumed in order, so the indirection array is set up
+  // once as the identity
+  unsigned *array = (unsigned *)(sq + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; i++) {
+    array[i] = i;
+  }
+
+  char *cq = u->cq_ring;
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  kop_error err = kop_uring_setup_bufs(u);
+  if (err != NOERROR) {
+    kop_uring_free(u);
+    return err;
+  }
+
+  return NOERROR;
+}
+
+void kop_uring_free(kop_uring *u) {
+  if (u->fd >= 0) {
+    close(u->fd);
+  }
+  if (u->sqes != NULL) {
+    munmap(u->sqes, u->sqes_size);
+  }
+  if (u->cq_ring != NULL && u->cq_ring != u->sq_ring) {
+    munmap(u->cq_ring, u->cq_ring_size);
+  }
+  if (u->sq_ring != NULL) {
+    munmap(u->sq_ring, u->sq_ring_size);
+  }
+  if (u->buf_ring != NULL) {
+    munmap(u->buf_ring, u->buf_ring_size);
+  }
+  free(u->bufs);
+
+  *u = (kop_uring){.fd = -1};
+}
+
+void kop_uring_buf_recycle(kop_uring *u, unsigned bid) {
+  struct io_uring_buf *buf =
+      &u->buf_ring->bufs[u->buf_tail & (KOP_URING_BUFS - 1)];
+  buf->addr = (uintptr_t)kop_uring_buf(u, bid);
+  buf->len = KOP_URING_BUF_SIZE;
+  buf->bid = (unsigned short)bid;
+  u->buf_tail++;
+  __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+static unsigned kop_uring_pending(kop_uring *u) {
+  __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+  return u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *kop_uring_get_sqe(kop_uring *u) {
+  if (kop_uring_pending(u) > u->sq_mask) {
+    // full, hand what we have to the kernel without waiting
+    sys_enter(u->fd, kop_uring_pending(u), 0, 0, NULL, 0);
+    // it may have taken none of them, with EBUSY while the completion queue
+    // overflows, and the next SQE would overwrite one still queued
+    if (kop_uring_pending(u) > u->sq_mask) {
+      return NULL;
+    }
+  }
+
+  struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail & u->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_local_tail++;
+
+  return sqe;
+}
+
+kop_error kop_uring_submit_and_wait(kop_uring *u, int timeout_ms) {
+  unsigned to_submit = kop_uring_pending(u);
+  unsigned min_complete = timeout_ms != 0 && kop_uring_peek_cqe(u) == NULL;
+  unsigned flags = IORING_ENTER_GETEVENTS;
+
+  struct __kernel_timespec ts = {
+      .tv_sec = timeout_ms / 1000,
+      .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+  };
+  struct io_uring_getevents_arg arg = {.ts = (uintptr_t)&ts};
+  void *argp = NULL;
+  size_t argsz = 0;
+  if (min_complete > 0 && timeout_ms > 0) {
+    flags |= IORING_ENTER_EXT_ARG;
+    argp = &arg;
+    argsz = sizeof(arg);
+  }
+
+  if (sys_enter(u->fd, to_submit, min_complete, flags, argp, argsz) < 0 &&
+      errno != ETIME && errno != EBUSY) {
+    return ERR_QUEUE_WAIT;
+  }
+
+  return NOERROR;
+}
+
+#endif // KOP_URING
@@ -0,0 +1,142 @@
+#ifndef KOP_URING_H_
+#define KOP_URING_H_
+
+#include "utils.h"
+
+#if defined(KOP_URING)
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// size of the submission queue, the completion queue gets twice as many
+#define KOP_URING_ENTRIES 256
+// buffers multishot recv picks from, shared by all connections of a reactor
+#define KOP_URING_BUFS 256
+#define KOP_URING_BUF_SIZE 4096
+// group id of the provided buffer ring
+#define KOP_URING_BGID 0
+
+// Minimal io_uring wrapper on top of the raw syscalls: the two rings, the
+// mapped SQE array and one provided buffer ring. Only the reactor thread that
+// created it may touch it.
+typedef struct kop_uring {
+  int fd;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  // tail of the SQEs prepared so far, published on submit
+  unsigned sq_local_tail;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  char *bufs;
+  unsigned short buf_tail;
+} kop_uring;
+
+// Whether the running kernel has everything the backend relies on: multishot
+// accept and recv, provided buffer rings and sendmsg.
+bool kop_uring_supported(void);
+kop_error kop_uring_init(kop_uring *u);
+void kop_uring_free(kop_uring *u);
+// Returns a zeroed SQE, submitting the queued ones first if the ring is full.
+struct io_uring_sqe *kop_uring_get_sqe(kop_uring *u);
+// Submits everything prepared so far and waits up to `timeout_ms` for a
+// completion, -1 waits indefinitely and 0 only submits. A single syscall.
+kop_error kop_uring_submit_and_wait(kop_uring *u, int timeout_ms);
+
+static inline struct io_uring_cqe *kop_uring_peek_cqe(kop_uring *u) {
+  unsigned head = *u->cq_head;
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &u->cqes[head & u->cq_mask];
+}
+
+static inline void kop_uring_cqe_seen(kop_uring *u) {
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Data multishot recv placed into provided buffer `bid`.
+static inline char *kop_uring_buf(kop_uring *u, unsigned bid) {
+  return u->bufs + (size_t)bid * KOP_URING_BUF_SIZE;
+}
+
+// Hands buffer `bid` back to the kernel.
+void kop_uring_buf_recycle(kop_uring *u, unsigned bid);
+
+static inline void kop_uring_prep_accept_multishot(struct io_uring_sqe *sqe,
+                                                   int fd, uint64_t data) {
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = data;
+}
+
+static inline void kop_uring_prep_recv_multishot(struct io_uring_sqe *sqe,
+                                                 int fd, uint64_t data) {
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = KOP_URING_BGID;
+  sqe->user_data = data;
+}
+
+static inline void kop_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                                          struct msghdr *msg, uint64_t data) {
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = data;
+}
+
+static inline void kop_uring_prep_poll(struct io_uring_sqe *sqe, int fd,
+                                       unsigned events, uint64_t data) {
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->user_data = data;
+}
+
+static inline void kop_uring_prep_read(struct io_uring_sqe *sqe, int fd,
+                                       void *buf, unsigned len,
+                                       uint64_t data) {
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = (uint64_t)-1;
+  sqe->user_data = data;
+}
+
+// Cancels the operation submitted with `target` as its user_data.
+static inline void kop_uring_prep_cancel(struct io_uring_sqe *sqe,
+                                         uint64_t target, uint64_t data) {
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = data;
+}
+
+#endif // KOP_URING
+
+#endif // !KOP_URING_H_
@@ -1,7 +1,13 @@
 #ifndef KOP_UTILS_H_
 #define KOP_UTILS_H_
 
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
 #if defined(__linux__)
 #define KOP_LINUX
@@ -19,6 +25,53 @@
 #define KOP_DEBUG_LOG(msg, ...)
 #endif
 
+// Non-owning view into somebody else's memory, usually the receive buffer of a
+// connection. It is not NUL-terminated.
+typedef struct kop_str {
+  const char *data;
+  size_t len;
+} kop_str;
+
+#define KOP_STR(literal) ((kop_str){.data = (literal), .len = sizeof(literal) - 1})
+#define KOP_STR_FMT "%.*s"
+#define KOP_STR_ARG(s) (int)(s).len, (s).data
+
+static inline kop_str kop_str_from_cstr(const char *s) {
+  return (kop_str){.data = s, .len = strlen(s)};
+}
+
+static inline bool kop_str_eq(kop_str a, const char *b) {
+  size_t len = strlen(b);
+  return a.len == len && memcmp(a.data, b, len) == 0;
+}
+
+static inline bool kop_str_eq_nocase(kop_str a, const char *b) {
+  size_t len = strlen(b);
+  return a.len == len && strncasecmp(a.data, b, len) == 0;
+}
+
+// Copies the viewed bytes into a freshly malloc'd NUL-terminated string. Use
+// it to keep anything out of a request past the lifetime of that request.
+static inline char *kop_str_dup(kop_str s) {
+  char *dup = malloc(s.len + 1);
+  if (dup == NULL) {
+    return NULL;
+  }
+  memcpy(dup, s.data, s.len);
+  dup[s.len] = '\0';
+  return dup;
+}
+
+// Moves a view that points into `old_base` to the same offset in `new_base`,
+// used when the buffer it points into is reallocated. Either base may be a
+// plain number, the view then holds its offset from it in the meantime.
+static inline void kop_str_rebase(kop_str *s, uintptr_t old_base,
+                                  uintptr_t new_base) {
+  if (s->data != NULL) {
+    s->data = (const char *)((uintptr_t)s->data - old_base + new_base);
+  }
+}
+
 #define kop_vector_init(type, v)                                               \
   do {                                                                         \
     v.len = 0;                                                                 \
@@ -29,7 +82,8 @@
 #define kop_vector_append(type, vptr, value)                                   \
   do {                                                                         \
     if ((vptr).len == (vptr).cap) {                                            \
-      (vptr).data = realloc((vptr).data, sizeof(type) * (vptr).cap * 2);       \
+      (vptr).cap *= 2;                                                         \
+      (vptr).data = realloc((vptr).data, sizeof(type) * (vptr).cap);           \
     }                                                                          \
                                                                                \
     (vptr).data[(vptr).len++] = value;                                         \
@@ -68,6 +122,16 @@ typedef enum kop_error {
   ERR_QUEUE_WAIT,
   ERR_QUEUE_ADD_CLIENT,
   ERR_DEAD_SERVER,
+  ERR_CREATING_THREAD,
+  ERR_WRITING_DATA,
+  ERR_INVALID_ROUTE,
+  ERR_OPENING_FILE,
+  ERR_BODY_TOO_LARGE,
+  ERR_HEADERS_TOO_LARGE,
+  ERR_UNSUPPORTED_TRANSFER_ENCODING,
+  ERR_COMPRESSING,
+
+  kop_error_count,
 } kop_error;
 
 static const char *kop_error_str[] = {
@@ -92,8 +156,29 @@ static const char *kop_error_str[] = {
     [ERR_QUEUE_WAIT] = "ERR_QUEUE_WAIT",
     [ERR_QUEUE_ADD_CLIENT] = "ERR_QUEUE_ADD_CLIENT",
     [ERR_DEAD_SERVER] = "ERR_DEAD_SERVER",
+    [ERR_CREATING_THREAD] = "ERR_CREATING_THREAD",
+    [ERR_WRITING_DATA] = "ERR_WRITING_DATA",
+    [ERR_INVALID_ROUTE] = "ERR_INVALID_ROUTE",
+    [ERR_OPENING_FILE] = "ERR_OPENING_FILE",
+    [ERR_BODY_TOO_LARGE] = "ERR_BODY_TOO_LARGE",
+    [ERR_HEADERS_TOO_LARGE] = "ERR_HEADERS_TOO_LARGE",
+    [ERR_UNSUPPORTED_TRANSFER_ENCODING] = "ERR_UNSUPPORTED_TRANSFER_ENCODING",
+    [ERR_COMPRESSING] = "ERR_COMPRESSING",
 };
 
 #define KOP_STRERROR(err) kop_error_str[err]
 
+static inline kop_error set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    return ERR_NONBLOCKING;
+  }
+
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return ERR_NONBLOCKING;
+  }
+
+  return NOERROR;
+}
+
 #endif // !KOP_UTILS_H_
@@ -0,0 +1,80 @@
+// Arenas and the pool that recycles them between requests.
+
+#include <stdint.h>
+
+#include "../src/arena.h"
+#include "test.h"
+
+static void test_alloc(void) {
+  kop_arena a = {0};
+
+  char *p = kop_arena_alloc(&a, 1);
+  char *q = kop_arena_alloc(&a, 1);
+  KOP_CHECK(p != NULL && q != NULL && p != q);
+  KOP_CHECK((uintptr_t)q % KOP_ARENA_ALIGN == 0);
+  KOP_CHECK(kop_arena_alloc(&a, 3 * KOP_ARENA_BLOCK_SIZE) != NULL);
+  KOP_CHECK(a.first->next != NULL);
+
+  // a reset rewinds, the blocks are used again
+  kop_arena_block *first = a.first;
+  kop_arena_reset(&a);
+  KOP_CHECK(kop_arena_alloc(&a, 1) == (void *)first->align);
+
+  kop_arena_free(&a);
+  KOP_CHECK(a.first == NULL && a.current == NULL);
+}
+
+static void test_pool_trims(void) {
+  kop_arena_pool pool = {0};
+
+  // an arena given back keeps one block of the default size
+  kop_arena *a = kop_arena_pool_get(&pool);
+  for (int i = 0; i < 10; i++) {
+    KOP_CHECK(kop_arena_alloc(a, KOP_ARENA_BLOCK_SIZE / 2) != NULL);
+  }
+  kop_arena_block *first = a->first;
+  kop_arena_pool_put(&pool, a);
+  KOP_CHECK(pool.len == 1);
+  KOP_CHECK(a->first == first && first->next == NULL);
+  KOP_CHECK(a->current == first && first->used == 0);
+
+  // one that only ever grew for a large allocation keeps none
+  a = kop_arena_pool_get(&pool);
+  KOP_CHECK(pool.len == 0);
+  kop_arena_free(a);
+  KOP_CHECK(kop_arena_alloc(a, 1 << 20) != NULL);
+  kop_arena_pool_put(&pool, a);
+  KOP_CHECK(a->first == NULL);
+  KOP_CHECK(kop_arena_pool_get(&pool) == a);
+  KOP_CHECK(kop_arena_alloc(a, 1) != NULL);
+  KOP_CHECK(a->first->cap == KOP_ARENA_BLOCK_SIZE);
+  kop_arena_pool_put(&pool, a);
+
+  kop_arena_pool_free(&pool);
+  KOP_CHECK(pool.free == NULL && pool.len == 0);
+}
+
+static void test_pool_cap(void) {
+  kop_arena_pool pool = {0};
+  static kop_arena *arenas[KOP_ARENA_POOL_MAX + 16];
+  size_t n = sizeof(arenas) / sizeof(arenas[0]);
+
+  for (size_t i = 0; i < n; i++) {
+    arenas[i] = kop_arena_pool_get(&pool);
+    KOP_CHECK(kop_arena_alloc(arenas[i], 64) != NULL);
+  }
+  for (size_t i = 0; i < n; i++) {
+    kop_arena_pool_put(&pool, arenas[i]);
+  }
+  KOP_CHECK(pool.len == KOP_ARENA_POOL_MAX);
+
+  kop_arena_pool_free(&pool);
+}
+
+int main(void) {
+  test_alloc();
+  test_pool_trims();
+  test_pool_cap();
+
+  return KOP_TEST_RESULT();
+}
@@ -0,0 +1,169 @@
+// The response cache: hits, expiry, eviction and the ETag it attaches, and
+// the If-None-Match comparison that answers 304 from it.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/arena.h"
+#include "../src/cache.h"
+#include "../src/http.h"
+#include "test.h"
+
+static kop_arena_pool pool;
+
+// Caches a 200 with `body` under `key`. Returns the entry with the
+// reference of the caller already released, NULL if it wasn't cached.
+static kop_cached_response *put(kop_response_cache *cache, const char *key,
+                                const char *body, const char *etag,
+                                uint64_t ttl, uint64_t now) {
+  kop_arena *arena = kop_arena_pool_get(&pool);
+  kop_http_response resp = {
+      .code = HTTP_OK, .body = body, .body_len = strlen(body)};
+  kop_http_response_add_header(&resp, arena, "Content-Type", "text/plain");
+  if (etag != NULL) {
+    kop_http_response_add_header(&resp, arena, "ETag", etag);
+  }
+
+  kop_cached_response *e;
+  KOP_CHECK(kop_response_cache_put(cache, kop_str_from_cstr(key), &resp,
+                                   arena, ttl, now, &e) == NOERROR);
+  kop_arena_pool_put(&pool, arena);
+  if (e != NULL) {
+    kop_cached_response_release(e);
+  }
+  return e;
+}
+
+static kop_cached_response *get(kop_response_cache *cache, const char *key,
+                                uint64_t now) {
+  kop_cached_response *e =
+      kop_response_cache_get(cache, kop_str_from_cstr(key), now);
+  if (e != NULL) {
+    kop_cached_response_release(e);
+  }
+  return e;
+}
+
+static void test_hit_and_miss(void) {
+  kop_response_cache cache;
+  KOP_CHECK(kop_response_cache_init(&cache, 1 << 16) == NOERROR);
+
+  kop_cached_response *e = put(&cache, "GET /a", "hello", NULL, 1000, 0);
+  KOP_CHECK(e != NULL);
+  KOP_CHECK(get(&cache, "GET /a", 10) == e);
+  KOP_CHECK(get(&cache, "GET /b", 10) == NULL);
+  KOP_CHECK(get(&cache, "GET /", 10) == NULL);
+
+  // the head ends right before Connection, the body follows it
+  KOP_CHECK(strncmp(e->data, "HTTP/1.1 200 ", 13) == 0);
+  KOP_CHECK(strncmp(e->data + e->head_len - 2, "\r\n", 2) == 0);
+  KOP_CHECK(e->len == e->head_len + 5);
+  KOP_CHECK(memcmp(e->data + e->head_len, "hello", 5) == 0);
+
+  // the generated ETag is quoted, is in the head and depends on the body
+  size_t etag_len = strlen(e->etag);
+  KOP_CHECK(etag_len > 2 && e->etag[0] == '"' && e->etag[etag_len - 1] == '"');
+  KOP_CHECK(strstr(e->data, e->etag) != NULL);
+  char etag[KOP_CACHE_MAX_ETAG + 1];
+  strcpy(etag, e->etag);
+  KOP_CHECK(strcmp(put(&cache, "GET /c", "hello", NULL, 1000, 0)->etag,
+                   etag) == 0);
+  KOP_CHECK(strcmp(put(&cache, "GET /d", "other", NULL, 1000, 0)->etag,
+                   etag) != 0);
+
+  // one the handler set is kept
+  e = put(&cache, "GET /e", "x", "W/\"v1\"", 1000, 0);
+  KOP_CHECK(strcmp(e->etag, "W/\"v1\"") == 0);
+
+  kop_response_cache_free(&cache);
+}
+
+static void test_expiry_and_replace(void) {
+  kop_response_cache cache;
+  KOP_CHECK(kop_response_cache_init(&cache, 1 << 16) == NOERROR);
+
+  put(&cache, "GET /a", "one", NULL, 100, 1000);
+  KOP_CHECK(get(&cache, "GET /a", 1099) != NULL);
+  KOP_CHECK(get(&cache, "GET /a", 1100) == NULL);
+  KOP_CHECK(cache.len == 0 && cache.size == 0);
+
+  // a response still being sent keeps its entry alive after it's replaced
+  put(&cache, "GET /a", "one", NULL, 100, 0);
+  kop_cached_response *old =
+      kop_response_cache_get(&cache, kop_str_from_cstr("GET /a"), 0);
+  kop_cached_response *e = put(&cache, "GET /a", "two", NULL, 100, 0);
+  KOP_CHECK(e != old && !old->cached && e->cached);
+  KOP_CHECK(get(&cache, "GET /a", 0) == e);
+  KOP_CHECK(cache.len == 1);
+  KOP_CHECK(memcmp(old->data + old->head_len, "one", 3) == 0);
+  kop_cached_response_release(old);
+
+  kop_response_cache_free(&cache);
+}
+
+static void test_eviction(void) {
+  kop_response_cache cache;
+  KOP_CHECK(kop_response_cache_init(&cache, 1024) == NOERROR);
+
+  char body[200];
+  memset(body, 'x', sizeof(body) - 1);
+  body[sizeof(body) - 1] = '\0';
+  char key[16];
+  for (int i = 0; i < 8; i++) {
+    snprintf(key, sizeof(key), "GET /%d", i);
+    KOP_CHECK(put(&cache, key, body, NULL, 1000, 0) != NULL);
+    // the first one is used all the time, it stays
+    KOP_CHECK(get(&cache, "GET /0", 0) != NULL);
+    KOP_CHECK(cache.size <= cache.cap);
+  }
+  KOP_CHECK(get(&cache, "GET /1", 0) == NULL);
+  KOP_CHECK(get(&cache, "GET /7", 0) != NULL);
+
+  // a response bigger than the whole cache isn't cached and evicts nothing
+  char big[2048];
+  memset(big, 'y', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  size_t len = cache.len;
+  KOP_CHECK(put(&cache, "GET /big", big, NULL, 1000, 0) == NULL);
+  KOP_CHECK(cache.len == len);
+
+  kop_response_cache_free(&cache);
+
+  // without a capacity nothing is cached
+  KOP_CHECK(kop_response_cache_init(&cache, 0) == NOERROR);
+  KOP_CHECK(put(&cache, "GET /a", "a", NULL, 1000, 0) == NULL);
+  KOP_CHECK(get(&cache, "GET /a", 0) == NULL);
+  kop_response_cache_free(&cache);
+}
+
+static bool matches(const char *list, const char *etag) {
+  return kop_http_etag_matches(kop_str_from_cstr(list), etag);
+}
+
+static void test_etag_matches(void) {
+  KOP_CHECK(matches("\"abc\"", "\"abc\""));
+  KOP_CHECK(matches("\"x\", \"abc\"", "\"abc\""));
+  KOP_CHECK(matches("\"x\" ,\t\"abc\" ", "\"abc\""));
+  KOP_CHECK(matches("*", "\"abc\""));
+  // the weak comparison ignores W/ on either side
+  KOP_CHECK(matches("W/\"abc\"", "\"abc\""));
+  KOP_CHECK(matches("\"abc\"", "W/\"abc\""));
+  KOP_CHECK(matches("W/\"abc\"", "W/\"abc\""));
+
+  KOP_CHECK(!matches("", "\"abc\""));
+  KOP_CHECK(!matches("\"abcd\"", "\"abc\""));
+  KOP_CHECK(!matches("\"ab\"", "\"abc\""));
+  KOP_CHECK(!matches("abc", "\"abc\""));
+  KOP_CHECK(!matches("\"x\", \"y\"", "\"abc\""));
+  KOP_CHECK(!matches("**", "\"abc\""));
+}
+
+int main(void) {
+  test_hit_and_miss();
+  test_expiry_and_replace();
+  test_eviction();
+  test_etag_matches();
+
+  kop_arena_pool_free(&pool);
+  return KOP_TEST_RESULT();
+}
@@ -0,0 +1,84 @@
+// Accept-Encoding negotiation and which responses are compressed.
+
+#include "../src/compress.h"
+#include "test.h"
+
+static kop_encoding negotiate(const char *accept_encoding) {
+  return kop_encoding_negotiate(kop_str_from_cstr(accept_encoding));
+}
+
+static void test_negotiate(void) {
+  // nothing acceptable, or nothing compiled in, is identity
+  KOP_CHECK(negotiate("") == KOP_ENCODING_IDENTITY);
+  KOP_CHECK(negotiate("identity") == KOP_ENCODING_IDENTITY);
+  KOP_CHECK(negotiate("compress, zstd") == KOP_ENCODING_IDENTITY);
+  KOP_CHECK(negotiate("*;q=0") == KOP_ENCODING_IDENTITY);
+  KOP_CHECK(negotiate("gzip;q=0, deflate;q=0.000, br;q=0") ==
+            KOP_ENCODING_IDENTITY);
+
+#if defined(KOP_ZLIB)
+  KOP_CHECK(negotiate("gzip") == KOP_ENCODING_GZIP);
+  KOP_CHECK(negotiate("GZIP") == KOP_ENCODING_GZIP);
+  KOP_CHECK(negotiate("deflate") == KOP_ENCODING_DEFLATE);
+  // the same weight goes to gzip, a higher one wins
+  KOP_CHECK(negotiate("deflate, gzip") == KOP_ENCODING_GZIP);
+  KOP_CHECK(negotiate("gzip;q=0.5, deflate") == KOP_ENCODING_DEFLATE);
+  KOP_CHECK(negotiate("gzip; q=0.8 ,deflate;Q=0.81") ==
+            KOP_ENCODING_DEFLATE);
+  KOP_CHECK(negotiate("gzip;q=0.001") == KOP_ENCODING_GZIP);
+  // q=0 rules a coding out, even when * would allow it
+  KOP_CHECK(negotiate("gzip;q=0, br;q=0, *") == KOP_ENCODING_DEFLATE);
+  // a weight over 1 counts as 1
+  KOP_CHECK(negotiate("deflate;q=1.5, gzip;q=0.9") == KOP_ENCODING_DEFLATE);
+  // names are matched as a whole
+  KOP_CHECK(negotiate("gzipx, xgzip, gz") == KOP_ENCODING_IDENTITY);
+  KOP_CHECK(negotiate("x-gzip") == KOP_ENCODING_IDENTITY);
+#endif
+
+#if defined(KOP_BROTLI)
+  KOP_CHECK(negotiate("br") == KOP_ENCODING_BR);
+  KOP_CHECK(negotiate("*") == KOP_ENCODING_BR);
+#if defined(KOP_ZLIB)
+  KOP_CHECK(negotiate("gzip, deflate, br") == KOP_ENCODING_BR);
+  KOP_CHECK(negotiate("br;q=0.9, gzip") == KOP_ENCODING_GZIP);
+  KOP_CHECK(negotiate("br;q=0, *;q=0.5") == KOP_ENCODING_GZIP);
+  KOP_CHECK(negotiate("gzip;q=0, deflate;q=0, *") == KOP_ENCODING_BR);
+#endif
+#endif
+}
+
+static void test_compress_wanted(void) {
+  static const char *const types[] = {"application/x-custom", "font/", NULL};
+  kop_str html = kop_str_from_cstr("text/html; charset=utf-8");
+
+  KOP_CHECK(kop_compress_wanted(NULL, 0, html, KOP_COMPRESS_MIN_SIZE));
+  KOP_CHECK(!kop_compress_wanted(NULL, 0, html, KOP_COMPRESS_MIN_SIZE - 1));
+  // a route's own minimum replaces the default
+  KOP_CHECK(kop_compress_wanted(NULL, 100, html, 100));
+  KOP_CHECK(!kop_compress_wanted(NULL, 100, html, 99));
+
+  KOP_CHECK(kop_compress_wanted(
+      NULL, 0, kop_str_from_cstr("Application/JSON"), 4096));
+  KOP_CHECK(kop_compress_wanted(
+      NULL, 0, kop_str_from_cstr("image/svg+xml"), 4096));
+  KOP_CHECK(!kop_compress_wanted(NULL, 0, kop_str_from_cstr("image/png"),
+                                 4096));
+  KOP_CHECK(!kop_compress_wanted(
+      NULL, 0, kop_str_from_cstr("application/json-seq"), 4096));
+  KOP_CHECK(!kop_compress_wanted(NULL, 0, kop_str_from_cstr(""), 4096));
+  KOP_CHECK(!kop_compress_wanted(NULL, 0, kop_str_from_cstr("text"), 4096));
+
+  // a route's own types replace the defaults
+  KOP_CHECK(kop_compress_wanted(
+      types, 0, kop_str_from_cstr("application/x-custom;v=1"), 4096));
+  KOP_CHECK(kop_compress_wanted(types, 0, kop_str_from_cstr("font/woff"),
+                                4096));
+  KOP_CHECK(!kop_compress_wanted(types, 0, html, 4096));
+}
+
+int main(void) {
+  test_negotiate();
+  test_compress_wanted();
+
+  return KOP_TEST_RESULT();
+}
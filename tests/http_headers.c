@@ -0,0 +1,98 @@
+// Well-known header ids: the lookup by name and the slots a request keeps
+// them in.
+
+#include <string.h>
+
+#include "../src/arena.h"
+#include "../src/http.h"
+#include "../src/scan.h"
+#include "test.h"
+
+// Flips the case of every letter of `name` into `buf`.
+static kop_str swap_case(char *buf, const char *name) {
+  size_t len = strlen(name);
+  for (size_t i = 0; i < len; i++) {
+    char ch = name[i];
+    if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'z') {
+      ch ^= 0x20;
+    }
+    buf[i] = ch;
+  }
+  return (kop_str){.data = buf, .len = len};
+}
+
+static void test_known_names(void) {
+  char buf[64];
+  for (size_t id = 0; id < kop_http_header_id_count; id++) {
+    const char *name = kop_http_header_names[id];
+    KOP_CHECK(kop_http_header_id_of(kop_str_from_cstr(name)) == id);
+    KOP_CHECK(kop_http_header_id_of(swap_case(buf, name)) == id);
+  }
+  KOP_CHECK(kop_http_header_id_of(kop_str_from_cstr("content-LENGTH")) ==
+            KOP_HEADER_CONTENT_LENGTH);
+}
+
+static void test_unknown_names(void) {
+  static const char *const names[] = {
+      // unknown names
+      "X-Custom", "Date", "Server", "Keep-Alive",
+      // the same length, first and last byte as a known name
+      "Hast", "Cookee", "Content-Typee", "Accept-Lenguage", "Range-",
+      // prefixes and extensions of known names
+      "Hos", "Hosts", "Content-Length2", "Accept-",
+      // '-' and '\r' differ in the bit a case fold ignores
+      "Content\rType", "If-None\rMatch",
+  };
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    KOP_CHECK(kop_http_header_id_of(kop_str_from_cstr(names[i])) ==
+              KOP_HEADER_UNKNOWN);
+  }
+  KOP_CHECK(kop_http_header_id_of((kop_str){0}) == KOP_HEADER_UNKNOWN);
+}
+
+static void test_request_slots(void) {
+  kop_arena_pool pool = {0};
+  kop_arena *arena = kop_arena_pool_get(&pool);
+  kop_http_parser parser;
+  kop_http_request req;
+  kop_http_parser_init(&parser, &req, arena);
+
+  static const char head[] = "GET / HTTP/1.1\r\n"
+                             "host: first.example\r\n"
+                             "Accept: text/html\r\n"
+                             "HOST: second.example\r\n"
+                             "X-Forwarded-For: 10.0.0.1\r\n"
+                             "\r\n";
+  char buf[sizeof(head)];
+  memcpy(buf, head, sizeof(head));
+  kop_http_parse_status status;
+  KOP_CHECK(parse_http_request(&parser, &req, buf, sizeof(head) - 1,
+                               &status) == NOERROR);
+  KOP_CHECK(status == KOP_PARSE_HEADERS_COMPLETE);
+
+  // the first of repeated headers is the one kept, all stay in the list
+  KOP_CHECK(kop_str_eq(kop_http_request_header(&req, KOP_HEADER_HOST),
+                       "first.example"));
+  KOP_CHECK(kop_str_eq(kop_http_request_header(&req, KOP_HEADER_ACCEPT),
+                       "text/html"));
+  KOP_CHECK(kop_str_eq(
+      kop_http_request_header(&req, KOP_HEADER_X_FORWARDED_FOR), "10.0.0.1"));
+  KOP_CHECK(req.headers.len == 4);
+  KOP_CHECK(kop_http_request_header(&req, KOP_HEADER_COOKIE).data == NULL);
+  KOP_CHECK(kop_str_eq(kop_http_request_find_header(
+                           &req, kop_str_from_cstr("Host")),
+                       "first.example"));
+
+  kop_arena_pool_put(&pool, arena);
+  kop_arena_pool_free(&pool);
+}
+
+int main(void) {
+  kop_scan_init();
+
+  test_known_names();
+  test_unknown_names();
+  test_request_slots();
+
+  return KOP_TEST_RESULT();
+}
@@ -0,0 +1,89 @@
+// Method tokens, which are compared a word at a time.
+
+#include <string.h>
+
+#include "../src/arena.h"
+#include "../src/http.h"
+#include "../src/scan.h"
+#include "test.h"
+
+// Parses `token` the way the request line does, with bytes of the rest of
+// the line after it.
+static kop_http_method method_of(const char *token, const char *rest) {
+  char buf[32];
+  size_t len = strlen(token);
+  memcpy(buf, token, len);
+  strcpy(buf + len, rest);
+  return kop_http_method_from_str(buf, len);
+}
+
+static void test_known_methods(void) {
+  for (size_t m = 0; m < kop_http_method_count; m++) {
+    const char *name = kop_http_method_str[m];
+    KOP_CHECK(method_of(name, " / HTTP/1.1") == m);
+    // whatever follows the token is not part of it
+    KOP_CHECK(method_of(name, "GETPOST") == m);
+  }
+}
+
+static void test_bad_methods(void) {
+  static const char *const tokens[] = {
+      // too short, lower case or almost a method
+      "", "GE", "get", "Get", "GEt", "G T", "POS", "PATC", "OPTION",
+      // a method with more after it
+      "GETS", "PUTS", "HEADS", "DELETES", "OPTIONSX",
+      // methods the server doesn't know
+      "TRACE", "CONNECT",
+  };
+  for (size_t i = 0; i < sizeof(tokens) / sizeof(tokens[0]); i++) {
+    KOP_CHECK(method_of(tokens[i], " / HTTP/1.1") == HTTP_BAD_METHOD);
+  }
+  // the length decides, a longer known method doesn't match a prefix of it
+  KOP_CHECK(kop_http_method_from_str("POST / HTTP/1.1", 3) == HTTP_BAD_METHOD);
+  KOP_CHECK(kop_http_method_from_str("DELETE / HTTP/1.1", 5) ==
+            HTTP_BAD_METHOD);
+}
+
+static kop_error parse_line(kop_arena_pool *pool, const char *line,
+                            kop_http_method *method) {
+  char buf[64];
+  strcpy(buf, line);
+
+  kop_arena *arena = kop_arena_pool_get(pool);
+  kop_http_parser parser;
+  kop_http_request req;
+  kop_http_parse_status status;
+  kop_http_parser_init(&parser, &req, arena);
+  kop_error err = parse_http_request(&parser, &req, buf, strlen(buf), &status);
+  *method = req.method;
+  kop_arena_pool_put(pool, arena);
+  return err;
+}
+
+static void test_request_line(void) {
+  kop_arena_pool pool = {0};
+  kop_http_method method;
+
+  KOP_CHECK(parse_line(&pool, "OPTIONS * HTTP/1.1\r\n\r\n", &method) ==
+            NOERROR);
+  KOP_CHECK(method == HTTP_OPTIONS);
+  KOP_CHECK(parse_line(&pool, "PATCH /a HTTP/1.1\r\n\r\n", &method) ==
+            NOERROR);
+  KOP_CHECK(method == HTTP_PATCH);
+  KOP_CHECK(parse_line(&pool, "get / HTTP/1.1\r\n\r\n", &method) ==
+            ERR_MALFORMED_METHOD);
+  KOP_CHECK(parse_line(&pool, "BREW /pot HTTP/1.1\r\n\r\n", &method) ==
+            ERR_MALFORMED_METHOD);
+
+  kop_arena_pool_free(&pool);
+}
+
+int main(void) {
+  kop_scan_init();
+
+  test_known_methods();
+  test_bad_methods();
+  test_request_line();
+
+  return KOP_TEST_RESULT();
+}
@@ -0,0 +1,322 @@
+// Request parsing: framing of the body, chunked decoding and the limits on
+// the head and the body.
+
+#include <string.h>
+
+#include "../src/arena.h"
+#include "../src/http.h"
+#include "../src/scan.h"
+#include "test.h"
+
+static kop_arena_pool pool;
+
+// A request being parsed out of a buffer the test owns.
+typedef struct parse {
+  kop_arena *arena;
+  kop_http_parser parser;
+  kop_http_request req;
+  char buf[16 << 10];
+  size_t len;
+} parse;
+
+static void parse_begin(parse *p) {
+  p->arena = kop_arena_pool_get(&pool);
+  p->len = 0;
+  kop_http_parser_init(&p->parser, &p->req, p->arena);
+}
+
+static void parse_end(parse *p) { kop_arena_pool_put(&pool, p->arena); }
+
+// Appends `data` and parses on, the way the server does after every read:
+// once more right after the headers, where it would have routed.
+static kop_error parse_feed(parse *p, const char *data,
+                            kop_http_parse_status *status) {
+  size_t n = strlen(data);
+  memcpy(p->buf + p->len, data, n);
+  p->len += n;
+
+  kop_error err =
+      parse_http_request(&p->parser, &p->req, p->buf, p->len, status);
+  if (err == NOERROR && *status == KOP_PARSE_HEADERS_COMPLETE) {
+    err = parse_http_request(&p->parser, &p->req, p->buf, p->len, status);
+  }
+  return err;
+}
+
+// Appends `n` times `ch` and parses on.
+static kop_error parse_feed_run(parse *p, char ch, size_t n,
+                                kop_http_parse_status *status) {
+  memset(p->buf + p->len, ch, n);
+  p->len += n;
+  return parse_http_request(&p->parser, &p->req, p->buf, p->len, status);
+}
+
+// Parses `data` as a whole request and returns the error it ended with.
+static kop_error parse_all(const char *data) {
+  parse p;
+  kop_http_parse_status status;
+  parse_begin(&p);
+  kop_error err = parse_feed(&p, data, &status);
+  parse_end(&p);
+  return err;
+}
+
+static void test_request_line_and_headers(void) {
+  parse p;
+  kop_http_parse_status status;
+  parse_begin(&p);
+
+  KOP_CHECK(parse_feed(&p,
+                       "GET /users/42?x=1 HTTP/1.1\r\n"
+                       "Host: example.com\r\n"
+                       "X-Custom:  spaced\r\n"
+                       "\r\n",
+                       &status) == NOERROR);
+  KOP_CHECK(status == KOP_PARSE_COMPLETE);
+  KOP_CHECK(p.req.method == HTTP_GET);
+  KOP_CHECK(p.req.minor_version == 1);
+  KOP_CHECK(kop_str_eq(p.req.path, "/users/42?x=1"));
+  KOP_CHECK(p.req.headers.len == 2);
+  KOP_CHECK(kop_str_eq(kop_http_request_header(&p.req, KOP_HEADER_HOST),
+                       "example.com"));
+  KOP_CHECK(kop_str_eq(kop_http_request_find_header(
+                           &p.req, kop_str_from_cstr("x-custom")),
+                       "spaced"));
+  KOP_CHECK(p.req.body.len == 0);
+
+  parse_end(&p);
+
+  // spaces and tabs on either side of a value are dropped
+  parse_begin(&p);
+  KOP_CHECK(parse_feed(&p,
+                       "POST / HTTP/1.1\r\n"
+                       "Content-Length: 5 \r\n"
+                       "Host:\texample.com\t \r\n"
+                       "X-Custom: \t a b\t\r\n"
+                       "\r\n"
+                       "hello",
+                       &status) == NOERROR);
+  KOP_CHECK(status == KOP_PARSE_COMPLETE);
+  KOP_CHECK(kop_str_eq(kop_http_request_header(&p.req, KOP_HEADER_HOST),
+                       "example.com"));
+  KOP_CHECK(kop_str_eq(kop_http_request_find_header(
+                           &p.req, kop_str_from_cstr("x-custom")),
+                       "a b"));
+  KOP_CHECK(kop_str_eq(p.req.body, "hello"));
+  parse_end(&p);
+
+  KOP_CHECK(parse_all("GET / HTTP/1.1\r\nX-Blank: \t \r\n\r\n") ==
+            ERR_MALFORMED_HEADER);
+}
+
+static void test_split_reads(void) {
+  const char *req = "\r\nPOST /echo HTTP/1.1\r\n"
+                    "Host: x\r\n"
+                    "Content-Length: 5\r\n"
+                    "\r\n"
+                    "hello";
+  parse p;
+  kop_http_parse_status status = KOP_PARSE_NEED_MORE;
+  parse_begin(&p);
+
+  // a byte at a time, the head is only done once its empty line is in
+  size_t head = strstr(req, "\r\n\r\n") + 4 - req;
+  for (size_t i = 0; req[i] != '\0'; i++) {
+    char byte[2] = {req[i], '\0'};
+    KOP_CHECK(parse_feed(&p, byte, &status) == NOERROR);
+    if (i + 1 < head) {
+      KOP_CHECK(status == KOP_PARSE_NEED_MORE);
+    } else if (req[i + 1] != '\0') {
+      KOP_CHECK(status == KOP_PARSE_HEADERS_COMPLETE);
+    }
+  }
+  KOP_CHECK(status == KOP_PARSE_COMPLETE);
+  KOP_CHECK(p.req.method == HTTP_POST);
+  KOP_CHECK(kop_str_eq(p.req.body, "hello"));
+
+  parse_end(&p);
+}
+
+static void test_chunked(void) {
+  parse p;
+  kop_http_parse_status status;
+  parse_begin(&p);
+
+  KOP_CHECK(parse_feed(&p,
+                       "POST /echo HTTP/1.1\r\n"
+                       "Transfer-Encoding: chunked\r\n"
+                       "\r\n"
+                       "5\r\nhel",
+                       &status) == NOERROR);
+  KOP_CHECK(status == KOP_PARSE_HEADERS_COMPLETE);
+  KOP_CHECK(parse_feed(&p, "lo\r\n6;ext=1\r\n world\r\n0\r\n", &status) ==
+            NOERROR);
+  KOP_CHECK(status == KOP_PARSE_HEADERS_COMPLETE);
+  KOP_CHECK(parse_feed(&p, "Trailer: x\r\n\r\n", &status) == NOERROR);
+  KOP_CHECK(status == KOP_PARSE_COMPLETE);
+  KOP_CHECK(kop_str_eq(p.req.body, "hello world"));
+
+  parse_end(&p);
+
+  KOP_CHECK(parse_all("POST / HTTP/1.1\r\n"
+                      "Transfer-Encoding: chunked\r\n"
+                      "\r\n"
+                      "zz\r\n") == ERR_MALFORMED_BODY);
+}
+
+static void test_body_framing(void) {
+  // repeated Content-Length is fine as long as every copy agrees
+  KOP_CHECK(parse_all("POST / HTTP/1.1\r\n"
+                      "Content-Length: 3\r\n"
+                      "content-length: 3\r\n"
+                      "\r\n"
+                      "abc") == NOERROR);
+  KOP_CHECK(parse_all("POST / HTTP/1.1\r\n"
+                      "Content-Length: 3\r\n"
+                      "Content-Length: 4\r\n"
+                      "\r\n"
+                      "abcd") == ERR_INVALID_BODY);
+  KOP_CHECK(parse_all("POST / HTTP/1.1\r\n"
+                      "Content-Length: 3, 3\r\n"
+                      "\r\n"
+                      "abc") == ERR_INVALID_BODY);
+  KOP_CHECK(parse_all("POST / HTTP/1.1\r\n"
+                      "Content-Length: -1\r\n"
+                      "\r\n") == ERR_INVALID_BODY);
+  KOP_CHECK(parse_all("POST / HTTP/1.1\r\n"
+                      "Content-Length: 99999999999999999999999\r\n"
+                      "\r\n") == ERR_INVALID_BODY);
+  KOP_CHECK(parse_all("POST / HTTP/1.1\r\n"
+                      "Content-Length: \r\n"
+                      "\r\n") != NOERROR);
+
+  // both framings at once is how requests get smuggled
+  KOP_CHECK(parse_all("POST / HTTP/1.1\r\n"
+                      "Transfer-Encoding: chunked\r\n"
+                      "Content-Length: 3\r\n"
+                      "\r\n"
+                      "abc") == ERR_INVALID_BODY);
+  KOP_CHECK(parse_all("POST / HTTP/1.1\r\n"
+                      "Transfer-Encoding: chunked\r\n"
+                      "Transfer-Encoding: chunked\r\n"
+                      "\r\n"
+                      "0\r\n\r\n") == ERR_INVALID_BODY);
+  KOP_CHECK(parse_all("POST / HTTP/1.1\r\n"
+                      "Transfer-Encoding: gzip, chunked\r\n"
+                      "\r\n") == ERR_UNSUPPORTED_TRANSFER_ENCODING);
+}
+
+static void test_limits(void) {
+  parse p;
+  kop_http_parse_status status;
+
+  // the body limit is set between the head and the body, like the server
+  // does once it knows the route
+  parse_begin(&p);
+  strcpy(p.buf, "POST / HTTP/1.1\r\nContent-Length: 11\r\n\r\n");
+  p.len = strlen(p.buf);
+  KOP_CHECK(parse_http_request(&p.parser, &p.req, p.buf, p.len, &status) ==
+            NOERROR);
+  KOP_CHECK(status == KOP_PARSE_HEADERS_COMPLETE);
+  p.parser.max_body = 10;
+  KOP_CHECK(parse_http_request(&p.parser, &p.req, p.buf, p.len, &status) ==
+            ERR_BODY_TOO_LARGE);
+  parse_end(&p);
+
+  // a head over the limit fails whether it is complete or not
+  parse_begin(&p);
+  p.parser.max_head = 64;
+  KOP_CHECK(parse_feed(&p, "GET / HTTP/1.1\r\nHost: x\r\n", &status) ==
+            NOERROR);
+  KOP_CHECK(status == KOP_PARSE_NEED_MORE);
+  KOP_CHECK(parse_feed(&p, "X-Long: aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+                       &status) == ERR_HEADERS_TOO_LARGE);
+  parse_end(&p);
+
+  parse_begin(&p);
+  p.parser.max_head = 32;
+  KOP_CHECK(parse_feed(&p, "GET / HTTP/1.1\r\nX-Long: aaaaaaaaaaaaaaaa\r\n\r\n",
+                       &status) == ERR_HEADERS_TOO_LARGE);
+  parse_end(&p);
+
+  // chunk framing lines are bounded too, complete or not
+  static const char *const chunked_head = "POST / HTTP/1.1\r\n"
+                                          "Transfer-Encoding: chunked\r\n"
+                                          "\r\n";
+  parse_begin(&p);
+  KOP_CHECK(parse_feed(&p, chunked_head, &status) == NOERROR);
+  KOP_CHECK(parse_feed(&p, "5;ext=", &status) == NOERROR);
+  KOP_CHECK(parse_feed_run(&p, 'a', KOP_HTTP_MAX_CHUNK_LINE, &status) ==
+            ERR_MALFORMED_BODY);
+  parse_end(&p);
+
+  parse_begin(&p);
+  KOP_CHECK(parse_feed(&p, chunked_head, &status) == NOERROR);
+  KOP_CHECK(parse_feed_run(&p, '0', KOP_HTTP_MAX_CHUNK_LINE + 1, &status) ==
+            ERR_MALFORMED_BODY);
+  parse_end(&p);
+
+  parse_begin(&p);
+  KOP_CHECK(parse_feed(&p, chunked_head, &status) == NOERROR);
+  KOP_CHECK(parse_feed(&p, "1\r\nx", &status) == NOERROR);
+  KOP_CHECK(parse_feed_run(&p, ' ', KOP_HTTP_MAX_CHUNK_LINE + 1, &status) ==
+            ERR_MALFORMED_BODY);
+  parse_end(&p);
+
+  // trailers count against the limit on the head, one long line or many
+  parse_begin(&p);
+  p.parser.max_head = 256;
+  KOP_CHECK(parse_feed(&p, chunked_head, &status) == NOERROR);
+  KOP_CHECK(parse_feed(&p, "0\r\nX-Trailer: ", &status) == NOERROR);
+  KOP_CHECK(parse_feed_run(&p, 'a', 256, &status) == ERR_HEADERS_TOO_LARGE);
+  parse_end(&p);
+
+  parse_begin(&p);
+  p.parser.max_head = 256;
+  KOP_CHECK(parse_feed(&p, chunked_head, &status) == NOERROR);
+  KOP_CHECK(parse_feed(&p, "0\r\n", &status) == NOERROR);
+  kop_error err = NOERROR;
+  for (int i = 0; i < 32 && err == NOERROR; i++) {
+    err = parse_feed(&p, "X-Trailer: 0123456789\r\n", &status);
+  }
+  KOP_CHECK(err == ERR_HEADERS_TOO_LARGE);
+  parse_end(&p);
+
+  parse_begin(&p);
+  p.parser.max_head = 256;
+  KOP_CHECK(parse_feed(&p, chunked_head, &status) == NOERROR);
+  KOP_CHECK(parse_feed(&p, "0\r\nX-Trailer: 1\r\n\r\n", &status) ==
+            NOERROR);
+  KOP_CHECK(status == KOP_PARSE_COMPLETE);
+  parse_end(&p);
+
+  KOP_CHECK(kop_http_error_code(ERR_HEADERS_TOO_LARGE) ==
+            HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE);
+  KOP_CHECK(kop_http_error_code(ERR_BODY_TOO_LARGE) ==
+            HTTP_CONTENT_TOO_LARGE);
+  KOP_CHECK(kop_http_error_code(ERR_UNSUPPORTED_TRANSFER_ENCODING) ==
+            HTTP_NOT_IMPLEMENTED);
+  KOP_CHECK(kop_http_error_code(ERR_INVALID_BODY) == HTTP_BAD_REQUEST);
+}
+
+static void test_malformed(void) {
+  KOP_CHECK(parse_all("GET /\r\n\r\n") != NOERROR);
+  KOP_CHECK(parse_all("GET / HTTP/1.1\r\nNo colon\r\n\r\n") ==
+            ERR_MALFORMED_HEADER);
+  KOP_CHECK(parse_all("GET / HTTP/1.1\r\n: empty name\r\n\r\n") ==
+            ERR_MALFORMED_HEADER);
+}
+
+int main(void) {
+  kop_scan_init();
+
+  test_request_line_and_headers();
+  test_split_reads();
+  test_chunked();
+  test_body_framing();
+  test_limits();
+  test_malformed();
+
+  kop_arena_pool_free(&pool);
+  return KOP_TEST_RESULT();
+}
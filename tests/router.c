@@ -0,0 +1,210 @@
+// The radix router: splitting edges, capturing parameters, the priority of
+// static edges over parameters over wildcards, and 404 against 405.
+
+#include <string.h>
+
+#include "../src/router.h"
+#include "test.h"
+
+// Handlers are only compared, never called.
+#define HANDLER(name)                                                          \
+  static void name(struct kop_context *ctx, void *data) {                      \
+    (void)ctx;                                                                 \
+    (void)data;                                                                \
+  }
+
+HANDLER(h_users)
+HANDLER(h_user)
+HANDLER(h_me)
+HANDLER(h_post)
+HANDLER(h_files)
+HANDLER(h_other)
+
+static kop_route_params params;
+
+static kop_route_match find(kop_router *router, kop_http_method method,
+                            const char *path) {
+  return kop_router_find(router, method, kop_str_from_cstr(path), &params);
+}
+
+// Whether `path` finds `handler` for GET.
+static bool finds(kop_router *router, const char *path,
+                  kop_handler_func handler) {
+  kop_route_match m = find(router, HTTP_GET, path);
+  return m.status == KOP_ROUTE_FOUND && m.handler == handler;
+}
+
+static bool param_is(size_t i, const char *name, const char *value) {
+  return i < params.len && kop_str_eq(params.data[i].name, name) &&
+         kop_str_eq(params.data[i].value, value);
+}
+
+static void test_static_split(void) {
+  kop_router router;
+  KOP_CHECK(kop_router_init(&router) == NOERROR);
+
+  // each one splits an edge of the ones before it
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/users", h_users, NULL) ==
+            NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/user", h_user, NULL) ==
+            NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/us", h_me, NULL) == NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/usage", h_other, NULL) ==
+            NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_POST, "/users", h_post, NULL) ==
+            NOERROR);
+
+  KOP_CHECK(finds(&router, "/users", h_users));
+  KOP_CHECK(finds(&router, "/user", h_user));
+  KOP_CHECK(finds(&router, "/us", h_me));
+  KOP_CHECK(finds(&router, "/usage", h_other));
+  KOP_CHECK(find(&router, HTTP_POST, "/users").handler == h_post);
+  KOP_CHECK(find(&router, HTTP_GET, "/u").status == KOP_ROUTE_NOT_FOUND);
+  KOP_CHECK(find(&router, HTTP_GET, "/userss").status == KOP_ROUTE_NOT_FOUND);
+  KOP_CHECK(find(&router, HTTP_GET, "/").status == KOP_ROUTE_NOT_FOUND);
+  // the query string isn't part of the path
+  KOP_CHECK(finds(&router, "/users?page=2", h_users));
+
+  // routes keep their ids in the order they were added
+  KOP_CHECK(router.routes.len == 5);
+  KOP_CHECK(find(&router, HTTP_GET, "/us").id == 2);
+  KOP_CHECK(strcmp(router.routes.data[2].path, "/us") == 0);
+
+  // the same method and path twice is an error
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/user", h_other, NULL) ==
+            ERR_INVALID_ROUTE);
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "users", h_other, NULL) ==
+            ERR_INVALID_ROUTE);
+
+  kop_router_free(&router);
+}
+
+static void test_captures(void) {
+  kop_router router;
+  KOP_CHECK(kop_router_init(&router) == NOERROR);
+
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/users/:id", h_user, NULL) ==
+            NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/users/:id/posts/:post",
+                           h_post, NULL) == NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/files/*path", h_files,
+                           NULL) == NOERROR);
+
+  KOP_CHECK(finds(&router, "/users/42", h_user));
+  KOP_CHECK(params.len == 1 && param_is(0, "id", "42"));
+  KOP_CHECK(finds(&router, "/users/42/posts/7?x=1", h_post));
+  KOP_CHECK(params.len == 2 && param_is(0, "id", "42") &&
+            param_is(1, "post", "7"));
+  KOP_CHECK(finds(&router, "/files/a/b/c.txt", h_files));
+  KOP_CHECK(params.len == 1 && param_is(0, "path", "a/b/c.txt"));
+  KOP_CHECK(finds(&router, "/files/", h_files));
+  KOP_CHECK(params.len == 1 && param_is(0, "path", ""));
+
+  // a parameter takes one segment and never an empty one
+  KOP_CHECK(find(&router, HTTP_GET, "/users/").status ==
+            KOP_ROUTE_NOT_FOUND);
+  KOP_CHECK(find(&router, HTTP_GET, "/users/42/posts").status ==
+            KOP_ROUTE_NOT_FOUND);
+  KOP_CHECK(params.len == 0);
+
+  // a parameter is named the same by every route through it, a wildcard
+  // is the last segment
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/users/:name/x", h_other,
+                           NULL) == ERR_INVALID_ROUTE);
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/a/*rest/b", h_other, NULL) ==
+            ERR_INVALID_ROUTE);
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/a/:", h_other, NULL) ==
+            ERR_INVALID_ROUTE);
+
+  kop_router_free(&router);
+}
+
+static void test_priority(void) {
+  kop_router router;
+  KOP_CHECK(kop_router_init(&router) == NOERROR);
+
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/users/*rest", h_files,
+                           NULL) == NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/users/:id", h_user, NULL) ==
+            NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/users/me", h_me, NULL) ==
+            NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/users/:id/edit", h_post,
+                           NULL) == NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/users/me/settings",
+                           h_other, NULL) == NOERROR);
+
+  // static beats parameter beats wildcard, whatever order they came in
+  KOP_CHECK(finds(&router, "/users/me", h_me));
+  KOP_CHECK(params.len == 0);
+  KOP_CHECK(finds(&router, "/users/42", h_user));
+  KOP_CHECK(finds(&router, "/users/42/x", h_files));
+  KOP_CHECK(params.len == 1 && param_is(0, "rest", "42/x"));
+
+  // a static edge that dead-ends falls back to the parameter
+  KOP_CHECK(finds(&router, "/users/me/edit", h_post));
+  KOP_CHECK(params.len == 1 && param_is(0, "id", "me"));
+  KOP_CHECK(finds(&router, "/users/me/settings", h_other));
+  KOP_CHECK(params.len == 0);
+  // and the parameter to the wildcard, without its capture left behind
+  KOP_CHECK(finds(&router, "/users/me/edit/more", h_files));
+  KOP_CHECK(params.len == 1 && param_is(0, "rest", "me/edit/more"));
+  KOP_CHECK(finds(&router, "/users/mex", h_user));
+
+  kop_router_free(&router);
+}
+
+static void test_methods(void) {
+  kop_router router;
+  KOP_CHECK(kop_router_init(&router) == NOERROR);
+
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/a", h_users, NULL) ==
+            NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_POST, "/a", h_post, NULL) ==
+            NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_HEAD, "/b", h_me, NULL) == NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_GET, "/b", h_users, NULL) ==
+            NOERROR);
+  KOP_CHECK(kop_router_add(&router, HTTP_PUT, "/c", h_other, NULL) ==
+            NOERROR);
+
+  // HEAD falls back to GET unless it has a handler of its own
+  KOP_CHECK(find(&router, HTTP_HEAD, "/a").handler == h_users);
+  KOP_CHECK(find(&router, HTTP_HEAD, "/b").handler == h_me);
+  KOP_CHECK(find(&router, HTTP_HEAD, "/c").status ==
+            KOP_ROUTE_METHOD_NOT_ALLOWED);
+
+  // a path that exists for other methods is a 405, with what it does have
+  kop_route_match m = find(&router, HTTP_DELETE, "/a");
+  KOP_CHECK(m.status == KOP_ROUTE_METHOD_NOT_ALLOWED);
+  KOP_CHECK(m.handlers != NULL && m.handlers[HTTP_GET] == h_users &&
+            m.handlers[HTTP_POST] == h_post && m.handlers[HTTP_PUT] == NULL &&
+            m.handlers[HTTP_DELETE] == NULL);
+  KOP_CHECK(m.opts == NULL && m.handler == NULL);
+  KOP_CHECK(find(&router, HTTP_BAD_METHOD, "/a").status ==
+            KOP_ROUTE_METHOD_NOT_ALLOWED);
+
+  m = find(&router, HTTP_GET, "/d");
+  KOP_CHECK(m.status == KOP_ROUTE_NOT_FOUND && m.handlers == NULL);
+
+  // options are kept per method
+  kop_route_opts opts = {.max_body = 10, .offload = true};
+  KOP_CHECK(kop_router_add(&router, HTTP_POST, "/c", h_post, &opts) ==
+            NOERROR);
+  m = find(&router, HTTP_POST, "/c");
+  KOP_CHECK(m.opts->max_body == 10 && m.opts->offload);
+  KOP_CHECK(!find(&router, HTTP_PUT, "/c").opts->offload);
+  KOP_CHECK(kop_router_add(&router, HTTP_BAD_METHOD, "/e", h_other, NULL) ==
+            ERR_INVALID_ROUTE);
+
+  kop_router_free(&router);
+}
+
+int main(void) {
+  test_static_split();
+  test_captures();
+  test_priority();
+  test_methods();
+
+  return KOP_TEST_RESULT();
+}
@@ -0,0 +1,86 @@
+// Every delimiter scanning implementation the CPU supports has to find
+// exactly what the scalar one finds, at every alignment and tail length.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/scan.h"
+#include "test.h"
+
+#define BUF_SIZE 256
+#define ROUNDS 24
+
+// Random bytes with the needles, bytes next to them and bytes with the top
+// bit set mixed in, `density` in 256ths.
+static void fill(char *buf, size_t len, char a, char b, int density) {
+  static const char near[] = {'\x0c', '\x0e', '9', ';', '\x8a', '\xff'};
+  for (size_t i = 0; i < len; i++) {
+    int r = rand() % 256;
+    if (r < density) {
+      buf[i] = r % 2 ? a : b;
+    } else if (r < density + 32) {
+      buf[i] = near[(size_t)r % sizeof(near)];
+    } else {
+      buf[i] = (char)(rand() % 256);
+      if (buf[i] == a || buf[i] == b) {
+        buf[i] = 'x';
+      }
+    }
+  }
+}
+
+// Compares `impl` with the scalar one over every slice of `buf` starting
+// at the first 64 offsets. Returns the number of mismatches, each reported.
+static int compare(const kop_scan_impl *impl, const char *buf, char a,
+                   char b) {
+  const kop_scan_impl *ref = &kop_scan_impls[0];
+  int mismatches = 0;
+
+  for (size_t off = 0; off < 64; off++) {
+    for (size_t n = 0; off + n <= BUF_SIZE; n++) {
+      const char *want = ref->find2(buf + off, n, a, b);
+      const char *got = impl->find2(buf + off, n, a, b);
+      if (got != want || impl->find(buf + off, n, a) !=
+                             ref->find(buf + off, n, a)) {
+        if (mismatches++ < 5) {
+          fprintf(stderr, "%s: mismatch at offset %zu, length %zu\n",
+                  impl->name, off, n);
+        }
+      }
+    }
+  }
+
+  return mismatches;
+}
+
+int main(void) {
+  kop_scan_init();
+  srand(1);
+
+  // the needles the parser looks for and one with the top bit set
+  static const char needles[][2] = {{':', '\n'}, {'\r', '\n'}, {'\x80', ' '}};
+  static char buf[BUF_SIZE];
+
+  for (size_t i = 0; i < kop_scan_impls_count; i++) {
+    const kop_scan_impl *impl = &kop_scan_impls[i];
+    if (!impl->supported()) {
+      printf("%s not supported, skipped\n", impl->name);
+      continue;
+    }
+
+    int mismatches = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+      const char *n = needles[(size_t)round % 3];
+      // from none at all to one every few bytes
+      fill(buf, BUF_SIZE, n[0], n[1], (round % 8) * 4);
+      mismatches += compare(impl, buf, n[0], n[1]);
+    }
+    KOP_CHECK(mismatches == 0);
+  }
+
+  // the one picked is one of them
+  KOP_CHECK(kop_scan >= kop_scan_impls &&
+            kop_scan < kop_scan_impls + kop_scan_impls_count);
+
+  return KOP_TEST_RESULT();
+}
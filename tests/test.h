@@ -0,0 +1,23 @@
+#ifndef KOP_TEST_H_
+#define KOP_TEST_H_
+
+#include <stdio.h>
+
+// Every file in tests/ is a program of its own, ctest runs it and a nonzero
+// exit status fails it. A failed check is reported and the test goes on, so
+// one run shows everything that broke.
+
+static int kop_test_failures = 0;
+
+#define KOP_CHECK(cond)                                                        \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond);        \
+      kop_test_failures++;                                                     \
+    }                                                                          \
+  } while (0)
+
+// What main returns.
+#define KOP_TEST_RESULT() (kop_test_failures == 0 ? 0 : 1)
+
+#endif // !KOP_TEST_H_
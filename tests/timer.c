@@ -0,0 +1,218 @@
+// The timer wheel, driven by a clock of its own: deadlines on every level,
+// cascading, clamping, cancelling and the timeout it reports.
+
+#include <stdlib.h>
+
+#include "../src/timer.h"
+#include "test.h"
+
+// milliseconds the 4 levels cover
+#define WHEEL_SPAN                                                             \
+  ((uint64_t)1 << (KOP_TIMER_WHEEL_BITS * KOP_TIMER_WHEEL_LEVELS))
+
+// Takes the fired timers off `expired` and returns how many there were.
+static size_t drain(kop_timer *expired) {
+  size_t n = 0;
+  while (kop_timer_pending(expired)) {
+    kop_timer_cancel(expired->next);
+    n++;
+  }
+  return n;
+}
+
+// Advances the wheel a tick at a time and returns the tick `t` fired at, 0
+// if it didn't by `until`.
+static uint64_t fires_at(kop_timer_wheel *w, kop_timer *t, uint64_t until) {
+  kop_timer expired;
+  kop_timer_init(&expired);
+  for (uint64_t now = w->now + 1; now <= until; now++) {
+    kop_timer_wheel_advance(w, now, &expired);
+    bool fired = false;
+    while (kop_timer_pending(&expired)) {
+      fired = fired || expired.next == t;
+      kop_timer_cancel(expired.next);
+    }
+    if (fired) {
+      return now;
+    }
+  }
+  return 0;
+}
+
+static void test_levels(void) {
+  // deadlines on every level and at their edges, from a start that isn't
+  // aligned to any of them
+  static const uint64_t deltas[] = {
+      1, 2, 63, 64, 65, 100, 4095, 4096, 4097, 70000, 262143, 262144, 300000,
+  };
+  for (size_t i = 0; i < sizeof(deltas) / sizeof(deltas[0]); i++) {
+    kop_timer_wheel w;
+    kop_timer t;
+    uint64_t start = 1000003;
+    kop_timer_wheel_init(&w, start);
+    kop_timer_init(&t);
+    kop_timer_wheel_add(&w, &t, start + deltas[i]);
+    KOP_CHECK(kop_timer_pending(&t));
+    KOP_CHECK(fires_at(&w, &t, start + deltas[i] + 1) == start + deltas[i]);
+  }
+}
+
+static void test_clamp(void) {
+  kop_timer_wheel w;
+  kop_timer t;
+  kop_timer_wheel_init(&w, 500);
+  kop_timer_init(&t);
+
+  // a deadline that passed already fires on the next tick
+  kop_timer_wheel_add(&w, &t, 100);
+  KOP_CHECK(fires_at(&w, &t, 510) == 501);
+
+  // one further out than the wheel reaches fires at the end of its span
+  kop_timer_wheel_add(&w, &t, w.now + 10 * WHEEL_SPAN);
+  KOP_CHECK(t.expires == w.now + WHEEL_SPAN - 1);
+}
+
+static void test_cancel(void) {
+  kop_timer_wheel w;
+  kop_timer a, b, c;
+  kop_timer_wheel_init(&w, 0);
+  kop_timer_init(&a);
+  kop_timer_init(&b);
+  kop_timer_init(&c);
+
+  kop_timer_wheel_add(&w, &a, 10);
+  kop_timer_wheel_add(&w, &b, 10);
+  kop_timer_wheel_add(&w, &c, 5000);
+  kop_timer_cancel(&a);
+  KOP_CHECK(!kop_timer_pending(&a));
+  // cancelling twice is harmless
+  kop_timer_cancel(&a);
+
+  kop_timer expired;
+  kop_timer_init(&expired);
+  kop_timer_wheel_advance(&w, 10, &expired);
+  KOP_CHECK(expired.next == &b && expired.prev == &b);
+  KOP_CHECK(drain(&expired) == 1);
+
+  // re-adding moves it, a cancelled one on a higher level never fires
+  kop_timer_wheel_add(&w, &b, 20);
+  kop_timer_wheel_add(&w, &b, 30);
+  kop_timer_cancel(&c);
+  kop_timer_wheel_advance(&w, 29, &expired);
+  KOP_CHECK(drain(&expired) == 0);
+  kop_timer_wheel_advance(&w, 10000, &expired);
+  KOP_CHECK(drain(&expired) == 1);
+  KOP_CHECK(kop_timer_wheel_timeout(&w) == -1);
+
+  // a fired timer re-added before it is taken off the list leaves it
+  kop_timer_wheel_add(&w, &b, 10010);
+  kop_timer_wheel_advance(&w, 10010, &expired);
+  KOP_CHECK(expired.next == &b);
+  kop_timer_wheel_add(&w, &b, 10020);
+  KOP_CHECK(!kop_timer_pending(&expired));
+  KOP_CHECK(fires_at(&w, &b, 10020) == 10020);
+}
+
+static void test_timeout(void) {
+  kop_timer_wheel w;
+  kop_timer t;
+  kop_timer_wheel_init(&w, 7);
+  kop_timer_init(&t);
+  KOP_CHECK(kop_timer_wheel_timeout(&w) == -1);
+
+  kop_timer_wheel_add(&w, &t, 7 + 40);
+  KOP_CHECK(kop_timer_wheel_timeout(&w) == 40);
+
+  // for a higher level it is when its slot cascades, never past the
+  // deadline, and following it reaches the deadline
+  static const uint64_t deltas[] = {64, 1000, 4096, 100000, 262144, 1000000};
+  for (size_t i = 0; i < sizeof(deltas) / sizeof(deltas[0]); i++) {
+    uint64_t deadline = w.now + deltas[i];
+    kop_timer_wheel_add(&w, &t, deadline);
+
+    kop_timer expired;
+    kop_timer_init(&expired);
+    size_t waits = 0;
+    int timeout;
+    while ((timeout = kop_timer_wheel_timeout(&w)) >= 0 && waits < 100) {
+      KOP_CHECK(timeout > 0);
+      KOP_CHECK(w.now + (uint64_t)timeout <= deadline);
+      kop_timer_wheel_advance(&w, w.now + (uint64_t)timeout, &expired);
+      waits++;
+    }
+    KOP_CHECK(w.now == deadline);
+    KOP_CHECK(drain(&expired) == 1);
+    // one wait per level at most
+    KOP_CHECK(waits <= KOP_TIMER_WHEEL_LEVELS + 1);
+  }
+}
+
+// Many timers with random deadlines and an irregular clock: each one fires
+// on the first advance that reaches its deadline, none early, none twice.
+static void test_random(void) {
+  enum { N = 2000 };
+  static kop_timer timers[N];
+  static uint64_t deadlines[N];
+  kop_timer_wheel w;
+  kop_timer_wheel_init(&w, 123456);
+  srand(1);
+
+  for (size_t i = 0; i < N; i++) {
+    kop_timer_init(&timers[i]);
+    deadlines[i] = w.now + 1 + (uint64_t)rand() % 300000;
+    kop_timer_wheel_add(&w, &timers[i], deadlines[i]);
+  }
+  // some are cancelled and some moved while armed
+  for (size_t i = 0; i < N; i += 7) {
+    kop_timer_cancel(&timers[i]);
+    deadlines[i] = 0;
+  }
+  for (size_t i = 3; i < N; i += 11) {
+    deadlines[i] = w.now + 1 + (uint64_t)rand() % 5000;
+    kop_timer_wheel_add(&w, &timers[i], deadlines[i]);
+  }
+
+  size_t armed = 0;
+  for (size_t i = 0; i < N; i++) {
+    armed += kop_timer_pending(&timers[i]);
+  }
+
+  size_t fired = 0, wrong = 0;
+  kop_timer expired;
+  kop_timer_init(&expired);
+  uint64_t prev = w.now;
+  while (w.now < 123456 + 300001) {
+    uint64_t now = w.now + 1 + (uint64_t)rand() % 700;
+    kop_timer_wheel_advance(&w, now, &expired);
+    while (kop_timer_pending(&expired)) {
+      kop_timer *t = expired.next;
+      size_t i = (size_t)(t - timers);
+      kop_timer_cancel(t);
+      if (deadlines[i] <= prev || deadlines[i] > now) {
+        wrong++;
+      }
+      deadlines[i] = 0;
+      fired++;
+    }
+    prev = now;
+  }
+
+  size_t left = 0;
+  for (size_t i = 0; i < N; i++) {
+    left += deadlines[i] != 0 || kop_timer_pending(&timers[i]);
+  }
+  KOP_CHECK(wrong == 0);
+  KOP_CHECK(left == 0);
+  KOP_CHECK(fired == armed && armed > N / 2);
+  KOP_CHECK(kop_timer_wheel_timeout(&w) == -1);
+}
+
+int main(void) {
+  test_levels();
+  test_clamp();
+  test_cancel();
+  test_timeout();
+  test_random();
+
+  return KOP_TEST_RESULT();
+}